@@ -0,0 +1,501 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "codec.h"
+#include "timestamp.h"
+
+/*
+ * Check the channel count against the family, and parse the optional
+ * order as a comma-separated permutation of the device channels
+ */
+
+int layout_init(struct layout *l, unsigned int channels, int family,
+		const char *order)
+{
+	unsigned int n, max;
+	const char *p;
+	char *end;
+
+	memset(l, 0, sizeof *l);
+
+	switch (family) {
+	case 0:
+		max = 2;
+		break;
+	case 1:
+		max = 8;
+		break;
+	case 255:
+		max = MAX_CODEC_CHANNELS;
+		break;
+	default:
+		fprintf(stderr, "Unknown channel mapping family %d\n", family);
+		return -1;
+	}
+
+	if (channels == 0 || channels > max) {
+		fprintf(stderr, "Mapping family %d carries 1 to %u channels\n",
+			family, max);
+		return -1;
+	}
+
+	l->channels = channels;
+	l->family = family;
+
+	for (n = 0; n < channels; n++)
+		l->order[n] = n;
+
+	if (order == NULL)
+		return 0;
+
+	p = order;
+	for (n = 0; n < channels; n++) {
+		unsigned long c;
+
+		c = strtoul(p, &end, 10);
+		if (end == p || c >= channels)
+			goto invalid;
+		l->order[n] = c;
+
+		if (n < channels - 1) {
+			if (*end != ',')
+				goto invalid;
+			p = end + 1;
+		}
+	}
+	if (*end != '\0')
+		goto invalid;
+
+	/* Every device channel is used exactly once */
+
+	for (n = 0; n < channels; n++) {
+		unsigned int m;
+
+		for (m = n + 1; m < channels; m++) {
+			if (l->order[m] == l->order[n])
+				goto invalid;
+		}
+		if (l->order[n] != n)
+			l->reorder = 1;
+	}
+
+	return 0;
+
+invalid:
+	fprintf(stderr, "Channel order '%s' is not a permutation of %u "
+		"channels\n", order, channels);
+	return -1;
+}
+
+/*
+ * Create an encoder for the layout, which also decides the streams
+ * and the coupling between them
+ */
+
+OpusMSEncoder* layout_encoder_create(struct layout *l, unsigned int rate,
+		int application)
+{
+	OpusMSEncoder *encoder;
+	int error;
+
+	encoder = opus_multistream_surround_encoder_create(rate, l->channels,
+			l->family, &l->streams, &l->coupled, l->mapping,
+			application, &error);
+	if (encoder == NULL) {
+		fprintf(stderr, "opus_multistream_surround_encoder_create: %s\n",
+			opus_strerror(error));
+		return NULL;
+	}
+
+	return encoder;
+}
+
+/*
+ * The streams are not sent in-band, so derive them in the same way as
+ * the sender, from a temporary encoder
+ */
+
+OpusMSDecoder* layout_decoder_create(struct layout *l, unsigned int rate)
+{
+	OpusMSEncoder *encoder;
+	OpusMSDecoder *decoder;
+	int error;
+
+	encoder = layout_encoder_create(l, rate, OPUS_APPLICATION_AUDIO);
+	if (encoder == NULL)
+		return NULL;
+	opus_multistream_encoder_destroy(encoder);
+
+	decoder = opus_multistream_decoder_create(rate, l->channels,
+			l->streams, l->coupled, l->mapping, &error);
+	if (decoder == NULL) {
+		fprintf(stderr, "opus_multistream_decoder_create: %s\n",
+			opus_strerror(error));
+		return NULL;
+	}
+
+	return decoder;
+}
+
+/*
+ * Reorder interleaved audio in place, from device order to Opus
+ * order and back again
+ */
+
+void layout_to_opus(const struct layout *l, int16_t *pcm,
+		unsigned int samples)
+{
+	int16_t frame[MAX_CODEC_CHANNELS];
+	unsigned int s, c;
+
+	if (!l->reorder)
+		return;
+
+	for (s = 0; s < samples; s++) {
+		memcpy(frame, pcm, sizeof(*pcm) * l->channels);
+		for (c = 0; c < l->channels; c++)
+			pcm[c] = frame[l->order[c]];
+		pcm += l->channels;
+	}
+}
+
+void layout_from_opus(const struct layout *l, int16_t *pcm,
+		unsigned int samples)
+{
+	int16_t frame[MAX_CODEC_CHANNELS];
+	unsigned int s, c;
+
+	if (!l->reorder)
+		return;
+
+	for (s = 0; s < samples; s++) {
+		memcpy(frame, pcm, sizeof(*pcm) * l->channels);
+		for (c = 0; c < l->channels; c++)
+			pcm[l->order[c]] = frame[c];
+		pcm += l->channels;
+	}
+}
+
+static const struct profile profiles[] = {
+	/* General audio, as tx has always used */
+	{ "audio", OPUS_APPLICATION_AUDIO, VBR_ON, -1, OPUS_AUTO },
+
+	{ "voice", OPUS_APPLICATION_VOIP, VBR_ON, -1, OPUS_SIGNAL_VOICE },
+
+	/* CELT only, without the SILK lookahead; the lowest delay */
+	{ "lowdelay", OPUS_APPLICATION_RESTRICTED_LOWDELAY, VBR_CONSTRAINED,
+		-1, OPUS_SIGNAL_MUSIC },
+};
+
+/*
+ * Parse a profile name followed by any overrides, eg.
+ * "lowdelay,vbr=off,complexity=5,signal=voice"
+ */
+
+int profile_init(struct profile *p, const char *spec)
+{
+	char *s, *item, *value, *save;
+	size_t n;
+
+	s = strdup(spec);
+	if (s == NULL) {
+		perror("strdup");
+		return -1;
+	}
+
+	item = strtok_r(s, ",", &save);
+	for (n = 0; n < sizeof(profiles) / sizeof(*profiles); n++) {
+		if (item != NULL && strcmp(item, profiles[n].name) == 0)
+			break;
+	}
+	if (n == sizeof(profiles) / sizeof(*profiles)) {
+		fprintf(stderr, "Unknown encoder profile '%s'\n", spec);
+		free(s);
+		return -1;
+	}
+	*p = profiles[n];
+
+	while ((item = strtok_r(NULL, ",", &save)) != NULL) {
+		value = strchr(item, '=');
+		if (value == NULL)
+			goto invalid;
+		*value++ = '\0';
+
+		if (strcmp(item, "vbr") == 0) {
+			if (strcmp(value, "off") == 0)
+				p->vbr = VBR_OFF;
+			else if (strcmp(value, "on") == 0)
+				p->vbr = VBR_ON;
+			else if (strcmp(value, "constrained") == 0)
+				p->vbr = VBR_CONSTRAINED;
+			else
+				goto invalid;
+		} else if (strcmp(item, "complexity") == 0) {
+			p->complexity = atoi(value);
+			if (p->complexity < 0 || p->complexity > 10)
+				goto invalid;
+		} else if (strcmp(item, "signal") == 0) {
+			if (strcmp(value, "auto") == 0)
+				p->signal = OPUS_AUTO;
+			else if (strcmp(value, "voice") == 0)
+				p->signal = OPUS_SIGNAL_VOICE;
+			else if (strcmp(value, "music") == 0)
+				p->signal = OPUS_SIGNAL_MUSIC;
+			else
+				goto invalid;
+		} else {
+			goto invalid;
+		}
+	}
+
+	free(s);
+	return 0;
+
+invalid:
+	fprintf(stderr, "Invalid encoder setting '%s'\n", item);
+	free(s);
+	return -1;
+}
+
+/*
+ * Opus frames are 2.5, 5, 10 or 20ms; other than in the low delay
+ * profile, 40 and 60ms are also permitted
+ */
+
+int profile_check_frame(const struct profile *p, unsigned int rate,
+		unsigned int frame)
+{
+	unsigned int quarters; /* of 2.5ms */
+
+	if (frame * 400 % rate != 0)
+		goto invalid;
+
+	quarters = frame * 400 / rate;
+	switch (quarters) {
+	case 1:
+	case 2:
+	case 4:
+	case 8:
+		return 0;
+	case 16:
+	case 24:
+		if (p->application != OPUS_APPLICATION_RESTRICTED_LOWDELAY)
+			return 0;
+	}
+
+invalid:
+	fprintf(stderr, "Frame size of %u samples at %uHz is not allowed "
+		"by profile %s\n", frame, rate, p->name);
+	return -1;
+}
+
+#define CTL(encoder, request) { \
+	int e = opus_multistream_encoder_ctl(encoder, request); \
+	if (e != OPUS_OK) { \
+		fprintf(stderr, #request ": %s\n", opus_strerror(e)); \
+		return -1; \
+	} \
+}
+
+int profile_apply(const struct profile *p, OpusMSEncoder *encoder,
+		unsigned int kbps)
+{
+	CTL(encoder, OPUS_SET_BITRATE(kbps * 1000));
+	CTL(encoder, OPUS_SET_VBR(p->vbr != VBR_OFF));
+	CTL(encoder, OPUS_SET_VBR_CONSTRAINT(p->vbr == VBR_CONSTRAINED));
+	CTL(encoder, OPUS_SET_SIGNAL(p->signal));
+	if (p->complexity != -1)
+		CTL(encoder, OPUS_SET_COMPLEXITY(p->complexity));
+
+	return 0;
+}
+
+/*
+ * Report the algorithmic delay of the profile, and the cost of an
+ * encode measured on a scratch encoder so that the real one is
+ * untouched. The test signal is noise, which is about the worst case
+ */
+
+#define REPORT_FRAMES 200
+
+int profile_report(const struct profile *p, struct layout *l,
+		unsigned int rate, unsigned int frame, unsigned int kbps)
+{
+	OpusMSEncoder *encoder;
+	opus_int32 lookahead, z;
+	unsigned char packet[1500];
+	uint64_t start, ns, total = 0, max = 0;
+	unsigned int n, seed = 1;
+	int16_t *pcm;
+
+	encoder = layout_encoder_create(l, rate, p->application);
+	if (encoder == NULL)
+		return -1;
+
+	if (profile_apply(p, encoder, kbps) == -1)
+		goto fail;
+
+	z = opus_multistream_encoder_ctl(encoder, OPUS_GET_LOOKAHEAD(&lookahead));
+	if (z != OPUS_OK) {
+		fprintf(stderr, "OPUS_GET_LOOKAHEAD: %s\n", opus_strerror(z));
+		goto fail;
+	}
+
+	pcm = malloc(sizeof(*pcm) * frame * l->channels);
+	if (pcm == NULL) {
+		perror("malloc");
+		goto fail;
+	}
+
+	for (n = 0; n < REPORT_FRAMES; n++) {
+		unsigned int s;
+
+		for (s = 0; s < frame * l->channels; s++)
+			pcm[s] = (rand_r(&seed) % 16384) - 8192;
+
+		start = monotonic_ns();
+		z = opus_multistream_encode(encoder, pcm, frame, packet,
+				sizeof packet);
+		ns = monotonic_ns() - start;
+
+		if (z < 0) {
+			fprintf(stderr, "opus_multistream_encode: %s\n",
+				opus_strerror(z));
+			free(pcm);
+			goto fail;
+		}
+
+		total += ns;
+		if (ns > max)
+			max = ns;
+	}
+
+	free(pcm);
+	opus_multistream_encoder_destroy(encoder);
+
+	fprintf(stderr, "Profile %s: %.1fms frame + %.1fms lookahead = "
+		"%.1fms algorithmic delay\n", p->name,
+		1000.0 * frame / rate, 1000.0 * lookahead / rate,
+		1000.0 * (frame + lookahead) / rate);
+	fprintf(stderr, "Encode cost: average %.1fus, maximum %.1fus "
+		"per frame (%.1f%% of real time)\n",
+		total / 1000.0 / REPORT_FRAMES, max / 1000.0,
+		100.0 * total / REPORT_FRAMES / (1e9 * frame / rate));
+
+	return 0;
+
+fail:
+	opus_multistream_encoder_destroy(encoder);
+	return -1;
+}
+
+/*
+ * The encode is only part of the work done in a frame period, so
+ * pressure is when it takes over half the period on average; only
+ * below a quarter is there room to raise the complexity again
+ */
+
+#define GOVERNOR_HIGH 50 /* percent of the deadline */
+#define GOVERNOR_LOW 25
+#define GOVERNOR_OVER 4 /* frames */
+#define GOVERNOR_HOLD_MS 2000
+
+int governor_init(struct governor *g, OpusMSEncoder *encoder,
+		unsigned int rate, unsigned int frame)
+{
+	opus_int32 complexity;
+	int e;
+
+	e = opus_multistream_encoder_ctl(encoder,
+			OPUS_GET_COMPLEXITY(&complexity));
+	if (e != OPUS_OK) {
+		fprintf(stderr, "OPUS_GET_COMPLEXITY: %s\n", opus_strerror(e));
+		return -1;
+	}
+
+	g->encoder = encoder;
+	g->deadline = (uint64_t)frame * 1000000000 / rate;
+	g->complexity = complexity;
+	g->average = 0;
+	g->over = 0;
+	g->under = 0;
+	g->hold = (uint64_t)GOVERNOR_HOLD_MS * rate / frame / 1000;
+
+	return 0;
+}
+
+/*
+ * Account for the time taken by one encode. Return the new complexity
+ * if it was changed, otherwise -1. Safe to call from the audio thread
+ */
+
+int governor_update(struct governor *g, uint64_t encode)
+{
+	int complexity = g->complexity;
+
+	/* Exponential average over about 8 frames */
+
+	if (g->average == 0)
+		g->average = encode;
+	else
+		g->average += ((int64_t)encode - (int64_t)g->average) / 8;
+
+	if (g->average * 100 > g->deadline * GOVERNOR_HIGH
+			|| encode > g->deadline)
+	{
+		g->over++;
+		g->under = 0;
+	} else if (g->average * 100 < g->deadline * GOVERNOR_LOW) {
+		g->under++;
+		g->over = 0;
+	} else {
+		g->over = 0;
+		g->under = 0;
+	}
+
+	/* A single encode over the deadline will already have cost
+	 * audio, so act on it at once */
+
+	if (complexity > 0 && (g->over >= GOVERNOR_OVER
+			|| encode > g->deadline))
+	{
+		complexity--;
+	} else if (complexity < 10 && g->under >= g->hold) {
+		complexity++;
+	} else {
+		return -1;
+	}
+
+	if (opus_multistream_encoder_ctl(g->encoder,
+			OPUS_SET_COMPLEXITY(complexity)) != OPUS_OK)
+	{
+		return -1;
+	}
+
+	g->complexity = complexity;
+	g->over = 0;
+	g->under = 0;
+	g->average = 0; /* measure afresh at the new complexity */
+
+	return complexity;
+}
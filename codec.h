@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdint.h>
+#include <opus/opus_multistream.h>
+
+#define MAX_CODEC_CHANNELS 255
+
+/*
+ * How the channels of the audio device are carried by Opus streams.
+ *
+ * The mapping family is that of RFC 7845: 0 is mono or stereo in a
+ * single stream, 1 is 1 to 8 channels in Vorbis order with pairs
+ * coupled, 255 is any number of independent channels. Sender and
+ * receiver must agree on the channels and family, from which the
+ * streams are derived.
+ *
+ * The order gives, for each Opus channel, the device channel it comes
+ * from (tx) or goes to (rx); eg. to carry 5.1 from a device which
+ * delivers L R C LFE Ls Rs use 0,2,1,4,5,3
+ */
+
+struct layout {
+	unsigned int channels;
+	int family;
+	int streams, coupled;
+	unsigned char mapping[MAX_CODEC_CHANNELS];
+
+	int reorder;
+	unsigned char order[MAX_CODEC_CHANNELS];
+};
+
+int layout_init(struct layout *l, unsigned int channels, int family,
+		const char *order);
+
+OpusMSEncoder* layout_encoder_create(struct layout *l, unsigned int rate,
+		int application);
+OpusMSDecoder* layout_decoder_create(struct layout *l, unsigned int rate);
+
+void layout_to_opus(const struct layout *l, int16_t *pcm,
+		unsigned int samples);
+void layout_from_opus(const struct layout *l, int16_t *pcm,
+		unsigned int samples);
+
+/*
+ * An encoder profile sets the application and the encoder controls
+ * together. The bitrate is given separately; a complexity of -1
+ * leaves the encoder's default
+ */
+
+enum vbr {
+	VBR_OFF,
+	VBR_ON,
+	VBR_CONSTRAINED
+};
+
+struct profile {
+	const char *name;
+	int application;
+	enum vbr vbr;
+	int complexity, signal;
+};
+
+int profile_init(struct profile *p, const char *spec);
+int profile_check_frame(const struct profile *p, unsigned int rate,
+		unsigned int frame);
+int profile_apply(const struct profile *p, OpusMSEncoder *encoder,
+		unsigned int kbps);
+int profile_report(const struct profile *p, struct layout *l,
+		unsigned int rate, unsigned int frame, unsigned int kbps);
+
+/*
+ * Step the encoder complexity down when encoding comes too close to
+ * the frame deadline, and back up again when there is headroom
+ */
+
+struct governor {
+	OpusMSEncoder *encoder;
+	uint64_t deadline; /* ns */
+	int complexity;
+	uint64_t average; /* ns, smoothed */
+	unsigned int over, under; /* consecutive frames */
+	unsigned int hold; /* frames to wait before raising */
+};
+
+int governor_init(struct governor *g, OpusMSEncoder *encoder,
+		unsigned int rate, unsigned int frame);
+int governor_update(struct governor *g, uint64_t encode);
+
+#endif
@@ -0,0 +1,723 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Codec benchmark: run audio through the encoder and decoder as
+ * configured by tx and rx, over every combination of the given frame
+ * sizes, bitrates, complexities, channel counts, sample formats and
+ * thread counts, and report the cost of each
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "codec.h"
+#include "defaults.h"
+#include "notice.h"
+#include "timestamp.h"
+
+#define MAX_VALUES 16
+#define MAX_THREADS 64
+#define MAX_FRAME 2880
+#define MAX_PACKET 1500
+
+#define DEFAULT_SECONDS 10
+
+enum format {
+	INT16,
+	FLOAT
+};
+
+struct list {
+	unsigned int n;
+	int value[MAX_VALUES];
+};
+
+/*
+ * Source audio, in both formats, with as many channels as the most
+ * asked for; fewer channels take the first of each sample
+ */
+
+static struct {
+	unsigned int rate, channels, samples;
+	int16_t *pcm;
+	float *fpcm;
+} source;
+
+struct run {
+	/* Configuration */
+	const struct profile *profile;
+	struct layout layout;
+	unsigned int frame, kbps;
+	enum format format;
+
+	/* Results, per thread */
+	uint64_t *encode_ns, *decode_ns;
+	unsigned long frames, bytes;
+	int error;
+
+	pthread_t thread;
+};
+
+static int parse_list(const char *arg, struct list *l)
+{
+	const char *p = arg;
+	char *end;
+
+	l->n = 0;
+	for (;;) {
+		if (l->n == MAX_VALUES)
+			goto invalid;
+
+		l->value[l->n++] = strtol(p, &end, 10);
+		if (end == p)
+			goto invalid;
+		if (*end == '\0')
+			return 0;
+		if (*end != ',')
+			goto invalid;
+		p = end + 1;
+	}
+
+invalid:
+	fprintf(stderr, "Invalid list '%s'\n", arg);
+	return -1;
+}
+
+static int parse_formats(const char *arg, struct list *l)
+{
+	char *s, *item, *save;
+	int r = 0;
+
+	s = strdup(arg);
+	if (s == NULL) {
+		perror("strdup");
+		return -1;
+	}
+
+	l->n = 0;
+	for (item = strtok_r(s, ",", &save); item != NULL;
+			item = strtok_r(NULL, ",", &save))
+	{
+		if (l->n == MAX_VALUES) {
+			r = -1;
+			break;
+		}
+		if (strcmp(item, "int16") == 0) {
+			l->value[l->n++] = INT16;
+		} else if (strcmp(item, "float") == 0) {
+			l->value[l->n++] = FLOAT;
+		} else {
+			fprintf(stderr, "Unknown format '%s'\n", item);
+			r = -1;
+			break;
+		}
+	}
+
+	free(s);
+	return r;
+}
+
+static unsigned int list_max(const struct list *l)
+{
+	unsigned int n;
+	int max = 0;
+
+	for (n = 0; n < l->n; n++) {
+		if (l->value[n] > max)
+			max = l->value[n];
+	}
+
+	return max;
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t le16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+/*
+ * Load a 16-bit PCM WAV file, spreading its channels across as many
+ * as will be benchmarked
+ */
+
+static int load_wav(const char *path, unsigned int channels)
+{
+	unsigned char header[12], chunk[8], fmt[16];
+	unsigned int file_channels = 0, s, c;
+	int16_t *data = NULL;
+	uint32_t size;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	if (fread(header, sizeof header, 1, f) != 1
+			|| memcmp(header, "RIFF", 4) != 0
+			|| memcmp(header + 8, "WAVE", 4) != 0)
+	{
+		goto invalid;
+	}
+
+	while (fread(chunk, sizeof chunk, 1, f) == 1) {
+		size = le32(chunk + 4);
+
+		if (memcmp(chunk, "fmt ", 4) == 0) {
+			if (size < sizeof fmt
+					|| fread(fmt, sizeof fmt, 1, f) != 1)
+				goto invalid;
+			if (le16(fmt) != 1 || le16(fmt + 14) != 16) {
+				fprintf(stderr, "%s: only 16-bit PCM is "
+					"supported\n", path);
+				goto fail;
+			}
+			file_channels = le16(fmt + 2);
+			source.rate = le32(fmt + 4);
+			size -= sizeof fmt;
+
+		} else if (memcmp(chunk, "data", 4) == 0) {
+			if (file_channels == 0)
+				goto invalid;
+
+			data = malloc(size);
+			if (data == NULL) {
+				perror("malloc");
+				goto fail;
+			}
+			if (fread(data, size, 1, f) != 1)
+				goto invalid;
+
+			source.samples = size / sizeof(*data) / file_channels;
+			break;
+		}
+
+		if (fseek(f, size + (size & 1), SEEK_CUR) == -1)
+			goto invalid;
+	}
+
+	if (data == NULL)
+		goto invalid;
+	fclose(f);
+
+	source.channels = channels;
+	source.pcm = malloc(sizeof(*source.pcm) * source.samples * channels);
+	if (source.pcm == NULL) {
+		perror("malloc");
+		free(data);
+		return -1;
+	}
+
+	for (s = 0; s < source.samples; s++) {
+		for (c = 0; c < channels; c++) {
+			const unsigned char *p;
+
+			p = (unsigned char*)&data[s * file_channels
+				+ c % file_channels];
+			source.pcm[s * channels + c] = (int16_t)le16(p);
+		}
+	}
+
+	free(data);
+	return 0;
+
+invalid:
+	fprintf(stderr, "%s: not a valid WAV file\n", path);
+fail:
+	free(data);
+	fclose(f);
+	return -1;
+}
+
+/*
+ * Generate a test signal: a sine, a sweep or noise, with each channel
+ * a little different so that the encoder cannot share the work
+ */
+
+static int generate(const char *signal, unsigned int rate,
+		unsigned int channels, unsigned int seconds)
+{
+	unsigned int s, c, seed = 1;
+
+	source.rate = rate;
+	source.channels = channels;
+	source.samples = rate * seconds;
+	source.pcm = malloc(sizeof(*source.pcm) * source.samples * channels);
+	if (source.pcm == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	for (s = 0; s < source.samples; s++) {
+		double t = (double)s / rate;
+
+		for (c = 0; c < channels; c++) {
+			double v;
+
+			if (strcmp(signal, "sine") == 0) {
+				v = sin(2 * M_PI * (440 + 110 * c) * t);
+			} else if (strcmp(signal, "sweep") == 0) {
+				double f = 20 * pow(1000, t / seconds);
+
+				v = sin(2 * M_PI * f * t + c);
+			} else if (strcmp(signal, "noise") == 0) {
+				v = (double)rand_r(&seed) / RAND_MAX * 2 - 1;
+			} else {
+				fprintf(stderr, "Unknown signal '%s'\n", signal);
+				return -1;
+			}
+
+			source.pcm[s * channels + c] = v * 0.5 * 32767;
+		}
+	}
+
+	return 0;
+}
+
+static int to_float(void)
+{
+	size_t n, len = (size_t)source.samples * source.channels;
+
+	source.fpcm = malloc(sizeof(*source.fpcm) * len);
+	if (source.fpcm == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	for (n = 0; n < len; n++)
+		source.fpcm[n] = source.pcm[n] / 32768.0f;
+
+	return 0;
+}
+
+/*
+ * Take the audio for one frame, from the source with its own number of
+ * channels into one with the number being benchmarked
+ */
+
+static void take(const struct run *r, unsigned int pos, void *out)
+{
+	unsigned int s, c, channels = r->layout.channels;
+
+	for (s = 0; s < r->frame; s++) {
+		for (c = 0; c < channels; c++) {
+			size_t i = (size_t)(pos + s) * source.channels + c;
+
+			if (r->format == INT16)
+				((int16_t*)out)[s * channels + c] = source.pcm[i];
+			else
+				((float*)out)[s * channels + c] = source.fpcm[i];
+		}
+	}
+}
+
+static void* run_codec(void *arg)
+{
+	struct run *r = arg;
+	OpusMSEncoder *encoder;
+	OpusMSDecoder *decoder;
+	unsigned char packet[MAX_PACKET];
+	unsigned int pos;
+	void *in, *out;
+	size_t size;
+
+	r->error = -1;
+
+	size = (r->format == INT16 ? sizeof(int16_t) : sizeof(float))
+		* MAX_FRAME * r->layout.channels;
+	in = malloc(size);
+	out = malloc(size);
+	if (in == NULL || out == NULL) {
+		perror("malloc");
+		goto out;
+	}
+
+	encoder = layout_encoder_create(&r->layout, source.rate,
+			r->profile->application);
+	if (encoder == NULL)
+		goto out;
+	if (profile_apply(r->profile, encoder, r->kbps) == -1)
+		goto out_encoder;
+
+	decoder = layout_decoder_create(&r->layout, source.rate);
+	if (decoder == NULL)
+		goto out_encoder;
+
+	r->frames = 0;
+	r->bytes = 0;
+
+	for (pos = 0; pos + r->frame <= source.samples; pos += r->frame) {
+		uint64_t start, mid, end;
+		int z, d;
+
+		take(r, pos, in);
+
+		start = monotonic_ns();
+		if (r->format == INT16) {
+			z = opus_multistream_encode(encoder, in, r->frame,
+					packet, sizeof packet);
+		} else {
+			z = opus_multistream_encode_float(encoder, in,
+					r->frame, packet, sizeof packet);
+		}
+		mid = monotonic_ns();
+		if (z < 0) {
+			fprintf(stderr, "opus_multistream_encode: %s\n",
+				opus_strerror(z));
+			goto out_decoder;
+		}
+
+		if (r->format == INT16) {
+			d = opus_multistream_decode(decoder, packet, z, out,
+					MAX_FRAME, 0);
+		} else {
+			d = opus_multistream_decode_float(decoder, packet, z,
+					out, MAX_FRAME, 0);
+		}
+		end = monotonic_ns();
+		if (d < 0) {
+			fprintf(stderr, "opus_multistream_decode: %s\n",
+				opus_strerror(d));
+			goto out_decoder;
+		}
+
+		r->encode_ns[r->frames] = mid - start;
+		r->decode_ns[r->frames] = end - mid;
+		r->frames++;
+		r->bytes += z;
+	}
+
+	r->error = 0;
+
+out_decoder:
+	opus_multistream_decoder_destroy(decoder);
+out_encoder:
+	opus_multistream_encoder_destroy(encoder);
+out:
+	free(in);
+	free(out);
+	return NULL;
+}
+
+static int compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, unsigned int p)
+{
+	if (n == 0)
+		return 0;
+	return sorted[(n - 1) * p / 100];
+}
+
+/*
+ * Run one combination of settings on the given number of threads at
+ * once, each with its own encoder and decoder, and print a line of
+ * results
+ */
+
+static int bench(const struct profile *profile, unsigned int channels,
+		unsigned int frame, unsigned int kbps, int complexity,
+		enum format format, unsigned int threads, int csv)
+{
+	struct run run[MAX_THREADS];
+	struct profile p = *profile;
+	uint64_t *encode, *decode, start, wall, total_ns = 0;
+	unsigned long frames = 0, bytes = 0;
+	unsigned int n, max_frames, started = 0;
+	double audio, rtf;
+	int family, r = 0;
+
+	if (profile_check_frame(&p, source.rate, frame) == -1)
+		return -1;
+	p.complexity = complexity;
+
+	max_frames = source.samples / frame;
+	encode = malloc(sizeof(*encode) * max_frames * threads);
+	decode = malloc(sizeof(*decode) * max_frames * threads);
+	if (encode == NULL || decode == NULL) {
+		perror("malloc");
+		free(encode);
+		free(decode);
+		return -1;
+	}
+
+	family = channels <= 2 ? 0 : channels <= 8 ? 1 : 255;
+
+	for (n = 0; n < threads; n++) {
+		run[n].profile = &p;
+		if (layout_init(&run[n].layout, channels, family, NULL) == -1) {
+			r = -1;
+			goto out;
+		}
+		run[n].frame = frame;
+		run[n].kbps = kbps;
+		run[n].format = format;
+		run[n].encode_ns = encode + (size_t)n * max_frames;
+		run[n].decode_ns = decode + (size_t)n * max_frames;
+	}
+
+	start = monotonic_ns();
+	for (n = 0; n < threads; n++) {
+		int e;
+
+		e = pthread_create(&run[n].thread, NULL, run_codec, &run[n]);
+		if (e != 0) {
+			errno = e;
+			perror("pthread_create");
+			r = -1;
+			break;
+		}
+		started++;
+	}
+	for (n = 0; n < started; n++)
+		pthread_join(run[n].thread, NULL);
+	wall = monotonic_ns() - start;
+
+	if (r == -1)
+		goto out;
+
+	/* Gather every frame from every thread into one distribution */
+
+	for (n = 0; n < threads; n++) {
+		if (run[n].error) {
+			r = -1;
+			goto out;
+		}
+		memmove(encode + frames, run[n].encode_ns,
+			sizeof(*encode) * run[n].frames);
+		memmove(decode + frames, run[n].decode_ns,
+			sizeof(*decode) * run[n].frames);
+		frames += run[n].frames;
+		bytes += run[n].bytes;
+	}
+
+	for (n = 0; n < frames; n++)
+		total_ns += encode[n] + decode[n];
+
+	qsort(encode, frames, sizeof *encode, compare);
+	qsort(decode, frames, sizeof *decode, compare);
+
+	/* The realtime factor is of one stream on one core, so it is
+	 * also the number of streams (encode and decode) which fit */
+
+	audio = (double)frames * frame / source.rate;
+	rtf = total_ns ? audio / (total_ns / 1e9) : 0;
+
+	printf(csv ? "%s,%u,%u,%u,%d,%s,%u,%lu,%lu,%lu,%lu,%.1f,%.0f,%.1f\n"
+		: "%-8s %3u %5u %5u %3d %-5s %3u %9lu %9lu %9lu %9lu %8.1f %9.0f %7.1f\n",
+		p.name, channels, frame, kbps, complexity,
+		format == INT16 ? "int16" : "float", threads,
+		(unsigned long)percentile(encode, frames, 50),
+		(unsigned long)percentile(encode, frames, 99),
+		(unsigned long)percentile(decode, frames, 50),
+		(unsigned long)percentile(decode, frames, 99),
+		rtf, frames / (wall / 1e9),
+		frames ? (double)bytes / frames : 0);
+	fflush(stdout);
+
+out:
+	free(encode);
+	free(decode);
+	return r;
+}
+
+static void usage(FILE *fd)
+{
+	fprintf(fd, "Usage: codecbench [<parameters>] [<file.wav>]\n"
+		"Benchmark the Opus encoder and decoder as used by tx and rx\n");
+
+	fprintf(fd, "\nSource audio, when no WAV file is given:\n");
+	fprintf(fd, "  -g <signal> Generate sine, sweep or noise (default noise)\n");
+	fprintf(fd, "  -r <rate>   Sample rate (default %dHz)\n",
+		DEFAULT_RATE);
+	fprintf(fd, "  -s <secs>   Duration (default %d seconds)\n",
+		DEFAULT_SECONDS);
+
+	fprintf(fd, "\nSettings, each a comma-separated list to sweep:\n");
+	fprintf(fd, "  -f <n,...>  Frame sizes (default %d)\n",
+		DEFAULT_FRAME);
+	fprintf(fd, "  -b <kbps,...>\n"
+		"              Bitrates (default %d)\n",
+		DEFAULT_BITRATE);
+	fprintf(fd, "  -x <n,...>  Complexities (default 10)\n");
+	fprintf(fd, "  -c <n,...>  Channels (default %d)\n",
+		DEFAULT_OUTPUTCHANNELS);
+	fprintf(fd, "  -F <fmt,...>\n"
+		"              Sample formats, int16 or float (default int16)\n");
+	fprintf(fd, "  -t <n,...>  Threads, each running its own stream (default 1)\n");
+	fprintf(fd, "  -P <spec>   Encoder profile, as tx (default audio)\n");
+
+	fprintf(fd, "\nOutput:\n");
+	fprintf(fd, "  -o csv      Comma-separated values\n");
+	fprintf(fd, "\nTimes are nanoseconds per frame. RTF is the realtime factor of\n"
+		"one stream on one core, which is how many such streams fit on it.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *signal = "noise", *profile_spec = "audio";
+	unsigned int rate = DEFAULT_RATE, seconds = DEFAULT_SECONDS;
+	struct list frames, bitrates, complexities, channels, formats, threads;
+	unsigned int f, b, x, c, m, t;
+	struct profile profile;
+	int csv = 0;
+
+	fputs(COPYRIGHT "\n", stderr);
+
+	frames.n = 1;
+	frames.value[0] = DEFAULT_FRAME;
+	bitrates.n = 1;
+	bitrates.value[0] = DEFAULT_BITRATE;
+	complexities.n = 1;
+	complexities.value[0] = 10;
+	channels.n = 1;
+	channels.value[0] = DEFAULT_OUTPUTCHANNELS;
+	formats.n = 1;
+	formats.value[0] = INT16;
+	threads.n = 1;
+	threads.value[0] = 1;
+
+	for (;;) {
+		int opt;
+
+		opt = getopt(argc, argv, "b:c:f:g:o:r:s:t:x:F:P:");
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'b':
+			if (parse_list(optarg, &bitrates) == -1)
+				return -1;
+			break;
+		case 'c':
+			if (parse_list(optarg, &channels) == -1)
+				return -1;
+			break;
+		case 'f':
+			if (parse_list(optarg, &frames) == -1)
+				return -1;
+			break;
+		case 'g':
+			signal = optarg;
+			break;
+		case 'o':
+			if (strcmp(optarg, "csv") != 0) {
+				usage(stderr);
+				return -1;
+			}
+			csv = 1;
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 't':
+			if (parse_list(optarg, &threads) == -1)
+				return -1;
+			break;
+		case 'x':
+			if (parse_list(optarg, &complexities) == -1)
+				return -1;
+			break;
+		case 'F':
+			if (parse_formats(optarg, &formats) == -1)
+				return -1;
+			break;
+		case 'P':
+			profile_spec = optarg;
+			break;
+		default:
+			usage(stderr);
+			return -1;
+		}
+	}
+
+	if (profile_init(&profile, profile_spec) == -1)
+		return -1;
+
+	for (x = 0; x < complexities.n; x++) {
+		if (complexities.value[x] < 0 || complexities.value[x] > 10) {
+			fprintf(stderr, "Complexity must be 0 to 10\n");
+			return -1;
+		}
+	}
+
+	for (t = 0; t < threads.n; t++) {
+		if (threads.value[t] < 1 || threads.value[t] > MAX_THREADS) {
+			fprintf(stderr, "Threads must be 1 to %d\n", MAX_THREADS);
+			return -1;
+		}
+	}
+
+	if (optind < argc) {
+		if (load_wav(argv[optind], list_max(&channels)) == -1)
+			return -1;
+	} else {
+		if (generate(signal, rate, list_max(&channels), seconds) == -1)
+			return -1;
+	}
+	if (to_float() == -1)
+		return -1;
+
+	if (csv) {
+		printf("profile,channels,frame,kbps,complexity,format,threads,"
+			"encode_p50_ns,encode_p99_ns,decode_p50_ns,decode_p99_ns,"
+			"rtf,packets_per_second,bytes_per_frame\n");
+	} else {
+		printf("%-8s %3s %5s %5s %3s %-5s %3s %9s %9s %9s %9s %8s %9s %7s\n",
+			"profile", "ch", "frame", "kbps", "cx", "fmt", "thr",
+			"enc p50", "enc p99", "dec p50", "dec p99",
+			"RTF", "pkt/s", "B/frame");
+	}
+
+	for (c = 0; c < channels.n; c++)
+	for (f = 0; f < frames.n; f++)
+	for (b = 0; b < bitrates.n; b++)
+	for (x = 0; x < complexities.n; x++)
+	for (m = 0; m < formats.n; m++)
+	for (t = 0; t < threads.n; t++) {
+		if (bench(&profile, channels.value[c], frames.value[f],
+				bitrates.value[b], complexities.value[x],
+				formats.value[m], threads.value[t], csv) == -1)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
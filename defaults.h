@@ -23,5 +23,5 @@
 #define DEFAULT_VERBOSE 1
 
 #define STATS_INTERVAL_MS 5000
-#define TIMED_SELECT_INTERVAL 1
+#define METRICS_INTERVAL_MS 1000
 #endif
@@ -25,6 +25,9 @@
 #include "portaudio.h"
 #endif
 
+#include "device.h"
+#include "timestamp.h"
+
 #define CHK(call, r) { \
 	if (r < 0) { \
 		aerror(call, r); \
@@ -131,12 +134,13 @@ void log_pa_stream_info(PaStream *stream, PaStreamParameters *params)
 }
 
 int open_pa_writestream(PaStream **stream,
-		unsigned int rate, unsigned int channels, unsigned int device)
+		unsigned int rate, unsigned int channels, unsigned int device,
+		PaSampleFormat format)
 {
 	PaStreamParameters outputParameters;
     outputParameters.device = device;//Pa_GetDefaultOutputDevice();
 	outputParameters.channelCount = channels;
-	outputParameters.sampleFormat = paInt16;
+	outputParameters.sampleFormat = format;
 	outputParameters.suggestedLatency = Pa_GetDeviceInfo(outputParameters.device)->defaultLowOutputLatency;
 	outputParameters.hostApiSpecificStreamInfo = NULL;
 
@@ -164,12 +168,13 @@ int open_pa_writestream(PaStream **stream,
 }
 
 int open_pa_readstream(PaStream **stream,
-		unsigned int rate, unsigned int channels, unsigned int device)
+		unsigned int rate, unsigned int channels, unsigned int device,
+		PaSampleFormat format)
 {
 	PaStreamParameters inputParameters;
     inputParameters.device = device, //Pa_GetDefaultInputDevice();
 	inputParameters.channelCount = channels;
-	inputParameters.sampleFormat = paInt16;
+	inputParameters.sampleFormat = format;
 	inputParameters.suggestedLatency = Pa_GetDeviceInfo(inputParameters.device)->defaultLowInputLatency;
 	inputParameters.hostApiSpecificStreamInfo = NULL;
 
@@ -196,4 +201,61 @@ int open_pa_readstream(PaStream **stream,
 
 	return 0;
 }
-#endif
\ No newline at end of file
+/*
+ * Convert a time on the stream's clock to the shared wall clock
+ */
+
+static uint64_t pa_to_wallclock(PaStream *stream, PaTime t)
+{
+	return wallclock_ns() + (int64_t)((t - Pa_GetStreamTime(stream)) * 1e9);
+}
+
+/*
+ * Estimate the wall clock time at which the first sample of the given
+ * number just read was captured.
+ *
+ * The blocking API has no equivalent of inputBufferAdcTime, so work
+ * back from the current time by the reported input latency and the
+ * audio which is still buffered
+ */
+
+uint64_t pa_capture_time(PaStream *stream, unsigned long samples)
+{
+	const PaStreamInfo *info;
+	signed long avail;
+	PaTime t;
+
+	info = Pa_GetStreamInfo(stream);
+	avail = Pa_GetStreamReadAvailable(stream);
+	if (avail < 0)
+		avail = 0;
+
+	t = Pa_GetStreamTime(stream) - info->inputLatency
+		- (samples + avail) / info->sampleRate;
+
+	return pa_to_wallclock(stream, t);
+}
+
+/*
+ * Estimate the wall clock time at which the next sample written will
+ * be played; the equivalent of outputBufferDacTime. The reported
+ * output latency is for a full buffer
+ */
+
+uint64_t pa_playout_time(PaStream *stream)
+{
+	const PaStreamInfo *info;
+	signed long avail;
+	PaTime t;
+
+	info = Pa_GetStreamInfo(stream);
+	avail = Pa_GetStreamWriteAvailable(stream);
+	if (avail < 0)
+		avail = 0;
+
+	t = Pa_GetStreamTime(stream) + info->outputLatency
+		- avail / info->sampleRate;
+
+	return pa_to_wallclock(stream, t);
+}
+#endif
@@ -20,6 +20,8 @@
 #ifndef DEVICE_H
 #define DEVICE_H
 
+#include <stdint.h>
+
 void aerror(const char *msg, int r);
 
 #ifdef USE_ALSA
@@ -31,10 +33,15 @@ int set_alsa_sw(snd_pcm_t *pcm);
 
 #ifdef USE_PORTAUDIO
 int open_pa_writestream(PaStream **stream,
-		unsigned int rate, unsigned int channels, unsigned int device);
+		unsigned int rate, unsigned int channels, unsigned int device,
+		PaSampleFormat format);
 
 int open_pa_readstream(PaStream **stream,
-		unsigned int rate, unsigned int channels, unsigned int device);
+		unsigned int rate, unsigned int channels, unsigned int device,
+		PaSampleFormat format);
+
+uint64_t pa_capture_time(PaStream *stream, unsigned long samples);
+uint64_t pa_playout_time(PaStream *stream);
 #endif
 
 #endif
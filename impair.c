@@ -0,0 +1,799 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Network impairment proxy: forward UDP from tx to rx, usually both
+ * on loopback, through a model of a bad network (delay and jitter,
+ * burst loss, reordering, duplication and a bottleneck link) so that
+ * the receiver can be tested reproducibly.
+ *
+ * Impairments are drawn from a seeded generator, so a run with the
+ * same seed and the same packets is the same run. Alternatively the
+ * delay and loss of each packet is read from a trace, one line per
+ * packet, which can be written by an earlier run.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#ifdef LINUX
+#include <sys/prctl.h>
+#endif
+
+#include "defaults.h"
+#include "notice.h"
+#include "sched.h"
+#include "timestamp.h"
+
+#define MAX_PACKET 1500
+#define MAX_QUEUE 4096 /* packets in flight */
+
+#define DEFAULT_LISTEN (DEFAULT_PORT + 1)
+#define DEFAULT_REORDER_MS 10
+
+/*
+ * select() is good to a few tens of microseconds at best; wake this
+ * much early and spin the rest of the way to the departure time
+ */
+
+#define SPIN_NS 100000
+
+static unsigned int verbose = DEFAULT_VERBOSE;
+
+/*
+ * A small generator of our own (xorshift64*), so that a seed gives
+ * the same impairments on every platform
+ */
+
+static uint64_t state;
+
+static void seed_random(uint64_t seed)
+{
+	state = seed ? seed : 1;
+}
+
+static uint64_t random64(void)
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 2685821657736338717ULL;
+}
+
+/* Uniform in [0, 1) */
+
+static double uniform(void)
+{
+	return (random64() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int chance(double percent)
+{
+	return uniform() * 100 < percent;
+}
+
+/*
+ * Delay distribution, in milliseconds
+ */
+
+enum distribution {
+	FIXED,
+	UNIFORM,
+	NORMAL,
+	PARETO
+};
+
+struct delay {
+	enum distribution distribution;
+	double a, b;
+};
+
+/*
+ * Parse a distribution, eg. "20", "uniform:10,30", "normal:20,5"
+ * (mean, standard deviation) or "pareto:10,1.5" (minimum, shape)
+ */
+
+static int parse_delay(struct delay *d, const char *spec)
+{
+	const char *colon;
+	char name[16];
+	size_t len;
+	int n;
+
+	d->b = 0;
+
+	colon = strchr(spec, ':');
+	if (colon == NULL) {
+		d->distribution = FIXED;
+		d->a = atof(spec);
+		return 0;
+	}
+
+	len = colon - spec;
+	if (len >= sizeof(name))
+		goto bad;
+	memcpy(name, spec, len);
+	name[len] = '\0';
+
+	n = sscanf(colon + 1, "%lf,%lf", &d->a, &d->b);
+
+	if (strcmp(name, "fixed") == 0 && n == 1) {
+		d->distribution = FIXED;
+	} else if (strcmp(name, "uniform") == 0 && n == 2 && d->b >= d->a) {
+		d->distribution = UNIFORM;
+	} else if (strcmp(name, "normal") == 0 && n == 2) {
+		d->distribution = NORMAL;
+	} else if (strcmp(name, "pareto") == 0 && n == 2 && d->b > 0) {
+		d->distribution = PARETO;
+	} else {
+		goto bad;
+	}
+
+	if (d->a < 0)
+		goto bad;
+
+	return 0;
+
+bad:
+	fprintf(stderr, "Bad delay '%s'\n", spec);
+	return -1;
+}
+
+static double draw_delay(const struct delay *d)
+{
+	double u, v, ms;
+
+	switch (d->distribution) {
+	case UNIFORM:
+		return d->a + uniform() * (d->b - d->a);
+
+	case NORMAL:
+		/* Box-Muller, truncated at no delay */
+		u = 1.0 - uniform();
+		v = uniform();
+		ms = d->a + d->b * sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+		return ms > 0 ? ms : 0;
+
+	case PARETO:
+		/* Heavy tail, as seen on Wi-Fi */
+		u = 1.0 - uniform();
+		return d->a / pow(u, 1 / d->b);
+
+	case FIXED:
+	default:
+		return d->a;
+	}
+}
+
+/*
+ * Gilbert-Elliott loss: a two state Markov chain moving from good to
+ * bad with probability p and back with probability r, per packet;
+ * packets are lost with probability k when good and h when bad.
+ * Percentages throughout
+ */
+
+struct loss {
+	double p, r, h, k;
+	int bad;
+};
+
+static int parse_loss(struct loss *l, const char *spec)
+{
+	int n;
+
+	l->h = 100;
+	l->k = 0;
+
+	n = sscanf(spec, "%lf,%lf,%lf,%lf", &l->p, &l->r, &l->h, &l->k);
+	if (n < 2 || l->p < 0 || l->p > 100 || l->r <= 0 || l->r > 100
+		|| l->h < 0 || l->h > 100 || l->k < 0 || l->k > 100)
+	{
+		fprintf(stderr, "Bad loss model '%s'\n", spec);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int draw_loss(struct loss *l)
+{
+	if (l->bad) {
+		if (chance(l->r))
+			l->bad = 0;
+	} else {
+		if (chance(l->p))
+			l->bad = 1;
+	}
+
+	return chance(l->bad ? l->h : l->k);
+}
+
+/*
+ * Packets in flight, in a heap ordered by departure time. Ties go in
+ * order of arrival, so a fixed delay never reorders
+ */
+
+struct packet {
+	uint64_t departure, seq;
+	size_t len;
+	unsigned char data[MAX_PACKET];
+};
+
+static struct packet pool[MAX_QUEUE];
+static struct packet *heap[MAX_QUEUE], *spare[MAX_QUEUE];
+static unsigned int nheap, nspare;
+
+static int before(const struct packet *a, const struct packet *b)
+{
+	if (a->departure != b->departure)
+		return a->departure < b->departure;
+	return a->seq < b->seq;
+}
+
+static void heap_push(struct packet *p)
+{
+	unsigned int n, parent;
+
+	n = nheap++;
+	while (n > 0) {
+		parent = (n - 1) / 2;
+		if (!before(p, heap[parent]))
+			break;
+		heap[n] = heap[parent];
+		n = parent;
+	}
+	heap[n] = p;
+}
+
+static struct packet* heap_pop(void)
+{
+	struct packet *top, *last;
+	unsigned int n, child;
+
+	top = heap[0];
+	last = heap[--nheap];
+
+	n = 0;
+	for (;;) {
+		child = n * 2 + 1;
+		if (child >= nheap)
+			break;
+		if (child + 1 < nheap && before(heap[child + 1], heap[child]))
+			child++;
+		if (!before(heap[child], last))
+			break;
+		heap[n] = heap[child];
+		n = child;
+	}
+	heap[n] = last;
+
+	return top;
+}
+
+/*
+ * The impairment applied to each packet, from the models or a trace
+ */
+
+static struct {
+	struct delay delay;
+	struct loss loss;
+	int lossy;
+	double reorder, reorder_ms, duplicate;
+	unsigned int kbps, queue_ms;
+
+	FILE *replay, *record;
+} config;
+
+static struct {
+	unsigned long received, sent, lost, dropped, duplicated, reordered;
+	double delay_sum, delay_max;
+} stats;
+
+/*
+ * Read the next line of the trace: a delay in milliseconds, or "-"
+ * for a lost packet. At the end the trace starts again
+ */
+
+static int replay(double *ms)
+{
+	char line[64];
+	int looped = 0;
+
+	for (;;) {
+		if (fgets(line, sizeof line, config.replay) == NULL) {
+			if (looped || ferror(config.replay)) {
+				fprintf(stderr, "Trace has no packets\n");
+				return -1;
+			}
+			rewind(config.replay);
+			looped = 1;
+			continue;
+		}
+
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		if (line[0] == '-') {
+			*ms = -1;
+			return 0;
+		}
+
+		*ms = atof(line);
+		return 0;
+	}
+}
+
+/*
+ * Decide the fate of one packet: its delay in milliseconds, or
+ * negative if it is lost
+ */
+
+static int impairment(double *ms)
+{
+	if (config.replay) {
+		if (replay(ms) == -1)
+			return -1;
+	} else if (config.lossy && draw_loss(&config.loss)) {
+		*ms = -1;
+	} else {
+		*ms = draw_delay(&config.delay);
+		if (config.reorder && chance(config.reorder)) {
+			*ms += config.reorder_ms;
+			stats.reordered++;
+		}
+	}
+
+	if (config.record) {
+		if (*ms < 0)
+			fputs("-\n", config.record);
+		else
+			fprintf(config.record, "%.3f\n", *ms);
+	}
+
+	return 0;
+}
+
+/*
+ * The bottleneck link: packets leave no faster than its rate, and
+ * are dropped when more than queue_ms is waiting to go
+ */
+
+static uint64_t link_free;
+
+static int bottleneck(uint64_t *departure, size_t len)
+{
+	uint64_t start;
+
+	if (config.kbps == 0)
+		return 0;
+
+	start = *departure > link_free ? *departure : link_free;
+	if (start - *departure > (uint64_t)config.queue_ms * 1000000)
+		return -1;
+
+	link_free = start + (uint64_t)len * 8 * 1000000 / config.kbps;
+	*departure = link_free;
+
+	return 0;
+}
+
+static int enqueue(const unsigned char *data, size_t len, uint64_t arrival,
+		double ms)
+{
+	static uint64_t seq;
+	struct packet *p;
+	uint64_t departure;
+
+	departure = arrival + (uint64_t)(ms * 1e6);
+	if (bottleneck(&departure, len) == -1) {
+		stats.dropped++;
+		return 0;
+	}
+
+	if (nspare == 0) {
+		stats.dropped++;
+		return 0;
+	}
+
+	p = spare[--nspare];
+	p->departure = departure;
+	p->seq = seq++;
+	p->len = len;
+	memcpy(p->data, data, len);
+	heap_push(p);
+
+	stats.delay_sum += ms;
+	if (ms > stats.delay_max)
+		stats.delay_max = ms;
+
+	return 0;
+}
+
+/*
+ * Take in every packet waiting on the socket
+ */
+
+static int receive(int in)
+{
+	unsigned char data[MAX_PACKET];
+	uint64_t arrival;
+	ssize_t z;
+	double ms;
+
+	for (;;) {
+		z = recv(in, data, sizeof data, MSG_DONTWAIT);
+		if (z == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			perror("recv");
+			return -1;
+		}
+
+		arrival = monotonic_ns();
+		stats.received++;
+
+		if (impairment(&ms) == -1)
+			return -1;
+		if (ms < 0) {
+			stats.lost++;
+			continue;
+		}
+
+		if (enqueue(data, z, arrival, ms) == -1)
+			return -1;
+
+		if (config.duplicate && chance(config.duplicate)) {
+			stats.duplicated++;
+			if (enqueue(data, z, arrival, ms) == -1)
+				return -1;
+		}
+	}
+}
+
+/*
+ * Send every packet which is due
+ */
+
+static int transmit(int out, uint64_t now)
+{
+	struct packet *p;
+
+	while (nheap > 0 && heap[0]->departure <= now) {
+		p = heap_pop();
+
+		if (send(out, p->data, p->len, 0) == -1) {
+			/* Nobody listening yet is not an error */
+			if (errno != ECONNREFUSED) {
+				perror("send");
+				return -1;
+			}
+		} else {
+			stats.sent++;
+		}
+
+		spare[nspare++] = p;
+	}
+
+	return 0;
+}
+
+static void report(void)
+{
+	unsigned long delayed;
+
+	delayed = stats.received - stats.lost;
+
+	fprintf(stderr, "Received %lu, sent %lu, lost %lu, dropped %lu, "
+		"duplicated %lu, reordered %lu, delay mean %.2fms max %.2fms\n",
+		stats.received, stats.sent, stats.lost, stats.dropped,
+		stats.duplicated, stats.reordered,
+		delayed ? stats.delay_sum / delayed : 0, stats.delay_max);
+}
+
+static int run(int in, int out)
+{
+	uint64_t now, next, last;
+	struct timeval tv, *timeout;
+	fd_set fds;
+	int r;
+
+	last = monotonic_ns();
+
+	for (;;) {
+		now = monotonic_ns();
+
+		if (transmit(out, now) == -1)
+			return -1;
+
+		if (verbose > 0
+			&& now - last > (uint64_t)STATS_INTERVAL_MS * 1000000)
+		{
+			report();
+			last = now;
+		}
+
+		/* Sleep until a packet arrives or, short of the next
+		 * departure, spin */
+
+		if (nheap == 0) {
+			timeout = NULL;
+		} else {
+			next = heap[0]->departure;
+			if (next - now < SPIN_NS) {
+				if (receive(in) == -1)
+					return -1;
+				continue;
+			}
+			next -= SPIN_NS;
+			tv.tv_sec = (next - now) / 1000000000;
+			tv.tv_usec = (next - now) % 1000000000 / 1000;
+			timeout = &tv;
+		}
+
+		FD_ZERO(&fds);
+		FD_SET(in, &fds);
+
+		r = select(in + 1, &fds, NULL, NULL, timeout);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("select");
+			return -1;
+		}
+
+		if (r > 0 && receive(in) == -1)
+			return -1;
+	}
+}
+
+static int open_socket(const char *addr, const char *port, int listen)
+{
+	struct addrinfo hints, *res, *a;
+	int fd, r;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (listen)
+		hints.ai_flags = AI_PASSIVE;
+
+	r = getaddrinfo(addr, port, &hints, &res);
+	if (r != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(r));
+		return -1;
+	}
+
+	fd = -1;
+	for (a = res; a != NULL; a = a->ai_next) {
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (fd == -1)
+			continue;
+
+		if (listen)
+			r = bind(fd, a->ai_addr, a->ai_addrlen);
+		else
+			r = connect(fd, a->ai_addr, a->ai_addrlen);
+		if (r == 0)
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+	if (fd == -1)
+		perror(listen ? "bind" : "connect");
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+static void usage(FILE *fd)
+{
+	fprintf(fd, "Usage: impair [<parameters>]\n"
+		"Forward UDP through a model of a bad network, eg. tx to rx\n");
+
+	fprintf(fd, "\nNetwork parameters:\n");
+	fprintf(fd, "  -a <addr>   IP address to listen on (default any)\n");
+	fprintf(fd, "  -l <port>   UDP port to listen on (default %d)\n",
+		DEFAULT_LISTEN);
+	fprintf(fd, "  -h <addr>   IP address to forward to (default 127.0.0.1)\n");
+	fprintf(fd, "  -p <port>   UDP port to forward to (default %d)\n",
+		DEFAULT_PORT);
+
+	fprintf(fd, "\nImpairments:\n");
+	fprintf(fd, "  -d <dist>   Delay in milliseconds: <ms>, uniform:<min>,<max>,\n"
+		"              normal:<mean>,<sd> or pareto:<min>,<shape> (default 0)\n");
+	fprintf(fd, "  -g <p>,<r>[,<h>,<k>]\n"
+		"              Gilbert-Elliott burst loss: percent chance per packet\n"
+		"              of going bad (p) and good again (r), and of loss\n"
+		"              when bad (h, default 100) and good (k, default 0)\n");
+	fprintf(fd, "  -x <pct>    Random loss, as -g 0,100,0,<pct>\n");
+	fprintf(fd, "  -o <pct>[,<ms>]\n"
+		"              Reorder, holding back packets by a further time\n"
+		"              (default %dms)\n", DEFAULT_REORDER_MS);
+	fprintf(fd, "  -u <pct>    Duplicate packets\n");
+	fprintf(fd, "  -b <kbps>   Bottleneck link rate (default unlimited)\n");
+	fprintf(fd, "  -q <ms>     Queue at the bottleneck before dropping (default 100)\n");
+
+	fprintf(fd, "\nReproducing a run:\n");
+	fprintf(fd, "  -s <seed>   Seed for the impairments (default from the clock)\n");
+	fprintf(fd, "  -w <file>   Record the delay or loss of each packet\n");
+	fprintf(fd, "  -t <file>   Replay a recorded trace in place of -d, -g, -x and -o\n");
+
+	fprintf(fd, "\nProgram parameters:\n");
+	fprintf(fd, "  -v <n>      Verbosity level (default %d)\n",
+		DEFAULT_VERBOSE);
+#ifdef LINUX
+	fprintf(fd, "  -C <spec>   Real-time CPU and priority, eg. network=2:80\n");
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+	const char *bind_addr = NULL, *listen_port = NULL,
+		*addr = "127.0.0.1", *port = NULL;
+	char listen_default[8], port_default[8];
+	uint64_t seed;
+	int in, out;
+	unsigned int n;
+
+	fputs(COPYRIGHT "\n", stderr);
+
+	seed = wallclock_ns();
+	config.queue_ms = 100;
+	config.reorder_ms = DEFAULT_REORDER_MS;
+
+	for (;;) {
+		int c;
+
+#ifdef LINUX
+		c = getopt(argc, argv, "a:b:d:g:h:l:o:p:q:s:t:u:v:w:x:C:");
+#else
+		c = getopt(argc, argv, "a:b:d:g:h:l:o:p:q:s:t:u:v:w:x:");
+#endif
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'a':
+			bind_addr = optarg;
+			break;
+		case 'b':
+			config.kbps = atoi(optarg);
+			break;
+		case 'd':
+			if (parse_delay(&config.delay, optarg) == -1)
+				return -1;
+			break;
+		case 'g':
+			if (parse_loss(&config.loss, optarg) == -1)
+				return -1;
+			config.lossy = 1;
+			break;
+		case 'h':
+			addr = optarg;
+			break;
+		case 'l':
+			listen_port = optarg;
+			break;
+		case 'o':
+			if (sscanf(optarg, "%lf,%lf", &config.reorder,
+					&config.reorder_ms) < 1)
+			{
+				usage(stderr);
+				return -1;
+			}
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'q':
+			config.queue_ms = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			config.replay = fopen(optarg, "r");
+			if (config.replay == NULL) {
+				perror(optarg);
+				return -1;
+			}
+			break;
+		case 'u':
+			config.duplicate = atof(optarg);
+			break;
+		case 'v':
+			verbose = atoi(optarg);
+			break;
+		case 'w':
+			config.record = fopen(optarg, "w");
+			if (config.record == NULL) {
+				perror(optarg);
+				return -1;
+			}
+			setvbuf(config.record, NULL, _IOLBF, 0);
+			break;
+		case 'x':
+			config.loss.p = 0;
+			config.loss.r = 100;
+			config.loss.h = 0;
+			config.loss.k = atof(optarg);
+			config.lossy = 1;
+			break;
+#ifdef LINUX
+		case 'C':
+			if (rt_configure(optarg) == -1)
+				return -1;
+			break;
+#endif
+		default:
+			usage(stderr);
+			return -1;
+		}
+	}
+
+	if (listen_port == NULL) {
+		snprintf(listen_default, sizeof listen_default, "%d",
+			DEFAULT_LISTEN);
+		listen_port = listen_default;
+	}
+	if (port == NULL) {
+		snprintf(port_default, sizeof port_default, "%d", DEFAULT_PORT);
+		port = port_default;
+	}
+
+	seed_random(seed);
+	if (verbose > 0 && !config.replay)
+		fprintf(stderr, "Seed %llu\n", (unsigned long long)seed);
+
+	for (n = 0; n < MAX_QUEUE; n++)
+		spare[n] = &pool[n];
+	nspare = MAX_QUEUE;
+
+	in = open_socket(bind_addr, listen_port, 1);
+	if (in == -1)
+		return -1;
+
+	out = open_socket(addr, port, 0);
+	if (out == -1)
+		return -1;
+
+#ifdef LINUX
+	/* Ask for timers as close as the kernel will give */
+	if (prctl(PR_SET_TIMERSLACK, 1) == -1)
+		perror("prctl");
+#endif
+
+	/* Best effort; a late wakeup is only a less accurate delay */
+	rt_prefault(pool, sizeof pool);
+	rt_lock_memory();
+	rt_thread(RT_NETWORK);
+
+	return run(in, out);
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include "jitter.h"
+
+void jitter_init(struct jitter *j, unsigned int rate)
+{
+	j->rate = rate;
+	j->started = 0;
+	j->jitter = 0;
+}
+
+void jitter_update(struct jitter *j, uint64_t arrival, uint32_t ts)
+{
+	double d;
+
+	if (j->started) {
+		/* Differences only, so the RTP timestamp can wrap */
+		d = (double)(int64_t)(arrival - j->arrival)
+			- (double)(int32_t)(ts - j->ts) * 1e9 / j->rate;
+		if (d < 0)
+			d = -d;
+		j->jitter += (d - j->jitter) / 16;
+	}
+
+	j->started = 1;
+	j->arrival = arrival;
+	j->ts = ts;
+}
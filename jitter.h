@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef JITTER_H
+#define JITTER_H
+
+#include <stdint.h>
+
+/*
+ * Interarrival jitter as RFC 3550 (section 6.4.1): the smoothed
+ * difference between packet spacing on arrival and in RTP time.
+ *
+ * The arrival time should be the kernel's time of receipt, so that a
+ * late wakeup of the receiving thread is not mistaken for jitter on
+ * the network
+ */
+
+struct jitter {
+	unsigned int rate; /* of the RTP clock */
+	int started;
+	uint64_t arrival;
+	uint32_t ts;
+	double jitter; /* ns */
+};
+
+void jitter_init(struct jitter *j, unsigned int rate);
+void jitter_update(struct jitter *j, uint64_t arrival, uint32_t ts);
+
+#endif
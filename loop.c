@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifdef LINUX
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "loop.h"
+#include "timestamp.h"
+
+#define EVENTS 64 /* per system call */
+
+int loop_init(struct loop *l)
+{
+	l->fd = epoll_create1(EPOLL_CLOEXEC);
+	if (l->fd == -1) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	wheel_init(&l->wheel, monotonic_ns());
+	return 0;
+}
+
+void loop_clear(struct loop *l)
+{
+	close(l->fd);
+}
+
+/*
+ * Watch a descriptor for input; it should be non-blocking
+ */
+
+int loop_add(struct loop *l, struct watch *w)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = w;
+
+	if (epoll_ctl(l->fd, EPOLL_CTL_ADD, w->fd, &ev) == -1) {
+		perror("epoll_ctl");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Wait for input, or for a timer to be due, and handle it
+ */
+
+int loop_run(struct loop *l)
+{
+	struct epoll_event ev[EVENTS];
+	uint64_t now, next;
+	int n, timeout;
+
+	now = monotonic_ns();
+	next = wheel_next(&l->wheel);
+	if (next == UINT64_MAX)
+		timeout = -1;
+	else if (next <= now)
+		timeout = 0;
+	else if (next - now > (uint64_t)INT_MAX * 1000000)
+		timeout = INT_MAX;
+	else
+		timeout = (next - now + 999999) / 1000000;
+
+	n = epoll_wait(l->fd, ev, EVENTS, timeout);
+	if (n == -1) {
+		if (errno != EINTR) {
+			perror("epoll_wait");
+			return -1;
+		}
+		n = 0;
+	}
+
+	now = monotonic_ns();
+	while (n--) {
+		struct watch *w = ev[n].data.ptr;
+
+		if (w->ready(w, now) == -1)
+			return -1;
+	}
+
+	wheel_run(&l->wheel, now);
+	return 0;
+}
+
+#endif
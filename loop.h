@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef LOOP_H
+#define LOOP_H
+
+#include "wheel.h"
+
+/*
+ * An event loop on epoll: any number of file descriptors, each with
+ * a handler, and a timer wheel. Descriptors are edge-triggered, so a
+ * handler is called once when there is something new, and must take
+ * everything there is until EAGAIN; one which is idle costs nothing.
+ * The loop wakes no more often than its timers need.
+ */
+
+struct watch {
+	int fd;
+	int (*ready)(struct watch *w, uint64_t now); /* -1 ends the loop */
+	void *data;
+};
+
+struct loop {
+	int fd;
+	struct wheel wheel;
+};
+
+int loop_init(struct loop *l);
+void loop_clear(struct loop *l);
+
+int loop_add(struct loop *l, struct watch *w);
+int loop_run(struct loop *l);
+
+#endif
@@ -0,0 +1,129 @@
+#!/bin/sh
+#
+# End-to-end benchmark of tx to rx over loopback, with WAV files in
+# place of the audio devices so that it runs on a machine with no
+# audio hardware.
+#
+# Each combination of frame size, jitter buffer and bitrate is run in
+# turn and reported as a line of CSV: latency and SNR from comparing
+# the audio out with the audio in, and concealment, underruns and CPU
+# as reported by rx and tx. Optionally the packets go through impair.
+#
+# Run from the build directory, or set BIN.
+#
+
+set -e
+
+BIN=${BIN:-.}
+
+FRAMES="240 480 960"
+JITTERS="8 16 32"
+BITRATES="64 128"
+SECS=10
+BUFFER=20
+RATE=48000
+PORT=50070
+IMPAIR=
+DIR=
+
+usage()
+{
+	cat >&2 <<EOF
+Usage: loopbench.sh [<parameters>]
+  -f <list>   Frame sizes (default "$FRAMES")
+  -j <list>   Jitter buffers in milliseconds (default "$JITTERS")
+  -b <list>   Bitrates in kbit/s (default "$BITRATES")
+  -s <secs>   Length of the test signal (default $SECS)
+  -m <ms>     Buffer time of rx (default $BUFFER)
+  -R <rate>   Rate of the audio in and out, converted by tx and rx
+              (default $RATE)
+  -p <port>   UDP port (default $PORT)
+  -i <args>   Run impair between tx and rx, with these arguments
+  -o <dir>    Keep the audio and logs in this directory
+EOF
+	exit 1
+}
+
+while getopts b:f:i:j:m:o:p:s:R: opt; do
+	case $opt in
+	b) BITRATES=$OPTARG ;;
+	f) FRAMES=$OPTARG ;;
+	i) IMPAIR=$OPTARG ;;
+	j) JITTERS=$OPTARG ;;
+	m) BUFFER=$OPTARG ;;
+	o) DIR=$OPTARG ;;
+	p) PORT=$OPTARG ;;
+	s) SECS=$OPTARG ;;
+	R) RATE=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+
+if [ -z "$DIR" ]; then
+	DIR=$(mktemp -d)
+	trap 'rm -rf "$DIR"' EXIT
+fi
+mkdir -p "$DIR"
+
+# Print the value of a name=value pair from the summary line of tx or rx
+
+field()
+{
+	sed -n "s/^$1: .*$2=\([^ %]*\).*/\1/p" "$3"
+}
+
+"$BIN/wavcmp" -G "$SECS" -r "$RATE" -c 2 "$DIR/in.wav" 2> /dev/null
+
+echo "frame,jitter_ms,kbps,latency_ms,snr_db,correlation,frames,plc,underruns,late,tx_cpu_pct,rx_cpu_pct"
+
+for FRAME in $FRAMES; do
+for JITTER in $JITTERS; do
+for KBPS in $BITRATES; do
+	NAME="$FRAME-$JITTER-$KBPS"
+	RX_PORT=$PORT
+
+	if [ -n "$IMPAIR" ]; then
+		RX_PORT=$((PORT + 1))
+		"$BIN/impair" -l "$PORT" -h 127.0.0.1 -p "$RX_PORT" -v 0 $IMPAIR \
+			2> "$DIR/impair-$NAME.log" &
+		IMPAIR_PID=$!
+	fi
+
+	"$BIN/rx" -h 127.0.0.1 -p "$RX_PORT" -c 2 -j "$JITTER" -m "$BUFFER" \
+		-R "$RATE" -W "$DIR/out-$NAME.wav" -v 0 \
+		> /dev/null 2> "$DIR/rx-$NAME.log" &
+	RX_PID=$!
+	sleep 1
+
+	"$BIN/tx" -h 127.0.0.1 -p "$PORT" -c 2 -f "$FRAME" -b "$KBPS" \
+		-R "$RATE" -W "$DIR/in.wav" -v 0 \
+		> /dev/null 2> "$DIR/tx-$NAME.log"
+
+	# rx ends by itself once the packets stop; in case none came
+	( sleep 10; kill "$RX_PID" 2> /dev/null ) &
+	WATCHDOG=$!
+	wait "$RX_PID" || true
+	kill "$WATCHDOG" 2> /dev/null || true
+
+	if [ -n "$IMPAIR" ]; then
+		kill "$IMPAIR_PID"
+		wait "$IMPAIR_PID" || true
+	fi
+
+	TX_START=$(field tx start "$DIR/tx-$NAME.log")
+	RX_START=$(field rx start "$DIR/rx-$NAME.log")
+	DELTA=$(awk "BEGIN { printf \"%.3f\", ($TX_START - $RX_START) / 1e6 }")
+
+	CMP=$("$BIN/wavcmp" -d "$DELTA" "$DIR/in.wav" "$DIR/out-$NAME.wav" \
+		2> /dev/null || echo "latency_ms= snr_db= correlation=")
+
+	echo "$FRAME,$JITTER,$KBPS,$(echo "$CMP" | sed 's/[a-z_]*=//g; s/ /,/g'),$(
+		field rx frames "$DIR/rx-$NAME.log"),$(
+		field rx plc "$DIR/rx-$NAME.log"),$(
+		field rx underruns "$DIR/rx-$NAME.log"),$(
+		field rx late "$DIR/rx-$NAME.log"),$(
+		field tx cpu "$DIR/tx-$NAME.log"),$(
+		field rx cpu "$DIR/rx-$NAME.log")"
+done
+done
+done
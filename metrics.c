@@ -0,0 +1,438 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "defaults.h"
+#include "metrics.h"
+#include "sched.h"
+
+#define MAX_METRICS 64
+#define CLIENT_TIMEOUT_MS 1000 /* so one client cannot hold up the rest */
+
+enum type {
+	COUNTER,
+	GAUGE,
+	HISTOGRAM
+};
+
+struct metric {
+	const char *name, *help;
+	enum type type;
+	atomic_ulong value; /* or the sum, for a histogram */
+
+	/* Histograms only */
+	unsigned long bound[METRIC_MAX_BUCKETS];
+	unsigned int nbounds;
+	double scale;
+	atomic_ulong count[METRIC_MAX_BUCKETS + 1];
+};
+
+static struct metric metric[MAX_METRICS];
+static unsigned int nmetrics;
+
+static struct metric* metric_new(const char *name, const char *help,
+		enum type type)
+{
+	struct metric *m;
+
+	if (nmetrics == MAX_METRICS) {
+		fprintf(stderr, "Too many metrics\n");
+		abort();
+	}
+
+	m = &metric[nmetrics++];
+	m->name = name;
+	m->help = help;
+	m->type = type;
+	atomic_init(&m->value, 0);
+
+	return m;
+}
+
+struct metric* metric_counter(const char *name, const char *help)
+{
+	return metric_new(name, help, COUNTER);
+}
+
+struct metric* metric_gauge(const char *name, const char *help)
+{
+	return metric_new(name, help, GAUGE);
+}
+
+/*
+ * Observed values are integers in whatever unit is convenient to the
+ * caller (eg. nanoseconds); they are divided by the scale on export,
+ * as Prometheus expects base units (eg. seconds)
+ */
+
+struct metric* metric_histogram(const char *name, const char *help,
+		const unsigned long *bounds, unsigned int nbounds,
+		double scale)
+{
+	struct metric *m;
+	unsigned int n;
+
+	if (nbounds > METRIC_MAX_BUCKETS) {
+		fprintf(stderr, "%s: too many buckets\n", name);
+		abort();
+	}
+
+	m = metric_new(name, help, HISTOGRAM);
+	memcpy(m->bound, bounds, sizeof(*bounds) * nbounds);
+	m->nbounds = nbounds;
+	m->scale = scale;
+	for (n = 0; n <= nbounds; n++)
+		atomic_init(&m->count[n], 0);
+
+	return m;
+}
+
+void metric_add(struct metric *m, unsigned long n)
+{
+	atomic_fetch_add_explicit(&m->value, n, memory_order_relaxed);
+}
+
+void metric_set(struct metric *m, unsigned long v)
+{
+	atomic_store_explicit(&m->value, v, memory_order_relaxed);
+}
+
+void metric_observe(struct metric *m, unsigned long v)
+{
+	unsigned int n;
+
+	for (n = 0; n < m->nbounds; n++) {
+		if (v <= m->bound[n])
+			break;
+	}
+
+	atomic_fetch_add_explicit(&m->count[n], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&m->value, v, memory_order_relaxed);
+}
+
+/*
+ * Write all metrics in the Prometheus text exposition format. The
+ * individual values are read without any lock, so a histogram may be
+ * a frame out of step with its own sum
+ */
+
+void metrics_write(FILE *f)
+{
+	unsigned int n, b;
+
+	for (n = 0; n < nmetrics; n++) {
+		struct metric *m = &metric[n];
+		unsigned long v, total;
+
+		v = atomic_load_explicit(&m->value, memory_order_relaxed);
+
+		fprintf(f, "# HELP %s %s\n", m->name, m->help);
+
+		switch (m->type) {
+		case COUNTER:
+			fprintf(f, "# TYPE %s counter\n", m->name);
+			fprintf(f, "%s %lu\n", m->name, v);
+			break;
+
+		case GAUGE:
+			fprintf(f, "# TYPE %s gauge\n", m->name);
+			fprintf(f, "%s %lu\n", m->name, v);
+			break;
+
+		case HISTOGRAM:
+			fprintf(f, "# TYPE %s histogram\n", m->name);
+			total = 0;
+			for (b = 0; b <= m->nbounds; b++) {
+				total += atomic_load_explicit(&m->count[b],
+						memory_order_relaxed);
+				if (b < m->nbounds) {
+					fprintf(f, "%s_bucket{le=\"%g\"} %lu\n",
+						m->name, m->bound[b] / m->scale,
+						total);
+				} else {
+					fprintf(f, "%s_bucket{le=\"+Inf\"} %lu\n",
+						m->name, total);
+				}
+			}
+			fprintf(f, "%s_sum %g\n", m->name, v / m->scale);
+			fprintf(f, "%s_count %lu\n", m->name, total);
+			break;
+		}
+	}
+}
+
+/*
+ * Periodically replace the given file, eg. for the node_exporter
+ * textfile collector. The rename is atomic so a reader never sees a
+ * partial file
+ */
+
+static void* run_file(void *arg)
+{
+	const char *path = arg;
+	char tmp[4096];
+	FILE *f;
+
+	snprintf(tmp, sizeof tmp, "%s.tmp", path);
+
+	for (;;) {
+		f = fopen(tmp, "w");
+		if (f == NULL) {
+			perror("fopen");
+			return NULL;
+		}
+
+		metrics_write(f);
+
+		if (fclose(f) != 0) {
+			perror("fclose");
+			return NULL;
+		}
+
+		if (rename(tmp, path) == -1) {
+			perror("rename");
+			return NULL;
+		}
+
+		usleep(METRICS_INTERVAL_MS * 1000);
+	}
+}
+
+/*
+ * Answer each connection with a minimal HTTP response, enough for
+ * Prometheus to scrape
+ */
+
+static void* run_socket(void *arg)
+{
+	int s = (intptr_t)arg;
+	struct timeval timeout = {
+		.tv_sec = CLIENT_TIMEOUT_MS / 1000,
+		.tv_usec = CLIENT_TIMEOUT_MS % 1000 * 1000,
+	};
+
+	for (;;) {
+		char request[1024];
+		FILE *f;
+		int c;
+
+		c = accept(s, NULL, NULL);
+		if (c == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			return NULL;
+		}
+
+		if (setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+				sizeof timeout) == -1
+			|| setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+				sizeof timeout) == -1)
+		{
+			perror("setsockopt");
+			close(c);
+			continue;
+		}
+
+		/* The request itself is of no interest */
+
+		if (recv(c, request, sizeof request, 0) == -1) {
+			close(c);
+			continue;
+		}
+
+		f = fdopen(c, "w");
+		if (f == NULL) {
+			close(c);
+			continue;
+		}
+
+		fputs("HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"\r\n", f);
+		metrics_write(f);
+		fclose(f);
+	}
+}
+
+static int listen_tcp(const char *port)
+{
+	struct sockaddr_in sa;
+	int s, one = 1;
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	if (s == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) == -1) {
+		perror("setsockopt");
+		goto fail;
+	}
+
+	memset(&sa, 0, sizeof sa);
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(atoi(port));
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(s, (struct sockaddr*)&sa, sizeof sa) == -1) {
+		perror("bind");
+		goto fail;
+	}
+
+	return s;
+
+fail:
+	close(s);
+	return -1;
+}
+
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un sa;
+	int s;
+
+	if (strlen(path) >= sizeof sa.sun_path) {
+		fprintf(stderr, "%s: path too long\n", path);
+		return -1;
+	}
+
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof sa);
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	unlink(path);
+
+	if (bind(s, (struct sockaddr*)&sa, sizeof sa) == -1) {
+		perror("bind");
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+/*
+ * Return the spec with any path in it made absolute, so that it can
+ * be exported after go_daemon(). The result is to be freed
+ */
+
+char* metrics_absolute(const char *spec)
+{
+	char *path, *r;
+
+	if (strncmp(spec, "tcp:", 4) == 0) {
+		r = strdup(spec);
+		if (r == NULL)
+			perror("strdup");
+		return r;
+	}
+
+	if (strncmp(spec, "unix:", 5) != 0)
+		return absolute_path(spec);
+
+	path = absolute_path(spec + 5);
+	if (path == NULL)
+		return NULL;
+
+	r = malloc(strlen(path) + 6);
+	if (r == NULL) {
+		perror("malloc");
+		free(path);
+		return NULL;
+	}
+
+	sprintf(r, "unix:%s", path);
+	free(path);
+
+	return r;
+}
+
+/*
+ * Start exporting metrics, where spec is one of "tcp:<port>" (on the
+ * loopback interface), "unix:<path>" or the path of a file to rewrite.
+ *
+ * The exporter thread inherits the scheduling of the caller, so this
+ * must be called before go_realtime(), but after go_daemon() which
+ * leaves only the calling thread
+ */
+
+int metrics_export(const char *spec)
+{
+	pthread_t thread;
+	void *(*run)(void*);
+	void *arg;
+	int r, s;
+
+	if (strncmp(spec, "tcp:", 4) == 0 || strncmp(spec, "unix:", 5) == 0) {
+		if (spec[0] == 't')
+			s = listen_tcp(spec + 4);
+		else
+			s = listen_unix(spec + 5);
+		if (s == -1)
+			return -1;
+
+		if (listen(s, 4) == -1) {
+			perror("listen");
+			close(s);
+			return -1;
+		}
+
+		/* A scraper which hangs up early must not end the process */
+
+		signal(SIGPIPE, SIG_IGN);
+
+		run = run_socket;
+		arg = (void*)(intptr_t)s;
+	} else {
+		run = run_file;
+		arg = (void*)spec;
+	}
+
+	r = pthread_create(&thread, NULL, run, arg);
+	if (r != 0) {
+		errno = r;
+		perror("pthread_create");
+		return -1;
+	}
+
+	pthread_detach(thread);
+
+	return 0;
+}
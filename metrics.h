@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+#define METRIC_MAX_BUCKETS 16
+
+struct metric;
+
+/*
+ * Metrics are registered at startup, before any other threads are
+ * running. Updates are single atomic operations and never block, so
+ * they are safe to make from the audio thread
+ */
+
+struct metric* metric_counter(const char *name, const char *help);
+struct metric* metric_gauge(const char *name, const char *help);
+struct metric* metric_histogram(const char *name, const char *help,
+		const unsigned long *bounds, unsigned int nbounds,
+		double scale);
+
+void metric_add(struct metric *m, unsigned long n);
+void metric_set(struct metric *m, unsigned long v);
+void metric_observe(struct metric *m, unsigned long v);
+
+void metrics_write(FILE *f);
+char* metrics_absolute(const char *spec);
+int metrics_export(const char *spec);
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+#include "mpmc.h"
+
+static unsigned long sequence(struct mpmc *q, unsigned long slot,
+		memory_order order)
+{
+	return atomic_load_explicit(&q->sequence[slot], order) + slot;
+}
+
+static void set_sequence(struct mpmc *q, unsigned long slot,
+		unsigned long seq)
+{
+	atomic_store_explicit(&q->sequence[slot], seq - slot,
+		memory_order_release);
+}
+
+/*
+ * Move on from the position, if its slot is at the given sequence
+ * number; return the slot, or -1 if the queue has nothing for us
+ */
+
+static long advance(struct mpmc *q, atomic_ulong *position,
+		unsigned long ahead)
+{
+	unsigned long pos, seq, slot;
+
+	pos = atomic_load_explicit(position, memory_order_relaxed);
+
+	for (;;) {
+		slot = pos & (q->size - 1);
+		seq = sequence(q, slot, memory_order_acquire);
+
+		if (seq == pos + ahead) {
+			if (atomic_compare_exchange_weak_explicit(position,
+					&pos, pos + 1, memory_order_relaxed,
+					memory_order_relaxed))
+			{
+				return slot;
+			}
+		} else if ((long)(seq - (pos + ahead)) < 0) {
+			return -1;
+		} else {
+			pos = atomic_load_explicit(position,
+				memory_order_relaxed);
+		}
+	}
+}
+
+/*
+ * A slot to write into, or -1 if the queue is full
+ */
+
+long mpmc_claim(struct mpmc *q)
+{
+	return advance(q, &q->tail, 0);
+}
+
+/*
+ * The slot, having been written, is ready to be read
+ */
+
+void mpmc_publish(struct mpmc *q, unsigned long slot)
+{
+	set_sequence(q, slot, sequence(q, slot, memory_order_relaxed) + 1);
+}
+
+/*
+ * A slot to read from, or -1 if the queue is empty
+ */
+
+long mpmc_take(struct mpmc *q)
+{
+	return advance(q, &q->head, 1);
+}
+
+/*
+ * The slot, having been read, is free to be written again
+ */
+
+void mpmc_release(struct mpmc *q, unsigned long slot)
+{
+	set_sequence(q, slot,
+		sequence(q, slot, memory_order_relaxed) + q->size - 1);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+#ifndef MPMC_H
+#define MPMC_H
+
+#include <stdatomic.h>
+
+/*
+ * Bounded multiple-producer, multiple-consumer queue (after Dmitry
+ * Vyukov) which never blocks. It hands out the index of a slot; the
+ * caller keeps the slots themselves, in an array of the same size.
+ *
+ * Each slot has a sequence number which says whether it is free to be
+ * written, or ready to be read. They are stored less the slot's index,
+ * so a queue in static storage needs no initialisation beyond
+ * MPMC_INIT
+ */
+
+struct mpmc {
+	unsigned long size; /* a power of two */
+	atomic_ulong *sequence; /* one for each slot */
+	atomic_ulong head, tail;
+};
+
+#define MPMC_INIT(array) { \
+	.size = sizeof(array) / sizeof(*(array)), \
+	.sequence = (array), \
+}
+
+long mpmc_claim(struct mpmc *q);
+void mpmc_publish(struct mpmc *q, unsigned long slot);
+
+long mpmc_take(struct mpmc *q);
+void mpmc_release(struct mpmc *q, unsigned long slot);
+
+#endif
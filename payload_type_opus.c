@@ -77,4 +77,35 @@ PayloadType payload_type_opus_mono={
 	SEND_FMTP(NULL),
 	NO_AVPF,
 	FLAGS(0)
-};
\ No newline at end of file
+};
+/* Linear PCM, RFC 3551 and RFC 3190, at the 48kHz of AES67 */
+
+PayloadType payload_type_l16_48000={
+	TYPE(PAYLOAD_AUDIO_CONTINUOUS),
+	CLOCK_RATE(48000),
+	BITS_PER_SAMPLE(16),
+	ZERO_PATTERN(Myoffset0),
+	PATTERN_LENGTH(2),
+	NORMAL_BITRATE(1536000),			/* (48000 x 16bits x 2 channels) */
+	MIME_TYPE("L16"),
+	CHANNELS(2),
+	RECV_FMTP(NULL),
+	SEND_FMTP(NULL),
+	NO_AVPF,
+	FLAGS(0)
+};
+
+PayloadType payload_type_l24_48000={
+	TYPE(PAYLOAD_AUDIO_CONTINUOUS),
+	CLOCK_RATE(48000),
+	BITS_PER_SAMPLE(24),
+	ZERO_PATTERN(Myoffset0),
+	PATTERN_LENGTH(3),
+	NORMAL_BITRATE(2304000),			/* (48000 x 24bits x 2 channels) */
+	MIME_TYPE("L24"),
+	CHANNELS(2),
+	RECV_FMTP(NULL),
+	SEND_FMTP(NULL),
+	NO_AVPF,
+	FLAGS(0)
+};
@@ -1,8 +1,22 @@
 #ifndef PAYLOAD_TYPE_OPUS_H
 #define PAYLOAD_TYPE_OPUS_H
 
+/* Dynamic payload type numbers, as used by opusrtp and our own */
+
+#define PAYLOAD_TYPE_OPUS 120
+#define PAYLOAD_TYPE_L16 96
+#define PAYLOAD_TYPE_L24 97
+
+/* The numbers alone serve the native RTP stack, which has no profile */
+
+#ifndef USE_NATIVE_RTP
+
 #include <ortp/payloadtype.h>
 
-PayloadType payload_type_opus_mono;
+extern PayloadType payload_type_opus_mono;
+extern PayloadType payload_type_l16_48000;
+extern PayloadType payload_type_l24_48000;
+
+#endif
 
 #endif
\ No newline at end of file
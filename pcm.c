@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <strings.h>
+
+#include "pcm.h"
+
+int encoding_parse(const char *name)
+{
+	if (strcasecmp(name, "opus") == 0)
+		return ENCODING_OPUS;
+	if (strcasecmp(name, "L16") == 0)
+		return ENCODING_L16;
+	if (strcasecmp(name, "L24") == 0)
+		return ENCODING_L24;
+
+	fprintf(stderr, "Unknown encoding '%s'\n", name);
+	return -1;
+}
+
+size_t encoding_sample_size(enum encoding e)
+{
+	return e == ENCODING_L24 ? sizeof(int32_t) : sizeof(int16_t);
+}
+
+size_t encoding_wire_size(enum encoding e)
+{
+	return e == ENCODING_L24 ? 3 : 2;
+}
+
+/*
+ * Pack n samples (not frames) into network byte order, returning the
+ * length of the payload
+ */
+
+size_t pcm_pack(enum encoding e, const void *pcm, size_t n,
+		unsigned char *packet)
+{
+	size_t i;
+
+	if (e == ENCODING_L24) {
+		const int32_t *s = pcm;
+
+		for (i = 0; i < n; i++) {
+			uint32_t v = s[i];
+
+			*packet++ = v >> 24;
+			*packet++ = v >> 16;
+			*packet++ = v >> 8;
+		}
+		return n * 3;
+	} else {
+		const int16_t *s = pcm;
+
+		for (i = 0; i < n; i++) {
+			uint16_t v = s[i];
+
+			*packet++ = v >> 8;
+			*packet++ = v;
+		}
+		return n * 2;
+	}
+}
+
+/*
+ * Unpack a payload, returning the number of samples; any trailing
+ * partial sample is ignored
+ */
+
+size_t pcm_unpack(enum encoding e, const unsigned char *packet,
+		size_t len, void *pcm)
+{
+	size_t i, n;
+
+	if (e == ENCODING_L24) {
+		int32_t *s = pcm;
+
+		n = len / 3;
+		for (i = 0; i < n; i++) {
+			s[i] = (int32_t)((uint32_t)packet[0] << 24
+				| (uint32_t)packet[1] << 16
+				| (uint32_t)packet[2] << 8);
+			packet += 3;
+		}
+	} else {
+		int16_t *s = pcm;
+
+		n = len / 2;
+		for (i = 0; i < n; i++) {
+			s[i] = (int16_t)(packet[0] << 8 | packet[1]);
+			packet += 2;
+		}
+	}
+
+	return n;
+}
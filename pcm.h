@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef PCM_H
+#define PCM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Uncompressed payloads, as RFC 3551 L16 and RFC 3190 L24: big-endian
+ * samples, interleaved. L16 is carried from int16_t audio and L24
+ * from int32_t, of which the top 24 bits are used
+ */
+
+enum encoding {
+	ENCODING_OPUS,
+	ENCODING_L16,
+	ENCODING_L24
+};
+
+int encoding_parse(const char *name);
+size_t encoding_sample_size(enum encoding e); /* in memory */
+size_t encoding_wire_size(enum encoding e); /* in a packet */
+
+size_t pcm_pack(enum encoding e, const void *pcm, size_t n,
+		unsigned char *packet);
+size_t pcm_unpack(enum encoding e, const unsigned char *packet,
+		size_t len, void *pcm);
+
+#endif
@@ -9,6 +9,7 @@
 #include <opus/opus.h>
 #include "portaudio.h"
 #include "pa_ringbuffer.h"
+#include "sched.h"
 //#include "pa_util.h"
 
 #define CHK(call, r) { \
@@ -184,6 +185,7 @@ paOutputData* InitPaOutputData(PaSampleFormat sampleFormat, long bufferElements,
     long writeDataBufElementCount = bufferElements;
     long writeSampleSize = Pa_GetSampleSize(sampleFormat);
     od->rBufToRTData = valloc(writeSampleSize * writeDataBufElementCount);
+    rt_prefault(od->rBufToRTData, writeSampleSize * writeDataBufElementCount);
     PaUtil_InitializeRingBuffer(&od->rBufToRT, writeSampleSize, writeDataBufElementCount, od->rBufToRTData);
     od->frameSizeBytes = writeSampleSize;
     od->channels = outputChannels;
@@ -209,6 +211,7 @@ paInputData* InitPaInputData(PaSampleFormat sampleFormat, long bufferElements, u
     long readDataBufElementCount = bufferElements;
     long readSampleSize = Pa_GetSampleSize(sampleFormat);
     id->rBufFromRTData = valloc(readSampleSize * readDataBufElementCount);
+    rt_prefault(id->rBufFromRTData, readSampleSize * readDataBufElementCount);
     PaUtil_InitializeRingBuffer(&id->rBufFromRT, readSampleSize, readDataBufElementCount, id->rBufFromRTData);
     id->frameSizeBytes = readSampleSize;
     id->channels = inputChannels;
@@ -243,6 +246,9 @@ int main(int argc, char *argv[])
     int paCallbackFramesPerBuffer = 64; /* since opus decodes 120 frames, this is closests to how our latency is going to be
                                         // frames per buffer for OS Audio buffer*/
     
+    /* keep the buffers shared with the audio callbacks resident */
+    rt_lock_memory();
+
     /* PortAudio setup*/
     err = Pa_Initialize();
 	if (err != paNoError)
@@ -278,6 +284,9 @@ int main(int argc, char *argv[])
     void *transferBuffer = valloc(bufferSize);
     void *opusEncodeBuffer = valloc(bufferSize);
     void *opusDecodeBuffer = valloc(bufferSize);
+    rt_prefault(transferBuffer, bufferSize);
+    rt_prefault(opusEncodeBuffer, bufferSize);
+    rt_prefault(opusDecodeBuffer, bufferSize);
 
     /* setup output device and stream */
  
@@ -0,0 +1,674 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Transcoding relay: receive one stream, decode it once and re-encode
+ * it in parallel at several bitrates and frame sizes ("tiers"), one
+ * encoder thread per tier. Each subscriber is sent the tier it is
+ * assigned to.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <opus/opus.h>
+#include <ortp/ortp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "codec.h"
+#include "defaults.h"
+#include "notice.h"
+#include "rtlog.h"
+#include "sched.h"
+#include "payload_type_opus.h"
+#include "timestamp.h"
+
+#define MAX_TIERS 8
+#define MAX_SUBSCRIBERS 64
+
+#define MAX_FRAME 2880 /* largest Opus frame, 60ms at 48kHz */
+#define MAX_PACKET 1500
+
+/*
+ * Decoded audio is kept in a ring sized as a multiple of every Opus
+ * frame size (120 to 2880 samples at 48kHz) so that frames, both as
+ * decoded and as read by each tier, never wrap around the end
+ */
+
+#define RING_FRAMES (5760 * 4)
+
+static unsigned int verbose = DEFAULT_VERBOSE;
+
+struct pcm_ring {
+	int16_t *pcm;
+	unsigned int channels;
+	atomic_ulong written; /* total samples (per channel) decoded */
+	atomic_int stop;
+};
+
+struct tier {
+	unsigned int kbps, frame;
+	OpusEncoder *encoder;
+	RtpSession *subscriber[MAX_SUBSCRIBERS];
+	unsigned int nsubscribers;
+
+	const struct pcm_ring *ring;
+	sem_t wake;
+	pthread_t thread;
+	atomic_int failed; /* the thread has given up */
+
+	/* Encode statistics, written by the tier thread only */
+	atomic_ulong frames, overruns, encode_ns, encode_ns_max;
+};
+
+static RtpSession* create_rtp_send(const char *addr_desc, const int port)
+{
+	RtpSession *session;
+
+	session = rtp_session_new(RTP_SESSION_SENDONLY);
+#ifdef LINUX
+	assert(session != NULL);
+#endif
+
+	rtp_session_set_scheduling_mode(session, 0);
+	rtp_session_set_blocking_mode(session, 0);
+	rtp_session_set_connected_mode(session, FALSE);
+	if (rtp_session_set_remote_addr(session, addr_desc, port) != 0)
+		abort();
+	if (rtp_session_set_payload_type(session, PAYLOAD_TYPE_OPUS) != 0)
+		abort();
+	if (rtp_session_set_multicast_ttl(session, 16) != 0)
+		abort();
+	if (rtp_session_set_dscp(session, 40) != 0)
+		abort();
+
+	return session;
+}
+
+static RtpSession* create_rtp_recv(const char *addr_desc, const int port,
+		unsigned int jitter)
+{
+	RtpSession *session;
+
+	session = rtp_session_new(RTP_SESSION_RECVONLY);
+	rtp_session_set_scheduling_mode(session, TRUE);
+	rtp_session_set_blocking_mode(session, TRUE);
+	rtp_session_set_local_addr(session, addr_desc, port, -1);
+	rtp_session_set_connected_mode(session, FALSE);
+	rtp_session_enable_adaptive_jitter_compensation(session, TRUE);
+	rtp_session_set_jitter_compensation(session, jitter); /* ms */
+	rtp_session_set_time_jump_limit(session, jitter * 16); /* ms */
+	if (rtp_session_set_payload_type(session, PAYLOAD_TYPE_OPUS) != 0)
+		abort();
+
+	/* See create_rtp_recv() in rx.c */
+
+	rtp_session_enable_rtcp(session, FALSE);
+
+	return session;
+}
+
+/*
+ * Encode the next frame of this tier directly from the shared ring
+ * and send it to every subscriber. Return 0 if there was not yet a
+ * complete frame available, otherwise 1
+ */
+
+static int encode_one_frame(struct tier *t, unsigned long *consumed,
+		unsigned int *ts)
+{
+	const struct pcm_ring *ring = t->ring;
+	unsigned char packet[MAX_PACKET];
+	unsigned long written;
+	const int16_t *pcm;
+	uint64_t start, duration;
+	opus_int32 z;
+	unsigned int n;
+
+	written = atomic_load_explicit(&ring->written, memory_order_acquire);
+	if (written - *consumed < t->frame)
+		return 0;
+
+	/* The decoder never waits for us; if we fell so far behind
+	 * that it may already be overwriting our next frame then skip
+	 * ahead, keeping our position aligned to the frame size */
+
+	if (written - *consumed > RING_FRAMES - MAX_FRAME - t->frame) {
+		unsigned long skip;
+
+		skip = written - written % t->frame - *consumed;
+		*consumed += skip;
+		*ts += skip;
+		atomic_fetch_add_explicit(&t->overruns, 1, memory_order_relaxed);
+		return 0;
+	}
+
+	pcm = ring->pcm + (*consumed % RING_FRAMES) * ring->channels;
+
+	start = monotonic_ns();
+	z = opus_encode(t->encoder, pcm, t->frame, packet, sizeof packet);
+	duration = monotonic_ns() - start;
+
+	if (z < 0) {
+		fprintf(stderr, "opus_encode: %s\n", opus_strerror(z));
+		return -1;
+	}
+
+	/* Check again, the audio may have been overwritten whilst
+	 * we were encoding it */
+
+	written = atomic_load_explicit(&ring->written, memory_order_acquire);
+	if (written - *consumed > RING_FRAMES - MAX_FRAME) {
+		atomic_fetch_add_explicit(&t->overruns, 1, memory_order_relaxed);
+	} else {
+		for (n = 0; n < t->nsubscribers; n++)
+			rtp_session_send_with_ts(t->subscriber[n], packet, z, *ts);
+	}
+
+	*consumed += t->frame;
+	*ts += t->frame;
+
+	atomic_fetch_add_explicit(&t->frames, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&t->encode_ns, duration, memory_order_relaxed);
+	if (duration > atomic_load_explicit(&t->encode_ns_max, memory_order_relaxed))
+		atomic_store_explicit(&t->encode_ns_max, duration, memory_order_relaxed);
+
+	return 1;
+}
+
+static void* run_tier(void *arg)
+{
+	struct tier *t = arg;
+	unsigned long consumed;
+	unsigned int ts = 0;
+
+	rt_thread(RT_CODEC);
+
+	/* Join the stream at the next frame boundary */
+
+	consumed = atomic_load_explicit(&t->ring->written, memory_order_acquire);
+	consumed -= consumed % t->frame;
+
+	for (;;) {
+		int r;
+
+		sem_wait(&t->wake);
+		if (atomic_load(&t->ring->stop))
+			break;
+
+		do {
+			r = encode_one_frame(t, &consumed, &ts);
+		} while (r == 1);
+
+		if (r == -1) {
+			atomic_store(&t->failed, 1);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Decode one frame directly into the ring, returning the number of
+ * samples decoded (per channel) or -1 on error
+ */
+
+static int decode_one_frame(struct pcm_ring *ring, OpusDecoder *decoder,
+		const void *packet, size_t len, unsigned int rate,
+		int *last)
+{
+	unsigned long written;
+	unsigned int pos, space;
+	int16_t *pcm;
+	int r, n;
+
+	written = atomic_load_explicit(&ring->written, memory_order_relaxed);
+	pos = written % RING_FRAMES;
+	space = RING_FRAMES - pos;
+
+	if (packet == NULL)
+		n = *last;
+	else
+		n = opus_packet_get_nb_samples(packet, len, rate);
+	if (n < 0) {
+		fprintf(stderr, "opus_packet_get_nb_samples: %s\n",
+			opus_strerror(n));
+		return -1;
+	}
+
+	/* Only a change of frame size mid-stream can leave a space
+	 * which is too small; fill it with silence and start again at
+	 * the beginning of the ring */
+
+	if ((unsigned int)n > space) {
+		memset(ring->pcm + pos * ring->channels, 0,
+			sizeof(*ring->pcm) * space * ring->channels);
+		atomic_store_explicit(&ring->written, written + space,
+			memory_order_release);
+		written += space;
+		pos = 0;
+		space = RING_FRAMES;
+	}
+
+	pcm = ring->pcm + pos * ring->channels;
+
+	if (packet == NULL)
+		r = opus_decode(decoder, NULL, 0, pcm, n, 1);
+	else
+		r = opus_decode(decoder, packet, len, pcm, MAX_FRAME, 0);
+	if (r < 0) {
+		fprintf(stderr, "opus_decode: %s\n", opus_strerror(r));
+		return -1;
+	}
+
+	*last = r;
+	atomic_store_explicit(&ring->written, written + r, memory_order_release);
+
+	return r;
+}
+
+static void print_stats(struct tier *tier, size_t ntiers)
+{
+	size_t n;
+
+	for (n = 0; n < ntiers; n++) {
+		struct tier *t = &tier[n];
+		unsigned long frames, ns, max, overruns;
+
+		frames = atomic_exchange(&t->frames, 0);
+		ns = atomic_exchange(&t->encode_ns, 0);
+		max = atomic_exchange(&t->encode_ns_max, 0);
+		overruns = atomic_exchange(&t->overruns, 0);
+
+		rtlog(stdout, "tier %ld (%ld kbps, %ld samples): "
+			"%ld frames, encode avg %ld ns, max %ld ns\n",
+			(long)n, (long)t->kbps, (long)t->frame,
+			(long)frames, (long)(frames ? ns / frames : 0),
+			(long)max);
+		if (overruns > 0)
+			rtlog(stdout, "tier %ld: %ld overruns\n",
+				(long)n, (long)overruns);
+	}
+}
+
+static int run_relay(RtpSession *session,
+		OpusDecoder *decoder,
+		struct pcm_ring *ring,
+		struct tier *tier,
+		size_t ntiers,
+		const unsigned int rate)
+{
+	int ts = 0, last = MAX_FRAME;
+
+	uint64_t tc_start, tc_now;
+	tc_start = monotonic_ns();
+
+	for (;;) {
+		int have_more, packet_size, decoded_size;
+		unsigned char buf[32768];
+		void *packet;
+		size_t n;
+
+		packet_size = rtp_session_recv_with_ts(session, (uint8_t*)buf,
+				sizeof(buf), ts, &have_more);
+#ifdef LINUX
+		assert(packet_size >= 0);
+#endif
+		if (packet_size == 0) {
+			packet = NULL;
+			if (verbose > 1)
+				rtlog_char(stderr, '#');
+		} else {
+			packet = buf;
+			if (verbose > 1)
+				rtlog_char(stderr, '.');
+		}
+
+		decoded_size = decode_one_frame(ring, decoder, packet,
+				packet_size, rate, &last);
+		if (decoded_size == -1)
+			return -1;
+
+		ts += decoded_size;
+
+		for (n = 0; n < ntiers; n++) {
+			if (atomic_load_explicit(&tier[n].failed,
+					memory_order_relaxed))
+			{
+				fprintf(stderr, "Tier %zu failed\n", n);
+				return -1;
+			}
+			sem_post(&tier[n].wake);
+		}
+
+		tc_now = monotonic_ns();
+		if (tc_now - tc_start > (uint64_t)STATS_INTERVAL_MS * 1000000) {
+			print_stats(tier, ntiers);
+			tc_start = tc_now;
+		}
+	}
+}
+
+/*
+ * Parse "<tier>:<addr>:<port>"; the address may itself contain
+ * colons (IPv6) so the port is taken from the last one
+ */
+
+static int parse_subscriber(char *arg, unsigned int *tier,
+		const char **addr, unsigned int *port)
+{
+	char *a, *p;
+
+	a = strchr(arg, ':');
+	p = strrchr(arg, ':');
+	if (a == NULL || p == a)
+		return -1;
+
+	*a++ = '\0';
+	*p++ = '\0';
+
+	*tier = atoi(arg);
+	*addr = a;
+	*port = atoi(p);
+
+	return 0;
+}
+
+static void usage(FILE *fd)
+{
+	fprintf(fd, "Usage: relay [<parameters>]\n"
+		"Real-time audio transcoding relay over IP\n");
+
+	fprintf(fd, "\nNetwork parameters (incoming):\n");
+	fprintf(fd, "  -h <addr>   IP address to listen on (default %s)\n",
+		DEFAULT_ADDR);
+	fprintf(fd, "  -p <port>   UDP port number (default %d)\n",
+		DEFAULT_PORT);
+	fprintf(fd, "  -j <ms>     Jitter buffer (default %d milliseconds)\n",
+		DEFAULT_JITTER);
+
+	fprintf(fd, "\nDecoding parameters (must match sender):\n");
+	fprintf(fd, "  -r <rate>   Sample rate (default %dHz)\n",
+		DEFAULT_RATE);
+	fprintf(fd, "  -c <n>      Number of channels (default %d)\n",
+		DEFAULT_OUTPUTCHANNELS);
+
+	fprintf(fd, "\nEncoding parameters (outgoing):\n");
+	fprintf(fd, "  -t <kbps>:<n>\n"
+		"              Add a tier at the given bitrate and frame size,\n"
+		"              numbered from 0 in the order given (maximum %d)\n",
+		MAX_TIERS);
+	fprintf(fd, "  -s <tier>:<addr>:<port>\n"
+		"              Send the given tier to a subscriber\n");
+
+	fprintf(fd, "\nProgram parameters:\n");
+	fprintf(fd, "  -v <n>      Verbosity level (default %d)\n",
+		DEFAULT_VERBOSE);
+#ifdef LINUX
+	fprintf(fd, "  -C <spec>   Real-time CPU and priority, eg. audio=2:80,codec=3\n");
+	fprintf(fd, "  -D <file>   Run as a daemon, writing process ID to the given file\n");
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+	int r, error;
+	size_t n, ntiers = 0;
+	OpusDecoder *decoder;
+	RtpSession *session;
+	struct pcm_ring ring;
+	struct tier tier[MAX_TIERS];
+	struct profile profile;
+
+	/* command-line options */
+	const char
+#ifdef LINUX
+		*pid = NULL,
+#endif
+		*addr = DEFAULT_ADDR;
+	unsigned int rate = DEFAULT_RATE,
+		jitter = DEFAULT_JITTER,
+		channels = DEFAULT_OUTPUTCHANNELS,
+		port = DEFAULT_PORT;
+	struct {
+		unsigned int tier, port;
+		const char *addr;
+	} subscriber[MAX_SUBSCRIBERS];
+	size_t nsubscribers = 0;
+
+	fputs(COPYRIGHT "\n", stderr);
+
+	memset(tier, 0, sizeof tier);
+
+	for (;;) {
+		int c;
+		char *p;
+
+#ifdef LINUX
+		c = getopt(argc, argv, "c:h:j:p:r:s:t:v:C:D:");
+#else
+		c = getopt(argc, argv, "c:h:j:p:r:s:t:v:");
+#endif
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'c':
+			channels = atoi(optarg);
+			break;
+		case 'h':
+			addr = optarg;
+			break;
+		case 'j':
+			jitter = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 's':
+			if (nsubscribers == MAX_SUBSCRIBERS) {
+				fprintf(stderr, "Too many subscribers\n");
+				return -1;
+			}
+			if (parse_subscriber(optarg,
+					&subscriber[nsubscribers].tier,
+					&subscriber[nsubscribers].addr,
+					&subscriber[nsubscribers].port) == -1)
+			{
+				usage(stderr);
+				return -1;
+			}
+			nsubscribers++;
+			break;
+		case 't':
+			if (ntiers == MAX_TIERS) {
+				fprintf(stderr, "Too many tiers\n");
+				return -1;
+			}
+			p = strchr(optarg, ':');
+			if (p == NULL) {
+				usage(stderr);
+				return -1;
+			}
+			tier[ntiers].kbps = atoi(optarg);
+			tier[ntiers].frame = atoi(p + 1);
+			ntiers++;
+			break;
+		case 'v':
+			verbose = atoi(optarg);
+			break;
+#ifdef LINUX
+		case 'C':
+			if (rt_configure(optarg) == -1)
+				return -1;
+			break;
+		case 'D':
+			pid = optarg;
+			break;
+#endif
+		default:
+			usage(stderr);
+			return -1;
+		}
+	}
+
+	if (ntiers == 0) {
+		fprintf(stderr, "At least one tier (-t) is required\n");
+		return -1;
+	}
+
+	decoder = opus_decoder_create(rate, channels, &error);
+	if (decoder == NULL) {
+		fprintf(stderr, "opus_decoder_create: %s\n",
+			opus_strerror(error));
+		return -1;
+	}
+
+	ring.pcm = calloc(RING_FRAMES * channels, sizeof *ring.pcm);
+	if (ring.pcm == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	ring.channels = channels;
+	atomic_init(&ring.written, 0);
+	atomic_init(&ring.stop, 0);
+
+	/* Every tier encodes general audio, as tx does by default */
+
+	if (profile_init(&profile, "audio") == -1)
+		return -1;
+
+	for (n = 0; n < ntiers; n++) {
+		struct tier *t = &tier[n];
+
+		if (profile_check_frame(&profile, rate, t->frame) == -1)
+			return -1;
+
+		t->encoder = opus_encoder_create(rate, channels,
+				profile.application, &error);
+		if (t->encoder == NULL) {
+			fprintf(stderr, "opus_encoder_create: %s\n",
+				opus_strerror(error));
+			return -1;
+		}
+
+		error = opus_encoder_ctl(t->encoder,
+				OPUS_SET_BITRATE(t->kbps * 1000));
+		if (error != OPUS_OK) {
+			fprintf(stderr, "OPUS_SET_BITRATE: %s\n",
+				opus_strerror(error));
+			return -1;
+		}
+
+		t->ring = &ring;
+		if (sem_init(&t->wake, 0, 0) == -1) {
+			perror("sem_init");
+			return -1;
+		}
+	}
+
+	ortp_init();
+	ortp_scheduler_init();
+	ortp_set_log_level_mask(NULL, ORTP_WARNING|ORTP_ERROR);
+	ortp_set_log_handler(rtlog_ortp);
+
+	/* Both directions use the 48kHz Opus clock, like rx */
+
+	rtp_profile_set_payload(&av_profile, PAYLOAD_TYPE_OPUS,
+		&payload_type_opus_mono);
+
+	for (n = 0; n < nsubscribers; n++) {
+		struct tier *t;
+
+		if (subscriber[n].tier >= ntiers) {
+			fprintf(stderr, "Subscriber %s: no such tier %u\n",
+				subscriber[n].addr, subscriber[n].tier);
+			return -1;
+		}
+
+		t = &tier[subscriber[n].tier];
+		if (t->nsubscribers == MAX_SUBSCRIBERS) {
+			fprintf(stderr, "Too many subscribers\n");
+			return -1;
+		}
+		t->subscriber[t->nsubscribers++] =
+			create_rtp_send(subscriber[n].addr, subscriber[n].port);
+	}
+
+	session = create_rtp_recv(addr, port, jitter);
+#ifdef LINUX
+	assert(session != NULL);
+#endif
+
+#ifdef LINUX
+	if (pid)
+		go_daemon(pid);
+#endif
+
+	/* Only the calling thread survives daemon() */
+
+	if (rtlog_start() == -1)
+		return -1;
+
+#ifdef LINUX
+	go_realtime();
+#endif
+
+	for (n = 0; n < ntiers; n++) {
+		r = pthread_create(&tier[n].thread, NULL, run_tier, &tier[n]);
+		if (r != 0) {
+			errno = r;
+			perror("pthread_create");
+			return -1;
+		}
+	}
+
+	r = run_relay(session, decoder, &ring, tier, ntiers, rate);
+
+	atomic_store(&ring.stop, 1);
+	for (n = 0; n < ntiers; n++) {
+		size_t s;
+
+		sem_post(&tier[n].wake);
+		pthread_join(tier[n].thread, NULL);
+
+		for (s = 0; s < tier[n].nsubscribers; s++)
+			rtp_session_destroy(tier[n].subscriber[s]);
+		opus_encoder_destroy(tier[n].encoder);
+		sem_destroy(&tier[n].wake);
+	}
+
+	rtp_session_destroy(session);
+	ortp_exit();
+	ortp_global_stats_display();
+	rtlog_stop();
+
+	opus_decoder_destroy(decoder);
+	free(ring.pcm);
+
+	return r;
+}
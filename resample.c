@@ -0,0 +1,302 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "resample.h"
+
+#define MAX_PHASES 1024
+
+#define CUTOFF 0.45 /* of the lower rate */
+#define BETA 6.0 /* Kaiser window; about 60dB of stopband */
+
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+	while (b != 0) {
+		unsigned int t = a % b;
+
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/*
+ * Modified Bessel function of the first kind, order zero
+ */
+
+static double bessel_i0(double x)
+{
+	double sum = 1, term = 1;
+	unsigned int k;
+
+	for (k = 1; k < 50; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+		if (term < sum * 1e-12)
+			break;
+	}
+
+	return sum;
+}
+
+/*
+ * Design the prototype low-pass filter at the upsampled rate and
+ * split it into phases, each normalised to unity gain so that the
+ * phases do not modulate a DC level
+ */
+
+static void design(struct resample *r, unsigned int in_rate,
+		unsigned int out_rate)
+{
+	unsigned int n = r->taps * r->up, p, t;
+	double c, fc, lower;
+
+	lower = in_rate < out_rate ? in_rate : out_rate;
+	fc = CUTOFF * lower / ((double)r->up * in_rate);
+	c = (n - 1) / 2.0;
+
+	for (p = 0; p < r->up; p++) {
+		float *h = r->coeff + (size_t)p * r->taps;
+		double sum = 0;
+
+		for (t = 0; t < r->taps; t++) {
+			double x, k, w, s;
+
+			/* Oldest sample first, to run along the history */
+			k = p + (double)(r->taps - 1 - t) * r->up;
+			x = (k - c) / (n / 2.0);
+			w = bessel_i0(BETA * sqrt(1 - x * x)) / bessel_i0(BETA);
+
+			if (k == c)
+				s = 2 * fc;
+			else
+				s = sin(2 * M_PI * fc * (k - c)) / (M_PI * (k - c));
+
+			h[t] = s * w;
+			sum += h[t];
+		}
+
+		for (t = 0; t < r->taps; t++)
+			h[t] /= sum;
+	}
+}
+
+int resample_init(struct resample *r, unsigned int in_rate,
+		unsigned int out_rate, unsigned int channels)
+{
+	unsigned int g;
+
+	if (in_rate == 0 || out_rate == 0 || channels == 0) {
+		fprintf(stderr, "Invalid sample rate conversion\n");
+		return -1;
+	}
+
+	g = gcd(in_rate, out_rate);
+	r->up = out_rate / g;
+	r->down = in_rate / g;
+	if (r->up > MAX_PHASES) {
+		fprintf(stderr, "Cannot convert %uHz to %uHz, the ratio "
+			"%u/%u is too complex\n",
+			in_rate, out_rate, r->up, r->down);
+		return -1;
+	}
+
+	/* Lowering the rate lowers the cutoff against the input, so
+	 * more taps are needed for the same transition */
+
+	r->taps = RESAMPLE_TAPS;
+	if (r->down > r->up)
+		r->taps = (RESAMPLE_TAPS * r->down + r->up - 1) / r->up;
+	r->taps = (r->taps + 7) & ~7u;
+
+	r->channels = channels;
+	r->coeff = malloc(sizeof(*r->coeff) * r->up * r->taps);
+	r->history = malloc(sizeof(*r->history) * 2 * r->taps * channels);
+	if (r->coeff == NULL || r->history == NULL) {
+		perror("malloc");
+		free(r->coeff);
+		free(r->history);
+		return -1;
+	}
+
+	design(r, in_rate, out_rate);
+	r->delay = (r->taps * r->up - 1) / (2.0 * r->up * in_rate);
+	resample_reset(r);
+
+	return 0;
+}
+
+void resample_clear(struct resample *r)
+{
+	free(r->coeff);
+	free(r->history);
+}
+
+void resample_reset(struct resample *r)
+{
+	memset(r->history, 0,
+		sizeof(*r->history) * 2 * r->taps * r->channels);
+	r->phase = r->up;
+	r->pos = 0;
+}
+
+/*
+ * Input needed to produce the given output; this varies from one
+ * call to the next, eg. 441 or 442 samples for 480 at 48000Hz
+ */
+
+unsigned int resample_input(const struct resample *r, unsigned int out)
+{
+	if (out == 0)
+		return 0;
+
+	return ((uint64_t)r->phase + (uint64_t)(out - 1) * r->down) / r->up;
+}
+
+/*
+ * Output which would be produced from the given input
+ */
+
+unsigned int resample_output(const struct resample *r, unsigned int in)
+{
+	uint64_t end = (uint64_t)(in + 1) * r->up;
+
+	if (end <= r->phase)
+		return 0;
+
+	return (end - r->phase + r->down - 1) / r->down;
+}
+
+/*
+ * The inner product of the history with one phase of the filter. Taps
+ * are a multiple of 8, so this is two vectors at a time; GCC and Clang
+ * give SSE on x86 and NEON on ARM
+ */
+
+#if defined(__GNUC__)
+
+typedef float v4sf __attribute__((vector_size(16)));
+
+static float dot(const float *x, const float *h, unsigned int n)
+{
+	v4sf a = {0, 0, 0, 0}, b = {0, 0, 0, 0};
+	unsigned int i;
+
+	for (i = 0; i < n; i += 8) {
+		v4sf x0, x1, h0, h1;
+
+		/* memcpy is an unaligned load, without breaking aliasing */
+		memcpy(&x0, x + i, sizeof x0);
+		memcpy(&x1, x + i + 4, sizeof x1);
+		memcpy(&h0, h + i, sizeof h0);
+		memcpy(&h1, h + i + 4, sizeof h1);
+
+		a += x0 * h0;
+		b += x1 * h1;
+	}
+
+	a += b;
+	return a[0] + a[1] + a[2] + a[3];
+}
+
+#else
+
+static float dot(const float *x, const float *h, unsigned int n)
+{
+	float a = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		a += x[i] * h[i];
+
+	return a;
+}
+
+#endif
+
+static int16_t to_int16(float x)
+{
+	x += x < 0 ? -0.5f : 0.5f;
+	if (x >= 32767)
+		return 32767;
+	if (x <= -32768)
+		return -32768;
+	return (int16_t)x;
+}
+
+/*
+ * Convert interleaved audio, producing no more than max samples (per
+ * channel) and returning how many were. Any output beyond max is
+ * kept for the next call, but the input is always taken in full, so
+ * it must be no more than resample_input() of max
+ */
+
+unsigned int resample_process(struct resample *r,
+		const int16_t *in, unsigned int samples,
+		int16_t *out, unsigned int max)
+{
+	unsigned int i = 0, o = 0, c, taps = r->taps;
+
+	for (;;) {
+		while (r->phase < r->up) {
+			const float *h;
+
+			if (o == max)
+				return o;
+
+			h = r->coeff + (size_t)r->phase * taps;
+			for (c = 0; c < r->channels; c++) {
+				const float *x;
+
+				x = r->history + (size_t)c * 2 * taps + r->pos;
+				out[(size_t)o * r->channels + c] =
+					to_int16(dot(x, h, taps));
+			}
+
+			o++;
+			r->phase += r->down;
+		}
+
+		if (i == samples)
+			break;
+
+		/* Keep two copies, so the last taps samples are always
+		 * contiguous */
+
+		for (c = 0; c < r->channels; c++) {
+			float *x = r->history + (size_t)c * 2 * taps;
+			float s = in[(size_t)i * r->channels + c];
+
+			x[r->pos] = s;
+			x[r->pos + taps] = s;
+		}
+		if (++r->pos == taps)
+			r->pos = 0;
+
+		r->phase -= r->up;
+		i++;
+	}
+
+	return o;
+}
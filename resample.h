@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <stdint.h>
+
+/*
+ * Polyphase sample rate converter between a device and the codec, eg.
+ * 44100Hz to 48000Hz, of 16-bit interleaved audio.
+ *
+ * The ratio is exact (160/147 in this example) so there is no drift
+ * of its own. The filter is a Kaiser-windowed sinc of RESAMPLE_TAPS
+ * taps at the input rate (more when reducing the rate), which is
+ * linear phase: its group delay is half that, 16 samples or 0.36ms at
+ * 44100Hz. Beyond this there is no buffering; a converter asks for
+ * only as much input as it needs.
+ */
+
+#define RESAMPLE_TAPS 32
+
+struct resample {
+	unsigned int channels;
+	unsigned int up, down; /* ratio, in lowest terms */
+	unsigned int taps; /* per phase, a multiple of 8 */
+	unsigned int phase; /* >= up when input is needed */
+	unsigned int pos;
+	float *coeff; /* up phases of taps, each reversed */
+	float *history; /* per channel, two copies of taps */
+	double delay; /* seconds */
+};
+
+int resample_init(struct resample *r, unsigned int in_rate,
+		unsigned int out_rate, unsigned int channels);
+void resample_clear(struct resample *r);
+void resample_reset(struct resample *r);
+
+unsigned int resample_input(const struct resample *r, unsigned int out);
+unsigned int resample_output(const struct resample *r, unsigned int in);
+
+unsigned int resample_process(struct resample *r,
+		const int16_t *in, unsigned int samples,
+		int16_t *out, unsigned int max);
+
+#endif
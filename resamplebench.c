@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Resampler benchmark: convert a sine between each of the given
+ * device rates and the codec rate, in both directions and a frame at
+ * a time as tx and rx do, and report the cost, the delay and the
+ * distortion of each.
+ *
+ * The delay here is what the conversion adds in tx and rx. To compare
+ * with letting the operating system convert, open the device at the
+ * codec rate and compare the latency PortAudio reports for the stream
+ * with that at the device's own rate (-R native); the difference is
+ * the cost of the system's converter.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defaults.h"
+#include "notice.h"
+#include "resample.h"
+#include "timestamp.h"
+
+#define MAX_VALUES 16
+#define MAX_CHANNELS 8
+
+#define DEFAULT_SECONDS 10
+#define TONE 997 /* Hz, not a factor of any rate */
+#define LEVEL 16384
+#define SETTLE 0.1 /* seconds before measuring distortion */
+
+struct list {
+	unsigned int n;
+	int value[MAX_VALUES];
+};
+
+static int parse_list(const char *arg, struct list *l)
+{
+	const char *p = arg;
+	char *end;
+
+	l->n = 0;
+	for (;;) {
+		if (l->n == MAX_VALUES)
+			goto invalid;
+
+		l->value[l->n++] = strtol(p, &end, 10);
+		if (end == p)
+			goto invalid;
+		if (*end == '\0')
+			return 0;
+		if (*end != ',')
+			goto invalid;
+		p = end + 1;
+	}
+
+invalid:
+	fprintf(stderr, "Invalid list '%s'\n", arg);
+	return -1;
+}
+
+static int compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, unsigned int p)
+{
+	if (n == 0)
+		return 0;
+	return sorted[(n - 1) * p / 100];
+}
+
+static void tone(int16_t *pcm, unsigned long pos, unsigned int samples,
+		unsigned int channels, unsigned int rate)
+{
+	unsigned int s, c;
+
+	for (s = 0; s < samples; s++) {
+		double v = LEVEL * sin(2 * M_PI * TONE * (pos + s) / rate);
+
+		for (c = 0; c < channels; c++)
+			pcm[s * channels + c] = lrint(v);
+	}
+}
+
+/*
+ * Convert one way for the given duration, in frames of the codec
+ * rate. Capture asks for a whole frame of output; playback gives a
+ * whole frame of input
+ */
+
+static int bench(unsigned int device, unsigned int codec, int capture,
+		unsigned int frame, unsigned int channels,
+		unsigned int seconds, int csv)
+{
+	unsigned int in_rate, out_rate, max, n, o, s, frames, f;
+	unsigned long in_pos = 0, out_pos = 0;
+	double signal = 0, noise = 0, audio, rtf;
+	uint64_t *ns, total = 0;
+	int16_t *in, *out;
+	struct resample r;
+
+	in_rate = capture ? device : codec;
+	out_rate = capture ? codec : device;
+
+	if (resample_init(&r, in_rate, out_rate, channels) == -1)
+		return -1;
+
+	frames = (uint64_t)codec * seconds / frame;
+	/* Enough for a frame at either rate */
+	max = (uint64_t)frame * device / codec + 2;
+	if (max < frame)
+		max = frame;
+	ns = malloc(sizeof(*ns) * frames);
+	in = malloc(sizeof(*in) * max * channels);
+	out = malloc(sizeof(*out) * max * channels);
+	if (ns == NULL || in == NULL || out == NULL) {
+		perror("malloc");
+		free(ns);
+		free(in);
+		free(out);
+		resample_clear(&r);
+		return -1;
+	}
+
+	for (f = 0; f < frames; f++) {
+		uint64_t start;
+
+		n = capture ? resample_input(&r, frame) : frame;
+		tone(in, in_pos, n, channels, in_rate);
+		in_pos += n;
+
+		start = monotonic_ns();
+		o = resample_process(&r, in, n, out, capture ? frame : max);
+		ns[f] = monotonic_ns() - start;
+		total += ns[f];
+
+		/* Against the ideal, allowing for the filter's delay */
+
+		for (s = 0; s < o; s++) {
+			double t = (double)(out_pos + s) / out_rate, e;
+
+			if (t < SETTLE)
+				continue;
+			e = LEVEL * sin(2 * M_PI * TONE * (t - r.delay));
+			signal += e * e;
+			noise += (out[s * channels] - e) * (out[s * channels] - e);
+		}
+		out_pos += o;
+	}
+
+	qsort(ns, frames, sizeof *ns, compare);
+
+	audio = (double)frames * frame / codec;
+	rtf = total ? audio / (total / 1e9) : 0;
+
+	printf(csv ? "%u,%u,%u,%u,%.3f,%lu,%lu,%.0f,%.1f\n"
+		: "%7u %7u %5u %3u %8.3f %9lu %9lu %8.0f %7.1f\n",
+		in_rate, out_rate, frame, channels, r.delay * 1000,
+		(unsigned long)percentile(ns, frames, 50),
+		(unsigned long)percentile(ns, frames, 99),
+		rtf, noise > 0 ? 10 * log10(signal / noise) : INFINITY);
+	fflush(stdout);
+
+	free(ns);
+	free(in);
+	free(out);
+	resample_clear(&r);
+	return 0;
+}
+
+static void usage(FILE *fd)
+{
+	fprintf(fd, "Usage: resamplebench [<parameters>]\n"
+		"Benchmark the sample rate conversion of tx and rx\n");
+
+	fprintf(fd, "\nSettings, each a comma-separated list to sweep:\n");
+	fprintf(fd, "  -R <rate,...>\n"
+		"              Device rates (default 44100)\n");
+	fprintf(fd, "  -f <n,...>  Frame sizes at the codec rate (default %d)\n",
+		DEFAULT_FRAME);
+	fprintf(fd, "  -c <n,...>  Channels (default %d)\n",
+		DEFAULT_OUTPUTCHANNELS);
+
+	fprintf(fd, "\nOther parameters:\n");
+	fprintf(fd, "  -r <rate>   Codec rate (default %dHz)\n",
+		DEFAULT_RATE);
+	fprintf(fd, "  -s <secs>   Duration (default %d seconds)\n",
+		DEFAULT_SECONDS);
+	fprintf(fd, "  -o csv      Comma-separated values\n");
+	fprintf(fd, "\nTimes are nanoseconds per frame. RTF is the realtime factor of\n"
+		"one stream on one core. SNR is of a %dHz tone at -6dBFS.\n", TONE);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int rate = DEFAULT_RATE, seconds = DEFAULT_SECONDS;
+	struct list rates, frames, channels;
+	unsigned int d, f, c;
+	int csv = 0;
+
+	fputs(COPYRIGHT "\n", stderr);
+
+	rates.n = 1;
+	rates.value[0] = 44100;
+	frames.n = 1;
+	frames.value[0] = DEFAULT_FRAME;
+	channels.n = 1;
+	channels.value[0] = DEFAULT_OUTPUTCHANNELS;
+
+	for (;;) {
+		int opt;
+
+		opt = getopt(argc, argv, "c:f:o:r:s:R:");
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'c':
+			if (parse_list(optarg, &channels) == -1)
+				return -1;
+			break;
+		case 'f':
+			if (parse_list(optarg, &frames) == -1)
+				return -1;
+			break;
+		case 'o':
+			if (strcmp(optarg, "csv") != 0) {
+				usage(stderr);
+				return -1;
+			}
+			csv = 1;
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'R':
+			if (parse_list(optarg, &rates) == -1)
+				return -1;
+			break;
+		default:
+			usage(stderr);
+			return -1;
+		}
+	}
+
+	for (c = 0; c < channels.n; c++) {
+		if (channels.value[c] < 1 || channels.value[c] > MAX_CHANNELS) {
+			fprintf(stderr, "Channels must be 1 to %d\n",
+				MAX_CHANNELS);
+			return -1;
+		}
+	}
+	for (f = 0; f < frames.n; f++) {
+		if (frames.value[f] < 1) {
+			fprintf(stderr, "Invalid frame size\n");
+			return -1;
+		}
+	}
+
+	if (csv) {
+		printf("in_rate,out_rate,frame,channels,delay_ms,"
+			"p50_ns,p99_ns,rtf,snr_db\n");
+	} else {
+		printf("%7s %7s %5s %3s %8s %9s %9s %8s %7s\n",
+			"in", "out", "frame", "ch", "delay ms",
+			"p50", "p99", "RTF", "SNR dB");
+	}
+
+	for (d = 0; d < rates.n; d++)
+	for (f = 0; f < frames.n; f++)
+	for (c = 0; c < channels.n; c++) {
+		if (bench(rates.value[d], rate, 1, frames.value[f],
+				channels.value[c], seconds, csv) == -1)
+			return -1;
+		if (bench(rates.value[d], rate, 0, frames.value[f],
+				channels.value[c], seconds, csv) == -1)
+			return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,304 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mpmc.h"
+#include "rtlog.h"
+
+#define QUEUE_RECORDS 1024 /* must be a power of two */
+#define TEXT_SIZE 200
+#define IDLE_US 10000
+
+enum kind {
+	FORMAT, /* format and arguments, formatted by the log thread */
+	TEXT,   /* already formatted */
+	CHAR
+};
+
+struct record {
+	FILE *f;
+	enum kind kind;
+	union {
+		struct {
+			const char *fmt;
+			long arg[4];
+		} format;
+		char text[TEXT_SIZE];
+		int c;
+	};
+};
+
+/*
+ * Records go from any thread to the log thread by way of a queue
+ * which needs no initialisation
+ */
+
+static struct record queue[QUEUE_RECORDS];
+static atomic_ulong sequence[QUEUE_RECORDS];
+static struct mpmc ring = MPMC_INIT(sequence);
+static unsigned long dropped;
+static atomic_ulong ndropped;
+
+static pthread_t thread;
+static atomic_int stop;
+static int running;
+
+static struct record* claim(void)
+{
+	long n;
+
+	n = mpmc_claim(&ring);
+	if (n == -1) {
+		atomic_fetch_add_explicit(&ndropped, 1, memory_order_relaxed);
+		return NULL;
+	}
+
+	return &queue[n];
+}
+
+static void publish(struct record *r)
+{
+	mpmc_publish(&ring, r - queue);
+}
+
+void rtlog_record(FILE *f, const char *fmt, ...)
+{
+	struct record *r;
+	va_list ap;
+	int n;
+
+	r = claim();
+	if (r == NULL)
+		return;
+
+	r->f = f;
+	r->kind = FORMAT;
+	r->format.fmt = fmt;
+
+	va_start(ap, fmt);
+	for (n = 0; n < 4; n++)
+		r->format.arg[n] = va_arg(ap, long);
+	va_end(ap);
+
+	publish(r);
+}
+
+void rtlog_char(FILE *f, int c)
+{
+	struct record *r;
+
+	r = claim();
+	if (r == NULL)
+		return;
+
+	r->f = f;
+	r->kind = CHAR;
+	r->c = c;
+
+	publish(r);
+}
+
+/*
+ * Format now, into the record. This costs more on the calling
+ * thread, but allows for any format (including strings which may not
+ * outlive the call); anything longer than a record is truncated
+ */
+
+void rtlog_vtext(FILE *f, const char *fmt, va_list ap)
+{
+	struct record *r;
+
+	r = claim();
+	if (r == NULL)
+		return;
+
+	r->f = f;
+	r->kind = TEXT;
+	vsnprintf(r->text, sizeof r->text, fmt, ap);
+
+	publish(r);
+}
+
+void rtlog_text(FILE *f, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	rtlog_vtext(f, fmt, ap);
+	va_end(ap);
+}
+
+#ifndef USE_NATIVE_RTP
+
+/*
+ * Handler for oRTP's own log messages, which may come from its
+ * scheduler thread
+ */
+
+void rtlog_ortp(const char *domain, OrtpLogLevel lev, const char *fmt,
+		va_list args)
+{
+	struct record *r;
+	const char *level;
+	int n;
+
+	switch (lev) {
+	case ORTP_DEBUG:
+		level = "debug";
+		break;
+	case ORTP_WARNING:
+		level = "warning";
+		break;
+	case ORTP_ERROR:
+		level = "error";
+		break;
+	case ORTP_FATAL:
+		level = "fatal";
+		break;
+	default:
+		level = "message";
+		break;
+	}
+
+	r = claim();
+	if (r == NULL)
+		return;
+
+	r->f = stdout;
+	r->kind = TEXT;
+	n = snprintf(r->text, sizeof r->text, "ortp-%s-", level);
+	if (n > 0 && n < (int)sizeof r->text)
+		vsnprintf(r->text + n, sizeof r->text - n, fmt, args);
+
+	/* oRTP messages do not carry their own newline */
+
+	n = strlen(r->text);
+	if (n == sizeof r->text - 1)
+		n--;
+	r->text[n] = '\n';
+	r->text[n + 1] = '\0';
+
+	publish(r);
+}
+
+#endif
+
+/*
+ * Take the next record from the queue and write it out, returning 0
+ * if the queue was empty
+ */
+
+static int write_one(void)
+{
+	struct record *r;
+	long n;
+
+	n = mpmc_take(&ring);
+	if (n == -1)
+		return 0;
+	r = &queue[n];
+
+	switch (r->kind) {
+	case FORMAT:
+		fprintf(r->f, r->format.fmt,
+			r->format.arg[0], r->format.arg[1],
+			r->format.arg[2], r->format.arg[3]);
+		break;
+	case TEXT:
+		fputs(r->text, r->f);
+		break;
+	case CHAR:
+		fputc(r->c, r->f);
+		break;
+	}
+
+	mpmc_release(&ring, n);
+
+	return 1;
+}
+
+static void write_all(void)
+{
+	unsigned long d;
+
+	while (write_one())
+		;
+
+	d = atomic_load_explicit(&ndropped, memory_order_relaxed);
+	if (d != dropped) {
+		fprintf(stderr, "rtlog: %lu messages dropped\n", d - dropped);
+		dropped = d;
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+}
+
+static void* run(void *arg)
+{
+	while (!atomic_load(&stop)) {
+		write_all();
+		usleep(IDLE_US);
+	}
+
+	return NULL;
+}
+
+/*
+ * The log thread inherits the scheduling of the caller, so this must
+ * be called before go_realtime(), but after go_daemon() which leaves
+ * only the calling thread
+ */
+
+int rtlog_start(void)
+{
+	int r;
+
+	r = pthread_create(&thread, NULL, run, NULL);
+	if (r != 0) {
+		errno = r;
+		perror("pthread_create");
+		return -1;
+	}
+
+	running = 1;
+
+	return 0;
+}
+
+/*
+ * Write out anything remaining, after which messages are no longer
+ * written
+ */
+
+void rtlog_stop(void)
+{
+	if (!running)
+		return;
+
+	atomic_store(&stop, 1);
+	pthread_join(thread, NULL);
+	write_all();
+	running = 0;
+}
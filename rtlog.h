@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef RTLOG_H
+#define RTLOG_H
+
+#include <stdarg.h>
+#include <stdio.h>
+#ifndef USE_NATIVE_RTP
+#include <ortp/ortp.h>
+#endif
+
+/*
+ * Logging which is safe from real-time threads: messages are queued
+ * as fixed-size records without blocking, and written out by a
+ * background thread. If the queue is full the message is dropped,
+ * and counted.
+ *
+ * rtlog() defers even the formatting; the format must be a string
+ * constant and takes up to four arguments, which must all be long
+ */
+
+#define rtlog(f, ...) rtlog_record(f, __VA_ARGS__, 0L, 0L, 0L, 0L)
+
+void rtlog_record(FILE *f, const char *fmt, ...);
+void rtlog_char(FILE *f, int c);
+void rtlog_text(FILE *f, const char *fmt, ...);
+void rtlog_vtext(FILE *f, const char *fmt, va_list ap);
+
+#ifndef USE_NATIVE_RTP
+void rtlog_ortp(const char *domain, OrtpLogLevel lev, const char *fmt,
+		va_list args);
+#endif
+
+int rtlog_start(void);
+void rtlog_stop(void);
+
+#endif
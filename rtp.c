@@ -0,0 +1,1084 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#define _GNU_SOURCE /* recvmmsg */
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "rtp.h"
+#include "timestamp.h"
+
+#define RTCP_INTERVAL_MS 5000
+#define RTCP_POLL_MS 100
+#define RTCP_SR 200
+#define RTCP_SDES 202
+#define CNAME "trx"
+
+#define EXTENSION_PROFILE 0xbede /* one-byte form, RFC 8285 */
+
+#define REPORT_SIZE 44 /* sender report and SDES */
+
+#ifdef USE_SRTP
+#define REPORT_BUFFER (REPORT_SIZE + SRTCP_MAX_TRAILER)
+#else
+#define REPORT_BUFFER REPORT_SIZE
+#endif
+
+static uint32_t be32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put16(unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/*
+ * Find the capture time amongst the one-byte header extensions
+ */
+
+static uint64_t parse_extension(const unsigned char *p, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len) {
+		unsigned int id = p[i] >> 4, n = (p[i] & 0xf) + 1;
+
+		if (p[i] == 0) { /* padding */
+			i++;
+			continue;
+		}
+		if (id == 15 || i + 1 + n > len)
+			break;
+		if (id == CAPTURE_TIME_EXTENSION && n == CAPTURE_TIME_SIZE)
+			return ns_from_ntp(p + i + 1);
+		i += 1 + n;
+	}
+
+	return 0;
+}
+
+int rtp_parse(const unsigned char *p, size_t len, struct rtp *r)
+{
+	size_t offset, end;
+
+	if (len < 12 || p[0] >> 6 != 2)
+		return -1;
+
+	r->pt = p[1] & 0x7f;
+	r->marker = p[1] >> 7;
+	r->seq = p[2] << 8 | p[3];
+	r->ts = be32(p + 4);
+	r->ssrc = be32(p + 8);
+	r->capture = 0;
+
+	offset = 12 + 4 * (p[0] & 0xf); /* CSRCs */
+	if (p[0] & 0x10) { /* header extension */
+		size_t n;
+
+		if (offset + 4 > len)
+			return -1;
+		n = 4 * (p[offset + 2] << 8 | p[offset + 3]);
+		if (offset + 4 + n > len)
+			return -1;
+		if ((p[offset] << 8 | p[offset + 1]) == EXTENSION_PROFILE)
+			r->capture = parse_extension(p + offset + 4, n);
+		offset += 4 + n;
+	}
+
+	end = len;
+	if (p[0] & 0x20) { /* padding */
+		if (p[len - 1] > len)
+			return -1;
+		end -= p[len - 1];
+	}
+
+	if (offset > end)
+		return -1;
+
+	r->payload = p + offset;
+	r->len = end - offset;
+	return 0;
+}
+
+/*
+ * Write the header for a packet, with the capture time if it is
+ * given, and return its length; at most 28 bytes
+ */
+
+size_t rtp_header(unsigned char *p, unsigned int pt, int marker,
+		uint16_t seq, uint32_t ts, uint32_t ssrc, uint64_t capture)
+{
+	p[0] = 0x80 | (capture ? 0x10 : 0);
+	p[1] = (marker ? 0x80 : 0) | (pt & 0x7f);
+	put16(p + 2, seq);
+	put32(p + 4, ts);
+	put32(p + 8, ssrc);
+
+	if (capture == 0)
+		return 12;
+
+	/* One element of 8 bytes, padded to a whole word */
+
+	put16(p + 12, EXTENSION_PROFILE);
+	put16(p + 14, 3);
+	p[16] = CAPTURE_TIME_EXTENSION << 4 | (CAPTURE_TIME_SIZE - 1);
+	ntp_from_ns(capture, p + 17);
+	p[25] = 0;
+	p[26] = 0;
+	p[27] = 0;
+
+	return 28;
+}
+
+static void set_port(struct sockaddr_storage *addr, unsigned int port)
+{
+	if (addr->ss_family == AF_INET6)
+		((struct sockaddr_in6*)addr)->sin6_port = htons(port);
+	else
+		((struct sockaddr_in*)addr)->sin_port = htons(port);
+}
+
+static struct addrinfo* resolve(const char *addr, unsigned int port,
+		int flags)
+{
+	struct addrinfo hints, *res;
+	char service[16];
+	int r;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = flags;
+
+	snprintf(service, sizeof service, "%u", port);
+	r = getaddrinfo(addr, service, &hints, &res);
+	if (r != 0) {
+		fprintf(stderr, "%s: %s\n", addr, gai_strerror(r));
+		return NULL;
+	}
+
+	return res;
+}
+
+static uint32_t random_ssrc(void)
+{
+	uint64_t x;
+
+	x = wallclock_ns() ^ (uint64_t)getpid() << 32;
+	x *= 0x9e3779b97f4a7c15ull;
+	return x >> 32;
+}
+
+/*
+ * Send to the given address and port, and RTCP to the port after;
+ * by way of io_uring if asked for, and the kernel has it
+ */
+
+int rtp_sender_init(struct rtp_sender *s, const char *addr,
+		unsigned int port, unsigned int pt, int ttl, int dscp,
+		int uring)
+{
+	struct addrinfo *res;
+	int r, tos = dscp << 2;
+
+	res = resolve(addr, port, 0);
+	if (res == NULL)
+		return -1;
+
+	s->fd = socket(res->ai_family, SOCK_DGRAM, 0);
+	if (s->fd == -1) {
+		perror("socket");
+		freeaddrinfo(res);
+		return -1;
+	}
+
+	memcpy(&s->addr, res->ai_addr, res->ai_addrlen);
+	s->addrlen = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	s->rtcp = s->addr;
+	set_port(&s->rtcp, port + 1);
+
+	if (s->addr.ss_family == AF_INET6) {
+		r = setsockopt(s->fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+			&ttl, sizeof ttl);
+		if (r == 0) {
+			r = setsockopt(s->fd, IPPROTO_IPV6, IPV6_TCLASS,
+				&tos, sizeof tos);
+		}
+	} else {
+		unsigned char hops = ttl;
+
+		r = setsockopt(s->fd, IPPROTO_IP, IP_MULTICAST_TTL,
+			&hops, sizeof hops);
+		if (r == 0)
+			r = setsockopt(s->fd, IPPROTO_IP, IP_TOS, &tos, sizeof tos);
+	}
+	if (r == -1) {
+		perror("setsockopt");
+		close(s->fd);
+		return -1;
+	}
+
+	s->pt = pt;
+	s->ssrc = random_ssrc();
+	s->seq = (s->ssrc >> 7) & 0x7fff; /* far from a wrap, for SRTP */
+	s->packets = 0;
+	s->octets = 0;
+	s->report = 0;
+#ifdef USE_SRTP
+	s->srtp = NULL;
+#endif
+
+#ifdef USE_IO_URING
+	s->uring = 0;
+	if (uring) {
+		if (uring_init(&s->ring, 2 * RTP_SEND_SLOTS, 0, 0) == 0)
+			s->uring = 1;
+		else
+			fprintf(stderr, "io_uring: %s; sending by sendmsg()\n",
+				strerror(errno));
+	}
+	s->error = 0;
+	for (r = 0; r < RTP_SEND_SLOTS; r++)
+		s->out[r].busy = 0;
+#else
+	(void)uring;
+#endif
+
+	return 0;
+}
+
+void rtp_sender_clear(struct rtp_sender *s)
+{
+#ifdef USE_IO_URING
+	if (s->uring)
+		uring_clear(&s->ring);
+#endif
+	close(s->fd);
+}
+
+/*
+ * A sender report, with the SDES item which RFC 3550 requires in
+ * every compound packet. It is sent alongside a packet of audio, so
+ * the timestamp is that of the packet. Return its length, or 0 if it
+ * cannot be sent
+ */
+
+static size_t report(struct rtp_sender *s, uint32_t ts, unsigned char *p)
+{
+	size_t len = REPORT_SIZE;
+
+	p[0] = 0x80;
+	p[1] = RTCP_SR;
+	put16(p + 2, 6);
+	put32(p + 4, s->ssrc);
+	ntp_from_ns(wallclock_ns(), p + 8);
+	put32(p + 16, ts);
+	put32(p + 20, s->packets);
+	put32(p + 24, s->octets);
+
+	p[28] = 0x81;
+	p[29] = RTCP_SDES;
+	put16(p + 30, 3);
+	put32(p + 32, s->ssrc);
+	p[36] = 1; /* CNAME */
+	p[37] = sizeof(CNAME) - 1;
+	memcpy(p + 38, CNAME, sizeof(CNAME) - 1);
+	memset(p + 38 + sizeof(CNAME) - 1, 0,
+		REPORT_SIZE - 38 - (sizeof(CNAME) - 1));
+
+#ifdef USE_SRTP
+	if (s->srtp && srtp_protect_rtcp(s->srtp, p, &len) == -1)
+		return 0;
+#endif
+
+	return len;
+}
+
+static void sent(struct rtp_sender *s, size_t len, int *rtcp)
+{
+	uint64_t now;
+
+	s->seq++;
+	s->packets++;
+	s->octets += len;
+
+	now = monotonic_ns();
+	*rtcp = (now >= s->report);
+	if (*rtcp)
+		s->report = now + (uint64_t)RTCP_INTERVAL_MS * 1000000;
+}
+
+#ifdef USE_IO_URING
+
+/*
+ * Copy a packet into a free slot and queue it, or return -1 if every
+ * slot is still in flight
+ */
+
+static int queue_send(struct rtp_sender *s, const struct sockaddr_storage *to,
+		const struct iovec *iov, unsigned int count)
+{
+	struct uring_event e;
+	unsigned int n, i;
+	size_t len = 0;
+
+	/* Completions are collected as we go, not waited for */
+
+	while (uring_next(&s->ring, &e)) {
+		s->out[e.data].busy = 0;
+		if (e.res < 0)
+			s->error = -e.res;
+	}
+
+	for (n = 0; n < RTP_SEND_SLOTS; n++) {
+		if (!s->out[n].busy)
+			break;
+	}
+	if (n == RTP_SEND_SLOTS)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		memcpy(s->out[n].buf + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	s->out[n].iov.iov_base = s->out[n].buf;
+	s->out[n].iov.iov_len = len;
+
+	memset(&s->out[n].msg, 0, sizeof s->out[n].msg);
+	s->out[n].msg.msg_name = (void*)to;
+	s->out[n].msg.msg_namelen = s->addrlen;
+	s->out[n].msg.msg_iov = &s->out[n].iov;
+	s->out[n].msg.msg_iovlen = 1;
+
+	if (uring_sendmsg(&s->ring, s->fd, &s->out[n].msg, n) == -1)
+		return -1;
+
+	s->out[n].busy = 1;
+	return 0;
+}
+
+/*
+ * The packet, and the report when one is due, go to the kernel in a
+ * single system call. The error from an earlier send, which would
+ * have been seen straight away without io_uring, is given now
+ */
+
+static int send_uring(struct rtp_sender *s, uint32_t ts,
+		const struct iovec *iov, unsigned int count)
+{
+	unsigned char p[REPORT_BUFFER];
+	struct iovec r;
+	int rtcp;
+
+	if (queue_send(s, &s->addr, iov, count) == -1)
+		return 1; /* by sendmsg() instead */
+
+	sent(s, iov[1].iov_len, &rtcp);
+	if (rtcp) {
+		r.iov_base = p;
+		r.iov_len = report(s, ts, p);
+		if (r.iov_len > 0)
+			queue_send(s, &s->rtcp, &r, 1);
+	}
+
+	if (uring_submit(&s->ring) == -1)
+		return -1;
+
+	if (s->error) {
+		errno = s->error;
+		s->error = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+#endif
+
+/*
+ * Send a packet; the payload is not copied, but goes to the kernel
+ * alongside the header. With SRTP it is encrypted where it is, so
+ * the caller's buffer is overwritten. Return -1 on error, with errno
+ * set
+ */
+
+int rtp_send(struct rtp_sender *s, uint32_t ts, int marker,
+		uint64_t capture, void *payload, size_t len)
+{
+	unsigned char header[28], p[REPORT_BUFFER];
+	struct iovec iov[3];
+	struct msghdr msg;
+	unsigned int count = 2;
+	int rtcp;
+#ifdef USE_SRTP
+	unsigned char tag[SRTP_MAX_TAG];
+	int z;
+#endif
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = rtp_header(header, s->pt, marker, s->seq, ts,
+		s->ssrc, capture);
+	iov[1].iov_base = payload;
+	iov[1].iov_len = len;
+
+#ifdef USE_SRTP
+	if (s->srtp) {
+		if (iov[0].iov_len + len + s->srtp->tag > RTP_MAX_PACKET) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		z = srtp_protect(s->srtp, header, iov[0].iov_len,
+			payload, len, tag);
+		if (z == -1) {
+			errno = EIO;
+			return -1;
+		}
+		iov[2].iov_base = tag;
+		iov[2].iov_len = z;
+		count = 3;
+	}
+#endif
+
+#ifdef USE_IO_URING
+	if (s->uring) {
+		int r;
+
+		if (iov[0].iov_len + len > RTP_MAX_PACKET) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+
+		r = send_uring(s, ts, iov, count);
+		if (r != 1)
+			return r;
+	}
+#endif
+
+	memset(&msg, 0, sizeof msg);
+	msg.msg_name = &s->addr;
+	msg.msg_namelen = s->addrlen;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+
+	if (sendmsg(s->fd, &msg, 0) == -1) {
+#ifdef USE_SRTP
+		/* The sequence number has had its keystream */
+		if (s->srtp)
+			s->seq++;
+#endif
+		return -1;
+	}
+
+	sent(s, len, &rtcp);
+	if (rtcp) {
+		size_t n;
+
+		/* Best effort; the audio does not depend on it */
+		n = report(s, ts, p);
+		if (n > 0) {
+			sendto(s->fd, p, n, 0, (struct sockaddr*)&s->rtcp,
+				s->addrlen);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Join the group, if the address is a multicast one
+ */
+
+static int join(int fd, const struct addrinfo *a)
+{
+	if (a->ai_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 = (const void*)a->ai_addr;
+		struct ipv6_mreq m;
+
+		if (!IN6_IS_ADDR_MULTICAST(&sin6->sin6_addr))
+			return 0;
+
+		m.ipv6mr_multiaddr = sin6->sin6_addr;
+		m.ipv6mr_interface = 0;
+		if (setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP,
+				&m, sizeof m) == -1)
+		{
+			perror("IPV6_JOIN_GROUP");
+			return -1;
+		}
+	} else {
+		const struct sockaddr_in *sin = (const void*)a->ai_addr;
+		struct ip_mreq m;
+
+		if (!IN_MULTICAST(ntohl(sin->sin_addr.s_addr)))
+			return 0;
+
+		m.imr_multiaddr = sin->sin_addr;
+		m.imr_interface.s_addr = htonl(INADDR_ANY);
+		if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+				&m, sizeof m) == -1)
+		{
+			perror("IP_ADD_MEMBERSHIP");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int open_socket(const char *addr, unsigned int port)
+{
+	struct addrinfo *res;
+	int fd, one = 1;
+
+	res = resolve(addr, port, AI_PASSIVE);
+	if (res == NULL)
+		return -1;
+
+	fd = socket(res->ai_family, SOCK_DGRAM, 0);
+	if (fd == -1) {
+		perror("socket");
+		freeaddrinfo(res);
+		return -1;
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) == -1)
+		perror("SO_REUSEADDR");
+
+	if (bind(fd, res->ai_addr, res->ai_addrlen) == -1) {
+		perror("bind");
+		goto fail;
+	}
+	if (join(fd, res) == -1)
+		goto fail;
+
+	freeaddrinfo(res);
+	return fd;
+
+fail:
+	freeaddrinfo(res);
+	close(fd);
+	return -1;
+}
+
+/*
+ * Receive on the given address and port, and RTCP on the port after.
+ * Packets are played the given delay after the first one arrives, and
+ * a timestamp further than the jump from where it is expected starts
+ * the stream over. Packets come by way of io_uring if asked for, and
+ * the kernel has it
+ */
+
+int rtp_receiver_init(struct rtp_receiver *r, const char *addr,
+		unsigned int port, uint32_t delay, uint32_t jump, int uring)
+{
+	unsigned int n;
+	int one = 1;
+
+	r->fd = open_socket(addr, port);
+	if (r->fd == -1)
+		return -1;
+
+	/* Have the kernel stamp each packet on receipt */
+#ifdef SO_TIMESTAMPNS
+	if (setsockopt(r->fd, SOL_SOCKET, SO_TIMESTAMPNS,
+			&one, sizeof one) == -1)
+	{
+		perror("SO_TIMESTAMPNS");
+	}
+#else
+	if (setsockopt(r->fd, SOL_SOCKET, SO_TIMESTAMP,
+			&one, sizeof one) == -1)
+	{
+		perror("SO_TIMESTAMP");
+	}
+#endif
+
+	/* Without RTCP the audio plays just the same */
+	r->rtcp_fd = open_socket(addr, port + 1);
+	if (r->rtcp_fd == -1)
+		fprintf(stderr, "Not receiving RTCP on port %u\n", port + 1);
+
+	r->delay = delay;
+	r->jump = jump;
+	r->started = 0;
+
+	for (n = 0; n < RTP_SLOTS; n++) {
+		r->slot[n] = &r->pool[n];
+		r->slot[n]->used = 0;
+	}
+	for (n = 0; n < RTP_BATCH; n++) {
+		r->spare[n] = &r->pool[RTP_SLOTS + n];
+		r->spare[n]->used = 0;
+	}
+	r->poll = 0;
+
+	memset(&r->stats, 0, sizeof r->stats);
+	memset(&r->report, 0, sizeof r->report);
+#ifdef USE_SRTP
+	r->srtp = NULL;
+#endif
+
+#ifdef USE_IO_URING
+	r->uring = 0;
+	if (uring) {
+		memset(&r->msg, 0, sizeof r->msg);
+		r->msg.msg_controllen = CMSG_SPACE(sizeof(struct timespec));
+
+		if (uring_init(&r->ring, 8, RTP_URING_BUFFERS,
+				uring_buffer_size(&r->msg, RTP_MAX_PACKET)) == -1)
+		{
+			fprintf(stderr, "io_uring: %s; receiving by recvmmsg()\n",
+				strerror(errno));
+		} else if (uring_recvmsg(&r->ring, r->fd, &r->msg, 0) == -1
+			|| uring_submit(&r->ring) == -1)
+		{
+			perror("io_uring");
+			uring_clear(&r->ring);
+		} else {
+			r->uring = 1;
+		}
+	}
+#else
+	(void)uring;
+#endif
+
+	return 0;
+}
+
+void rtp_receiver_clear(struct rtp_receiver *r)
+{
+#ifdef USE_IO_URING
+	if (r->uring)
+		uring_clear(&r->ring);
+#endif
+	close(r->fd);
+	if (r->rtcp_fd != -1)
+		close(r->rtcp_fd);
+}
+
+static uint64_t arrival_time(struct msghdr *msg)
+{
+	struct cmsghdr *c;
+
+	for (c = CMSG_FIRSTHDR(msg); c != NULL; c = CMSG_NXTHDR(msg, c)) {
+		if (c->cmsg_level != SOL_SOCKET)
+			continue;
+#ifdef SCM_TIMESTAMPNS
+		if (c->cmsg_type == SCM_TIMESTAMPNS) {
+			struct timespec t;
+
+			memcpy(&t, CMSG_DATA(c), sizeof t);
+			return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+		}
+#endif
+		if (c->cmsg_type == SCM_TIMESTAMP) {
+			struct timeval t;
+
+			memcpy(&t, CMSG_DATA(c), sizeof t);
+			return (uint64_t)t.tv_sec * 1000000000
+				+ (uint64_t)t.tv_usec * 1000;
+		}
+	}
+
+	return wallclock_ns();
+}
+
+static void empty(struct rtp_receiver *r)
+{
+	unsigned int n;
+
+	for (n = 0; n < RTP_SLOTS; n++)
+		r->slot[n]->used = 0;
+}
+
+/*
+ * Start the stream over from the given packet, to be played the delay
+ * from now
+ */
+
+static void restart(struct rtp_receiver *r, const struct rtp *h, uint32_t ts)
+{
+	if (r->started)
+		r->stats.resyncs++;
+
+	r->started = 1;
+	r->ssrc = h->ssrc;
+	r->offset = h->ts - (ts + r->delay);
+	r->next = h->seq;
+	empty(r);
+}
+
+/*
+ * Put a spare packet, just received, into the jitter buffer and take
+ * a free one in its place
+ */
+
+static void hold(struct rtp_receiver *r, unsigned int n, uint32_t ts)
+{
+	struct rtp_packet **s, *p = r->spare[n];
+	const struct rtp *h = &p->rtp;
+	int16_t ahead;
+
+	r->stats.received++;
+
+	if (!r->started || h->ssrc != r->ssrc) {
+		restart(r, h, ts);
+	} else {
+		int32_t due = h->ts - r->offset - ts;
+
+		if (due > (int32_t)r->jump || due < -(int32_t)r->jump)
+			restart(r, h, ts);
+	}
+
+	ahead = h->seq - r->next;
+	if (ahead < 0) {
+		r->stats.late++;
+		return;
+	}
+
+	/* Too far ahead to hold; give up on the oldest */
+
+	while (ahead >= RTP_SLOTS) {
+		s = &r->slot[r->next & (RTP_SLOTS - 1)];
+		if ((*s)->used && (*s)->rtp.seq == r->next)
+			r->stats.late++;
+		else
+			r->stats.lost++;
+		(*s)->used = 0;
+		r->next++;
+		ahead--;
+	}
+
+	s = &r->slot[h->seq & (RTP_SLOTS - 1)];
+	if ((*s)->used && (*s)->rtp.seq == h->seq) {
+		r->stats.duplicate++;
+		return;
+	}
+
+	r->spare[n] = *s;
+	r->spare[n]->used = 0;
+	*s = p;
+	p->used = 1;
+}
+
+/*
+ * Parse a packet just received, when it is genuine
+ */
+
+static int parse(struct rtp_receiver *r, struct rtp_packet *p, size_t len)
+{
+#ifdef USE_SRTP
+	if (r->srtp && srtp_unprotect(r->srtp, p->buf, &len) == -1) {
+		r->stats.rejected++;
+		return -1;
+	}
+#endif
+	return rtp_parse(p->buf, len, &p->rtp);
+}
+
+static void take_report(struct rtp_receiver *r)
+{
+	unsigned char p[RTP_MAX_PACKET];
+	ssize_t z;
+	size_t i;
+
+	for (;;) {
+		z = recv(r->rtcp_fd, p, sizeof p, MSG_DONTWAIT);
+		if (z == -1)
+			break;
+
+#ifdef USE_SRTP
+		if (r->srtp) {
+			size_t len = z;
+
+			if (srtp_unprotect_rtcp(r->srtp, p, &len) == -1) {
+				r->stats.rejected++;
+				continue;
+			}
+			z = len;
+		}
+#endif
+
+		/* Walk the compound packet for a sender report */
+
+		for (i = 0; i + 4 <= (size_t)z; i += 4 + 4 * (p[i + 2] << 8 | p[i + 3])) {
+			if (p[i] >> 6 != 2)
+				break;
+			if (p[i + 1] == RTCP_SR && i + 28 <= (size_t)z) {
+				r->report.ntp = ns_from_ntp(p + i + 8);
+				r->report.ts = be32(p + i + 16);
+				r->stats.reports++;
+			}
+		}
+	}
+}
+
+#ifdef USE_IO_URING
+
+/*
+ * Take the packets which have completed, from memory we share with
+ * the kernel. Return -1 if io_uring is no longer to be used
+ */
+
+static int take_uring(struct rtp_receiver *r, uint32_t ts)
+{
+	struct uring_event e;
+
+	while (uring_next(&r->ring, &e)) {
+		struct rtp_packet *p = r->spare[0];
+		unsigned char *b;
+		struct msghdr h;
+		size_t len;
+
+		if (uring_packet(&r->ring, &e, &r->msg, &h, &b, &len) == 0
+			&& len <= sizeof p->buf)
+		{
+			memcpy(p->buf, b, len);
+			if (parse(r, p, len) == 0) {
+				p->arrival = arrival_time(&h);
+				hold(r, 0, ts);
+			}
+		}
+		if (e.buffer != -1)
+			uring_recycle(&r->ring, e.buffer);
+
+		if (e.more)
+			continue;
+
+		/* The receive is no longer armed; perhaps it ran out of
+		 * buffers for a moment, or the kernel refuses it */
+
+		if (e.res < 0 && e.res != -ENOBUFS) {
+			fprintf(stderr, "io_uring: %s; receiving by recvmmsg()\n",
+				strerror(-e.res));
+			goto fail;
+		}
+		if (uring_recvmsg(&r->ring, r->fd, &r->msg, 0) == -1
+			|| uring_submit(&r->ring) == -1)
+		{
+			perror("io_uring");
+			goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	uring_clear(&r->ring);
+	r->uring = 0;
+	return -1;
+}
+
+#endif
+
+/*
+ * Take everything the socket has, without blocking
+ */
+
+#ifdef LINUX
+
+static void take(struct rtp_receiver *r, uint32_t ts)
+{
+	unsigned char control[RTP_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+	struct mmsghdr msg[RTP_BATCH];
+	struct iovec iov[RTP_BATCH];
+	unsigned int n;
+	int z;
+
+#ifdef USE_IO_URING
+	if (r->uring && take_uring(r, ts) == 0)
+		return;
+#endif
+
+	memset(msg, 0, sizeof msg);
+
+	do {
+		for (n = 0; n < RTP_BATCH; n++) {
+			iov[n].iov_base = r->spare[n]->buf;
+			iov[n].iov_len = sizeof r->spare[n]->buf;
+			msg[n].msg_hdr.msg_iov = &iov[n];
+			msg[n].msg_hdr.msg_iovlen = 1;
+			msg[n].msg_hdr.msg_control = control[n];
+			msg[n].msg_hdr.msg_controllen = sizeof control[n];
+		}
+
+		do {
+			z = recvmmsg(r->fd, msg, RTP_BATCH, MSG_DONTWAIT, NULL);
+		} while (z == -1 && errno == EINTR);
+		if (z == -1)
+			break;
+
+		for (n = 0; n < z; n++) {
+			struct rtp_packet *p = r->spare[n];
+
+			if (parse(r, p, msg[n].msg_len) == -1)
+				continue;
+			p->arrival = arrival_time(&msg[n].msg_hdr);
+			hold(r, n, ts);
+		}
+	} while (z == RTP_BATCH);
+}
+
+#else
+
+static void take(struct rtp_receiver *r, uint32_t ts)
+{
+	unsigned char control[CMSG_SPACE(sizeof(struct timespec))];
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t z;
+
+#ifdef USE_IO_URING
+	if (r->uring && take_uring(r, ts) == 0)
+		return;
+#endif
+
+	for (;;) {
+		struct rtp_packet *p = r->spare[0];
+
+		iov.iov_base = p->buf;
+		iov.iov_len = sizeof p->buf;
+
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof control;
+
+		z = recvmsg(r->fd, &msg, MSG_DONTWAIT);
+		if (z == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (parse(r, p, z) == -1)
+			continue;
+		p->arrival = arrival_time(&msg);
+		hold(r, 0, ts);
+	}
+}
+
+#endif
+
+/*
+ * The next packet in order, if it is due at the given timestamp
+ */
+
+static struct rtp_packet* due(struct rtp_receiver *r, uint32_t ts)
+{
+	unsigned int n;
+
+	for (n = 0; n < RTP_SLOTS; n++) {
+		uint16_t seq = r->next + n;
+		struct rtp_packet *p = r->slot[seq & (RTP_SLOTS - 1)];
+
+		if (!p->used || p->rtp.seq != seq)
+			continue;
+		if ((int32_t)(p->rtp.ts - r->offset - ts) > 0)
+			return NULL; /* not yet */
+
+		r->stats.lost += n;
+		r->next = seq + 1;
+		p->used = 0;
+		return p;
+	}
+
+	return NULL;
+}
+
+/*
+ * The packet to play at the given timestamp (in the units of the
+ * stream) or NULL if there is none. It stays valid until the next
+ * call. A packet which is missing is passed over once the one after
+ * it is due
+ */
+
+const struct rtp_packet* rtp_receive(struct rtp_receiver *r, uint32_t ts)
+{
+	struct rtp_packet *p;
+	uint64_t now;
+
+	/* With the next packet to hand, the socket can wait; there is
+	 * no system call for the packets of a burst after the first. Not
+	 * so past a gap, as what fills it may be waiting there */
+
+	p = r->slot[r->next & (RTP_SLOTS - 1)];
+	if (r->started && p->used && p->rtp.seq == r->next)
+		return due(r, ts);
+
+	take(r, ts);
+
+	if (r->rtcp_fd != -1) {
+		now = monotonic_ns();
+		if (now >= r->poll) {
+			take_report(r);
+			r->poll = now + (uint64_t)RTCP_POLL_MS * 1000000;
+		}
+	}
+
+	if (!r->started)
+		return NULL;
+
+	return due(r, ts);
+}
+
+/*
+ * Audio held beyond the given timestamp, in timestamp units
+ */
+
+uint32_t rtp_buffered(const struct rtp_receiver *r, uint32_t ts)
+{
+	int32_t most = 0;
+	unsigned int n;
+
+	for (n = 0; n < RTP_SLOTS; n++) {
+		const struct rtp_packet *p = r->slot[n];
+		int32_t d;
+
+		if (!p->used)
+			continue;
+		d = p->rtp.ts - r->offset - ts;
+		if (d > most)
+			most = d;
+	}
+
+	return most;
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef RTP_H
+#define RTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#ifdef USE_IO_URING
+#include "uring.h"
+#endif
+
+#ifdef USE_SRTP
+#include "srtp.h"
+#endif
+
+/*
+ * A small RTP stack of our own (RFC 3550), for tx and rx in place of
+ * oRTP when built with RTP=native. Only what trx needs: one stream
+ * each way, the capture time extension and sender reports.
+ *
+ * Packets are built and received in fixed buffers; nothing is
+ * allocated after the start, and there are no threads. The receiver
+ * runs from the caller's loop: each call takes whatever the socket
+ * has into a jitter buffer ordered by sequence number, and gives back
+ * the oldest packet which is due to be played.
+ *
+ * The parser also serves the server mode of rx (-N), whichever stack
+ * is built.
+ *
+ * Built with IO_URING=yes, and given the choice at run time, both
+ * ends go by way of io_uring where the kernel has it: the receiver
+ * takes packets from a multishot receive without a system call, and
+ * the sender hands each packet and its report over together.
+ *
+ * Built with SRTP=yes, either end can be given SRTP keys, and then
+ * encrypts or decrypts each packet where it lies in the buffer.
+ */
+
+#define RTP_CLOCK 48000 /* Hz; Opus is 48000 whatever its rate (RFC 7587) */
+#define RTP_MAX_PACKET 1500
+#define RTP_SLOTS 64 /* jitter buffer, a power of two */
+#define RTP_BATCH 16 /* packets per system call */
+#define RTP_SEND_SLOTS 8 /* sends in flight, with io_uring */
+#define RTP_URING_BUFFERS 256 /* a power of two */
+
+struct rtp {
+	unsigned int pt;
+	int marker;
+	uint16_t seq;
+	uint32_t ts, ssrc;
+	uint64_t capture; /* wall clock ns from the extension, or 0 */
+	const unsigned char *payload;
+	size_t len;
+};
+
+int rtp_parse(const unsigned char *p, size_t len, struct rtp *r);
+size_t rtp_header(unsigned char *p, unsigned int pt, int marker,
+		uint16_t seq, uint32_t ts, uint32_t ssrc, uint64_t capture);
+
+struct rtp_sender {
+	int fd;
+	struct sockaddr_storage addr, rtcp;
+	socklen_t addrlen;
+	unsigned int pt;
+	uint16_t seq;
+	uint32_t ssrc;
+	unsigned long packets, octets;
+	uint64_t report; /* monotonic time of the next sender report */
+
+#ifdef USE_SRTP
+	struct srtp *srtp; /* or NULL, set by the caller */
+#endif
+
+#ifdef USE_IO_URING
+	int uring; /* in use */
+	struct uring ring;
+	int error; /* from a send which has completed */
+
+	struct {
+		int busy;
+		struct msghdr msg;
+		struct iovec iov;
+		unsigned char buf[RTP_MAX_PACKET];
+	} out[RTP_SEND_SLOTS];
+#endif
+};
+
+int rtp_sender_init(struct rtp_sender *s, const char *addr,
+		unsigned int port, unsigned int pt, int ttl, int dscp,
+		int uring);
+void rtp_sender_clear(struct rtp_sender *s);
+
+int rtp_send(struct rtp_sender *s, uint32_t ts, int marker,
+		uint64_t capture, void *payload, size_t len);
+
+/*
+ * A packet as held in the jitter buffer
+ */
+
+struct rtp_packet {
+	int used;
+	struct rtp rtp;
+	uint64_t arrival; /* wall clock ns, from the kernel where possible */
+	unsigned char buf[RTP_MAX_PACKET];
+};
+
+struct rtp_receiver {
+	int fd, rtcp_fd;
+	uint32_t delay, jump; /* timestamp units */
+	int started;
+	uint32_t ssrc, offset; /* packet timestamp less the caller's */
+	uint16_t next; /* sequence number expected next */
+
+	struct rtp_packet *slot[RTP_SLOTS], *spare[RTP_BATCH];
+	struct rtp_packet pool[RTP_SLOTS + RTP_BATCH];
+	uint64_t poll; /* monotonic time to next look for RTCP */
+
+	struct {
+		unsigned long received, lost, late, duplicate, resyncs,
+			reports, rejected;
+	} stats;
+
+	struct {
+		uint64_t ntp; /* wall clock ns */
+		uint32_t ts;
+	} report; /* the sender's last */
+
+#ifdef USE_SRTP
+	struct srtp *srtp; /* or NULL, set by the caller */
+#endif
+
+#ifdef USE_IO_URING
+	int uring; /* in use */
+	struct uring ring;
+	struct msghdr msg; /* layout of each buffer */
+#endif
+};
+
+int rtp_receiver_init(struct rtp_receiver *r, const char *addr,
+		unsigned int port, uint32_t delay, uint32_t jump, int uring);
+void rtp_receiver_clear(struct rtp_receiver *r);
+
+const struct rtp_packet* rtp_receive(struct rtp_receiver *r, uint32_t ts);
+uint32_t rtp_buffered(const struct rtp_receiver *r, uint32_t ts);
+
+#endif
@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * RTP benchmark: send packets to ourselves over the loopback with the
+ * native RTP stack, and again with bare system calls on the same
+ * sockets. The difference is what the stack costs per packet, over
+ * and above the kernel. Built with IO_URING=yes, the stack is run a
+ * second time by way of io_uring; with SRTP=yes, again with each
+ * suite of SRTP.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "defaults.h"
+#include "notice.h"
+#include "rtp.h"
+#include "srtp.h"
+#include "timestamp.h"
+
+#define BATCH 32 /* packets in flight, well within socket buffers */
+#define DEFAULT_PACKETS 100000
+#define DEFAULT_SIZE 160 /* bytes, eg. 10ms of Opus at 128kbit/s */
+#define TS_PER_PACKET 480
+
+struct result {
+	uint64_t send, receive; /* ns */
+	unsigned long packets;
+};
+
+static int bench_native(struct rtp_sender *s, struct rtp_receiver *r,
+		const unsigned char *payload, size_t size,
+		unsigned long packets, struct result *x)
+{
+	unsigned char buf[RTP_MAX_PACKET];
+	uint32_t ts = 0;
+	unsigned long n, b;
+
+	memset(x, 0, sizeof *x);
+	memcpy(buf, payload, size); /* as SRTP writes over it */
+
+	for (n = 0; n < packets; n += BATCH) {
+		uint64_t start;
+
+		start = monotonic_ns();
+		for (b = 0; b < BATCH; b++) {
+			if (rtp_send(s, ts + b * TS_PER_PACKET, 0, 0,
+					buf, size) == -1)
+			{
+				perror("rtp_send");
+				return -1;
+			}
+		}
+		x->send += monotonic_ns() - start;
+
+		/* Everything sent is due */
+
+		start = monotonic_ns();
+		for (b = 0; b < BATCH; b++) {
+			if (rtp_receive(r, ts + (b + BATCH) * TS_PER_PACKET)
+					== NULL)
+				break;
+		}
+		x->receive += monotonic_ns() - start;
+
+		x->packets += b;
+		ts += BATCH * TS_PER_PACKET;
+	}
+
+	return 0;
+}
+
+/*
+ * The same traffic, without the stack
+ */
+
+static int bench_bare(struct rtp_sender *s, struct rtp_receiver *r,
+		const unsigned char *payload, size_t size,
+		unsigned long packets, struct result *x)
+{
+	unsigned char buf[RTP_MAX_PACKET];
+	unsigned long n, b;
+
+	memset(x, 0, sizeof *x);
+	memcpy(buf, payload, size);
+
+	for (n = 0; n < packets; n += BATCH) {
+		uint64_t start;
+
+		start = monotonic_ns();
+		for (b = 0; b < BATCH; b++) {
+			if (sendto(s->fd, buf, size + 12, 0,
+					(struct sockaddr*)&s->addr,
+					s->addrlen) == -1)
+			{
+				perror("sendto");
+				return -1;
+			}
+		}
+		x->send += monotonic_ns() - start;
+
+		start = monotonic_ns();
+		for (b = 0; b < BATCH; b++) {
+			if (recv(r->fd, buf, sizeof buf, MSG_DONTWAIT) == -1)
+				break;
+		}
+		recv(r->fd, buf, sizeof buf, MSG_DONTWAIT); /* as the stack does */
+		x->receive += monotonic_ns() - start;
+
+		x->packets += b;
+	}
+
+	return 0;
+}
+
+static void usage(FILE *fd)
+{
+	fprintf(fd, "Usage: rtpbench [<parameters>]\n"
+		"Benchmark the per-packet cost of the native RTP stack\n");
+
+	fprintf(fd, "\nParameters:\n");
+	fprintf(fd, "  -p <port>   UDP port number on the loopback (default %d)\n",
+		DEFAULT_PORT);
+	fprintf(fd, "  -n <n>      Packets (default %d)\n", DEFAULT_PACKETS);
+	fprintf(fd, "  -s <bytes>  Payload size (default %d)\n", DEFAULT_SIZE);
+	fprintf(fd, "\nTimes are nanoseconds per packet, including the system calls,\n"
+		"against bare sendto() and recv(). Everything runs on one core, so\n"
+		"packets/s is per core, for each packet both sent and received.\n");
+#ifdef USE_SRTP
+	fprintf(fd, "\nThe rows for SRTP are the native stack encrypting and\n"
+		"decrypting in each suite; the cost of SRTP is their difference.\n");
+#endif
+}
+
+static void print(const char *name, const struct result *x)
+{
+	double send, receive;
+
+	send = (double)x->send / x->packets;
+	receive = (double)x->receive / x->packets;
+	printf("%-9s %9.0f %9.0f %11.0f\n", name, send, receive,
+		1e9 / (send + receive));
+}
+
+/*
+ * Run the stack, with io_uring or not and SRTP or not, and bare system
+ * calls on the same sockets
+ */
+
+static int bench(const char *addr, unsigned int port, int uring,
+		const struct srtp_key *key,
+		const unsigned char *payload, size_t size,
+		unsigned long packets, struct result *native, struct result *bare)
+{
+	static struct rtp_receiver r;
+	struct rtp_sender *s;
+	int e = 0;
+#ifdef USE_SRTP
+	struct srtp encrypt, decrypt;
+#else
+	(void)key;
+#endif
+
+	s = malloc(sizeof *s);
+	if (s == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	if (rtp_receiver_init(&r, addr, port, 0, UINT32_MAX / 2, uring) == -1) {
+		free(s);
+		return -1;
+	}
+	if (rtp_sender_init(s, addr, port, 120, 1, 0, uring) == -1) {
+		rtp_receiver_clear(&r);
+		free(s);
+		return -1;
+	}
+
+#ifdef USE_SRTP
+	if (key) {
+		if (srtp_init(&encrypt, key) == -1) {
+			e = -1;
+			goto done;
+		}
+		if (srtp_init(&decrypt, key) == -1) {
+			srtp_clear(&encrypt);
+			e = -1;
+			goto done;
+		}
+		s->srtp = &encrypt;
+		r.srtp = &decrypt;
+	}
+#endif
+
+	if (bench_native(s, &r, payload, size, packets, native) == -1)
+		e = -1;
+	else if (bare && bench_bare(s, &r, payload, size, packets, bare) == -1)
+		e = -1;
+
+	if (native->packets < packets) {
+		fprintf(stderr, "Packets were lost on the loopback "
+			"(%lu of %lu)\n", native->packets, packets);
+	}
+	fprintf(stderr, "%lu received, %lu lost, %lu late, %lu rejected\n",
+		r.stats.received, r.stats.lost, r.stats.late,
+		r.stats.rejected);
+
+#ifdef USE_SRTP
+	if (key) {
+		srtp_clear(&encrypt);
+		srtp_clear(&decrypt);
+	}
+done:
+#endif
+	rtp_sender_clear(s);
+	rtp_receiver_clear(&r);
+	free(s);
+
+	return e;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int port = DEFAULT_PORT;
+	unsigned long packets = DEFAULT_PACKETS;
+	size_t size = DEFAULT_SIZE;
+	unsigned char payload[RTP_MAX_PACKET];
+	struct result native, bare;
+#ifdef USE_IO_URING
+	struct result uring;
+#endif
+#ifdef USE_SRTP
+	struct srtp_key key;
+	struct result cm, gcm;
+#endif
+
+	fputs(COPYRIGHT "\n", stderr);
+
+	for (;;) {
+		int opt;
+
+		opt = getopt(argc, argv, "n:p:s:");
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'n':
+			packets = atol(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		default:
+			usage(stderr);
+			return -1;
+		}
+	}
+
+	if (size > RTP_MAX_PACKET - 28 - SRTP_MAX_TAG) {
+		fprintf(stderr, "Payload too large\n");
+		return -1;
+	}
+	memset(payload, 0x55, size);
+
+	if (bench("127.0.0.1", port, 0, NULL, payload, size, packets,
+			&native, &bare) == -1)
+	{
+		return -1;
+	}
+#ifdef USE_IO_URING
+	if (bench("127.0.0.1", port, 1, NULL, payload, size, packets,
+			&uring, NULL) == -1)
+	{
+		return -1;
+	}
+#endif
+#ifdef USE_SRTP
+	memset(key.key, 0x2b, sizeof key.key);
+	memset(key.salt, 0xf0, sizeof key.salt);
+
+	key.suite = SRTP_AES_CM_128_HMAC_SHA1_80;
+	if (bench("127.0.0.1", port, 0, &key, payload, size, packets,
+			&cm, NULL) == -1)
+	{
+		return -1;
+	}
+	key.suite = SRTP_AEAD_AES_128_GCM;
+	if (bench("127.0.0.1", port, 0, &key, payload, size, packets,
+			&gcm, NULL) == -1)
+	{
+		return -1;
+	}
+#endif
+
+	printf("%-9s %9s %9s %11s\n", "", "send", "receive", "packets/s");
+	print("bare", &bare);
+	print("native", &native);
+#ifdef USE_IO_URING
+	print("io_uring", &uring);
+#endif
+#ifdef USE_SRTP
+	print("AES-CM", &cm);
+	print("AES-GCM", &gcm);
+#endif
+
+	return 0;
+}
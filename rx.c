@@ -17,8 +17,16 @@
  *
  */
 
+#include <alloca.h>
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
 #include <netdb.h>
+#include <signal.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #ifdef USE_ALSA
 #include <alsa/asoundlib.h>
 #endif
@@ -26,36 +34,298 @@
 #include "portaudio.h"
 #endif
 #include <opus/opus.h>
+#ifndef USE_NATIVE_RTP
 #include <ortp/ortp.h>
+#endif
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include "codec.h"
 #include "defaults.h"
 #include "device.h"
+#include "jitter.h"
+#include "metrics.h"
 #include "notice.h"
-#include "sched.h"
 #include "payload_type_opus.h"
+#include "pcm.h"
+#include "resample.h"
+#include "rtlog.h"
+#include "rtp.h"
+#include "sched.h"
+#include "server.h"
+#include "sockopt.h"
+#ifdef USE_SRTP
+#include "srtp.h"
+#endif
+#include "stretch.h"
+#include "timestamp.h"
+#include "trace.h"
+#include "wav.h"
 
 static unsigned int verbose = DEFAULT_VERBOSE;
+static enum encoding encoding = ENCODING_OPUS;
+static struct sockopts sockopts;
+
+#ifdef USE_SRTP
+static struct srtp srtp;
+#endif
+
+/* The sender may stop sending in silence (tx -Z or -S); after this
+ * many frames without a packet the gap is taken to be silence, not
+ * loss */
+
+#define SILENCE_FRAMES 3
+
+static int suppression = 0, silent = 0;
+
+/* Audio to a file in place of the device, eg. for testing. Once the
+ * stream has started, it ends after this long without a packet */
+
+#define FILE_IDLE_MS 1000
+
+static struct wav file;
+static uint64_t file_start; /* wall clock time of the first sample */
+static unsigned int file_buffer; /* ms */
+static uint64_t file_clock; /* monotonic time the file started playing */
+static unsigned long file_position; /* samples */
+static volatile sig_atomic_t stop = 0;
+
+/* Device at a rate other than the codec's */
+
+static int resampling = 0;
+static struct resample resampler;
+
+/* Adaptive playout: rather than oRTP's scheduler, the device sets the
+ * pace, and the time packets wait to be played is steered to the
+ * jitter buffer time by playing a little faster or slower */
+
+#define PLAYOUT_SPEED 0.04
+#define MAX_DECODE 2880 /* 60ms at 48000Hz */
+
+static int adaptive = 0;
+static struct stretch stretcher;
+
+static struct {
+	double target, margin, wait; /* ns; wait is smoothed */
+	double speed;
+} playout;
+
+/* Synchronised playout: each frame is played at its capture time, as
+ * stamped by tx -E, plus a fixed delay; receivers which share a clock
+ * then play in step. Small errors are taken out a sample at a time,
+ * larger ones in one go */
+
+#define SYNC_DEADBAND_NS 100000
+#define SYNC_JUMP_NS 2000000
+
+static struct {
+	int enabled, locked;
+	uint64_t delay; /* ns */
+	unsigned int rate;
+	double error; /* ns, smoothed; positive is early */
+} lockstep;
+
+static struct {
+	unsigned long frames, plc, underruns;
+} summary;
+
+static struct metric *m_packets, *m_lost, *m_late, *m_rejected, *m_plc,
+	*m_silence,
+	*m_underruns, *m_drops, *m_decode, *m_jitter, *m_arrival, *m_latency,
+	*m_stretch, *m_wait, *m_removed, *m_added;
+
+static void init_metrics(void)
+{
+	static const unsigned long decode_ns[] = {
+		10000, 25000, 50000, 100000, 200000,
+		500000, 1000000, 2000000, 5000000
+	};
+	static const unsigned long jitter_us[] = {
+		1000, 2000, 4000, 8000, 16000, 32000, 64000, 128000, 256000
+	};
+	static const unsigned long latency_us[] = {
+		2000, 4000, 6000, 8000, 10000, 15000, 20000, 30000,
+		50000, 100000, 200000, 500000, 1000000
+	};
+
+	m_packets = metric_counter("trx_rx_packets_total",
+		"RTP packets received");
+	m_lost = metric_counter("trx_rx_packets_lost_total",
+		"RTP packets lost");
+	m_late = metric_counter("trx_rx_packets_late_total",
+		"RTP packets discarded for arriving too late");
+	m_rejected = metric_counter("trx_rx_packets_rejected_total",
+		"Packets failing SRTP authentication, or replayed");
+	m_plc = metric_counter("trx_rx_plc_frames_total",
+		"Frames concealed because no packet was available");
+	m_silence = metric_counter("trx_rx_silence_frames_total",
+		"Frames of silence played while the sender was suppressing");
+	m_underruns = metric_counter("trx_rx_underruns_total",
+		"Playback underruns");
+	m_drops = metric_counter("trx_rx_socket_drops_total",
+		"Packets dropped by the kernel for want of socket buffer");
+	m_decode = metric_histogram("trx_rx_decode_seconds",
+		"Time to decode one frame",
+		decode_ns, sizeof(decode_ns) / sizeof(*decode_ns), 1e9);
+	m_jitter = metric_histogram("trx_rx_jitter_buffer_seconds",
+		"Jitter buffer depth, sampled every frame",
+		jitter_us, sizeof(jitter_us) / sizeof(*jitter_us), 1e6);
+	m_arrival = metric_histogram("trx_rx_interarrival_jitter_seconds",
+		"Interarrival jitter (RFC 3550) by kernel receive time, per packet",
+		jitter_us, sizeof(jitter_us) / sizeof(*jitter_us), 1e6);
+	m_latency = metric_histogram("trx_rx_latency_seconds",
+		"Capture to playout latency, where the sender gives capture time",
+		latency_us, sizeof(latency_us) / sizeof(*latency_us), 1e6);
+	m_stretch = metric_histogram("trx_rx_stretch_seconds",
+		"Time to stretch one frame, in adaptive playout",
+		decode_ns, sizeof(decode_ns) / sizeof(*decode_ns), 1e9);
+	m_wait = metric_histogram("trx_rx_playout_wait_seconds",
+		"Time from receiving a packet to decoding it, in adaptive playout",
+		latency_us, sizeof(latency_us) / sizeof(*latency_us), 1e6);
+	m_removed = metric_counter("trx_rx_playout_removed_samples_total",
+		"Samples taken out to play faster, in adaptive playout");
+	m_added = metric_counter("trx_rx_playout_added_samples_total",
+		"Samples put in to play slower, in adaptive playout");
+}
+
+static void update_drops(int fd)
+{
+	static uint64_t next;
+	uint64_t now;
+
+	/* A system call, so not every frame */
+	now = monotonic_ns();
+	if (now > next) {
+		unsigned long drops;
+
+		if (sockopt_drops(fd, &drops) == 0)
+			metric_set(m_drops, drops);
+		next = now + (uint64_t)METRICS_INTERVAL_MS * 1000000;
+	}
+}
+
+/*
+ * Whether the device alone sets the pace of playout
+ */
+
+static int device_paced(void)
+{
+#ifdef USE_NATIVE_RTP
+	return 1;
+#else
+	return adaptive || lockstep.enabled;
+#endif
+}
+
+#ifdef USE_NATIVE_RTP
+
+/*
+ * Copy the statistics which the RTP stack keeps, and sample the depth
+ * of its jitter buffer
+ */
+
+static void update_metrics(const struct rtp_receiver *session, uint32_t ts)
+{
+	metric_set(m_packets, session->stats.received);
+	metric_set(m_lost, session->stats.lost);
+	metric_set(m_late, session->stats.late);
+	metric_set(m_rejected, session->stats.rejected);
+	metric_observe(m_jitter,
+		(uint64_t)rtp_buffered(session, ts) * 1000000 / RTP_CLOCK);
+
+	update_drops(session->fd);
+}
+
+/*
+ * Play out from the RTP stack, which is paced by the device; packets
+ * wait the jitter buffer time from when the stream starts, and a jump
+ * of more than 16 times that starts it over. Timestamps are in the
+ * RTP clock, not the decoding rate
+ */
+
+static int create_rtp_recv(struct rtp_receiver *session,
+		const char *addr_desc, const int port, unsigned int jitter)
+{
+	uint32_t delay = (uint64_t)jitter * RTP_CLOCK / 1000;
+
+	if (rtp_receiver_init(session, addr_desc, port, delay,
+			delay * 16, 1) == -1)
+	{
+		return -1;
+	}
+
+	if (sockopt_apply(&sockopts, session->fd, verbose) == -1) {
+		rtp_receiver_clear(session);
+		return -1;
+	}
+
+	return 0;
+}
+
+#else
+
+/*
+ * Copy the statistics which oRTP keeps for itself
+ */
+
+static void update_metrics(RtpSession *session)
+{
+	const rtp_stats_t *stats;
+	const jitter_stats_t *jitter;
+
+	stats = rtp_session_get_stats(session);
+	metric_set(m_packets, stats->packet_recv);
+	metric_set(m_lost, stats->cum_packet_loss > 0 ? stats->cum_packet_loss : 0);
+	metric_set(m_late, stats->outoftime);
+
+	jitter = rtp_session_get_jitter_stats(session);
+	metric_observe(m_jitter, jitter->jitter_buffer_size_ms * 1000);
+
+	update_drops(rtp_session_get_rtp_socket(session));
+}
 
 static void timestamp_jump(RtpSession *session, void *a, void *b, void *c)
 {
 	if (verbose > 1)
-		fputc('|', stderr);
+		rtlog_char(stderr, '|');
+
+	/* The sender's timestamps carried on through the silence, so
+	 * this is not a discontinuity */
+	if (silent)
+		return;
+
 	rtp_session_resync(session);
 }
 
 static RtpSession* create_rtp_recv(const char *addr_desc, const int port,
-		unsigned int jitter)
+		unsigned int jitter, int payload)
 {
 	RtpSession *session;
+	int one = 1;
 
 	session = rtp_session_new(RTP_SESSION_RECVONLY);
-	rtp_session_set_scheduling_mode(session, TRUE);
-	rtp_session_set_blocking_mode(session, TRUE);
+	rtp_session_set_scheduling_mode(session, !device_paced());
+	rtp_session_set_blocking_mode(session, !device_paced());
 	rtp_session_set_local_addr(session, addr_desc, port, -1);
 	rtp_session_set_connected_mode(session, FALSE);
-	rtp_session_enable_adaptive_jitter_compensation(session, TRUE);
+
+	/* Have the kernel stamp each packet on receipt, which oRTP keeps
+	 * with the packet. This is SO_TIMESTAMP, not SO_TIMESTAMPNS, as
+	 * it is the form oRTP knows */
+	if (setsockopt(rtp_session_get_rtp_socket(session), SOL_SOCKET,
+			SO_TIMESTAMP, &one, sizeof one) == -1)
+	{
+		perror("SO_TIMESTAMP");
+	}
+
+	if (sockopt_apply(&sockopts, rtp_session_get_rtp_socket(session),
+			verbose) == -1)
+	{
+		rtp_session_destroy(session);
+		return NULL;
+	}
+
+	rtp_session_enable_adaptive_jitter_compensation(session, !adaptive);
 	rtp_session_set_jitter_compensation(session, jitter); /* ms */
 	rtp_session_set_time_jump_limit(session, jitter * 16); /* ms */
 
@@ -63,10 +333,14 @@ static RtpSession* create_rtp_recv(const char *addr_desc, const int port,
 		opusrtp defaults to sending payload type 120
 	*/
 	rtp_profile_set_payload(&av_profile,120,&payload_type_opus_mono);
+	rtp_profile_set_payload(&av_profile, PAYLOAD_TYPE_L16,
+		&payload_type_l16_48000);
+	rtp_profile_set_payload(&av_profile, PAYLOAD_TYPE_L24,
+		&payload_type_l24_48000);
 
 	// payload type 11 = payload_type_l16_mono, having clock_rate of 44.1kHz, (payload info is used by jitter)
 	// payload type 120 = own opus
-	if (rtp_session_set_payload_type(session, 120) != 0)
+	if (rtp_session_set_payload_type(session, payload) != 0)
 		abort();
 	if (rtp_session_signal_connect(session, "timestamp_jump",
 					timestamp_jump, 0) != 0)
@@ -86,19 +360,220 @@ static RtpSession* create_rtp_recv(const char *addr_desc, const int port,
 	return session;
 }
 
+#endif
+
+/*
+ * Write to the file as a device would play it: starting the buffer
+ * time after the first write, and underrunning whenever a frame comes
+ * later than the audio before it has run out
+ */
+
+static int write_file(const void *pcm, unsigned long samples,
+		uint64_t capture)
+{
+	uint64_t now, played;
+
+	now = monotonic_ns();
+	if (file_clock == 0) {
+		file_clock = now + (uint64_t)file_buffer * 1000000;
+		file_start = wallclock_ns() + (uint64_t)file_buffer * 1000000;
+	}
+
+	played = (uint64_t)file_position * 1000000000 / file.rate;
+
+	/* With nothing else to set the pace (-A, -P or the native RTP
+	 * stack), block as a device does once its buffer is full */
+
+	if (device_paced()
+		&& file_clock + played > now + (uint64_t)file_buffer * 1000000)
+	{
+		struct timespec t;
+		uint64_t wait;
+
+		wait = file_clock + played - now
+			- (uint64_t)file_buffer * 1000000;
+		t.tv_sec = wait / 1000000000;
+		t.tv_nsec = wait % 1000000000;
+		nanosleep(&t, NULL);
+		now = monotonic_ns();
+	}
+	if (now > file_clock + played) {
+		metric_add(m_underruns, 1);
+		summary.underruns++;
+		file_clock = now - played;
+	}
+
+	if (capture) {
+		uint64_t playout = wallclock_ns() + (file_clock + played - now);
+
+		if (playout > capture)
+			metric_observe(m_latency, (playout - capture) / 1000);
+	}
+
+	file_position += samples;
+	return wav_write(&file, pcm, samples);
+}
+
+/*
+ * Wall clock time at which the file will play the next sample written
+ */
+
+static uint64_t file_playout_time(void)
+{
+	uint64_t now, played;
+
+	now = monotonic_ns();
+	if (file_clock == 0)
+		return wallclock_ns() + (uint64_t)file_buffer * 1000000;
+
+	played = (uint64_t)file_position * 1000000000 / file.rate;
+	if (now > file_clock + played)
+		return wallclock_ns(); /* will underrun */
+
+	return wallclock_ns() + (file_clock + played - now);
+}
+
+static void on_stop(int sig)
+{
+	stop = 1;
+}
+
+#ifndef USE_NATIVE_RTP
+
+/*
+ * Wall clock time a packet arrived, as the kernel saw it where
+ * possible
+ */
+
+static uint64_t arrival_time(const mblk_t *mp)
+{
+	if (mp->timestamp.tv_sec == 0)
+		return wallclock_ns();
+
+	return (uint64_t)mp->timestamp.tv_sec * 1000000000
+		+ (uint64_t)mp->timestamp.tv_usec * 1000;
+}
+
+#endif
+
+/*
+ * Set the speed of playout from how long a packet waited to be played.
+ * The wait is smoothed over a few packets, and with some hysteresis
+ * so that jitter alone does not change the speed
+ */
+
+static void steer(uint64_t arrival)
+{
+	uint64_t now;
+	double speed = playout.speed;
+
+	now = wallclock_ns();
+	if (now < arrival)
+		return;
+
+	metric_observe(m_wait, (now - arrival) / 1000);
+	playout.wait += ((double)(now - arrival) - playout.wait) / 8;
+
+	if (playout.wait > playout.target + playout.margin)
+		speed = PLAYOUT_SPEED;
+	else if (playout.wait < playout.target - playout.margin)
+		speed = -PLAYOUT_SPEED;
+	else if (speed * (playout.wait - playout.target) <= 0)
+		speed = 0; /* reached the target */
+
+	if (speed != playout.speed && verbose > 0) {
+		rtlog(stderr, "Playout speed %+ld%%, wait %ldus\n",
+			(long)(speed * 100), (long)(playout.wait / 1000));
+	}
+	playout.speed = speed;
+}
+
+/*
+ * Move the frame so that its first sample plays at its capture time
+ * plus the delay, given when the next sample written will play. There
+ * must be room after the frame for a further MAX_DECODE samples.
+ * Return the new length of the frame
+ */
+
+static unsigned int synchronise(void *pcm, unsigned int n,
+		unsigned int channels, uint64_t capture, uint64_t next)
+{
+	size_t bytes = encoding_sample_size(encoding) * channels;
+	double error, sample = 1e9 / lockstep.rate;
+	unsigned char *p = pcm;
+	unsigned int mid = n / 2;
+
+	error = (double)(capture + lockstep.delay) - (double)next;
+	lockstep.error += (error - lockstep.error) / 16;
+
+	if (!lockstep.locked || fabs(lockstep.error) > SYNC_JUMP_NS) {
+		long k = error / sample;
+
+		/* Insert silence if early, or drop the start if late; it
+		 * may take more than one frame */
+
+		lockstep.locked = 1;
+		if (k > MAX_DECODE) {
+			k = MAX_DECODE;
+			lockstep.locked = 0;
+		}
+		if (k < -(long)n) {
+			k = -(long)n;
+			lockstep.locked = 0;
+		}
+
+		if (k > 0) {
+			memmove(p + k * bytes, p, n * bytes);
+			memset(p, 0, k * bytes);
+			n += k;
+		} else if (k < 0) {
+			memmove(p, p - k * bytes, (n + k) * bytes);
+			n += k;
+		}
+
+		if (verbose > 0) {
+			rtlog(stderr, "Playout moved by %ld samples to "
+				"synchronise\n", k);
+		}
+		lockstep.error = 0;
+
+	} else if (lockstep.error > SYNC_DEADBAND_NS) {
+		/* Repeat a sample */
+		memmove(p + (mid + 1) * bytes, p + mid * bytes,
+			(n - mid) * bytes);
+		n++;
+		lockstep.error -= sample;
+
+	} else if (lockstep.error < -SYNC_DEADBAND_NS && n > 1) {
+		/* Skip a sample */
+		memmove(p + mid * bytes, p + (mid + 1) * bytes,
+			(n - mid - 1) * bytes);
+		n--;
+		lockstep.error += sample;
+	}
+
+	return n;
+}
+
 static int play_one_frame(void *packet,
 		size_t len,
-		OpusDecoder *decoder,
+		OpusMSDecoder *decoder,
+		const struct layout *layout,
 #ifdef USE_ALSA
 		snd_pcm_t *snd,
 #endif
 #ifdef USE_PORTAUDIO
 		PaStream *snd, // snd => stream
 #endif
-		const unsigned int channels)
+		const unsigned int channels,
+		const unsigned int ts,
+		uint64_t capture)
 {
 	int r;
-	int16_t *pcm;
+	unsigned int n;
+	void *pcm;
+	uint64_t start;
+	static int last = 0; /* samples in the last packet */
 	PaError err;
 	// why samples = 1920? is it 2*960 (960 is max frame size opus, 2 for stereo)
 #ifdef USE_ALSA
@@ -109,21 +584,114 @@ static int play_one_frame(void *packet,
 						  // for better analysis of the audio I am sending with 60ms from opusrtp
 #endif
 
-	pcm = alloca(sizeof(*pcm) * samples * channels);
+	/* Room for synchronise() to insert as much again */
+	pcm = alloca(sizeof(int32_t) * (samples + MAX_DECODE) * channels);
+
+	start = monotonic_ns();
+	if (packet == NULL && silent) {
+		/* The sender is not sending; play silence for as long as
+		 * the packet before, so timestamps stay in step */
 
-	if (packet == NULL) {
-		r = opus_decode(decoder, NULL, 0, pcm, samples, 1);
+		r = last ? last : samples;
+		memset(pcm, 0, encoding_sample_size(encoding) * r * channels);
+		metric_add(m_silence, 1);
+	} else if (encoding != ENCODING_OPUS) {
+		/* Uncompressed audio has no concealment but silence, for
+		 * as long as the packet before */
+
+		if (packet == NULL) {
+			r = last ? last : 48;
+			memset(pcm, 0, encoding_sample_size(encoding)
+				* r * channels);
+			metric_add(m_plc, 1);
+		} else {
+			r = pcm_unpack(encoding, packet, len, pcm) / channels;
+			last = r;
+		}
+	} else if (packet == NULL) {
+		/* Conceal as much as the last packet held; the decoder
+		 * needs a whole number of frames */
+		r = opus_multistream_decode(decoder, NULL, 0, pcm,
+				last ? last : samples, 1);
+		metric_add(m_plc, 1);
 	} else {
-		r = opus_decode(decoder, packet, len, pcm, samples, 0);
+		r = opus_multistream_decode(decoder, packet, len, pcm,
+				samples, 0);
+		if (r > 0)
+			last = r;
 	}
 	if (r < 0) {
-		fprintf(stderr, "opus_decode: %s\n", opus_strerror(r));
+		fprintf(stderr, "opus_multistream_decode: %s\n",
+			opus_strerror(r));
 		return -1;
 	}
+	if (encoding == ENCODING_OPUS)
+		layout_from_opus(layout, pcm, r);
+	metric_observe(m_decode, monotonic_ns() - start);
+	TRACE(TRACE_DECODE, ts);
+
+	/* The device plays the frame at its own rate; everything before
+	 * here, including the timestamps, is at the codec's */
+
+	n = r;
+	if (lockstep.enabled && capture) {
+		uint64_t next;
+
+		next = file_playout_time();
+#ifdef USE_PORTAUDIO
+		if (file.f == NULL)
+			next = pa_playout_time(snd);
+#endif
+
+		/* The converter plays everything a little later */
+		if (resampling)
+			next += resampler.delay * 1e9;
+
+		n = synchronise(pcm, n, channels, capture, next);
+	}
+
+	if (adaptive) {
+		unsigned long removed = stretcher.removed,
+			added = stretcher.added;
+		void *out;
+		int z;
+
+		start = monotonic_ns();
+		out = alloca(sizeof(int16_t) * stretch_output_max(&stretcher, n)
+			* channels);
+		z = stretch_process(&stretcher, pcm, n, out, playout.speed);
+		if (z == -1)
+			return -1;
+		n = z;
+		pcm = out;
+		metric_observe(m_stretch, monotonic_ns() - start);
+		metric_add(m_removed, stretcher.removed - removed);
+		metric_add(m_added, stretcher.added - added);
+	}
+
+	if (resampling) {
+		void *out;
+
+		out = alloca(sizeof(int16_t) * resample_output(&resampler, n)
+			* channels);
+		n = resample_process(&resampler, pcm, n, out, UINT_MAX);
+		pcm = out;
+		if (capture)
+			capture -= resampler.delay * 1e9;
+	}
+
+	if (file.f != NULL) {
+		if (write_file(pcm, n, capture) == -1)
+			return -1;
+		TRACE(TRACE_PLAYBACK, ts);
+		return r;
+	}
 
 #ifdef USE_ALSA
-	f = snd_pcm_writei(snd, pcm, r);
+	f = snd_pcm_writei(snd, pcm, n);
 	if (f < 0) {
+		if (f == -EPIPE)
+			metric_add(m_underruns, 1);
 		f = snd_pcm_recover(snd, f, 0);
 		if (f < 0) {
 			aerror("snd_pcm_writei", f);
@@ -131,23 +699,40 @@ static int play_one_frame(void *packet,
 		}
 		return 0;
 	}
-	if (f < r)
-		fprintf(stderr, "Short write %ld\n", f);
+	if (f < n)
+		rtlog(stderr, "Short write %ld\n", (long)f);
 #endif
 
 #ifdef USE_PORTAUDIO
-	err = Pa_WriteStream(snd, pcm, r);
+	/* Capture to playout ("mouth to ear"), when the sender told us
+	 * its capture time */
+	if (capture) {
+		uint64_t playout = pa_playout_time(snd);
+
+		if (playout > capture)
+			metric_observe(m_latency, (playout - capture) / 1000);
+	}
+
+	err = Pa_WriteStream(snd, pcm, n);
 	if (err == paOutputUnderflowed) {
-		fprintf(stderr, "Output underflowed\n");
+		metric_add(m_underruns, 1);
+		rtlog(stderr, "Output underflowed\n");
 	}
 #endif
+	TRACE(TRACE_PLAYBACK, ts);
 
 	return r;
 }
 
 
-static int run_rx(RtpSession *session,
-		OpusDecoder *decoder,
+static int run_rx(
+#ifdef USE_NATIVE_RTP
+		struct rtp_receiver *session,
+#else
+		RtpSession *session,
+#endif
+		OpusMSDecoder *decoder,
+		const struct layout *layout,
 #ifdef USE_ALSA
 		snd_pcm_t *snd,
 #endif
@@ -158,98 +743,144 @@ static int run_rx(RtpSession *session,
 		const unsigned int rate)
 {
 	int ts = 0;
+	unsigned int missing = 0;
+	unsigned long gap = 0;
+	uint64_t heard = 0;
+	struct jitter jitter;
 
-	struct timeval interval;
-	interval.tv_sec = TIMED_SELECT_INTERVAL;
-	interval.tv_usec = 0;
-	
-	SessionSet	*set;
-	set = session_set_new();
-	
-
-	uint64_t tc_start, tc_now;
-	tc_start = ortp_get_cur_time_ms();
+#ifdef USE_NATIVE_RTP
+	jitter_init(&jitter, RTP_CLOCK);
+#else
+	jitter_init(&jitter, rate);
+#endif
 
 	for (;;) {
-		int have_more=1, packet_size, 
+		int packet_size,
 		decoded_size = 2880; // see also comment in play_one_frame
-		unsigned char buf[32768]; 
+		unsigned char *payload = NULL;
+		uint64_t capture = 0, arrival = 0;
+		uint32_t timestamp = 0;
+		int received, marker = 0;
 		void *packet;
+#ifdef USE_NATIVE_RTP
+		const struct rtp_packet *p;
 
-		session_set_set(set, session);
-
-#define USE_RECVM 0
-#if !USE_RECVM
-		// max TIMED_SELECT_INTERVAL usec timed suspend for receiving
-        //r = session_set_timedselect(set, NULL, NULL, &interval);
-
-		// TODO: check https://github.com/BelledonneCommunications/ortp/blob/6b925368588ce0fc64a9762dbe86041151e8450a/src/tests/mrtprecv.c#L56
-		// for havemore loop and recv_with_ts
-		packet_size = rtp_session_recv_with_ts(session, (uint8_t*)buf,
-				sizeof(buf), ts, &have_more);
-
-#else
-		//int r = session_set_timedselect(set, NULL, NULL, &interval);
-		int r = session_set_select(set, NULL, NULL);
-		printf("session_set_timedselect: %d\n", r);
-		if (session_set_is_set(set,session)){
-			printf("session is set!\n");
+		p = rtp_receive(session, ts);
+		received = p != NULL;
+		if (p == NULL) {
+			packet_size = 0;
+		} else {
+			payload = (unsigned char*)p->rtp.payload;
+			packet_size = p->rtp.len;
+			marker = p->rtp.marker;
+			timestamp = p->rtp.ts;
+			arrival = p->arrival;
+			capture = p->rtp.capture;
 		}
-		
-		// recvm is recommended and this seems to work now
-		mblk_t *mp = rtp_session_recvm_with_ts(session, ts);
-		unsigned char *payload = NULL;
-		if ( mp!= NULL)
-		{
+#else
+		uint8_t *ext;
+		mblk_t *mp;
 
+		// recvm gives us the whole packet, including any header
+		// extensions, without copying the payload
+		mp = rtp_session_recvm_with_ts(session, ts);
+		received = mp != NULL;
+		if (mp == NULL) {
+			packet_size = 0;
+		} else {
 			packet_size = rtp_get_payload(mp, &payload);
-			printf("packetsize: %d\n", packet_size);
+			marker = rtp_get_markbit(mp);
+			timestamp = rtp_get_timestamp(mp);
+			arrival = arrival_time(mp);
+			if (rtp_get_extension_header(mp, CAPTURE_TIME_EXTENSION,
+					&ext) == CAPTURE_TIME_SIZE)
+			{
+				capture = ns_from_ntp(ext);
+			}
 		}
 #endif
 
+		if (received) {
+			jitter_update(&jitter, arrival, timestamp);
+			if (adaptive)
+				steer(arrival);
+			metric_observe(m_arrival, jitter.jitter / 1000);
+		}
+
+		TRACE(TRACE_RECEIVE, ts);
+
 #ifdef LINUX
 		assert(packet_size >= 0);
-		assert(have_more == 0);
 #endif
 		if (packet_size == 0) {
 			packet = NULL;
+			if (suppression && ++missing > SILENCE_FRAMES)
+				silent = 1;
 			if (verbose > 1)
-				fputc('#', stderr);
+				rtlog_char(stderr, silent ? ' ' : '#');
 		} else {
-#if !USE_RECVM
-			packet = buf;
-#else
 			packet = payload;
-#endif
-			if (verbose > 1)
-				fputc('.', stderr);
+			missing = 0;
+			silent = 0;
+			if (verbose > 1) {
+				rtlog_char(stderr, marker ? '^' : '.');
+			}
 		}
 
-		decoded_size = play_one_frame(packet, packet_size, decoder, snd, channels);
+		decoded_size = play_one_frame(packet, packet_size, decoder,
+				layout, snd, channels, ts, capture);
+#ifndef USE_NATIVE_RTP
+		if (mp != NULL)
+			freemsg(mp);
+#endif
 		if (decoded_size== -1)
 			return -1;
 
+		/* Writing to a file, the stream has an end; count only the
+		 * concealment between the first and last packets */
+
+		if (file.f != NULL) {
+			if (packet != NULL) {
+				heard = monotonic_ns();
+				summary.plc += gap;
+				gap = 0;
+			} else if (heard && !silent) {
+				gap++;
+			}
+			if (heard)
+				summary.frames++;
+
+			if (stop || (heard && monotonic_ns() - heard
+					> (uint64_t)FILE_IDLE_MS * 1000000))
+			{
+				summary.frames -= gap;
+				break;
+			}
+		}
+
 		/* Follow the RFC, payload 0 has 8kHz reference rate */
 		/* opusrtp does 48kHz rate, and ts follows samplecount */
+#ifdef USE_NATIVE_RTP
+		/* RFC 7587: the stream is clocked at 48000Hz, whatever the
+		 * rate it is decoded at */
+		ts += decoded_size * RTP_CLOCK / rate;
+#else
 		ts += decoded_size; //* 8000 / rate;
+#endif
 		
 		// 44.1kHz rate timeclock is 2646 samples
 		//ts += 2646;
 
-		printf("play_one_frame, decoded_size:%d, packet_size: %d, ts: %d, have_more: %d\n", decoded_size, packet_size, ts, have_more);
+		rtlog(stdout, "play_one_frame, decoded_size:%ld, packet_size: %ld, ts: %ld\n",
+			(long)decoded_size, (long)packet_size, (long)ts);
 
-		// log globals stats on regular basis
-		tc_now = ortp_get_cur_time_ms();
-		if (tc_now - tc_start > STATS_INTERVAL_MS)
-		{
-			printf("\n\n");
-			ortp_global_stats_display();
-			printf("\n\n");
-			tc_start = tc_now;
-		}
+#ifdef USE_NATIVE_RTP
+		update_metrics(session, ts);
+#else
+		update_metrics(session);
+#endif
 	}
-	// should cleanup at the end
-	session_set_destroy(set);
+	return 0;
 }
 
 static void usage(FILE *fd)
@@ -274,41 +905,74 @@ static void usage(FILE *fd)
 #endif
 	fprintf(fd, "  -m <ms>     Buffer time (default %d milliseconds)\n",
 		DEFAULT_BUFFER);
+	fprintf(fd, "  -R <rate>   Device sample rate, converted from the encoding rate,\n"
+		"              or 'native' (default the encoding rate)\n");
+	fprintf(fd, "  -W <file>   Write a WAV file in real time, in place of the device\n");
 
 	fprintf(fd, "\nNetwork parameters:\n");
 	fprintf(fd, "  -h <addr>   IP address to listen on (default %s)\n",
 		DEFAULT_ADDR);
 	fprintf(fd, "  -p <port>   UDP port number (default %d)\n",
 		DEFAULT_PORT);
+#ifdef LINUX
+	fprintf(fd, "  -p <a>-<b>  With -N, a session on every second port from a to b\n");
+#endif
 	fprintf(fd, "  -j <ms>     Jitter buffer (default %d milliseconds)\n",
 		DEFAULT_JITTER);
+	fprintf(fd, "  -O <list>   Socket options, eg. rcvbuf=1M,busy_poll=50,priority=6\n");
+	fprintf(fd, "  -K <file>   Decrypt by SRTP, with the key in the given file\n");
+	fprintf(fd, "  -A          Adaptive playout: keep to the jitter buffer time by\n"
+		"              playing up to %d%% faster or slower\n",
+		(int)(PLAYOUT_SPEED * 100));
+	fprintf(fd, "  -P <ms>     Play each frame this long after its capture, as sent\n"
+		"              by tx -E, so that receivers sharing a clock play in step\n");
 
 	fprintf(fd, "\nEncoding parameters (must match sender):\n");
+	fprintf(fd, "  -e <enc>    Encoding: opus, L16 or L24 (default opus)\n");
 	fprintf(fd, "  -r <rate>   Sample rate (default %dHz)\n",
 		DEFAULT_RATE);
 	fprintf(fd, "  -c <n>      Number of channels (default %d)\n",
 		DEFAULT_OUTPUTCHANNELS);
+	fprintf(fd, "  -F <n>      Channel mapping family: 0, 1 (surround) or 255\n"
+		"              (default 0 for up to 2 channels, 1 up to 8, otherwise 255)\n");
+	fprintf(fd, "  -L <list>   Device channel of each Opus channel, eg. 0,2,1,4,5,3\n");
+	fprintf(fd, "  -Z          Sender suppresses silence (tx -Z or -S); play gaps\n"
+		"              as silence, not loss\n");
 
 	fprintf(fd, "\nProgram parameters:\n");
 	fprintf(fd, "  -v <n>      Verbosity level (default %d)\n",
 		DEFAULT_VERBOSE);
+	fprintf(fd, "  -M <spec>   Export metrics to tcp:<port>, unix:<path> or a file\n");
+	fprintf(fd, "  -T <file>   Write a per-frame trace (Chrome trace format)\n");
 #ifdef LINUX
+	fprintf(fd, "  -C <spec>   Real-time CPU and priority, eg. audio=2:80,codec=3\n");
 	fprintf(fd, "  -D <file>   Run as a daemon, writing process ID to the given file\n");
+	fprintf(fd, "  -N <n>      Serve any number of streams to files (-W <prefix>)\n"
+		"              or nowhere, with a worker on each of n cores\n");
 #endif
 }
 
 int main(int argc, char *argv[])
 {
-	int r, error;
+	int r, payload, family = -1, device_rate = -1;
+	unsigned int workers = 0, last_port = 0;
+	uint64_t begin;
 #ifdef USE_ALSA
-	snd_pcm_t *snd;
+	snd_pcm_t *snd = NULL;
 #endif
 #ifdef USE_PORTAUDIO
-	PaStream *stream;
+	PaStream *stream = NULL;
 	PaError err;
 #endif
-	OpusDecoder *decoder;
+	OpusMSDecoder *decoder;
+	struct layout layout;
+	unsigned long late;
+#ifdef USE_NATIVE_RTP
+	static struct rtp_receiver receiver; /* large, for its buffers */
+	struct rtp_receiver *session = &receiver;
+#else
 	RtpSession *session;
+#endif
 
 #ifdef USE_PORTAUDIO
 	err = Pa_Initialize();
@@ -327,6 +991,11 @@ int main(int argc, char *argv[])
 #ifdef USE_ALSA
 		*device = DEFAULT_DEVICE,
 #endif
+		*metrics = NULL,
+		*trace = NULL,
+		*wav = NULL,
+		*key = NULL,
+		*order = NULL,
 		*addr = DEFAULT_ADDR;
 	unsigned int buffer = DEFAULT_BUFFER,
 		rate = DEFAULT_RATE,
@@ -338,14 +1007,16 @@ int main(int argc, char *argv[])
 		port = DEFAULT_PORT;
 
 	fputs(COPYRIGHT "\n", stderr);
+	begin = wallclock_ns();
+	sockopt_init(&sockopts);
 
 	for (;;) {
 		int c;
 
 #ifdef LINUX
-		c = getopt(argc, argv, "c:d:h:j:m:p:r:v:D");
+		c = getopt(argc, argv, "c:d:e:h:j:m:p:r:v:AC:D:F:K:L:M:N:O:P:R:T:W:Z");
 #else
-		c = getopt(argc, argv, "c:d:h:j:m:p:r:v:");
+		c = getopt(argc, argv, "c:d:e:h:j:m:p:r:v:AF:K:L:M:O:P:R:T:W:Z");
 #endif
 		if (c == -1)
 			break;
@@ -356,6 +1027,12 @@ int main(int argc, char *argv[])
 		case 'd':
 			device = atoi(optarg);
 			break;
+		case 'e':
+			r = encoding_parse(optarg);
+			if (r == -1)
+				return -1;
+			encoding = r;
+			break;
 		case 'h':
 			addr = optarg;
 			break;
@@ -367,6 +1044,8 @@ int main(int argc, char *argv[])
 			break;
 		case 'p':
 			port = atoi(optarg);
+			if (strchr(optarg, '-'))
+				last_port = atoi(strchr(optarg, '-') + 1);
 			break;
 		case 'r':
 			rate = atoi(optarg);
@@ -374,10 +1053,55 @@ int main(int argc, char *argv[])
 		case 'v':
 			verbose = atoi(optarg);
 			break;
+		case 'A':
+			adaptive = 1;
+			break;
+		case 'F':
+			family = atoi(optarg);
+			break;
+		case 'K':
+			key = optarg;
+			break;
+		case 'L':
+			order = optarg;
+			break;
+		case 'M':
+			metrics = optarg;
+			break;
+		case 'O':
+			if (sockopt_parse(&sockopts, optarg) == -1)
+				return -1;
+			break;
+		case 'P':
+			lockstep.enabled = 1;
+			lockstep.delay = (uint64_t)atoi(optarg) * 1000000;
+			break;
+		case 'R':
+			if (strcmp(optarg, "native") == 0)
+				device_rate = 0;
+			else
+				device_rate = atoi(optarg);
+			break;
+		case 'T':
+			trace = optarg;
+			break;
+		case 'W':
+			wav = optarg;
+			break;
+		case 'Z':
+			suppression = 1;
+			break;
 #ifdef LINUX
+		case 'C':
+			if (rt_configure(optarg) == -1)
+				return -1;
+			break;
 		case 'D':
 			pid = optarg;
 			break;
+		case 'N':
+			workers = atoi(optarg);
+			break;
 #endif
 		default:
 			usage(stderr);
@@ -385,65 +1109,246 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	decoder = opus_decoder_create(rate, channels, &error);
-	if (decoder == NULL) {
-		fprintf(stderr, "opus_decoder_create: %s\n",
-			opus_strerror(error));
+#ifndef USE_SRTP
+	if (key) {
+		fprintf(stderr, "SRTP is not built in (make SRTP=yes)\n");
 		return -1;
 	}
+#endif
+	if (key && workers) {
+		fprintf(stderr, "-K does not apply to -N\n");
+		return -1;
+	}
+
+	if (encoding == ENCODING_OPUS) {
+		if (family == -1)
+			family = channels <= 2 ? 0 : channels <= 8 ? 1 : 255;
+		if (layout_init(&layout, channels, family, order) == -1)
+			return -1;
+
+		decoder = layout_decoder_create(&layout, rate);
+		if (decoder == NULL)
+			return -1;
+		payload = 120;
+	} else {
+		if (rate != 48000) {
+			fprintf(stderr, "L16 and L24 are received at 48000Hz only\n");
+			return -1;
+		}
+#ifdef USE_ALSA
+		if (encoding == ENCODING_L24) {
+			fprintf(stderr, "L24 is not available with ALSA\n");
+			return -1;
+		}
+#endif
+		decoder = NULL;
+		payload = encoding == ENCODING_L16 ? PAYLOAD_TYPE_L16
+			: PAYLOAD_TYPE_L24;
+	}
+
+#ifdef USE_PORTAUDIO
+	if (device_rate == 0 && wav == NULL)
+		device_rate = Pa_GetDeviceInfo(device)->defaultSampleRate;
+#endif
+	if (device_rate == -1 || (device_rate == 0 && wav != NULL))
+		device_rate = rate;
+	if (device_rate <= 0) {
+		fprintf(stderr, "Invalid device rate\n");
+		return -1;
+	}
+
+	if (device_rate != rate) {
+		if (encoding == ENCODING_L24) {
+			fprintf(stderr, "L24 cannot be resampled\n");
+			return -1;
+		}
+		if (workers) {
+			fprintf(stderr, "-R does not apply to -N\n");
+			return -1;
+		}
+		if (resample_init(&resampler, rate, device_rate, channels) == -1)
+			return -1;
+		resampling = 1;
+
+		if (verbose > 0) {
+			fprintf(stderr, "Converting %uHz to %dHz, delay %.2fms\n",
+				rate, device_rate, resampler.delay * 1000);
+		}
+	}
+
+	if (lockstep.enabled) {
+#ifdef USE_ALSA
+		fprintf(stderr, "-P is not available with ALSA\n");
+		return -1;
+#endif
+		if (adaptive || workers) {
+			fprintf(stderr, "-P cannot be used with -A or -N\n");
+			return -1;
+		}
+		lockstep.rate = rate;
+	}
+
+	if (adaptive) {
+		if (encoding == ENCODING_L24) {
+			fprintf(stderr, "L24 cannot be stretched\n");
+			return -1;
+		}
+		if (workers) {
+			fprintf(stderr, "-A does not apply to -N\n");
+			return -1;
+		}
+		if (stretch_init(&stretcher, rate, channels, MAX_DECODE) == -1)
+			return -1;
+
+		playout.target = (double)jitter * 1000000;
+		playout.margin = playout.target / 4;
+		if (playout.margin < 2000000)
+			playout.margin = 2000000;
+		playout.wait = playout.target;
+	}
 
+	if (last_port) {
+		if (!workers) {
+			fprintf(stderr, "A range of ports applies only to -N\n");
+			return -1;
+		}
+		if (last_port < port) {
+			fprintf(stderr, "Invalid range of ports\n");
+			return -1;
+		}
+	} else {
+		last_port = port;
+	}
+
+	if (workers) {
+		struct server server = {
+			.addr = addr,
+			.port = port,
+			.sessions = (last_port - port) / 2 + 1,
+			.workers = workers,
+			.rate = rate,
+			.channels = channels,
+			.encoding = encoding,
+			.payload = payload,
+			.layout = &layout,
+			.wav = wav,
+			.metrics = metrics,
+			.sockopts = &sockopts,
+			.verbose = verbose,
+		};
+
+		if (decoder)
+			opus_multistream_decoder_destroy(decoder);
+
+		return serve(&server);
+	}
+
+#ifndef USE_NATIVE_RTP
 	ortp_init();
 	ortp_scheduler_init();
 	
 	// enable showing of the global stats
 	ortp_set_log_level_mask(NULL, ORTP_MESSAGE|ORTP_WARNING|ORTP_ERROR);
-	ortp_set_log_file(stdout);
-
-	session = create_rtp_recv(addr, port, jitter);
-#ifdef LINUX
-	assert(session != NULL);
+	ortp_set_log_handler(rtlog_ortp);
 #endif
 
-#ifdef USE_ALSA
-	r = snd_pcm_open(&snd, device, SND_PCM_STREAM_PLAYBACK, 0);
-	if (r < 0) {
-		aerror("snd_pcm_open", r);
+	init_metrics();
+
+#ifdef USE_NATIVE_RTP
+	if (create_rtp_recv(session, addr, port, jitter) == -1)
 		return -1;
+#ifdef USE_SRTP
+	if (key) {
+		if (srtp_open(&srtp, key) == -1)
+			return -1;
+		session->srtp = &srtp;
 	}
-	if (set_alsa_hw(snd, rate, channels, buffer * 1000) == -1)
-		return -1;
-	if (set_alsa_sw(snd) == -1)
+#endif
+#else
+	session = create_rtp_recv(addr, port, jitter, payload);
+	if (session == NULL)
 		return -1;
 #endif
 
+	if (wav) {
+		if (wav_open_write(&file, wav, device_rate, channels,
+				encoding_sample_size(encoding)) == -1)
+		{
+			return -1;
+		}
+		file_buffer = buffer;
+		signal(SIGINT, on_stop);
+		signal(SIGTERM, on_stop);
+	} else {
+#ifdef USE_ALSA
+		r = snd_pcm_open(&snd, device, SND_PCM_STREAM_PLAYBACK, 0);
+		if (r < 0) {
+			aerror("snd_pcm_open", r);
+			return -1;
+		}
+		if (set_alsa_hw(snd, device_rate, channels, buffer * 1000) == -1)
+			return -1;
+		if (set_alsa_sw(snd) == -1)
+			return -1;
+#endif
+
 #ifdef USE_PORTAUDIO
-	// TODO buffer size?
-	err = open_pa_writestream(&stream, rate, channels, device);
-	if (err != paNoError)
-	{
-		aerror("open_pa_stream", err);
-		return -1;
-	}
+		// TODO buffer size?
+		err = open_pa_writestream(&stream, device_rate, channels, device,
+			encoding == ENCODING_L24 ? paInt32 : paInt16);
+		if (err != paNoError)
+		{
+			aerror("open_pa_stream", err);
+			return -1;
+		}
 
-	err = Pa_StartStream(stream);
-	if (err != paNoError)
-	{
-		aerror("open_pa_stream", err);
-		return -1;
-	}
+		err = Pa_StartStream(stream);
+		if (err != paNoError)
+		{
+			aerror("open_pa_stream", err);
+			return -1;
+		}
 #endif
+	}
 
 #ifdef LINUX
-	if (pid)
+	if (pid) {
+		/* daemon() changes to the root directory */
+
+		if (metrics) {
+			metrics = metrics_absolute(metrics);
+			if (metrics == NULL)
+				return -1;
+		}
+		if (trace) {
+			trace = absolute_path(trace);
+			if (trace == NULL)
+				return -1;
+		}
 		go_daemon(pid);
+	}
+#endif
 
+	/* Only the calling thread survives daemon() */
+
+	if (rtlog_start() == -1)
+		return -1;
+	if (metrics && metrics_export(metrics) == -1)
+		return -1;
+	if (trace) {
+		if (trace_start(trace) == -1)
+			return -1;
+		trace_thread("rx");
+	}
+
+#ifdef LINUX
 	go_realtime();
 #endif
 #ifdef USE_ALSA
-	r = run_rx(session, decoder, snd, channels, rate);
+	r = run_rx(session, decoder, &layout, snd, channels, rate);
 #endif
 #ifdef USE_PORTAUDIO
-	r = run_rx(session, decoder, stream, channels, rate);
+	r = run_rx(session, decoder, &layout, stream, channels, rate);
 #endif
 
 #ifdef USE_PORTAUDIO
@@ -451,33 +1356,72 @@ int main(int argc, char *argv[])
 #endif
 
 #ifdef USE_ALSA
-	if (snd_pcm_close(snd) < 0)
+	if (wav == NULL && snd_pcm_close(snd) < 0)
 		abort();
 #endif
 
 #ifdef USE_PORTAUDIO
-	err = Pa_StopStream(stream);
-	if (err != paNoError)
-	{
-		aerror("open_pa_stream", err);
-		return -1;
-	}
+	if (wav == NULL) {
+		err = Pa_StopStream(stream);
+		if (err != paNoError)
+		{
+			aerror("open_pa_stream", err);
+			return -1;
+		}
 	
-	err = Pa_CloseStream(stream);
-	if (err != paNoError)
-	{
-		aerror("open_pa_stream", err);
-		return -1;
+		err = Pa_CloseStream(stream);
+		if (err != paNoError)
+		{
+			aerror("open_pa_stream", err);
+			return -1;
+		}
 	}
 
 	Pa_Terminate();
 #endif
 
+	trace_stop();
+
+#ifdef USE_NATIVE_RTP
+	late = session->stats.late;
+#else
+	late = rtp_session_get_stats(session)->outoftime;
+#endif
+
+	/* A summary for scripts, eg. loopbench */
+	if (wav) {
+		fprintf(stderr, "rx: start=%llu frames=%lu plc=%lu "
+			"underruns=%lu late=%lu cpu=%.2f%%\n",
+			(unsigned long long)file_start, summary.frames,
+			summary.plc, summary.underruns, late,
+			100.0 * process_cpu_ns() / (wallclock_ns() - begin));
+		if (wav_close(&file) == -1)
+			r = -1;
+	}
+
+#ifdef USE_NATIVE_RTP
+	if (key && session->stats.rejected > 0) {
+		fprintf(stderr, "SRTP rejected %lu packets\n",
+			session->stats.rejected);
+	}
+	rtp_receiver_clear(session);
+#ifdef USE_SRTP
+	if (key)
+		srtp_clear(&srtp);
+#endif
+#else
 	rtp_session_destroy(session);
 	ortp_exit();
 	ortp_global_stats_display();
+#endif
+	rtlog_stop();
 
-	opus_decoder_destroy(decoder);
+	if (decoder)
+		opus_multistream_decoder_destroy(decoder);
+	if (resampling)
+		resample_clear(&resampler);
+	if (adaptive)
+		stretch_clear(&stretcher);
 
 	return r;
 }
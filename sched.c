@@ -17,42 +17,257 @@
  *
  */
 
+#define _GNU_SOURCE /* CPU affinity */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sched.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
 #include "sched.h"
 
 #define REALTIME_PRIORITY 80
+#define PREFAULT_STACK (256 * 1024)
 
-int go_realtime(void)
-{
 #ifdef LINUX
-	int max_pri;
-	struct sched_param sp;
+#define MAX_CPU (CPU_SETSIZE - 1)
+#else
+#define MAX_CPU INT_MAX /* not pinned anyway */
+#endif
+
+/*
+ * Placement and priority of each kind of thread; a CPU of -1 leaves
+ * the thread free to migrate
+ */
+
+static struct {
+	const char *name;
+	int cpu, priority;
+} role[] = {
+	[RT_AUDIO] = { "audio", -1, REALTIME_PRIORITY },
+	[RT_CODEC] = { "codec", -1, REALTIME_PRIORITY - 5 },
+	[RT_NETWORK] = { "network", -1, REALTIME_PRIORITY - 10 }
+};
+
+/*
+ * Parse a whole number, which must be within the given range
+ */
+
+static int parse_int(const char *s, long min, long max, int *v)
+{
+	char *end;
+	long l;
 
-	if (sched_getparam(0, &sp)) {
-		perror("sched_getparam");
+	errno = 0;
+	l = strtol(s, &end, 10);
+	if (errno != 0 || end == s || *end != '\0' || l < min || l > max)
 		return -1;
-	}
 
-	max_pri = sched_get_priority_max(SCHED_FIFO);
-	sp.sched_priority = REALTIME_PRIORITY;
+	*v = l;
+	return 0;
+}
+
+/*
+ * Parse a list such as "audio=2:80,codec=3,network=1:70", each giving
+ * a CPU to pin to ("any" for none) and optionally a priority
+ */
+
+int rt_configure(const char *spec)
+{
+	char *s, *item, *save;
+	size_t n;
 
-	if (sp.sched_priority > max_pri) {
-		fprintf(stderr, "Invalid priority (maximum %d)\n", max_pri);
+	s = strdup(spec);
+	if (s == NULL) {
+		perror("strdup");
 		return -1;
 	}
 
-	if (sched_setscheduler(0, SCHED_FIFO, &sp)) {
-		perror("sched_setscheduler");
+	for (item = strtok_r(s, ",", &save); item != NULL;
+			item = strtok_r(NULL, ",", &save))
+	{
+		char *value, *priority;
+
+		value = strchr(item, '=');
+		if (value == NULL)
+			goto invalid;
+		*value++ = '\0';
+
+		for (n = 0; n < sizeof(role) / sizeof(*role); n++) {
+			if (strcmp(item, role[n].name) == 0)
+				break;
+		}
+		if (n == sizeof(role) / sizeof(*role))
+			goto invalid;
+
+		priority = strchr(value, ':');
+		if (priority != NULL) {
+			*priority++ = '\0';
+			if (parse_int(priority,
+					sched_get_priority_min(SCHED_FIFO),
+					sched_get_priority_max(SCHED_FIFO),
+					&role[n].priority) == -1)
+			{
+				goto invalid;
+			}
+		}
+
+		if (strcmp(value, "any") == 0)
+			role[n].cpu = -1;
+		else if (parse_int(value, 0, MAX_CPU, &role[n].cpu) == -1)
+			goto invalid;
+	}
+
+	free(s);
+	return 0;
+
+invalid:
+	fprintf(stderr, "Invalid real-time setting '%s'\n", item);
+	free(s);
+	return -1;
+}
+
+/*
+ * Lock all current and future memory, so that the audio path does
+ * not take page faults
+ */
+
+int rt_lock_memory(void)
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		struct rlimit rl;
+
+		perror("mlockall");
+		if (getrlimit(RLIMIT_MEMLOCK, &rl) == 0
+				&& rl.rlim_cur != RLIM_INFINITY)
+		{
+			fprintf(stderr, "RLIMIT_MEMLOCK is %lu bytes; "
+				"memory is not locked\n",
+				(unsigned long)rl.rlim_cur);
+		}
 		return -1;
 	}
-#endif
 
 	return 0;
 }
 
+/*
+ * Touch every page of a buffer, so that it is faulted in now rather
+ * than on first use by the audio path
+ */
+
+void rt_prefault(void *buf, size_t len)
+{
+	volatile unsigned char *p = buf;
+	size_t n, page;
+
+	page = sysconf(_SC_PAGESIZE);
+	for (n = 0; n < len; n += page)
+		p[n] = p[n];
+	if (len > 0)
+		p[len - 1] = p[len - 1];
+}
+
+/*
+ * Grow the stack of the calling thread to the size we expect to use,
+ * which is then kept by mlockall()
+ */
+
+static void __attribute__((noinline)) prefault_stack(void)
+{
+	unsigned char stack[PREFAULT_STACK];
+
+	rt_prefault(stack, sizeof stack);
+}
+
+/*
+ * Apply the placement and priority for the given role to the calling
+ * thread, reporting anything which could not be obtained
+ */
+
+int rt_thread(enum rt_role r)
+{
+	int e, result = 0;
+
+	prefault_stack();
+
+#ifdef LINUX
+	if (role[r].cpu != -1) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(role[r].cpu, &set);
+
+		e = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+		if (e != 0) {
+			fprintf(stderr, "%s thread: cannot pin to CPU %d: %s\n",
+				role[r].name, role[r].cpu, strerror(e));
+			result = -1;
+		}
+	}
+
+	if (role[r].priority > 0) {
+		struct sched_param sp;
+		struct rlimit rl;
+		int max_pri;
+
+		max_pri = sched_get_priority_max(SCHED_FIFO);
+		if (role[r].priority > max_pri) {
+			fprintf(stderr, "Invalid priority (maximum %d)\n", max_pri);
+			return -1;
+		}
+
+		memset(&sp, 0, sizeof sp);
+		sp.sched_priority = role[r].priority;
+
+		e = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+		if (e != 0) {
+			fprintf(stderr, "%s thread: cannot set SCHED_FIFO "
+				"priority %d: %s\n",
+				role[r].name, role[r].priority, strerror(e));
+
+			if (e == EPERM && getrlimit(RLIMIT_RTPRIO, &rl) == 0
+					&& rl.rlim_cur != RLIM_INFINITY
+					&& rl.rlim_cur < (rlim_t)role[r].priority)
+			{
+				fprintf(stderr, "RLIMIT_RTPRIO is %lu; "
+					"see limits.conf(5)\n",
+					(unsigned long)rl.rlim_cur);
+			}
+			result = -1;
+		}
+	}
+#else
+	(void)e;
+#endif
+
+	return result;
+}
+
+/*
+ * Make the calling thread, which is the audio thread, real-time and
+ * lock the process into memory
+ */
+
+int go_realtime(void)
+{
+	int r = 0;
+
+	if (rt_lock_memory() == -1)
+		r = -1;
+
+	if (rt_thread(RT_AUDIO) == -1)
+		r = -1;
+
+	return r;
+}
+
 int go_daemon(const char *pid_file)
 {
 	FILE *f;
@@ -82,3 +297,36 @@ int go_daemon(const char *pid_file)
 
 	return 0;
 }
+
+/*
+ * Return the given path made absolute, for a file opened after
+ * go_daemon() has changed to the root directory. The result is to be
+ * freed
+ */
+
+char* absolute_path(const char *path)
+{
+	char cwd[PATH_MAX], *r;
+
+	if (path[0] == '/') {
+		r = strdup(path);
+		if (r == NULL)
+			perror("strdup");
+		return r;
+	}
+
+	if (getcwd(cwd, sizeof cwd) == NULL) {
+		perror("getcwd");
+		return NULL;
+	}
+
+	r = malloc(strlen(cwd) + strlen(path) + 2);
+	if (r == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+
+	sprintf(r, "%s/%s", cwd, path);
+
+	return r;
+}
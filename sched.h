@@ -20,9 +20,32 @@
 #ifndef MISC_H
 #define MISC_H
 
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum rt_role {
+	RT_AUDIO,
+	RT_CODEC,
+	RT_NETWORK
+};
+
+int rt_configure(const char *spec);
+int rt_lock_memory(void);
+void rt_prefault(void *buf, size_t len);
+int rt_thread(enum rt_role role);
+
 #ifdef LINUX
 int go_realtime(void);
 int go_daemon(const char *pid_file);
 #endif
 
+char* absolute_path(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
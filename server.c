@@ -0,0 +1,952 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Server mode of rx: many streams over a group of SO_REUSEPORT
+ * sockets, one per worker, with a classic BPF program on the group
+ * to choose the socket from the SSRC of each packet.
+ *
+ * There is no audio device; each stream is decoded in order of
+ * arrival with gaps concealed, and written to a file of its own if
+ * asked for.
+ */
+
+#define _GNU_SOURCE /* recvmmsg, CPU affinity */
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#ifdef LINUX
+#include <sched.h>
+#include <linux/filter.h>
+#endif
+
+#include "defaults.h"
+#include "jitter.h"
+#include "loop.h"
+#include "metrics.h"
+#include "rtp.h"
+#include "server.h"
+#include "timestamp.h"
+#include "wav.h"
+
+#ifdef USE_IO_URING
+#include "uring.h"
+#endif
+
+#ifdef LINUX
+
+#define MAX_WORKERS 64
+#define STREAMS 1024 /* per worker */
+#define TABLE (2 * STREAMS) /* a power of two */
+#define BATCH 32 /* packets per system call */
+#define MAX_PACKET 1500
+#define MAX_FRAME 5760 /* largest Opus packet, 120ms at 48kHz */
+#define MAX_CONCEAL 25 /* frames; a longer gap is not concealed */
+#define STREAM_IDLE_MS 10000
+#define STREAM_TICK_MS 1000 /* to sample jitter and look for idle */
+#define PUBLISH_MS 1000
+#define RCVBUF (4 * 1024 * 1024)
+#define URING_BUFFERS 1024 /* per worker, a power of two */
+
+struct stream {
+	int used;
+	struct worker *worker;
+	struct timer timer;
+	uint32_t ssrc;
+	uint16_t seq; /* expected next */
+	unsigned int last; /* samples in the last frame */
+	uint64_t heard;
+	struct jitter jitter;
+	OpusMSDecoder *decoder;
+	struct wav file;
+};
+
+/*
+ * A port to receive on; each worker has a socket of its own for every
+ * one
+ */
+
+struct session {
+	struct watch watch;
+	struct worker *worker;
+	uint32_t drops; /* as last told by the kernel */
+};
+
+/*
+ * Everything a worker touches per packet is its own. Statistics are
+ * published on a timer for the reporting thread
+ */
+
+struct worker {
+	unsigned int index;
+	pthread_t thread;
+	const struct server *server;
+
+	struct session *session;
+	unsigned int nsessions;
+
+	struct stream stream[STREAMS];
+	uint16_t table[TABLE]; /* index of a stream, plus one */
+	unsigned int nstreams;
+	void *pcm;
+
+	struct loop loop;
+	struct timer publish;
+	unsigned long reported[6];
+
+	struct mmsghdr msg[BATCH];
+	struct iovec iov[BATCH];
+	unsigned char buf[BATCH][MAX_PACKET];
+	unsigned char control[BATCH][CMSG_SPACE(sizeof(struct timespec))
+		+ CMSG_SPACE(sizeof(uint32_t))];
+
+	struct {
+		unsigned long packets, bytes, lost, late, concealed, drops;
+	} count;
+
+	atomic_ulong packets, streams;
+} __attribute__((aligned(64)));
+
+static struct worker *worker;
+static atomic_int stop;
+
+static struct metric *m_packets, *m_bytes, *m_lost, *m_late, *m_plc,
+	*m_streams, *m_drops, *m_jitter;
+
+static void init_metrics(void)
+{
+	static const unsigned long jitter_us[] = {
+		1000, 2000, 4000, 8000, 16000, 32000, 64000, 128000, 256000
+	};
+
+	m_packets = metric_counter("trx_rx_server_packets_total",
+		"RTP packets received, all streams");
+	m_bytes = metric_counter("trx_rx_server_bytes_total",
+		"RTP payload bytes received, all streams");
+	m_lost = metric_counter("trx_rx_server_packets_lost_total",
+		"RTP packets lost, all streams");
+	m_late = metric_counter("trx_rx_server_packets_late_total",
+		"RTP packets discarded for arriving out of order");
+	m_plc = metric_counter("trx_rx_server_plc_frames_total",
+		"Frames concealed, all streams");
+	m_drops = metric_counter("trx_rx_server_socket_drops_total",
+		"Packets dropped by the kernel for want of socket buffer");
+	m_streams = metric_gauge("trx_rx_server_streams",
+		"Streams being received");
+	m_jitter = metric_histogram("trx_rx_server_interarrival_jitter_seconds",
+		"Interarrival jitter (RFC 3550) by kernel receive time, "
+		"each stream sampled every second",
+		jitter_us, sizeof(jitter_us) / sizeof(*jitter_us), 1e6);
+}
+
+static void on_stop(int sig)
+{
+	atomic_store(&stop, 1);
+}
+
+/*
+ * Streams are found by SSRC in an open-addressed table of indices,
+ * kept no more than half full, so that a stream stays in one place
+ * for its timer
+ */
+
+static unsigned int slot(uint32_t ssrc)
+{
+	return (ssrc * 2654435761u) >> 16 & (TABLE - 1);
+}
+
+static uint16_t* lookup(struct worker *w, uint32_t ssrc)
+{
+	unsigned int i;
+
+	for (i = slot(ssrc); w->table[i]; i = (i + 1) & (TABLE - 1)) {
+		if (w->stream[w->table[i] - 1].ssrc == ssrc)
+			break;
+	}
+
+	return &w->table[i];
+}
+
+/*
+ * Take a stream out of the table, and move up any which follow it so
+ * there is no gap before their slot (Knuth's Algorithm R)
+ */
+
+static void unlink_stream(struct worker *w, uint32_t ssrc)
+{
+	unsigned int i, j, k;
+
+	i = lookup(w, ssrc) - w->table;
+	w->table[i] = 0;
+
+	for (j = (i + 1) & (TABLE - 1); w->table[j]; j = (j + 1) & (TABLE - 1)) {
+		k = slot(w->stream[w->table[j] - 1].ssrc);
+		if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+			w->table[i] = w->table[j];
+			w->table[j] = 0;
+			i = j;
+		}
+	}
+}
+
+static void stream_tick(struct timer *t, uint64_t now);
+
+static struct stream* stream_open(struct worker *w, uint32_t ssrc,
+		uint16_t seq, uint64_t now)
+{
+	const struct server *c = w->server;
+	struct stream *s;
+	unsigned int n;
+
+	if (w->nstreams == STREAMS)
+		return NULL;
+
+	for (n = 0; n < STREAMS; n++) {
+		if (!w->stream[n].used)
+			break;
+	}
+	s = &w->stream[n];
+
+	memset(s, 0, sizeof *s);
+	s->worker = w;
+	s->ssrc = ssrc;
+	s->seq = seq;
+	s->last = c->rate / 50;
+#ifdef USE_NATIVE_RTP
+	jitter_init(&s->jitter, RTP_CLOCK); /* as tx sends, RFC 7587 */
+#else
+	jitter_init(&s->jitter, c->rate);
+#endif
+
+	if (c->encoding == ENCODING_OPUS) {
+		s->decoder = layout_decoder_create((struct layout*)c->layout,
+				c->rate);
+		if (s->decoder == NULL)
+			return NULL;
+	}
+
+	if (c->wav) {
+		char path[4096];
+
+		snprintf(path, sizeof path, "%s%08x.wav", c->wav, ssrc);
+		if (wav_open_write(&s->file, path, c->rate, c->channels,
+				encoding_sample_size(c->encoding)) == -1)
+		{
+			if (s->decoder)
+				opus_multistream_decoder_destroy(s->decoder);
+			return NULL;
+		}
+	}
+
+	s->used = 1;
+	*lookup(w, ssrc) = n + 1;
+	w->nstreams++;
+
+	timer_init(&s->timer, stream_tick, s);
+	timer_add(&w->loop.wheel, &s->timer,
+		now + (uint64_t)STREAM_TICK_MS * 1000000);
+
+	if (c->verbose > 0) {
+		fprintf(stderr, "Worker %u: stream %08x started\n",
+			w->index, ssrc);
+	}
+
+	return s;
+}
+
+static void stream_close(struct worker *w, struct stream *s)
+{
+	if (w->server->verbose > 0) {
+		fprintf(stderr, "Worker %u: stream %08x ended\n",
+			w->index, s->ssrc);
+	}
+
+	if (s->decoder)
+		opus_multistream_decoder_destroy(s->decoder);
+	wav_close(&s->file);
+	timer_del(&w->loop.wheel, &s->timer);
+	unlink_stream(w, s->ssrc);
+	s->used = 0;
+	w->nstreams--;
+}
+
+/*
+ * Each stream looks after itself once a second; there is no sweep of
+ * the table, so streams cost nothing between their packets
+ */
+
+static void stream_tick(struct timer *t, uint64_t now)
+{
+	struct stream *s = t->data;
+
+	if (now - s->heard > (uint64_t)STREAM_IDLE_MS * 1000000) {
+		stream_close(s->worker, s);
+		return;
+	}
+
+	metric_observe(m_jitter, s->jitter.jitter / 1000);
+	timer_add(&s->worker->loop.wheel, t,
+		now + (uint64_t)STREAM_TICK_MS * 1000000);
+}
+
+/*
+ * Decode one frame (or conceal one, given no payload) and write it
+ */
+
+static int play(struct worker *w, struct stream *s,
+		const unsigned char *payload, size_t len)
+{
+	const struct server *c = w->server;
+	int r;
+
+	if (c->encoding != ENCODING_OPUS) {
+		if (payload) {
+			r = pcm_unpack(c->encoding, payload, len, w->pcm)
+				/ c->channels;
+		} else {
+			r = s->last;
+			memset(w->pcm, 0, encoding_sample_size(c->encoding)
+				* r * c->channels);
+		}
+	} else {
+		r = opus_multistream_decode(s->decoder, payload, len, w->pcm,
+				payload ? MAX_FRAME : s->last, 0);
+		if (r < 0) {
+			/* A bad packet ends nothing but itself */
+			return 0;
+		}
+		layout_from_opus(c->layout, w->pcm, r);
+	}
+
+	if (payload && r > 0)
+		s->last = r;
+
+	if (s->file.f)
+		return wav_write(&s->file, w->pcm, r);
+
+	return 0;
+}
+
+static int handle(struct worker *w, const unsigned char *p, size_t len,
+		uint64_t arrival, uint64_t now)
+{
+	struct stream *s;
+	struct rtp rtp;
+	uint16_t gap, *n;
+
+	if (rtp_parse(p, len, &rtp) == -1 || rtp.pt != w->server->payload)
+		return 0;
+
+	w->count.packets++;
+	w->count.bytes += rtp.len;
+
+	n = lookup(w, rtp.ssrc);
+	if (*n) {
+		s = &w->stream[*n - 1];
+	} else {
+		s = stream_open(w, rtp.ssrc, rtp.seq, now);
+		if (s == NULL) /* including when there are too many */
+			return 0;
+	}
+	s->heard = now;
+	jitter_update(&s->jitter, arrival, rtp.ts);
+
+	gap = rtp.seq - s->seq;
+	if (gap >= 0x8000) {
+		/* Behind what has already been played */
+		w->count.late++;
+		return 0;
+	}
+
+	if (gap > 0) {
+		w->count.lost += gap;
+		if (gap <= MAX_CONCEAL) {
+			while (gap--) {
+				if (play(w, s, NULL, 0) == -1)
+					return -1;
+				w->count.concealed++;
+			}
+		}
+	}
+	s->seq = rtp.seq + 1;
+
+	return play(w, s, rtp.payload, rtp.len);
+}
+
+static void publish(struct worker *w)
+{
+	unsigned long *reported = w->reported;
+
+	metric_add(m_packets, w->count.packets - reported[0]);
+	metric_add(m_bytes, w->count.bytes - reported[1]);
+	metric_add(m_lost, w->count.lost - reported[2]);
+	metric_add(m_late, w->count.late - reported[3]);
+	metric_add(m_plc, w->count.concealed - reported[4]);
+	metric_add(m_drops, w->count.drops - reported[5]);
+
+	reported[0] = w->count.packets;
+	reported[1] = w->count.bytes;
+	reported[2] = w->count.lost;
+	reported[3] = w->count.late;
+	reported[4] = w->count.concealed;
+	reported[5] = w->count.drops;
+
+	atomic_store_explicit(&w->packets, w->count.packets,
+		memory_order_relaxed);
+	atomic_store_explicit(&w->streams, w->nstreams,
+		memory_order_relaxed);
+}
+
+static void publish_tick(struct timer *t, uint64_t now)
+{
+	struct worker *w = t->data;
+
+	publish(w);
+	timer_add(&w->loop.wheel, t, now + (uint64_t)PUBLISH_MS * 1000000);
+}
+
+static void pin(struct worker *w)
+{
+	cpu_set_t set;
+	long cpus;
+	int e;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->index % cpus, &set);
+
+	e = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+	if (e != 0) {
+		fprintf(stderr, "Worker %u: cannot pin to CPU %ld: %s\n",
+			w->index, w->index % cpus, strerror(e));
+	}
+}
+
+/*
+ * The kernel's timestamp of arrival, and its running count of packets
+ * dropped from the session's socket, which comes with each packet
+ */
+
+static uint64_t arrival_time(struct session *s, struct msghdr *h)
+{
+	struct cmsghdr *cmsg;
+	uint64_t arrival = 0;
+
+	for (cmsg = CMSG_FIRSTHDR(h); cmsg; cmsg = CMSG_NXTHDR(h, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+
+		if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			struct timespec t;
+
+			memcpy(&t, CMSG_DATA(cmsg), sizeof t);
+			arrival = (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+
+		} else if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+			uint32_t drops;
+
+			memcpy(&drops, CMSG_DATA(cmsg), sizeof drops);
+			s->worker->count.drops += drops - s->drops;
+			s->drops = drops;
+		}
+	}
+
+	if (arrival == 0)
+		arrival = wallclock_ns();
+
+	return arrival;
+}
+
+/*
+ * A session's socket has packets; take them all, as it will not be
+ * reported again until there are more
+ */
+
+static int receive(struct watch *watch, uint64_t now)
+{
+	struct session *s = watch->data;
+	struct worker *w = s->worker;
+	int n, i;
+
+	for (;;) {
+		for (i = 0; i < BATCH; i++) {
+			w->msg[i].msg_hdr.msg_control = w->control[i];
+			w->msg[i].msg_hdr.msg_controllen = sizeof w->control[i];
+		}
+
+		n = recvmmsg(watch->fd, w->msg, BATCH, MSG_DONTWAIT, NULL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			perror("recvmmsg");
+			return -1;
+		}
+
+		for (i = 0; i < n; i++) {
+			uint64_t arrival;
+
+			arrival = arrival_time(s, &w->msg[i].msg_hdr);
+			if (handle(w, w->buf[i], w->msg[i].msg_len, arrival,
+					now) == -1)
+			{
+				return -1;
+			}
+		}
+
+		if (n < BATCH) /* there is no more, for now */
+			return 0;
+	}
+}
+
+/*
+ * Receive until told to stop; return -1 on error
+ */
+
+static int run_epoll(struct worker *w)
+{
+	unsigned int n;
+
+	for (n = 0; n < BATCH; n++) {
+		w->iov[n].iov_base = w->buf[n];
+		w->iov[n].iov_len = MAX_PACKET;
+		w->msg[n].msg_hdr.msg_iov = &w->iov[n];
+		w->msg[n].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (n = 0; n < w->nsessions; n++) {
+		struct session *s = &w->session[n];
+
+		s->watch.ready = receive;
+		s->watch.data = s;
+		if (loop_add(&w->loop, &s->watch) == -1)
+			return -1;
+	}
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		if (loop_run(&w->loop) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+#ifdef USE_IO_URING
+
+/*
+ * The same by way of io_uring: a multishot receive stays armed on each
+ * session, and packets are taken from memory shared with the kernel,
+ * so there is a system call only to wait when there is nothing to do.
+ * Return 1 if io_uring cannot be used, to use epoll instead
+ */
+
+static int run_uring(struct worker *w)
+{
+	struct uring ring;
+	struct msghdr msg;
+	unsigned int n;
+	int r = 0;
+
+	memset(&msg, 0, sizeof msg);
+	msg.msg_controllen = sizeof w->control[0];
+
+	if (uring_init(&ring, w->nsessions, URING_BUFFERS,
+			uring_buffer_size(&msg, MAX_PACKET)) == -1)
+	{
+		if (w->index == 0 && w->server->verbose > 0) {
+			fprintf(stderr, "io_uring: %s; receiving by epoll\n",
+				strerror(errno));
+		}
+		return 1;
+	}
+
+	for (n = 0; n < w->nsessions; n++) {
+		if (uring_recvmsg(&ring, w->session[n].watch.fd, &msg, n) == -1) {
+			perror("io_uring");
+			r = -1;
+			goto done;
+		}
+	}
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		struct uring_event e;
+		uint64_t now, next;
+
+		/* Until the next timer, at most */
+
+		now = monotonic_ns();
+		next = wheel_next(&w->loop.wheel);
+		if (uring_wait(&ring, next > now ? next - now : 0) == -1) {
+			perror("io_uring_enter");
+			r = -1;
+			break;
+		}
+
+		now = monotonic_ns();
+		while (uring_next(&ring, &e)) {
+			struct session *s = &w->session[e.data];
+			unsigned char *p;
+			struct msghdr h;
+			size_t len;
+
+			if (uring_packet(&ring, &e, &msg, &h, &p, &len) == 0) {
+				uint64_t arrival;
+
+				arrival = arrival_time(s, &h);
+				if (handle(w, p, len, arrival, now) == -1) {
+					r = -1;
+					goto done;
+				}
+			}
+			if (e.buffer != -1)
+				uring_recycle(&ring, e.buffer);
+
+			if (e.more)
+				continue;
+
+			/* No longer armed; perhaps out of buffers for a
+			 * moment, or the kernel refuses it */
+
+			if (e.res < 0 && e.res != -ENOBUFS) {
+				if (w->index == 0 && w->server->verbose > 0) {
+					fprintf(stderr, "io_uring: %s; receiving "
+						"by epoll\n", strerror(-e.res));
+				}
+				r = 1;
+				goto done;
+			}
+			if (uring_recvmsg(&ring, s->watch.fd, &msg, e.data) == -1) {
+				perror("io_uring");
+				r = -1;
+				goto done;
+			}
+		}
+
+		wheel_run(&w->loop.wheel, now);
+	}
+
+done:
+	uring_clear(&ring);
+	return r;
+}
+
+#endif
+
+static void* run_worker(void *arg)
+{
+	struct worker *w = arg;
+	int n, r = 1;
+
+	pin(w);
+
+	if (loop_init(&w->loop) == -1) {
+		atomic_store(&stop, 1);
+		return NULL;
+	}
+
+	timer_init(&w->publish, publish_tick, w);
+	timer_add(&w->loop.wheel, &w->publish,
+		monotonic_ns() + (uint64_t)PUBLISH_MS * 1000000);
+
+#ifdef USE_IO_URING
+	r = run_uring(w);
+#endif
+	if (r == 1)
+		run_epoll(w);
+
+	for (n = 0; n < STREAMS; n++) {
+		if (w->stream[n].used)
+			stream_close(w, &w->stream[n]);
+	}
+	publish(w);
+	loop_clear(&w->loop);
+	atomic_store(&stop, 1);
+
+	return NULL;
+}
+
+/*
+ * The group of sockets for one session, in the order the BPF program
+ * indexes them
+ */
+
+static int open_group(const struct server *c, const struct sockopts *opts,
+		unsigned int session)
+{
+	struct sock_filter code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, 8 }, /* SSRC */
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, c->workers },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog prog = {
+		.len = sizeof code / sizeof *code,
+		.filter = code,
+	};
+	struct addrinfo hints, *res;
+	char port[8];
+	unsigned int n;
+	int r, one = 1;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	snprintf(port, sizeof port, "%u", c->port + 2 * session);
+	r = getaddrinfo(c->addr, port, &hints, &res);
+	if (r != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(r));
+		return -1;
+	}
+
+	for (n = 0; n < c->workers; n++) {
+		int fd;
+
+		fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK,
+			res->ai_protocol);
+		if (fd == -1) {
+			perror("socket");
+			goto fail;
+		}
+		worker[n].session[session].watch.fd = fd;
+
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one,
+				sizeof one) == -1)
+		{
+			perror("SO_REUSEPORT");
+			goto fail;
+		}
+		if (sockopt_apply(opts, fd, n == 0 && session == 0
+				? c->verbose : 0) == -1)
+			goto fail;
+		sockopt_enable_drops(fd); /* not fatal */
+		if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one,
+				sizeof one) == -1)
+			perror("SO_TIMESTAMPNS");
+
+		if (bind(fd, res->ai_addr, res->ai_addrlen) == -1) {
+			perror("bind");
+			goto fail;
+		}
+	}
+
+	if (setsockopt(worker[0].session[session].watch.fd, SOL_SOCKET,
+			SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog) == -1)
+	{
+		perror("SO_ATTACH_REUSEPORT_CBPF");
+		goto fail;
+	}
+
+	freeaddrinfo(res);
+	return 0;
+
+fail:
+	freeaddrinfo(res);
+	return -1;
+}
+
+/*
+ * A socket for every session on every worker may be more than the
+ * soft limit on open files allows
+ */
+
+static void raise_files(const struct server *c)
+{
+	struct rlimit lim;
+	rlim_t need;
+
+	need = (rlim_t)c->sessions * c->workers + 64;
+
+	if (getrlimit(RLIMIT_NOFILE, &lim) == -1 || lim.rlim_cur >= need)
+		return;
+
+	lim.rlim_cur = need < lim.rlim_max ? need : lim.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &lim) == -1)
+		perror("RLIMIT_NOFILE");
+}
+
+static int open_sockets(const struct server *c)
+{
+	struct sockopts opts;
+	unsigned int n;
+
+	/* Many streams share each socket, so default to a large buffer */
+	if (c->sockopts != NULL)
+		opts = *c->sockopts;
+	else
+		sockopt_init(&opts);
+	if (opts.rcvbuf == -1)
+		opts.rcvbuf = RCVBUF;
+
+	raise_files(c);
+
+	for (n = 0; n < c->sessions; n++) {
+		if (open_group(c, &opts, n) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void report(unsigned long *last, uint64_t interval)
+{
+	unsigned long packets, total = 0, streams = 0;
+	unsigned int n;
+
+	for (n = 0; n < worker[0].server->workers; n++) {
+		struct worker *w = &worker[n];
+		unsigned long s;
+
+		packets = atomic_load_explicit(&w->packets,
+			memory_order_relaxed);
+		s = atomic_load_explicit(&w->streams, memory_order_relaxed);
+
+		if (w->server->verbose > 1) {
+			fprintf(stderr, "Worker %u: %lu streams, %.0f packets/s\n",
+				n, s, (packets - last[n]) / (interval / 1e9));
+		}
+
+		total += packets - last[n];
+		streams += s;
+		last[n] = packets;
+	}
+
+	metric_set(m_streams, streams);
+	fprintf(stderr, "%lu streams, %.0f packets/s\n",
+		streams, total / (interval / 1e9));
+}
+
+int serve(const struct server *c)
+{
+	unsigned long *last;
+	unsigned int n, i, started = 0;
+	uint64_t then, now;
+	int r = 0, e;
+
+	if (c->workers > MAX_WORKERS) {
+		fprintf(stderr, "At most %d workers\n", MAX_WORKERS);
+		return -1;
+	}
+
+	worker = aligned_alloc(64, sizeof(*worker) * c->workers);
+	last = calloc(c->workers, sizeof *last);
+	if (worker == NULL || last == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	for (n = 0; n < c->workers; n++) {
+		struct worker *w = &worker[n];
+
+		memset(w, 0, sizeof *w);
+		w->index = n;
+		w->server = c;
+		w->pcm = malloc(encoding_sample_size(c->encoding)
+			* MAX_FRAME * c->channels);
+		w->session = calloc(c->sessions, sizeof *w->session);
+		if (w->pcm == NULL || w->session == NULL) {
+			perror("malloc");
+			return -1;
+		}
+
+		w->nsessions = c->sessions;
+		for (i = 0; i < c->sessions; i++) {
+			w->session[i].watch.fd = -1;
+			w->session[i].worker = w;
+		}
+	}
+
+	init_metrics();
+	if (c->metrics && metrics_export(c->metrics) == -1)
+		return -1;
+
+	if (open_sockets(c) == -1)
+		return -1;
+
+	signal(SIGINT, on_stop);
+	signal(SIGTERM, on_stop);
+
+	for (n = 0; n < c->workers; n++) {
+		e = pthread_create(&worker[n].thread, NULL, run_worker,
+				&worker[n]);
+		if (e != 0) {
+			errno = e;
+			perror("pthread_create");
+			atomic_store(&stop, 1);
+			r = -1;
+			break;
+		}
+		started++;
+	}
+
+	then = monotonic_ns();
+	while (!atomic_load(&stop)) {
+		struct timespec t = { 0, 100000000 };
+
+		nanosleep(&t, NULL);
+
+		now = monotonic_ns();
+		if (now - then > (uint64_t)STATS_INTERVAL_MS * 1000000) {
+			if (c->verbose > 0)
+				report(last, now - then);
+			then = now;
+		}
+	}
+
+	for (n = 0; n < started; n++)
+		pthread_join(worker[n].thread, NULL);
+
+	for (n = 0; n < c->workers; n++) {
+		for (i = 0; i < c->sessions; i++) {
+			if (worker[n].session[i].watch.fd != -1)
+				close(worker[n].session[i].watch.fd);
+		}
+		free(worker[n].session);
+		free(worker[n].pcm);
+	}
+	free(worker);
+	free(last);
+
+	return r;
+}
+
+#else
+
+int serve(const struct server *c)
+{
+	fprintf(stderr, "Server mode is available on Linux only\n");
+	return -1;
+}
+
+#endif
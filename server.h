@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "codec.h"
+#include "pcm.h"
+#include "sockopt.h"
+
+/*
+ * Receive many streams on one port, each from its own sender, with a
+ * worker thread and socket per core. The kernel steers each packet to
+ * a worker by its SSRC, so a stream is only ever handled by one
+ * worker and its state needs no locking.
+ *
+ * There may be more than one session (port) to listen on, every
+ * second port from the first so there is room for RTCP
+ */
+
+struct server {
+	const char *addr;
+	unsigned int port, sessions, workers;
+	unsigned int rate, channels;
+	enum encoding encoding;
+	int payload;
+	const struct layout *layout; /* Opus only */
+	const char *wav; /* prefix of a file per stream, or NULL */
+	const char *metrics;
+	const struct sockopts *sockopts;
+	unsigned int verbose;
+};
+
+int serve(const struct server *s);
+
+#endif
@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#ifdef SO_MEMINFO
+#include <linux/sock_diag.h> /* SK_MEMINFO_* */
+#endif
+
+#include "sockopt.h"
+
+#define MAX_BUSY_POLL 1000000 /* us */
+
+void sockopt_init(struct sockopts *o)
+{
+	o->rcvbuf = -1;
+	o->sndbuf = -1;
+	o->busy_poll = -1;
+	o->priority = -1;
+	o->dscp = 40;
+	o->ttl = 16;
+	o->pmtu = -1;
+}
+
+/*
+ * Parse a size in bytes, with an optional suffix of k or M
+ */
+
+static int parse_size(const char *s, int *v)
+{
+	char *end;
+	long n;
+
+	n = strtol(s, &end, 10);
+	if (*end == 'k' || *end == 'K') {
+		n *= 1024;
+		end++;
+	} else if (*end == 'M') {
+		n *= 1024 * 1024;
+		end++;
+	}
+
+	if (end == s || *end != '\0' || n <= 0 || n > 256 * 1024 * 1024)
+		return -1;
+
+	*v = n;
+	return 0;
+}
+
+static int parse_int(const char *s, int *v, int min, int max)
+{
+	char *end;
+	long n;
+
+	n = strtol(s, &end, 10);
+	if (end == s || *end != '\0' || n < min || n > max)
+		return -1;
+
+	*v = n;
+	return 0;
+}
+
+static int parse_pmtu(const char *s, int *v)
+{
+#ifdef IP_MTU_DISCOVER
+	if (strcmp(s, "dont") == 0)
+		*v = IP_PMTUDISC_DONT;
+	else if (strcmp(s, "want") == 0)
+		*v = IP_PMTUDISC_WANT;
+	else if (strcmp(s, "do") == 0)
+		*v = IP_PMTUDISC_DO;
+	else if (strcmp(s, "probe") == 0)
+		*v = IP_PMTUDISC_PROBE;
+	else
+		return -1;
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Parse "<name>=<value>,..." on top of what is already set
+ */
+
+int sockopt_parse(struct sockopts *o, const char *spec)
+{
+	char buf[256], *name, *value, *next;
+	int r;
+
+	if (strlen(spec) >= sizeof buf) {
+		fprintf(stderr, "Socket options too long\n");
+		return -1;
+	}
+	strcpy(buf, spec);
+
+	for (name = buf; name != NULL; name = next) {
+		next = strchr(name, ',');
+		if (next)
+			*next++ = '\0';
+
+		value = strchr(name, '=');
+		if (value == NULL)
+			goto bad;
+		*value++ = '\0';
+
+		if (strcmp(name, "rcvbuf") == 0) {
+			r = parse_size(value, &o->rcvbuf);
+		} else if (strcmp(name, "sndbuf") == 0) {
+			r = parse_size(value, &o->sndbuf);
+#ifdef SO_BUSY_POLL
+		} else if (strcmp(name, "busy_poll") == 0) {
+			r = parse_int(value, &o->busy_poll, 0, MAX_BUSY_POLL);
+#endif
+#ifdef SO_PRIORITY
+		} else if (strcmp(name, "priority") == 0) {
+			r = parse_int(value, &o->priority, 0, 7);
+#endif
+		} else if (strcmp(name, "dscp") == 0) {
+			r = parse_int(value, &o->dscp, 0, 63);
+		} else if (strcmp(name, "ttl") == 0) {
+			r = parse_int(value, &o->ttl, 1, 255);
+		} else if (strcmp(name, "pmtu") == 0) {
+			r = parse_pmtu(value, &o->pmtu);
+		} else {
+			fprintf(stderr, "Unknown or unavailable socket option "
+				"'%s'\n", name);
+			return -1;
+		}
+
+		if (r == -1)
+			goto bad;
+	}
+
+	return 0;
+
+bad:
+	fprintf(stderr, "Bad socket option '%s'; expected eg. rcvbuf=1M, "
+		"sndbuf=256k, busy_poll=50, priority=6, dscp=46, ttl=16 "
+		"or pmtu=do\n", name);
+	return -1;
+}
+
+static int set(int fd, int level, int option, const char *name, int value,
+		int verbose)
+{
+	socklen_t len;
+	int granted;
+
+	if (setsockopt(fd, level, option, &value, sizeof value) == -1) {
+		fprintf(stderr, "%s %d: %s\n", name, value, strerror(errno));
+		return -1;
+	}
+
+	len = sizeof granted;
+	if (getsockopt(fd, level, option, &granted, &len) == -1) {
+		perror(name);
+		return -1;
+	}
+
+	if (granted != value)
+		fprintf(stderr, "%s: asked for %d, got %d\n", name, value, granted);
+	else if (verbose > 0)
+		fprintf(stderr, "%s: %d\n", name, granted);
+
+	return 0;
+}
+
+/*
+ * Socket buffers are capped by the system (net.core.rmem_max and
+ * wmem_max) unless forced, which needs CAP_NET_ADMIN. Linux doubles
+ * what is asked for, to allow for its overhead
+ */
+
+static int set_buffer(int fd, int option, int force, const char *name,
+		int value, int verbose)
+{
+	socklen_t len;
+	int granted;
+
+	if (force == -1
+		|| setsockopt(fd, SOL_SOCKET, force, &value, sizeof value) == -1)
+	{
+		if (setsockopt(fd, SOL_SOCKET, option, &value,
+				sizeof value) == -1)
+		{
+			fprintf(stderr, "%s %d: %s\n", name, value,
+				strerror(errno));
+			return -1;
+		}
+	}
+
+	len = sizeof granted;
+	if (getsockopt(fd, SOL_SOCKET, option, &granted, &len) == -1) {
+		perror(name);
+		return -1;
+	}
+
+	if (granted < value) {
+		fprintf(stderr, "%s: asked for %d bytes, got %d; raise the "
+			"system limit or run with CAP_NET_ADMIN\n",
+			name, value, granted);
+	} else if (verbose > 0) {
+		fprintf(stderr, "%s: %d bytes\n", name, granted);
+	}
+
+	return 0;
+}
+
+/*
+ * Apply the options to a socket, and report what was granted where
+ * it is less than asked for (or always, if verbose). DSCP and TTL are
+ * left to oRTP, which needs to know them; set them first, as on Linux
+ * the DSCP also sets the priority
+ */
+
+int sockopt_apply(const struct sockopts *o, int fd, int verbose)
+{
+	if (o->rcvbuf != -1) {
+#ifdef SO_RCVBUFFORCE
+		if (set_buffer(fd, SO_RCVBUF, SO_RCVBUFFORCE, "SO_RCVBUF",
+				o->rcvbuf, verbose) == -1)
+#else
+		if (set_buffer(fd, SO_RCVBUF, -1, "SO_RCVBUF",
+				o->rcvbuf, verbose) == -1)
+#endif
+			return -1;
+	}
+
+	if (o->sndbuf != -1) {
+#ifdef SO_SNDBUFFORCE
+		if (set_buffer(fd, SO_SNDBUF, SO_SNDBUFFORCE, "SO_SNDBUF",
+				o->sndbuf, verbose) == -1)
+#else
+		if (set_buffer(fd, SO_SNDBUF, -1, "SO_SNDBUF",
+				o->sndbuf, verbose) == -1)
+#endif
+			return -1;
+	}
+
+#ifdef SO_BUSY_POLL
+	if (o->busy_poll != -1) {
+		if (set(fd, SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL",
+				o->busy_poll, verbose) == -1)
+			return -1;
+	}
+#endif
+
+#ifdef SO_PRIORITY
+	if (o->priority != -1) {
+		if (set(fd, SOL_SOCKET, SO_PRIORITY, "SO_PRIORITY",
+				o->priority, verbose) == -1)
+			return -1;
+	}
+#endif
+
+#ifdef IP_MTU_DISCOVER
+	if (o->pmtu != -1) {
+		struct sockaddr_storage addr;
+		socklen_t len = sizeof addr;
+
+		if (getsockname(fd, (struct sockaddr*)&addr, &len) == -1) {
+			perror("getsockname");
+			return -1;
+		}
+
+		/* The values of IPV6_PMTUDISC_* are the same */
+		if (addr.ss_family == AF_INET6) {
+			if (set(fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER,
+					"IPV6_MTU_DISCOVER", o->pmtu,
+					verbose) == -1)
+				return -1;
+		} else {
+			if (set(fd, IPPROTO_IP, IP_MTU_DISCOVER,
+					"IP_MTU_DISCOVER", o->pmtu,
+					verbose) == -1)
+				return -1;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+/*
+ * Have the kernel give the count of packets it has dropped for want
+ * of buffer with each packet received (SO_RXQ_OVFL)
+ */
+
+int sockopt_enable_drops(int fd)
+{
+#ifdef SO_RXQ_OVFL
+	int one = 1;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof one) == -1) {
+		perror("SO_RXQ_OVFL");
+		return -1;
+	}
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Packets dropped by the kernel at this socket so far, for when the
+ * socket is read by something which discards the SO_RXQ_OVFL
+ * messages, such as oRTP
+ */
+
+int sockopt_drops(int fd, unsigned long *drops)
+{
+#ifdef SO_MEMINFO
+	uint32_t meminfo[SK_MEMINFO_VARS];
+	socklen_t len = sizeof meminfo;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == -1)
+		return -1;
+	if (len <= SK_MEMINFO_DROPS * sizeof *meminfo)
+		return -1;
+
+	*drops = meminfo[SK_MEMINFO_DROPS];
+	return 0;
+#else
+	return -1;
+#endif
+}
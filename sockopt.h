@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef SOCKOPT_H
+#define SOCKOPT_H
+
+/*
+ * Options for the sockets which carry audio, given on the command
+ * line as a list, eg. "rcvbuf=1M,busy_poll=50,priority=6". A value of
+ * -1 leaves the system default
+ */
+
+struct sockopts {
+	int rcvbuf, sndbuf; /* bytes */
+	int busy_poll; /* microseconds */
+	int priority; /* SO_PRIORITY */
+	int dscp, ttl;
+	int pmtu; /* IP_PMTUDISC_* */
+};
+
+void sockopt_init(struct sockopts *o);
+int sockopt_parse(struct sockopts *o, const char *spec);
+int sockopt_apply(const struct sockopts *o, int fd, int verbose);
+
+int sockopt_enable_drops(int fd);
+int sockopt_drops(int fd, unsigned long *drops);
+
+#endif
@@ -0,0 +1,760 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/params.h>
+
+#include "srtp.h"
+
+#define LABEL_RTP 0 /* encryption; authentication and salt follow */
+#define LABEL_RTCP 3
+
+#define HMAC_TAG 10 /* bytes, of HMAC-SHA1 */
+#define GCM_TAG 16
+#define SRTCP_E 0x80000000u /* encrypted */
+#define WINDOW 64 /* packets, for replay protection */
+#define JOIN_ROCS 64 /* rollovers searched, for a new source */
+#define MAX_PAYLOAD 1500
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint32_t be32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static int base64(const char *in, unsigned char *out, size_t max)
+{
+	static const char alphabet[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	unsigned int acc = 0, bits = 0;
+	size_t n = 0;
+
+	for (; *in && *in != '='; in++) {
+		const char *c = strchr(alphabet, *in);
+
+		if (c == NULL)
+			return -1;
+		acc = acc << 6 | (c - alphabet);
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			if (n == max)
+				return -1;
+			out[n++] = acc >> bits;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Read the master key and salt, and the suite they are for
+ */
+
+static int load_key(struct srtp_key *k, const char *path)
+{
+	char line[256], suite[64], key[128], *b;
+	unsigned char raw[30];
+	struct stat st;
+	size_t want;
+	FILE *f;
+	int n;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	if (fstat(fileno(f), &st) == 0 && (st.st_mode & 077))
+		fprintf(stderr, "%s: key is readable by others\n", path);
+
+	for (;;) {
+		if (fgets(line, sizeof line, f) == NULL) {
+			fprintf(stderr, "%s: no key\n", path);
+			fclose(f);
+			return -1;
+		}
+
+		b = line;
+		while (isspace((unsigned char)*b))
+			b++;
+		if (*b != '\0' && *b != '#')
+			break;
+	}
+	fclose(f);
+
+	n = sscanf(b, "%63s %127s", suite, key);
+	OPENSSL_cleanse(line, sizeof line);
+	if (n != 2) {
+		fprintf(stderr, "%s: expected a suite and key\n", path);
+		return -1;
+	}
+
+	if (strcmp(suite, "AES_CM_128_HMAC_SHA1_80") == 0) {
+		k->suite = SRTP_AES_CM_128_HMAC_SHA1_80;
+		want = 30;
+	} else if (strcmp(suite, "AEAD_AES_128_GCM") == 0) {
+		k->suite = SRTP_AEAD_AES_128_GCM;
+		want = 28;
+	} else {
+		fprintf(stderr, "%s: unknown suite %s\n", path, suite);
+		return -1;
+	}
+
+	/* Lifetime and key identifier, if any, are not used */
+
+	b = key;
+	if (strncmp(b, "inline:", 7) == 0)
+		b += 7;
+	b[strcspn(b, "|")] = '\0';
+
+	n = base64(b, raw, sizeof raw);
+	OPENSSL_cleanse(key, sizeof key);
+	if (n != (int)want) {
+		fprintf(stderr, "%s: key should be %zu bytes\n", path, want);
+		OPENSSL_cleanse(raw, sizeof raw);
+		return -1;
+	}
+
+	memset(k->salt, 0, sizeof k->salt);
+	memcpy(k->key, raw, 16);
+	memcpy(k->salt, raw + 16, want - 16);
+	OPENSSL_cleanse(raw, sizeof raw);
+
+	return 0;
+}
+
+/*
+ * The key derivation function (RFC 3711 section 4.3) with a key
+ * derivation rate of zero. A 12-byte salt, as for GCM, is padded with
+ * zeros
+ */
+
+static int derive(const struct srtp_key *k, unsigned int label,
+		unsigned char *out, size_t len)
+{
+	static const unsigned char zero[32];
+	unsigned char iv[16];
+	EVP_CIPHER_CTX *c;
+	int n, r;
+
+	memset(iv, 0, sizeof iv);
+	memcpy(iv, k->salt, sizeof k->salt);
+	iv[7] ^= label;
+
+	c = EVP_CIPHER_CTX_new();
+	if (c == NULL)
+		return -1;
+
+	r = EVP_EncryptInit_ex(c, EVP_aes_128_ctr(), NULL, k->key, iv)
+		&& EVP_EncryptUpdate(c, out, &n, zero, len);
+	EVP_CIPHER_CTX_free(c);
+
+	return r ? 0 : -1;
+}
+
+/*
+ * Set up the cipher with its key, once; each packet gives only the IV
+ */
+
+static int cipher_init(struct srtp_context *x, const char *name,
+		const unsigned char *key)
+{
+	EVP_CIPHER *cipher;
+	int r;
+
+	cipher = EVP_CIPHER_fetch(NULL, name, NULL);
+	if (cipher == NULL)
+		return -1;
+
+	r = EVP_CipherInit_ex2(x->cipher, cipher, key, NULL, 1, NULL);
+	EVP_CIPHER_free(cipher);
+
+	return r ? 0 : -1;
+}
+
+static int context_init(struct srtp_context *x, const struct srtp_key *k,
+		unsigned int label)
+{
+	unsigned char key[16], auth[20];
+	OSSL_PARAM params[2];
+	EVP_MAC *mac;
+	int r;
+
+	x->cipher = NULL;
+	x->mac = NULL;
+
+	memset(x->salt, 0, sizeof x->salt);
+	if (derive(k, label, key, sizeof key) == -1
+		|| derive(k, label + 2, x->salt,
+			k->suite == SRTP_AEAD_AES_128_GCM ? 12 : 14) == -1)
+	{
+		goto fail;
+	}
+
+	x->cipher = EVP_CIPHER_CTX_new();
+	if (x->cipher == NULL)
+		goto fail;
+
+	if (k->suite == SRTP_AEAD_AES_128_GCM) {
+		r = cipher_init(x, "AES-128-GCM", key);
+		OPENSSL_cleanse(key, sizeof key);
+		return r;
+	}
+
+	if (cipher_init(x, "AES-128-CTR", key) == -1)
+		goto fail;
+
+	/* The key is set up once; each packet then starts from it */
+
+	if (derive(k, label + 1, auth, sizeof auth) == -1)
+		goto fail;
+
+	mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+	if (mac == NULL)
+		goto fail;
+	x->mac = EVP_MAC_CTX_new(mac);
+	EVP_MAC_free(mac);
+	if (x->mac == NULL)
+		goto fail;
+
+	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+		"SHA1", 0);
+	params[1] = OSSL_PARAM_construct_end();
+	if (!EVP_MAC_init(x->mac, auth, sizeof auth, params))
+		goto fail;
+
+	OPENSSL_cleanse(key, sizeof key);
+	OPENSSL_cleanse(auth, sizeof auth);
+	return 0;
+
+fail:
+	OPENSSL_cleanse(key, sizeof key);
+	OPENSSL_cleanse(auth, sizeof auth);
+	return -1;
+}
+
+static void context_clear(struct srtp_context *x)
+{
+	EVP_CIPHER_CTX_free(x->cipher);
+	EVP_MAC_CTX_free(x->mac);
+	OPENSSL_cleanse(x->salt, sizeof x->salt);
+}
+
+int srtp_init(struct srtp *s, const struct srtp_key *k)
+{
+	memset(s, 0, sizeof *s);
+	s->suite = k->suite;
+	s->tag = k->suite == SRTP_AEAD_AES_128_GCM ? GCM_TAG : HMAC_TAG;
+
+	if (context_init(&s->rtp, k, LABEL_RTP) == -1
+		|| context_init(&s->rtcp, k, LABEL_RTCP) == -1)
+	{
+		fprintf(stderr, "SRTP: cannot set up keys\n");
+		context_clear(&s->rtp);
+		context_clear(&s->rtcp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Set up from the key in the given file
+ */
+
+int srtp_open(struct srtp *s, const char *path)
+{
+	struct srtp_key k;
+	int r;
+
+	if (load_key(&k, path) == -1)
+		return -1;
+
+	r = srtp_init(s, &k);
+	OPENSSL_cleanse(&k, sizeof k);
+
+	return r;
+}
+
+void srtp_clear(struct srtp *s)
+{
+	context_clear(&s->rtp);
+	context_clear(&s->rtcp);
+}
+
+/*
+ * The counter for AES-CM: the salt, with the SSRC and 48-bit packet
+ * index over it (RFC 3711 section 4.1.1)
+ */
+
+static void cm_iv(const struct srtp_context *x, unsigned char *iv,
+		uint32_t ssrc, uint32_t high, uint16_t low)
+{
+	memcpy(iv, x->salt, 14);
+	iv[14] = 0;
+	iv[15] = 0;
+
+	iv[4] ^= ssrc >> 24;
+	iv[5] ^= ssrc >> 16;
+	iv[6] ^= ssrc >> 8;
+	iv[7] ^= ssrc;
+	iv[8] ^= high >> 24;
+	iv[9] ^= high >> 16;
+	iv[10] ^= high >> 8;
+	iv[11] ^= high;
+	iv[12] ^= low >> 8;
+	iv[13] ^= low;
+}
+
+/*
+ * The nonce for GCM (RFC 7714 sections 8.1 and 9.1)
+ */
+
+static void gcm_iv(const struct srtp_context *x, unsigned char *iv,
+		uint32_t ssrc, uint32_t high, uint16_t low)
+{
+	unsigned int n;
+
+	iv[0] = 0;
+	iv[1] = 0;
+	put32(iv + 2, ssrc);
+	put32(iv + 6, high);
+	iv[10] = low >> 8;
+	iv[11] = low;
+
+	for (n = 0; n < 12; n++)
+		iv[n] ^= x->salt[n];
+}
+
+/*
+ * HMAC-SHA1 of up to three pieces, into a full-length tag
+ */
+
+static int hmac(struct srtp_context *x, unsigned char *out,
+		const void *a, size_t alen, const void *b, size_t blen,
+		const void *c, size_t clen)
+{
+	size_t n;
+
+	return EVP_MAC_init(x->mac, NULL, 0, NULL)
+		&& EVP_MAC_update(x->mac, a, alen)
+		&& EVP_MAC_update(x->mac, b, blen)
+		&& EVP_MAC_update(x->mac, c, clen)
+		&& EVP_MAC_final(x->mac, out, &n, 20);
+}
+
+/*
+ * Encrypt in place, with additional data for GCM; give the tag
+ */
+
+static int gcm_seal(struct srtp_context *x, const unsigned char *iv,
+		const unsigned char *aad, size_t alen,
+		const unsigned char *aad2, size_t alen2,
+		unsigned char *p, size_t len, unsigned char *tag)
+{
+	EVP_CIPHER_CTX *c = x->cipher;
+	int n;
+
+	return EVP_CipherInit_ex(c, NULL, NULL, NULL, iv, 1)
+		&& EVP_CipherUpdate(c, NULL, &n, aad, alen)
+		&& (alen2 == 0 || EVP_CipherUpdate(c, NULL, &n, aad2, alen2))
+		&& (len == 0 || EVP_CipherUpdate(c, p, &n, p, len))
+		&& EVP_CipherFinal_ex(c, tag, &n)
+		&& EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_GCM_GET_TAG, GCM_TAG, tag);
+}
+
+/*
+ * Decrypt, in place or to the given output, and return 0 only if the
+ * tag is good
+ */
+
+static int gcm_open(struct srtp_context *x, const unsigned char *iv,
+		const unsigned char *aad, size_t alen,
+		const unsigned char *aad2, size_t alen2,
+		const unsigned char *p, unsigned char *out, size_t len,
+		const unsigned char *tag)
+{
+	EVP_CIPHER_CTX *c = x->cipher;
+	unsigned char end[16];
+	int n;
+
+	if (EVP_CipherInit_ex(c, NULL, NULL, NULL, iv, 0)
+		&& EVP_CipherUpdate(c, NULL, &n, aad, alen)
+		&& (alen2 == 0 || EVP_CipherUpdate(c, NULL, &n, aad2, alen2))
+		&& (len == 0 || EVP_CipherUpdate(c, out, &n, p, len))
+		&& EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_GCM_SET_TAG, GCM_TAG,
+			(void*)tag)
+		&& EVP_CipherFinal_ex(c, end, &n))
+	{
+		return 0;
+	}
+
+	return -1;
+}
+
+static int cm_crypt(struct srtp_context *x, const unsigned char *iv,
+		unsigned char *p, size_t len)
+{
+	int n;
+
+	return EVP_CipherInit_ex(x->cipher, NULL, NULL, NULL, iv, 1)
+		&& (len == 0 || EVP_CipherUpdate(x->cipher, p, &n, p, len));
+}
+
+/*
+ * Encrypt a packet's payload where it is, and write its tag (of
+ * s->tag bytes). The header goes unchanged, but is authenticated.
+ * Return the length of the tag, or -1 on error
+ */
+
+int srtp_protect(struct srtp *s, const unsigned char *header, size_t hlen,
+		unsigned char *payload, size_t len, unsigned char *tag)
+{
+	unsigned char iv[16], roc[4], full[20];
+	uint32_t ssrc;
+	uint16_t seq;
+
+	seq = header[2] << 8 | header[3];
+	ssrc = be32(header + 8);
+
+	/* The rollover counter counts the wraps of sequence number */
+
+	if (s->send.started && seq < s->send.seq
+		&& (uint16_t)(seq - s->send.seq) < 0x8000)
+	{
+		s->send.roc++;
+	}
+	s->send.started = 1;
+	s->send.seq = seq;
+
+	if (s->suite == SRTP_AEAD_AES_128_GCM) {
+		gcm_iv(&s->rtp, iv, ssrc, s->send.roc, seq);
+		if (!gcm_seal(&s->rtp, iv, header, hlen, NULL, 0,
+				payload, len, tag))
+			return -1;
+		return GCM_TAG;
+	}
+
+	cm_iv(&s->rtp, iv, ssrc, s->send.roc, seq);
+	put32(roc, s->send.roc);
+	if (!cm_crypt(&s->rtp, iv, payload, len)
+		|| !hmac(&s->rtp, full, header, hlen, payload, len, roc, 4))
+	{
+		return -1;
+	}
+	memcpy(tag, full, HMAC_TAG);
+
+	return HMAC_TAG;
+}
+
+static size_t header_length(const unsigned char *p, size_t len)
+{
+	size_t n;
+
+	n = 12 + 4 * (p[0] & 0xf);
+	if ((p[0] & 0x10) && n + 4 <= len)
+		n += 4 + 4 * (p[n + 2] << 8 | p[n + 3]);
+
+	return n;
+}
+
+/*
+ * Whether an index has been seen already, or is too old to know
+ */
+
+static int replayed(uint64_t top, uint64_t window, uint64_t index)
+{
+	if (index > top)
+		return 0;
+	if (top - index >= WINDOW)
+		return 1;
+
+	return (window >> (top - index)) & 1;
+}
+
+static void seen(uint64_t *top, uint64_t *window, uint64_t index)
+{
+	if (index > *top) {
+		uint64_t shift = index - *top;
+
+		*window = shift >= WINDOW ? 0 : *window << shift;
+		*window |= 1;
+		*top = index;
+	} else {
+		*window |= (uint64_t)1 << (*top - index);
+	}
+}
+
+/*
+ * Authenticate a packet with the given rollover counter and, if it is
+ * genuine, decrypt its payload. For GCM the clear payload goes to the
+ * given output, so a packet which fails is left as it was
+ */
+
+static int open_rtp(struct srtp *s, unsigned char *p, size_t hlen,
+		size_t plen, uint32_t roc, unsigned char *out)
+{
+	unsigned char iv[16], b[4], full[20];
+	uint32_t ssrc;
+	uint16_t seq;
+
+	seq = p[2] << 8 | p[3];
+	ssrc = be32(p + 8);
+
+	if (s->suite == SRTP_AEAD_AES_128_GCM) {
+		gcm_iv(&s->rtp, iv, ssrc, roc, seq);
+		return gcm_open(&s->rtp, iv, p, hlen, NULL, 0, p + hlen, out,
+			plen, p + hlen + plen);
+	}
+
+	put32(b, roc);
+	if (!hmac(&s->rtp, full, p, hlen + plen, b, 4, NULL, 0)
+		|| CRYPTO_memcmp(full, p + hlen + plen, HMAC_TAG) != 0)
+	{
+		return -1;
+	}
+	cm_iv(&s->rtp, iv, ssrc, roc, seq);
+	if (!cm_crypt(&s->rtp, iv, p + hlen, plen))
+		return -1;
+	if (out != p + hlen)
+		memcpy(out, p + hlen, plen);
+
+	return 0;
+}
+
+/*
+ * The rollover counter is not sent, and a sender may have wrapped its
+ * sequence number before we began to listen; so for a new source,
+ * find the first of the counters which authenticates the packet
+ */
+
+static int join(struct srtp *s, unsigned char *p, size_t hlen,
+		size_t plen, uint32_t *roc)
+{
+	unsigned char clear[MAX_PAYLOAD];
+
+	if (plen > sizeof clear)
+		return -1;
+
+	for (*roc = 0; *roc < JOIN_ROCS; (*roc)++) {
+		if (open_rtp(s, p, hlen, plen, *roc, clear) == 0) {
+			memcpy(p + hlen, clear, plen);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Authenticate and decrypt a packet in place, taking the tag off the
+ * length. Return -1 if it is not genuine, or is a replay
+ */
+
+int srtp_unprotect(struct srtp *s, unsigned char *p, size_t *len)
+{
+	size_t hlen, plen;
+	uint32_t ssrc, roc;
+	uint16_t seq;
+	uint64_t index;
+
+	if (*len < 12 + s->tag || p[0] >> 6 != 2)
+		return -1;
+
+	hlen = header_length(p, *len - s->tag);
+	if (hlen > *len - s->tag)
+		return -1;
+	plen = *len - s->tag - hlen;
+
+	seq = p[2] << 8 | p[3];
+	ssrc = be32(p + 8);
+
+	if (!s->receive.started || ssrc != s->receive.ssrc) {
+		if (join(s, p, hlen, plen, &roc) == -1)
+			return -1;
+
+		s->receive.started = 1;
+		s->receive.ssrc = ssrc;
+		s->receive.roc = roc;
+		s->receive.seq = seq;
+		s->receive.top = (uint64_t)roc << 16 | seq;
+		s->receive.window = 1;
+
+		*len -= s->tag;
+		return 0;
+	}
+
+	/* Guess the rollover counter from the highest sequence number
+	 * so far (RFC 3711 appendix A) */
+
+	roc = s->receive.roc;
+	if (s->receive.seq < 0x8000) {
+		if (seq - s->receive.seq > 0x8000)
+			roc--;
+	} else if (s->receive.seq - 0x8000 > seq) {
+		roc++;
+	}
+
+	index = (uint64_t)roc << 16 | seq;
+	if (replayed(s->receive.top, s->receive.window, index))
+		return -1;
+
+	if (open_rtp(s, p, hlen, plen, roc, p + hlen) == -1)
+		return -1;
+
+	/* Only now that it is genuine does it move anything on */
+
+	if (roc == s->receive.roc + 1) {
+		s->receive.roc = roc;
+		s->receive.seq = seq;
+	} else if (roc == s->receive.roc && seq > s->receive.seq) {
+		s->receive.seq = seq;
+	}
+	seen(&s->receive.top, &s->receive.window, index);
+
+	*len -= s->tag;
+	return 0;
+}
+
+/*
+ * Encrypt a compound RTCP packet in place, and append the SRTCP index
+ * and tag; there must be room for SRTCP_MAX_TRAILER bytes more
+ */
+
+int srtp_protect_rtcp(struct srtp *s, unsigned char *p, size_t *len)
+{
+	unsigned char iv[16], e[4], full[20];
+	uint32_t ssrc, index;
+
+	if (*len < 8)
+		return -1;
+
+	ssrc = be32(p + 4);
+	index = s->send.rtcp_index++ & ~SRTCP_E;
+	put32(e, SRTCP_E | index);
+
+	if (s->suite == SRTP_AEAD_AES_128_GCM) {
+		gcm_iv(&s->rtcp, iv, ssrc, 0, 0);
+		iv[8] ^= e[0] & ~0x80;
+		iv[9] ^= e[1];
+		iv[10] ^= e[2];
+		iv[11] ^= e[3];
+		if (!gcm_seal(&s->rtcp, iv, p, 8, e, 4, p + 8, *len - 8,
+				p + *len))
+			return -1;
+		memcpy(p + *len + GCM_TAG, e, 4);
+		*len += GCM_TAG + 4;
+		return 0;
+	}
+
+	cm_iv(&s->rtcp, iv, ssrc, 0, 0);
+	iv[10] ^= e[0] & ~0x80;
+	iv[11] ^= e[1];
+	iv[12] ^= e[2];
+	iv[13] ^= e[3];
+	if (!cm_crypt(&s->rtcp, iv, p + 8, *len - 8))
+		return -1;
+
+	memcpy(p + *len, e, 4);
+	if (!hmac(&s->rtcp, full, p, *len + 4, NULL, 0, NULL, 0))
+		return -1;
+	memcpy(p + *len + 4, full, HMAC_TAG);
+	*len += 4 + HMAC_TAG;
+
+	return 0;
+}
+
+int srtp_unprotect_rtcp(struct srtp *s, unsigned char *p, size_t *len)
+{
+	unsigned char iv[16], full[20];
+	const unsigned char *e;
+	uint32_t ssrc, index;
+	size_t body;
+	int fresh;
+
+	if (*len < 8 + 4 + s->tag)
+		return -1;
+
+	body = *len - 4 - s->tag;
+	if (s->suite == SRTP_AEAD_AES_128_GCM)
+		e = p + body + GCM_TAG;
+	else
+		e = p + body;
+
+	ssrc = be32(p + 4);
+	index = be32(e) & ~SRTCP_E;
+
+	fresh = !s->receive.rtcp_started || ssrc != s->receive.rtcp_ssrc;
+	if (!fresh && replayed(s->receive.rtcp_top, s->receive.rtcp_window,
+			index))
+		return -1;
+
+	if (s->suite == SRTP_AEAD_AES_128_GCM) {
+		gcm_iv(&s->rtcp, iv, ssrc, 0, 0);
+		iv[8] ^= e[0] & ~0x80;
+		iv[9] ^= e[1];
+		iv[10] ^= e[2];
+		iv[11] ^= e[3];
+		if (gcm_open(&s->rtcp, iv, p, 8, e, 4, p + 8, p + 8, body - 8,
+				p + body) == -1)
+			return -1;
+	} else {
+		if (!hmac(&s->rtcp, full, p, body + 4, NULL, 0, NULL, 0)
+			|| CRYPTO_memcmp(full, p + body + 4, HMAC_TAG) != 0)
+		{
+			return -1;
+		}
+		if (e[0] & 0x80) {
+			cm_iv(&s->rtcp, iv, ssrc, 0, 0);
+			iv[10] ^= e[0] & ~0x80;
+			iv[11] ^= e[1];
+			iv[12] ^= e[2];
+			iv[13] ^= e[3];
+			if (!cm_crypt(&s->rtcp, iv, p + 8, body - 8))
+				return -1;
+		}
+	}
+
+	if (fresh) {
+		s->receive.rtcp_started = 1;
+		s->receive.rtcp_ssrc = ssrc;
+		s->receive.rtcp_top = index;
+		s->receive.rtcp_window = 1;
+	} else {
+		seen(&s->receive.rtcp_top, &s->receive.rtcp_window, index);
+	}
+
+	*len = body;
+	return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef SRTP_H
+#define SRTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * SRTP and SRTCP (RFC 3711) for the native RTP stack, in the suites
+ * AES_CM_128_HMAC_SHA1_80 and AEAD_AES_128_GCM (RFC 7714), by way of
+ * libcrypto; it uses AES-NI and carry-less multiply where the CPU has
+ * them.
+ *
+ * The payload is encrypted and decrypted where it lies, and the tag
+ * goes alongside; nothing is copied and nothing is allocated per
+ * packet.
+ *
+ * The master key is read from a file of one line, in the form of an
+ * SDP crypto attribute (RFC 4568), eg.
+ *
+ *   AES_CM_128_HMAC_SHA1_80 inline:<base64 of 30 bytes key and salt>
+ *   AEAD_AES_128_GCM inline:<base64 of 28 bytes key and salt>
+ *
+ * and the same key serves either end.
+ *
+ * The rollover counter of the sequence number is not sent. A receiver
+ * which joins a source late finds it by trying each of the first 64
+ * rollovers, so it can join within 64 wraps (almost 3 hours at 2.5ms
+ * packets, and 11 at 10ms) of the sender starting; and
+ * the sender starts low in the sequence, to make a wrap rare in the
+ * first place.
+ */
+
+#define SRTP_MAX_TAG 16
+#define SRTCP_MAX_TRAILER 20 /* index and tag */
+
+enum srtp_suite {
+	SRTP_AES_CM_128_HMAC_SHA1_80,
+	SRTP_AEAD_AES_128_GCM,
+};
+
+struct srtp_key {
+	enum srtp_suite suite;
+	unsigned char key[16], salt[14];
+};
+
+/*
+ * Keys and state for one stream each way
+ */
+
+struct srtp_context {
+	void *cipher, *mac; /* libcrypto's */
+	unsigned char salt[14];
+};
+
+struct srtp {
+	enum srtp_suite suite;
+	size_t tag;
+	struct srtp_context rtp, rtcp;
+
+	struct {
+		int started;
+		uint32_t roc;
+		uint16_t seq;
+		uint32_t rtcp_index;
+	} send;
+
+	struct {
+		int started, rtcp_started;
+		uint32_t ssrc, roc, rtcp_ssrc;
+		uint16_t seq; /* highest, in this rollover */
+		uint64_t top, window; /* replay protection */
+		uint64_t rtcp_top, rtcp_window;
+	} receive;
+};
+
+int srtp_init(struct srtp *s, const struct srtp_key *k);
+int srtp_open(struct srtp *s, const char *path);
+void srtp_clear(struct srtp *s);
+
+int srtp_protect(struct srtp *s, const unsigned char *header, size_t hlen,
+		unsigned char *payload, size_t len, unsigned char *tag);
+int srtp_unprotect(struct srtp *s, unsigned char *p, size_t *len);
+
+int srtp_protect_rtcp(struct srtp *s, unsigned char *p, size_t *len);
+int srtp_unprotect_rtcp(struct srtp *s, unsigned char *p, size_t *len);
+
+#endif
@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stretch.h"
+
+#define OVERLAP_US 2500
+#define MIN_US 2500
+#define MAX_US 10000 /* a pitch period of 100Hz */
+
+int stretch_init(struct stretch *s, unsigned int rate,
+		unsigned int channels, unsigned int max_frame)
+{
+	unsigned int i;
+
+	s->channels = channels;
+	s->overlap = (uint64_t)rate * OVERLAP_US / 1000000;
+	s->min = (uint64_t)rate * MIN_US / 1000000;
+	s->max = (uint64_t)rate * MAX_US / 1000000;
+	if (s->overlap == 0 || s->min == 0) {
+		fprintf(stderr, "Rate too low to stretch\n");
+		return -1;
+	}
+
+	/* History, audio held back for want of enough, and a frame */
+	s->size = s->max + s->min + s->overlap + max_frame;
+
+	s->buf = malloc(sizeof(*s->buf) * s->size * channels);
+	s->mono = malloc(sizeof(*s->mono) * (2 * s->max + s->overlap));
+	s->fade = malloc(sizeof(*s->fade) * s->overlap);
+	if (s->buf == NULL || s->mono == NULL || s->fade == NULL) {
+		perror("malloc");
+		stretch_clear(s);
+		return -1;
+	}
+
+	for (i = 0; i < s->overlap; i++)
+		s->fade[i] = 0.5 - 0.5 * cos(M_PI * (i + 0.5) / s->overlap);
+
+	/* Silence for history, so it can slow down from the start */
+	memset(s->buf, 0, sizeof(*s->buf) * s->max * channels);
+	s->len = s->max;
+	s->pos = s->max;
+	s->owed = 0;
+	s->removed = 0;
+	s->added = 0;
+
+	return 0;
+}
+
+void stretch_clear(struct stretch *s)
+{
+	free(s->buf);
+	free(s->mono);
+	free(s->fade);
+}
+
+unsigned int stretch_output_max(const struct stretch *s, unsigned int in)
+{
+	return in + s->min + s->overlap + s->max;
+}
+
+/*
+ * Find the jump from the read position, forward or back by from lo
+ * to hi samples, where the audio best matches that at the read
+ * position; by normalised cross-correlation, of all channels mixed
+ */
+
+static unsigned int search(struct stretch *s, int dir,
+		unsigned int lo, unsigned int hi)
+{
+	unsigned int i, d, best = lo, start, span, c;
+	const float *ref, *m;
+	long step = dir > 0 ? 1 : -1;
+	float score = -INFINITY;
+	double energy;
+
+	/* Mix just the span which may be compared */
+
+	start = dir > 0 ? s->pos : s->pos - hi;
+	span = hi + s->overlap;
+
+	for (i = 0; i < span; i++) {
+		const int16_t *x = s->buf + (size_t)(start + i) * s->channels;
+		float v = 0;
+
+		for (c = 0; c < s->channels; c++)
+			v += x[c];
+		s->mono[i] = v;
+	}
+
+	ref = s->mono + (s->pos - start);
+
+	/* The energy of each candidate is kept as a running sum */
+
+	m = ref + step * lo;
+	energy = 0;
+	for (i = 0; i < s->overlap; i++)
+		energy += m[i] * m[i];
+
+	for (d = lo; d <= hi; d++) {
+		float corr = 0;
+
+		m = ref + step * d;
+		for (i = 0; i < s->overlap; i++)
+			corr += ref[i] * m[i];
+
+		if (energy > 0 && corr / sqrtf(energy) > score) {
+			score = corr / sqrtf(energy);
+			best = d;
+		}
+
+		/* Slide the window on by one sample */
+		if (d < hi) {
+			if (dir > 0) {
+				energy += m[s->overlap] * m[s->overlap]
+					- m[0] * m[0];
+			} else {
+				energy += m[-1] * m[-1]
+					- m[s->overlap - 1] * m[s->overlap - 1];
+			}
+			if (energy < 0)
+				energy = 0;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Crossfade from the audio at the read position to that at the new
+ * one, and move on past the crossfade
+ */
+
+static unsigned int splice(struct stretch *s, unsigned int to, int16_t *out)
+{
+	const int16_t *a, *b;
+	unsigned int i, c;
+
+	a = s->buf + (size_t)s->pos * s->channels;
+	b = s->buf + (size_t)to * s->channels;
+
+	for (i = 0; i < s->overlap; i++) {
+		float w = s->fade[i];
+
+		for (c = 0; c < s->channels; c++) {
+			size_t k = (size_t)i * s->channels + c;
+
+			out[k] = lrintf(a[k] * (1 - w) + b[k] * w);
+		}
+	}
+
+	s->pos = to + s->overlap;
+	return s->overlap;
+}
+
+/*
+ * Take a frame of input and give the output, which is eventually
+ * shorter or longer by the given fraction (eg. 0.04 to play 4%
+ * faster). Return the number of samples output, which may be none
+ */
+
+int stretch_process(struct stretch *s, const int16_t *in, unsigned int n,
+		int16_t *out, double speed)
+{
+	unsigned int o = 0, avail;
+
+	if (s->len + n > s->size) {
+		fprintf(stderr, "Frame too large to stretch\n");
+		return -1;
+	}
+
+	memcpy(s->buf + (size_t)s->len * s->channels, in,
+		sizeof(*in) * n * s->channels);
+	s->len += n;
+
+	if (speed == 0)
+		s->owed = 0;
+	else
+		s->owed += speed * n;
+
+	avail = s->len - s->pos;
+
+	if (s->owed >= s->min) {
+		unsigned int hi, d;
+
+		/* Hold the audio back until there is enough to jump */
+		if (avail < s->min + s->overlap)
+			return 0;
+
+		hi = avail - s->overlap;
+		if (hi > s->max)
+			hi = s->max;
+
+		d = search(s, 1, s->min, hi);
+		o += splice(s, s->pos + d, out);
+		s->owed -= d;
+		s->removed += d;
+
+	} else if (s->owed <= -(double)s->min && avail >= s->overlap) {
+		unsigned int d;
+
+		d = search(s, -1, s->min, s->max);
+		o += splice(s, s->pos - d, out);
+		s->owed += d;
+		s->added += d;
+	}
+
+	/* The rest passes through */
+
+	memcpy(out + (size_t)o * s->channels,
+		s->buf + (size_t)s->pos * s->channels,
+		sizeof(*out) * (s->len - s->pos) * s->channels);
+	o += s->len - s->pos;
+	s->pos = s->len;
+
+	/* Keep only the history */
+
+	memmove(s->buf, s->buf + (size_t)(s->pos - s->max) * s->channels,
+		sizeof(*s->buf) * s->max * s->channels);
+	s->len = s->max;
+	s->pos = s->max;
+
+	/* Do not run on after a change of speed */
+	if (s->owed > 2 * s->max)
+		s->owed = 2 * s->max;
+	if (s->owed < -2.0 * s->max)
+		s->owed = -2.0 * s->max;
+
+	return o;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef STRETCH_H
+#define STRETCH_H
+
+#include <stdint.h>
+
+/*
+ * Time-scale modification of 16-bit interleaved audio, by waveform
+ * similarity overlap-add (WSOLA).
+ *
+ * The audio passes through untouched until asked to play faster or
+ * slower by some fraction. Then, every so often, the read position
+ * jumps forward (to play less) or back (to play more) by between 2.5
+ * and 10ms; the jump is chosen as the one where the waveform most
+ * resembles the audio it replaces, and the two are crossfaded over
+ * 2.5ms. Pitch is unchanged.
+ *
+ * To play faster, 5ms of audio must be to hand; with frames shorter
+ * than this it is held back until there is enough. Otherwise the
+ * stage adds no delay.
+ */
+
+struct stretch {
+	unsigned int channels;
+	unsigned int overlap, min, max; /* samples */
+	unsigned int size, len, pos; /* samples; pos is the read position */
+	int16_t *buf; /* history of max samples, then input */
+	float *mono, *fade;
+	double owed; /* samples to remove, or add if negative */
+	unsigned long removed, added;
+};
+
+int stretch_init(struct stretch *s, unsigned int rate,
+		unsigned int channels, unsigned int max_frame);
+void stretch_clear(struct stretch *s);
+
+unsigned int stretch_output_max(const struct stretch *s, unsigned int in);
+
+int stretch_process(struct stretch *s, const int16_t *in, unsigned int n,
+		int16_t *out, double speed);
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <time.h>
+
+#include "timestamp.h"
+
+/*
+ * Nanoseconds on a clock which is unaffected by changes to the
+ * system time; for measuring intervals only
+ */
+
+uint64_t monotonic_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/*
+ * Nanoseconds since the epoch on the system clock. This is the clock
+ * shared between hosts (eg. by NTP or PTP), and trivially between
+ * processes on the same host
+ */
+
+uint64_t wallclock_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_REALTIME, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/*
+ * Nanoseconds of CPU time used by all threads of this process
+ */
+
+uint64_t process_cpu_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+#define NTP_EPOCH_OFFSET 2208988800ULL /* 1900 to 1970, in seconds */
+
+/*
+ * Convert to and from the 64-bit NTP format (32.32 fixed point
+ * seconds since 1900), big-endian
+ */
+
+void ntp_from_ns(uint64_t ns, uint8_t *ntp)
+{
+	uint64_t sec, frac, v;
+	int n;
+
+	sec = ns / 1000000000 + NTP_EPOCH_OFFSET;
+	frac = ((ns % 1000000000) << 32) / 1000000000;
+	v = sec << 32 | frac;
+
+	for (n = 7; n >= 0; n--) {
+		ntp[n] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+uint64_t ns_from_ntp(const uint8_t *ntp)
+{
+	uint64_t sec, frac, v = 0;
+	int n;
+
+	for (n = 0; n < 8; n++)
+		v = v << 8 | ntp[n];
+
+	sec = (v >> 32) - NTP_EPOCH_OFFSET;
+	frac = v & 0xffffffff;
+
+	return sec * 1000000000 + ((frac * 1000000000) >> 32);
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#include <stdint.h>
+
+/*
+ * Capture time is carried as an RTP header extension (one-byte form)
+ * in 64-bit NTP format
+ */
+
+#define CAPTURE_TIME_EXTENSION 1
+#define CAPTURE_TIME_SIZE 8
+
+uint64_t monotonic_ns(void);
+uint64_t wallclock_ns(void);
+uint64_t process_cpu_ns(void);
+
+void ntp_from_ns(uint64_t ns, uint8_t *ntp);
+uint64_t ns_from_ntp(const uint8_t *ntp);
+
+#endif
@@ -0,0 +1,288 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Per-frame pipeline tracing, written in the Chrome trace event
+ * format (chrome://tracing or https://ui.perfetto.dev)
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pa_ringbuffer.h"
+#include "timestamp.h"
+#include "trace.h"
+
+int trace_enabled;
+
+#ifdef USE_TRACE
+
+#define MAX_THREADS 16
+#define RING_RECORDS 8192 /* per thread, must be a power of two */
+#define DUMP_INTERVAL_US 100000
+
+struct record {
+	uint64_t ns;
+	uint32_t frame;
+	uint32_t stage;
+};
+
+struct ring {
+	PaUtilRingBuffer rb;
+	struct record data[RING_RECORDS];
+	char name[32];
+	atomic_ulong dropped;
+
+	/* Used by the dump thread only */
+	uint64_t last;
+	int have_last;
+};
+
+static const char *stage_name[] = {
+	[TRACE_BEGIN] = "begin",
+	[TRACE_CAPTURE] = "capture",
+	[TRACE_ENCODE] = "encode",
+	[TRACE_SEND] = "send",
+	[TRACE_RECEIVE] = "receive",
+	[TRACE_DECODE] = "decode",
+	[TRACE_PLAYBACK] = "playback"
+};
+
+static _Atomic(struct ring*) ring[MAX_THREADS];
+static atomic_uint nrings;
+static __thread struct ring *self;
+
+static FILE *out;
+static pthread_t dumper;
+static atomic_int stop;
+static unsigned int named; /* threads with their metadata written */
+static int first = 1;
+
+/*
+ * Begin the next event in the array
+ */
+
+static void event(void)
+{
+	if (!first)
+		fputs(",\n", out);
+	first = 0;
+}
+
+static void dump_ring(unsigned int n, struct ring *r)
+{
+	struct record rec;
+
+	if (n >= named) {
+		event();
+		fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\","
+			"\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+			getpid(), n + 1, r->name);
+		named = n + 1;
+	}
+
+	while (PaUtil_ReadRingBuffer(&r->rb, &rec, 1) == 1) {
+		if (r->have_last && rec.stage != TRACE_BEGIN) {
+			event();
+			fprintf(out, "{\"name\":\"%s\",\"ph\":\"X\","
+				"\"pid\":%d,\"tid\":%u,"
+				"\"ts\":%.3f,\"dur\":%.3f,"
+				"\"args\":{\"frame\":%u}}",
+				stage_name[rec.stage], getpid(), n + 1,
+				r->last / 1e3, (rec.ns - r->last) / 1e3,
+				rec.frame);
+		}
+
+		r->last = rec.ns;
+		r->have_last = 1;
+	}
+}
+
+static void dump(void)
+{
+	unsigned int n, count;
+
+	count = atomic_load(&nrings);
+	for (n = 0; n < count; n++) {
+		struct ring *r;
+
+		/* Registered, but possibly not yet stored */
+
+		r = atomic_load(&ring[n]);
+		if (r == NULL)
+			break;
+		dump_ring(n, r);
+	}
+
+	fflush(out);
+}
+
+static void* run_dump(void *arg)
+{
+	while (!atomic_load(&stop)) {
+		dump();
+		usleep(DUMP_INTERVAL_US);
+	}
+
+	return NULL;
+}
+
+/*
+ * Start tracing to the given file. The dump thread inherits the
+ * scheduling of the caller, so this must be called before
+ * go_realtime(), but after go_daemon() which leaves only the calling
+ * thread
+ */
+
+int trace_start(const char *path)
+{
+	int r;
+
+	out = fopen(path, "w");
+	if (out == NULL) {
+		perror("fopen");
+		return -1;
+	}
+
+	fputs("[\n", out);
+	trace_enabled = 1;
+
+	r = pthread_create(&dumper, NULL, run_dump, NULL);
+	if (r != 0) {
+		errno = r;
+		perror("pthread_create");
+		return -1;
+	}
+
+	return 0;
+}
+
+void trace_stop(void)
+{
+	unsigned int n;
+
+	if (!trace_enabled)
+		return;
+
+	atomic_store(&stop, 1);
+	pthread_join(dumper, NULL);
+	dump();
+
+	fputs("\n]\n", out);
+	fclose(out);
+
+	for (n = 0; n < atomic_load(&nrings); n++) {
+		struct ring *r;
+		unsigned long d;
+
+		r = atomic_load(&ring[n]);
+		if (r == NULL)
+			break;
+
+		d = atomic_load(&r->dropped);
+		if (d > 0)
+			fprintf(stderr, "trace: %s: %lu records dropped\n",
+				r->name, d);
+	}
+}
+
+/*
+ * Give the calling thread a trace ring of its own; marks from any
+ * thread which has not done so are ignored. Call after trace_start()
+ */
+
+int trace_thread(const char *name)
+{
+	struct ring *r;
+	unsigned int n;
+
+	if (!trace_enabled)
+		return 0;
+
+	r = calloc(1, sizeof *r);
+	if (r == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	PaUtil_InitializeRingBuffer(&r->rb, sizeof(struct record),
+		RING_RECORDS, r->data);
+	snprintf(r->name, sizeof r->name, "%s", name);
+	atomic_init(&r->dropped, 0);
+
+	n = atomic_fetch_add(&nrings, 1);
+	if (n >= MAX_THREADS) {
+		fprintf(stderr, "trace: too many threads\n");
+		atomic_fetch_sub(&nrings, 1);
+		free(r);
+		return -1;
+	}
+
+	atomic_store(&ring[n], r);
+	self = r;
+
+	return 0;
+}
+
+void trace_mark(enum trace_stage stage, unsigned int frame)
+{
+	struct record rec;
+
+	if (self == NULL)
+		return;
+
+	rec.ns = monotonic_ns();
+	rec.frame = frame;
+	rec.stage = stage;
+
+	if (PaUtil_WriteRingBuffer(&self->rb, &rec, 1) != 1)
+		atomic_fetch_add_explicit(&self->dropped, 1, memory_order_relaxed);
+}
+
+#else
+
+int trace_start(const char *path)
+{
+	(void)path;
+	fprintf(stderr, "Tracing is not compiled in\n");
+	return -1;
+}
+
+void trace_stop(void)
+{
+}
+
+int trace_thread(const char *name)
+{
+	(void)name;
+	return 0;
+}
+
+void trace_mark(enum trace_stage stage, unsigned int frame)
+{
+	(void)stage;
+	(void)frame;
+}
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Stages of the pipeline. Each mark is made at the end of a stage,
+ * which is taken to have begun at the previous mark in the same
+ * thread
+ */
+
+enum trace_stage {
+	TRACE_BEGIN,
+	TRACE_CAPTURE,
+	TRACE_ENCODE,
+	TRACE_SEND,
+	TRACE_RECEIVE,
+	TRACE_DECODE,
+	TRACE_PLAYBACK
+};
+
+extern int trace_enabled;
+
+int trace_start(const char *path);
+void trace_stop(void);
+int trace_thread(const char *name);
+void trace_mark(enum trace_stage stage, unsigned int frame);
+
+/*
+ * With tracing compiled in but not started this is a single branch
+ * on a flag which never changes
+ */
+
+#ifdef USE_TRACE
+#define TRACE(stage, frame) do { \
+	if (__builtin_expect(trace_enabled, 0)) \
+		trace_mark(stage, frame); \
+} while (0)
+#else
+#define TRACE(stage, frame) do {} while (0)
+#endif
+
+#endif
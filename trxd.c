@@ -0,0 +1,1272 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Multi-link daemon: run many tx and rx links, as given in a
+ * configuration file, in one process.
+ *
+ * Each audio device is opened once, with all its channels, and served
+ * by its own thread which moves audio between the device and a ring
+ * per link. The encoding, decoding and networking for every link is
+ * done by a fixed pool of worker threads, to which a link is queued
+ * whenever it has work to do.
+ *
+ * On SIGHUP the configuration is read again; links which are
+ * unchanged carry on without interruption.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "portaudio.h"
+#include <opus/opus.h>
+#include <ortp/ortp.h>
+
+#include "defaults.h"
+#include "device.h"
+#include "mpmc.h"
+#include "notice.h"
+#include "pa_ringbuffer.h"
+#include "payload_type_opus.h"
+#include "rtlog.h"
+#include "sched.h"
+
+#define MAX_LINKS 64
+#define MAX_WORKERS 16
+#define MAX_CHANNELS 32 /* per device */
+#define MAX_LINK_CHANNELS 2
+#define MAX_FRAME 2880 /* largest Opus frame, 60ms at 48kHz */
+#define MAX_PACKET 1500
+
+#define DEFAULT_WORKERS 2
+
+#define PERIOD 256 /* samples per device transfer, see device.c */
+#define RING_SIZE 8192 /* samples per link, must be a power of two */
+
+enum direction {
+	TX,
+	RX
+};
+
+struct link {
+	char name[64], spec[512];
+	enum direction dir;
+
+	/* Configuration */
+	unsigned int device, first, channels;
+	char addr[64];
+	unsigned int port, frame, kbps, jitter;
+
+	OpusEncoder *encoder;
+	OpusDecoder *decoder;
+	RtpSession *session;
+	unsigned int ts;
+	int last; /* size of the last frame decoded, for concealment */
+
+	/* Audio between the device thread and the workers */
+	PaUtilRingBuffer ring;
+	int16_t *pcm;
+
+	atomic_int queued, removed;
+	atomic_ulong frames, plc, overruns, underruns;
+
+	struct link *next;
+};
+
+/*
+ * The links served by a device thread. A set is never modified once
+ * published; it is replaced as a whole
+ */
+
+struct link_set {
+	size_t n;
+	struct link *link[MAX_LINKS];
+};
+
+struct device {
+	unsigned int id;
+	enum direction dir;
+	unsigned int channels;
+	PaStream *stream;
+	pthread_t thread;
+
+	_Atomic(struct link_set*) links;
+	struct link_set *old; /* replaced, but maybe still in use */
+	atomic_ulong epoch;
+	atomic_int stop, running;
+
+	struct device *next;
+};
+
+struct worker {
+	pthread_t thread;
+	atomic_ulong epoch;
+	atomic_int idle;
+};
+
+static unsigned int verbose = DEFAULT_VERBOSE;
+static unsigned int rate = DEFAULT_RATE;
+
+static struct link *links; /* all current links, owned by main thread */
+static struct device *devices;
+
+static struct worker worker[MAX_WORKERS];
+static unsigned int nworkers = DEFAULT_WORKERS;
+static atomic_int stopping;
+
+/*
+ * Links waiting for a worker: a bounded multi-producer, multi-consumer
+ * queue which never blocks. A link is only ever in the queue once (see
+ * kick) so it cannot overflow
+ */
+
+static struct link *queue[MAX_LINKS]; /* a power of two */
+static atomic_ulong sequence[MAX_LINKS];
+static struct mpmc ring = MPMC_INIT(sequence);
+static sem_t queue_wake;
+
+static int queue_push(struct link *l)
+{
+	long n;
+
+	n = mpmc_claim(&ring);
+	if (n == -1)
+		return -1;
+
+	queue[n] = l;
+	mpmc_publish(&ring, n);
+
+	return 0;
+}
+
+static struct link* queue_pop(void)
+{
+	struct link *l;
+	long n;
+
+	n = mpmc_take(&ring);
+	if (n == -1)
+		return NULL;
+
+	l = queue[n];
+	mpmc_release(&ring, n);
+
+	return l;
+}
+
+/*
+ * Hand a link to the workers, unless it is already waiting for one
+ */
+
+static void kick(struct link *l)
+{
+	int expected = 0;
+
+	if (!atomic_compare_exchange_strong(&l->queued, &expected, 1))
+		return;
+
+	if (queue_push(l) == -1)
+		abort(); /* every link is queued at most once */
+	sem_post(&queue_wake);
+}
+
+/*
+ * Whether a link has a frame of work ready; for tx a complete frame
+ * is captured, for rx the ring is running short of audio to play
+ */
+
+static int ready(struct link *l)
+{
+	ring_buffer_size_t avail;
+
+	avail = PaUtil_GetRingBufferReadAvailable(&l->ring);
+	if (l->dir == TX)
+		return avail >= (ring_buffer_size_t)l->frame;
+	else
+		return avail < (ring_buffer_size_t)(l->frame + PERIOD);
+}
+
+static RtpSession* create_rtp_send(const char *addr_desc, const int port)
+{
+	RtpSession *session;
+
+	session = rtp_session_new(RTP_SESSION_SENDONLY);
+	if (session == NULL)
+		return NULL;
+
+	rtp_session_set_scheduling_mode(session, 0);
+	rtp_session_set_blocking_mode(session, 0);
+	rtp_session_set_connected_mode(session, FALSE);
+	if (rtp_session_set_remote_addr(session, addr_desc, port) != 0)
+		goto fail;
+	if (rtp_session_set_payload_type(session, PAYLOAD_TYPE_OPUS) != 0)
+		goto fail;
+	if (rtp_session_set_multicast_ttl(session, 16) != 0)
+		goto fail;
+	if (rtp_session_set_dscp(session, 40) != 0)
+		goto fail;
+
+	return session;
+
+fail:
+	rtp_session_destroy(session);
+	return NULL;
+}
+
+/*
+ * Unlike rx, a receive session here must never block a worker; the
+ * device clock paces the decoding instead
+ */
+
+static RtpSession* create_rtp_recv(const char *addr_desc, const int port,
+		unsigned int jitter)
+{
+	RtpSession *session;
+
+	session = rtp_session_new(RTP_SESSION_RECVONLY);
+	if (session == NULL)
+		return NULL;
+
+	rtp_session_set_scheduling_mode(session, FALSE);
+	rtp_session_set_blocking_mode(session, FALSE);
+	if (rtp_session_set_local_addr(session, addr_desc, port, -1) != 0) {
+		rtp_session_destroy(session);
+		return NULL;
+	}
+	rtp_session_set_connected_mode(session, FALSE);
+	rtp_session_enable_adaptive_jitter_compensation(session, TRUE);
+	rtp_session_set_jitter_compensation(session, jitter); /* ms */
+	rtp_session_set_time_jump_limit(session, jitter * 16); /* ms */
+	if (rtp_session_set_payload_type(session, PAYLOAD_TYPE_OPUS) != 0)
+		abort();
+
+	/* See create_rtp_recv() in rx.c */
+
+	rtp_session_enable_rtcp(session, FALSE);
+
+	return session;
+}
+
+/*
+ * Encode and send every complete frame which has been captured
+ */
+
+static int run_tx_link(struct link *l)
+{
+	int16_t pcm[MAX_FRAME * MAX_LINK_CHANNELS];
+	unsigned char packet[MAX_PACKET];
+	opus_int32 z;
+	mblk_t *mp;
+
+	while (PaUtil_GetRingBufferReadAvailable(&l->ring)
+			>= (ring_buffer_size_t)l->frame)
+	{
+		PaUtil_ReadRingBuffer(&l->ring, pcm, l->frame);
+
+		z = opus_encode(l->encoder, pcm, l->frame, packet, sizeof packet);
+		if (z < 0) {
+			rtlog_text(stderr, "%s: opus_encode: %s\n",
+				l->name, opus_strerror(z));
+			return -1;
+		}
+
+		mp = rtp_session_create_packet(l->session, RTP_FIXED_HEADER_SIZE,
+				packet, z);
+		rtp_session_sendm_with_ts(l->session, mp, l->ts);
+		l->ts += l->frame;
+
+		atomic_fetch_add_explicit(&l->frames, 1, memory_order_relaxed);
+	}
+
+	return 0;
+}
+
+/*
+ * Decode until there is enough audio for the device thread to take
+ * its next period, concealing any packet which has not arrived
+ */
+
+static int run_rx_link(struct link *l)
+{
+	int16_t pcm[MAX_FRAME * MAX_LINK_CHANNELS];
+	unsigned char *payload;
+	mblk_t *mp;
+	int r, len;
+
+	while (ready(l)) {
+		if (PaUtil_GetRingBufferWriteAvailable(&l->ring) < MAX_FRAME)
+			break;
+
+		mp = rtp_session_recvm_with_ts(l->session, l->ts);
+		if (mp == NULL) {
+			r = opus_decode(l->decoder, NULL, 0, pcm, l->last, 1);
+			atomic_fetch_add_explicit(&l->plc, 1,
+				memory_order_relaxed);
+		} else {
+			len = rtp_get_payload(mp, &payload);
+			r = opus_decode(l->decoder, payload, len, pcm,
+				MAX_FRAME, 0);
+			freemsg(mp);
+		}
+		if (r < 0) {
+			rtlog_text(stderr, "%s: opus_decode: %s\n",
+				l->name, opus_strerror(r));
+			return -1;
+		}
+
+		PaUtil_WriteRingBuffer(&l->ring, pcm, r);
+		l->last = r;
+		l->ts += r;
+
+		atomic_fetch_add_explicit(&l->frames, 1, memory_order_relaxed);
+	}
+
+	return 0;
+}
+
+static void* run_worker(void *arg)
+{
+	struct worker *w = arg;
+
+	rt_thread(RT_CODEC);
+
+	for (;;) {
+		struct link *l;
+
+		atomic_store(&w->idle, 1);
+		sem_wait(&queue_wake);
+		atomic_store(&w->idle, 0);
+
+		if (atomic_load(&stopping))
+			break;
+
+		l = queue_pop();
+		if (l == NULL)
+			continue;
+
+		if (!atomic_load(&l->removed)) {
+			if (l->dir == TX)
+				run_tx_link(l);
+			else
+				run_rx_link(l);
+		}
+
+		/* Any audio which arrived whilst we were busy would not
+		 * have queued the link again, so check */
+
+		atomic_store(&l->queued, 0);
+		if (!atomic_load(&l->removed) && ready(l))
+			kick(l);
+
+		atomic_fetch_add(&w->epoch, 1);
+	}
+
+	return NULL;
+}
+
+/*
+ * Take a period from the capture device and distribute it to the
+ * ring of each link
+ */
+
+static int capture_period(struct device *d, const struct link_set *set)
+{
+	int16_t buf[PERIOD * MAX_CHANNELS], pcm[PERIOD * MAX_CHANNELS];
+	PaError err;
+	size_t n;
+
+	err = Pa_ReadStream(d->stream, buf, PERIOD);
+	if (err != paNoError && err != paInputOverflowed) {
+		rtlog_text(stderr, "Device %u: %s\n", d->id,
+			Pa_GetErrorText(err));
+		return -1;
+	}
+
+	for (n = 0; n < set->n; n++) {
+		struct link *l = set->link[n];
+		unsigned int s, c;
+
+		for (s = 0; s < PERIOD; s++) {
+			for (c = 0; c < l->channels; c++) {
+				pcm[s * l->channels + c] =
+					buf[s * d->channels + l->first + c];
+			}
+		}
+
+		if (PaUtil_WriteRingBuffer(&l->ring, pcm, PERIOD) < PERIOD
+				|| err == paInputOverflowed)
+		{
+			atomic_fetch_add_explicit(&l->overruns, 1,
+				memory_order_relaxed);
+		}
+
+		if (ready(l))
+			kick(l);
+	}
+
+	return 0;
+}
+
+/*
+ * Mix a period from the ring of each link into its channels of the
+ * playback device
+ */
+
+static int playback_period(struct device *d, const struct link_set *set)
+{
+	int16_t buf[PERIOD * MAX_CHANNELS], pcm[PERIOD * MAX_CHANNELS];
+	ring_buffer_size_t got;
+	PaError err;
+	size_t n;
+
+	memset(buf, 0, sizeof(*buf) * PERIOD * d->channels);
+
+	for (n = 0; n < set->n; n++) {
+		struct link *l = set->link[n];
+		unsigned int s, c;
+
+		got = PaUtil_ReadRingBuffer(&l->ring, pcm, PERIOD);
+		if (got < PERIOD && atomic_load_explicit(&l->frames,
+				memory_order_relaxed) > 0)
+		{
+			atomic_fetch_add_explicit(&l->underruns, 1,
+				memory_order_relaxed);
+		}
+
+		for (s = 0; s < (unsigned int)got; s++) {
+			for (c = 0; c < l->channels; c++) {
+				buf[s * d->channels + l->first + c] =
+					pcm[s * l->channels + c];
+			}
+		}
+
+		if (ready(l))
+			kick(l);
+	}
+
+	err = Pa_WriteStream(d->stream, buf, PERIOD);
+	if (err != paNoError && err != paOutputUnderflowed) {
+		rtlog_text(stderr, "Device %u: %s\n", d->id,
+			Pa_GetErrorText(err));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void* run_device(void *arg)
+{
+	struct device *d = arg;
+
+	rt_thread(RT_AUDIO);
+
+	while (!atomic_load(&d->stop)) {
+		const struct link_set *set;
+		int r;
+
+		set = atomic_load_explicit(&d->links, memory_order_acquire);
+
+		if (d->dir == TX)
+			r = capture_period(d, set);
+		else
+			r = playback_period(d, set);
+
+		atomic_fetch_add(&d->epoch, 1);
+
+		if (r == -1)
+			break;
+	}
+
+	atomic_store(&d->running, 0);
+
+	return NULL;
+}
+
+/*
+ * Wait until every device thread and worker has passed a point at
+ * which it holds no reference to a link, so that anything unpublished
+ * before the call is no longer in use
+ */
+
+static void synchronise(void)
+{
+	unsigned long epoch[MAX_WORKERS];
+	struct device *d;
+	unsigned int n;
+
+	for (d = devices; d != NULL; d = d->next) {
+		unsigned long e = atomic_load(&d->epoch);
+
+		while (atomic_load(&d->running) && atomic_load(&d->epoch) == e)
+			usleep(1000);
+	}
+
+	for (n = 0; n < nworkers; n++)
+		epoch[n] = atomic_load(&worker[n].epoch);
+
+	for (n = 0; n < nworkers; n++) {
+		while (!atomic_load(&worker[n].idle)
+				&& atomic_load(&worker[n].epoch) == epoch[n])
+		{
+			usleep(1000);
+		}
+	}
+}
+
+static struct device* find_device(unsigned int id, enum direction dir)
+{
+	struct device *d;
+
+	for (d = devices; d != NULL; d = d->next) {
+		if (d->id == id && d->dir == dir)
+			return d;
+	}
+
+	return NULL;
+}
+
+/*
+ * Open a device with all of its channels, so that links can be added
+ * later without opening it again
+ */
+
+static struct device* open_device(unsigned int id, enum direction dir)
+{
+	const PaDeviceInfo *info;
+	struct device *d;
+	PaError err;
+	int r;
+
+	info = Pa_GetDeviceInfo(id);
+	if (info == NULL) {
+		fprintf(stderr, "Device %u: no such device\n", id);
+		return NULL;
+	}
+
+	d = calloc(1, sizeof *d);
+	if (d == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+
+	d->id = id;
+	d->dir = dir;
+	d->channels = dir == TX ? info->maxInputChannels
+		: info->maxOutputChannels;
+	if (d->channels > MAX_CHANNELS)
+		d->channels = MAX_CHANNELS;
+	if (d->channels == 0) {
+		fprintf(stderr, "Device %u (%s): no %s channels\n", id,
+			info->name, dir == TX ? "input" : "output");
+		goto fail;
+	}
+
+	if (dir == TX)
+		err = open_pa_readstream(&d->stream, rate, d->channels, id,
+			paInt16);
+	else
+		err = open_pa_writestream(&d->stream, rate, d->channels, id,
+			paInt16);
+	if (err != paNoError)
+		goto fail;
+
+	err = Pa_StartStream(d->stream);
+	if (err != paNoError) {
+		aerror("Pa_StartStream", err);
+		Pa_CloseStream(d->stream);
+		goto fail;
+	}
+
+	atomic_init(&d->links, calloc(1, sizeof(struct link_set)));
+	if (atomic_load(&d->links) == NULL) {
+		perror("calloc");
+		Pa_StopStream(d->stream);
+		Pa_CloseStream(d->stream);
+		goto fail;
+	}
+	atomic_init(&d->epoch, 0);
+	atomic_init(&d->stop, 0);
+	atomic_init(&d->running, 1);
+
+	r = pthread_create(&d->thread, NULL, run_device, d);
+	if (r != 0) {
+		errno = r;
+		perror("pthread_create");
+		free(atomic_load(&d->links));
+		Pa_StopStream(d->stream);
+		Pa_CloseStream(d->stream);
+		goto fail;
+	}
+
+	d->next = devices;
+	devices = d;
+
+	return d;
+
+fail:
+	free(d);
+	return NULL;
+}
+
+static void close_device(struct device *d)
+{
+	struct device **p;
+
+	atomic_store(&d->stop, 1);
+	pthread_join(d->thread, NULL);
+
+	Pa_StopStream(d->stream);
+	Pa_CloseStream(d->stream);
+
+	for (p = &devices; *p != d; p = &(*p)->next)
+		;
+	*p = d->next;
+
+	free(atomic_load(&d->links));
+	free(d);
+}
+
+static void destroy_link(struct link *l)
+{
+	if (l->encoder)
+		opus_encoder_destroy(l->encoder);
+	if (l->decoder)
+		opus_decoder_destroy(l->decoder);
+	if (l->session)
+		rtp_session_destroy(l->session);
+	free(l->pcm);
+	free(l);
+}
+
+static struct link* create_link(const struct link *conf)
+{
+	struct link *l;
+	int error;
+
+	l = malloc(sizeof *l);
+	if (l == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+
+	*l = *conf;
+	l->encoder = NULL;
+	l->decoder = NULL;
+	l->session = NULL;
+	l->ts = 0;
+	l->last = l->frame;
+	l->next = NULL;
+	atomic_init(&l->queued, 0);
+	atomic_init(&l->removed, 0);
+	atomic_init(&l->frames, 0);
+	atomic_init(&l->plc, 0);
+	atomic_init(&l->overruns, 0);
+	atomic_init(&l->underruns, 0);
+
+	l->pcm = calloc(RING_SIZE, sizeof(*l->pcm) * l->channels);
+	if (l->pcm == NULL) {
+		perror("calloc");
+		free(l);
+		return NULL;
+	}
+	PaUtil_InitializeRingBuffer(&l->ring, sizeof(*l->pcm) * l->channels,
+		RING_SIZE, l->pcm);
+
+	if (l->dir == TX) {
+		l->encoder = opus_encoder_create(rate, l->channels,
+			OPUS_APPLICATION_AUDIO, &error);
+		if (l->encoder == NULL) {
+			fprintf(stderr, "%s: opus_encoder_create: %s\n",
+				l->name, opus_strerror(error));
+			goto fail;
+		}
+
+		error = opus_encoder_ctl(l->encoder,
+			OPUS_SET_BITRATE(l->kbps * 1000));
+		if (error != OPUS_OK) {
+			fprintf(stderr, "%s: OPUS_SET_BITRATE: %s\n",
+				l->name, opus_strerror(error));
+			goto fail;
+		}
+
+		l->session = create_rtp_send(l->addr, l->port);
+	} else {
+		l->decoder = opus_decoder_create(rate, l->channels, &error);
+		if (l->decoder == NULL) {
+			fprintf(stderr, "%s: opus_decoder_create: %s\n",
+				l->name, opus_strerror(error));
+			goto fail;
+		}
+
+		l->session = create_rtp_recv(l->addr, l->port, l->jitter);
+	}
+
+	if (l->session == NULL) {
+		fprintf(stderr, "%s: cannot create RTP session for %s:%u\n",
+			l->name, l->addr, l->port);
+		goto fail;
+	}
+
+	return l;
+
+fail:
+	destroy_link(l);
+	return NULL;
+}
+
+/*
+ * Parse one line of configuration, in the form
+ *
+ *   tx|rx <name> [device=<n>] [channels=<first>-<last>] [addr=<addr>]
+ *       [port=<n>] [frame=<n>] [bitrate=<kbps>] [jitter=<ms>]
+ *
+ * The tokens are normalised into the spec, so that an unchanged link
+ * can be recognised on reload
+ */
+
+static int parse_link(char *line, struct link *l, const char *path,
+		unsigned int lineno)
+{
+	char *token, *save, *value;
+	unsigned int last;
+
+	memset(l, 0, sizeof *l);
+
+	token = strtok_r(line, " \t", &save);
+	if (strcmp(token, "tx") == 0) {
+		l->dir = TX;
+		l->device = Pa_GetDefaultInputDevice();
+		strcpy(l->addr, DEFAULT_ADDR);
+		l->channels = DEFAULT_INPUTCHANNELS;
+	} else if (strcmp(token, "rx") == 0) {
+		l->dir = RX;
+		l->device = Pa_GetDefaultOutputDevice();
+		strcpy(l->addr, "0.0.0.0");
+		l->channels = DEFAULT_OUTPUTCHANNELS;
+	} else {
+		fprintf(stderr, "%s:%u: expected tx or rx\n", path, lineno);
+		return -1;
+	}
+	strcpy(l->spec, token);
+
+	token = strtok_r(NULL, " \t", &save);
+	if (token == NULL || strlen(token) >= sizeof l->name) {
+		fprintf(stderr, "%s:%u: expected a link name\n", path, lineno);
+		return -1;
+	}
+	strcpy(l->name, token);
+
+	l->port = DEFAULT_PORT;
+	l->frame = DEFAULT_FRAME;
+	l->kbps = DEFAULT_BITRATE;
+	l->jitter = DEFAULT_JITTER;
+
+	while ((token = strtok_r(NULL, " \t", &save)) != NULL) {
+		if (strlen(l->spec) + strlen(token) + 2 > sizeof l->spec) {
+			fprintf(stderr, "%s:%u: line too long\n", path, lineno);
+			return -1;
+		}
+		strcat(l->spec, " ");
+		strcat(l->spec, token);
+
+		value = strchr(token, '=');
+		if (value == NULL)
+			goto invalid;
+		*value++ = '\0';
+
+		if (strcmp(token, "device") == 0) {
+			l->device = atoi(value);
+		} else if (strcmp(token, "channels") == 0) {
+			if (sscanf(value, "%u-%u", &l->first, &last) != 2
+					|| last < l->first)
+			{
+				goto invalid;
+			}
+			l->channels = last - l->first + 1;
+		} else if (strcmp(token, "addr") == 0) {
+			if (strlen(value) >= sizeof l->addr)
+				goto invalid;
+			strcpy(l->addr, value);
+		} else if (strcmp(token, "port") == 0) {
+			l->port = atoi(value);
+		} else if (strcmp(token, "frame") == 0) {
+			l->frame = atoi(value);
+		} else if (strcmp(token, "bitrate") == 0) {
+			l->kbps = atoi(value);
+		} else if (strcmp(token, "jitter") == 0) {
+			l->jitter = atoi(value);
+		} else {
+			goto invalid;
+		}
+	}
+
+	if (l->frame == 0 || l->frame > MAX_FRAME) {
+		fprintf(stderr, "%s:%u: invalid frame size %u\n",
+			path, lineno, l->frame);
+		return -1;
+	}
+	if (l->channels > MAX_LINK_CHANNELS) {
+		fprintf(stderr, "%s:%u: a link carries at most %d channels\n",
+			path, lineno, MAX_LINK_CHANNELS);
+		return -1;
+	}
+
+	return 0;
+
+invalid:
+	fprintf(stderr, "%s:%u: invalid setting '%s'\n", path, lineno, token);
+	return -1;
+}
+
+/*
+ * Read the whole configuration into a list of link descriptions; on
+ * any error the caller keeps the running configuration
+ */
+
+static int read_config(const char *path, struct link **conf)
+{
+	char line[1024], *p;
+	unsigned int lineno = 0;
+	struct link *l, *c;
+	FILE *f;
+
+	*conf = NULL;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof line, f) != NULL) {
+		lineno++;
+
+		p = strchr(line, '#');
+		if (p != NULL)
+			*p = '\0';
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[strspn(line, " \t")] == '\0')
+			continue;
+
+		l = malloc(sizeof *l);
+		if (l == NULL) {
+			perror("malloc");
+			goto fail;
+		}
+
+		if (parse_link(line, l, path, lineno) == -1) {
+			free(l);
+			goto fail;
+		}
+
+		for (c = *conf; c != NULL; c = c->next) {
+			if (strcmp(c->name, l->name) == 0) {
+				fprintf(stderr, "%s:%u: duplicate link '%s'\n",
+					path, lineno, l->name);
+				free(l);
+				goto fail;
+			}
+		}
+
+		l->next = *conf;
+		*conf = l;
+	}
+
+	fclose(f);
+	return 0;
+
+fail:
+	fclose(f);
+	while (*conf != NULL) {
+		l = *conf;
+		*conf = l->next;
+		free(l);
+	}
+	return -1;
+}
+
+/*
+ * Bring the running links into line with the configuration file.
+ * Links whose configuration is unchanged are left running; the device
+ * threads are given their new sets of links, and only then are links
+ * which have gone destroyed
+ */
+
+static int reload(const char *path)
+{
+	struct link *conf, *c, *l, *next, *retired = NULL, *kept = NULL;
+	struct device *d, *dnext;
+
+	if (read_config(path, &conf) == -1) {
+		fprintf(stderr, "%s: keeping the running configuration\n", path);
+		return -1;
+	}
+
+	/* Keep the links which are unchanged */
+
+	for (l = links; l != NULL; l = next) {
+		next = l->next;
+
+		for (c = conf; c != NULL; c = c->next) {
+			if (strcmp(c->name, l->name) == 0
+					&& strcmp(c->spec, l->spec) == 0)
+				break;
+		}
+
+		if (c != NULL) {
+			c->name[0] = '\0'; /* taken */
+			l->next = kept;
+			kept = l;
+		} else {
+			atomic_store(&l->removed, 1);
+			l->next = retired;
+			retired = l;
+		}
+	}
+	links = kept;
+
+	/* Create the new ones */
+
+	while (conf != NULL) {
+		c = conf;
+		conf = c->next;
+
+		if (c->name[0] == '\0') {
+			free(c);
+			continue;
+		}
+
+		d = find_device(c->device, c->dir);
+		if (d == NULL)
+			d = open_device(c->device, c->dir);
+
+		if (d == NULL) {
+			fprintf(stderr, "%s: skipped\n", c->name);
+		} else if (c->first + c->channels > d->channels) {
+			fprintf(stderr, "%s: device %u has only %u channels\n",
+				c->name, d->id, d->channels);
+		} else {
+			l = create_link(c);
+			if (l != NULL) {
+				l->next = links;
+				links = l;
+				if (verbose > 0) {
+					fprintf(stderr, "%s: started\n",
+						l->name);
+				}
+			}
+		}
+
+		free(c);
+	}
+
+	/* Publish the new set of links to each device */
+
+	for (d = devices; d != NULL; d = d->next) {
+		struct link_set *set;
+
+		set = calloc(1, sizeof *set);
+		if (set == NULL) {
+			perror("calloc");
+			abort();
+		}
+
+		for (l = links; l != NULL; l = l->next) {
+			if (l->device == d->id && l->dir == d->dir)
+				set->link[set->n++] = l;
+		}
+
+		d->old = atomic_exchange(&d->links, set);
+	}
+
+	synchronise();
+	for (d = devices; d != NULL; d = d->next) {
+		free(d->old);
+		d->old = NULL;
+	}
+
+	/* Retire the links which have gone, once nothing refers to them;
+	 * the device threads stopped queueing them at the synchronise()
+	 * above */
+
+	if (retired != NULL) {
+		for (l = retired; l != NULL; l = l->next) {
+			while (atomic_load(&l->queued))
+				usleep(1000);
+		}
+		synchronise();
+	}
+
+	while (retired != NULL) {
+		l = retired;
+		retired = l->next;
+		if (verbose > 0)
+			fprintf(stderr, "%s: stopped\n", l->name);
+		destroy_link(l);
+	}
+
+	/* Close any device which is no longer used */
+
+	for (d = devices; d != NULL; d = dnext) {
+		dnext = d->next;
+		if (atomic_load(&d->links)->n == 0)
+			close_device(d);
+	}
+
+	return 0;
+}
+
+static void print_stats(void)
+{
+	struct link *l;
+
+	for (l = links; l != NULL; l = l->next) {
+		unsigned long frames, plc, overruns, underruns;
+
+		frames = atomic_exchange(&l->frames, 0);
+		plc = atomic_exchange(&l->plc, 0);
+		overruns = atomic_exchange(&l->overruns, 0);
+		underruns = atomic_exchange(&l->underruns, 0);
+
+		if (l->dir == TX) {
+			rtlog_text(stdout, "%s: %lu frames, %lu overruns\n",
+				l->name, frames, overruns);
+		} else {
+			rtlog_text(stdout, "%s: %lu frames, %lu concealed, "
+				"%lu underruns\n",
+				l->name, frames, plc, underruns);
+		}
+	}
+}
+
+static int start_workers(void)
+{
+	unsigned int n;
+	int r;
+
+	if (sem_init(&queue_wake, 0, 0) == -1) {
+		perror("sem_init");
+		return -1;
+	}
+
+	for (n = 0; n < nworkers; n++) {
+		atomic_init(&worker[n].epoch, 0);
+		atomic_init(&worker[n].idle, 1);
+
+		r = pthread_create(&worker[n].thread, NULL, run_worker,
+				&worker[n]);
+		if (r != 0) {
+			errno = r;
+			perror("pthread_create");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void stop_workers(void)
+{
+	unsigned int n;
+
+	atomic_store(&stopping, 1);
+	for (n = 0; n < nworkers; n++)
+		sem_post(&queue_wake);
+	for (n = 0; n < nworkers; n++)
+		pthread_join(worker[n].thread, NULL);
+}
+
+static void usage(FILE *fd)
+{
+	fprintf(fd, "Usage: trxd [<parameters>] <config file>\n"
+		"Real-time audio links over IP, many in one process\n");
+
+	fprintf(fd, "\nParameters:\n");
+	fprintf(fd, "  -r <rate>   Sample rate of every device and link (default %dHz)\n",
+		DEFAULT_RATE);
+	fprintf(fd, "  -t <n>      Number of worker threads (default %d, maximum %d)\n",
+		DEFAULT_WORKERS, MAX_WORKERS);
+	fprintf(fd, "  -v <n>      Verbosity level (default %d)\n",
+		DEFAULT_VERBOSE);
+#ifdef LINUX
+	fprintf(fd, "  -C <spec>   Real-time CPU and priority, eg. audio=2:80,codec=3\n");
+	fprintf(fd, "  -D <file>   Run as a daemon, writing process ID to the given file\n");
+#endif
+
+	fprintf(fd, "\nEach line of the configuration file describes one link:\n"
+		"  tx <name> [device=<n>] [channels=<first>-<last>] [addr=<addr>]\n"
+		"      [port=<n>] [frame=<n>] [bitrate=<kbps>]\n"
+		"  rx <name> [device=<n>] [channels=<first>-<last>] [addr=<addr>]\n"
+		"      [port=<n>] [frame=<n>] [jitter=<ms>]\n"
+		"Device channels are numbered from 0. Send SIGHUP to reload the\n"
+		"file; links which are unchanged are not interrupted.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *config;
+#ifdef LINUX
+	const char *pid = NULL;
+#endif
+	struct timespec interval;
+	struct link *l;
+	sigset_t sigs;
+	PaError err;
+
+	fputs(COPYRIGHT "\n", stderr);
+
+	for (;;) {
+		int c;
+
+#ifdef LINUX
+		c = getopt(argc, argv, "r:t:v:C:D:");
+#else
+		c = getopt(argc, argv, "r:t:v:");
+#endif
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 't':
+			nworkers = atoi(optarg);
+			if (nworkers == 0 || nworkers > MAX_WORKERS) {
+				usage(stderr);
+				return -1;
+			}
+			break;
+		case 'v':
+			verbose = atoi(optarg);
+			break;
+#ifdef LINUX
+		case 'C':
+			if (rt_configure(optarg) == -1)
+				return -1;
+			break;
+		case 'D':
+			pid = optarg;
+			break;
+#endif
+		default:
+			usage(stderr);
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(stderr);
+		return -1;
+	}
+
+	/* Reloads happen after daemon() changes to the root directory */
+
+	config = realpath(argv[optind], NULL);
+	if (config == NULL) {
+		perror(argv[optind]);
+		return -1;
+	}
+
+#ifdef LINUX
+	if (pid)
+		go_daemon(pid);
+#endif
+
+	err = Pa_Initialize();
+	if (err != paNoError) {
+		aerror("Pa_Initialize", err);
+		return -1;
+	}
+
+	ortp_init();
+	ortp_scheduler_init();
+	ortp_set_log_level_mask(NULL, ORTP_WARNING|ORTP_ERROR);
+	ortp_set_log_handler(rtlog_ortp);
+
+	rtp_profile_set_payload(&av_profile, PAYLOAD_TYPE_OPUS,
+		&payload_type_opus_mono);
+
+	/* Signals are taken synchronously by the main thread, so block
+	 * them before any other thread is created */
+
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	if (rtlog_start() == -1)
+		return -1;
+
+	rt_lock_memory();
+
+	if (start_workers() == -1)
+		return -1;
+
+	if (reload(config) == -1)
+		return -1;
+
+	interval.tv_sec = STATS_INTERVAL_MS / 1000;
+	interval.tv_nsec = (STATS_INTERVAL_MS % 1000) * 1000000;
+
+	for (;;) {
+		int sig;
+
+		sig = sigtimedwait(&sigs, NULL, &interval);
+		if (sig == -1) {
+			if (errno == EAGAIN && verbose > 0)
+				print_stats();
+			continue;
+		}
+
+		if (sig != SIGHUP)
+			break;
+
+		if (verbose > 0)
+			fprintf(stderr, "Reloading %s\n", config);
+		reload(config);
+	}
+
+	/* Stop the devices before the workers, which they kick */
+
+	for (l = links; l != NULL; l = l->next)
+		atomic_store(&l->removed, 1);
+	while (devices != NULL)
+		close_device(devices);
+	stop_workers();
+
+	while (links != NULL) {
+		l = links;
+		links = l->next;
+		destroy_link(l);
+	}
+
+	ortp_exit();
+	Pa_Terminate();
+	rtlog_stop();
+
+	return 0;
+}
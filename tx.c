@@ -17,8 +17,15 @@
  *
  */
 
+#include <alloca.h>
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
 #include <netdb.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #ifdef USE_ALSA
 #include <alsa/asoundlib.h>
 #endif
@@ -26,18 +33,206 @@
 #include "portaudio.h"
 #endif
 #include <opus/opus.h>
+#ifndef USE_NATIVE_RTP
 #include <ortp/ortp.h>
+#endif
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include "codec.h"
 #include "defaults.h"
 #include "device.h"
+#include "metrics.h"
 #include "notice.h"
+#include "payload_type_opus.h"
+#include "pcm.h"
+#include "resample.h"
+#include "rtlog.h"
+#include "rtp.h"
 #include "sched.h"
+#include "sockopt.h"
+#ifdef USE_SRTP
+#include "srtp.h"
+#endif
+#include "timestamp.h"
+#include "trace.h"
+#include "wav.h"
+
+#define MAX_PACKET 1500
 
 static unsigned int verbose = DEFAULT_VERBOSE;
+static int send_capture_time = 0;
+static int auto_complexity = 0;
+static enum encoding encoding = ENCODING_OPUS;
+static struct sockopts sockopts;
+
+#ifdef USE_SRTP
+static struct srtp srtp;
+#endif
+
+/* Audio from a file in place of the device, eg. for testing */
+
+static struct wav file;
+static uint64_t file_start; /* wall clock time of the first sample */
+
+/* Device at a rate other than the codec's */
+
+static int resampling = 0;
+static struct resample resampler;
 
-static RtpSession* create_rtp_send(const char *addr_desc, const int port)
+/* Silence suppression */
+
+#define GATE_HANGOVER_MS 200
+
+static int dtx = 0;
+static int32_t gate = 0; /* peak level of silence, 16-bit; 0 for no gate */
+static unsigned int hangover; /* frames */
+
+static struct {
+	unsigned long frames, sent, bytes, encodes;
+	uint64_t encode_ns;
+	unsigned long saved_bytes, saved_encode_ns; /* estimated */
+} silence;
+static struct governor governor;
+
+static struct metric *m_packets, *m_bytes, *m_overruns, *m_encode,
+	*m_complexity, *m_complexity_changes, *m_suppressed, *m_saved_bytes,
+	*m_saved_encode;
+
+static void init_metrics(void)
+{
+	static const unsigned long encode_ns[] = {
+		25000, 50000, 100000, 200000, 500000,
+		1000000, 2000000, 5000000, 10000000
+	};
+
+	m_packets = metric_counter("trx_tx_packets_total",
+		"RTP packets sent");
+	m_bytes = metric_counter("trx_tx_payload_bytes_total",
+		"Encoded audio bytes sent");
+	m_overruns = metric_counter("trx_tx_overruns_total",
+		"Frames lost to capture overruns");
+	m_encode = metric_histogram("trx_tx_encode_seconds",
+		"Time to encode one frame",
+		encode_ns, sizeof(encode_ns) / sizeof(*encode_ns), 1e9);
+	m_complexity = metric_gauge("trx_tx_encoder_complexity",
+		"Current Opus encoder complexity");
+	m_complexity_changes = metric_counter("trx_tx_complexity_changes_total",
+		"Changes of encoder complexity made to meet the frame deadline");
+	m_suppressed = metric_counter("trx_tx_suppressed_frames_total",
+		"Frames of silence not sent");
+	m_saved_bytes = metric_counter("trx_tx_suppressed_bytes_total",
+		"Estimated payload bytes saved by silence suppression");
+	m_saved_encode = metric_counter("trx_tx_suppressed_encode_microseconds_total",
+		"Estimated encode time saved by silence suppression");
+}
+
+/*
+ * Whether the peak level of a frame is below the gate
+ */
+
+static int below_gate(const void *pcm, size_t n)
+{
+	size_t i;
+
+	if (encoding == ENCODING_L24) {
+		const int32_t *s = pcm;
+		int32_t level = gate * 65536;
+
+		for (i = 0; i < n; i++) {
+			if (s[i] >= level || s[i] <= -level)
+				return 0;
+		}
+	} else {
+		const int16_t *s = pcm;
+
+		for (i = 0; i < n; i++) {
+			if (s[i] >= gate || s[i] <= -gate)
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Account for a frame which is not sent, estimating what it would
+ * have cost from the frames which were
+ */
+
+static void suppressed(int encoded)
+{
+	unsigned long bytes = 0, ns = 0;
+
+	if (silence.sent > 0)
+		bytes = silence.bytes / silence.sent;
+	if (!encoded && silence.encodes > 0)
+		ns = silence.encode_ns / silence.encodes;
+
+	silence.saved_bytes += bytes;
+	silence.saved_encode_ns += ns;
+
+	metric_add(m_suppressed, 1);
+	metric_add(m_saved_bytes, bytes);
+	metric_add(m_saved_encode, ns / 1000);
+}
+
+static void report_silence(uint64_t interval)
+{
+	rtlog_text(stderr, "Silence suppression: %lu of %lu frames not sent, "
+		"saving %.1f kbit/s and %.2f%% CPU\n",
+		silence.frames - silence.sent, silence.frames,
+		silence.saved_bytes * 8 / (interval / 1e9) / 1000,
+		100.0 * silence.saved_encode_ns / interval);
+
+	silence.frames = 0;
+	silence.sent = 0;
+	silence.saved_bytes = 0;
+	silence.saved_encode_ns = 0;
+}
+
+/*
+ * Let the governor react to the time taken by an encode, and make
+ * known any change it makes
+ */
+
+static void govern(uint64_t encode)
+{
+	int c;
+
+	c = governor_update(&governor, encode);
+	if (c == -1)
+		return;
+
+	metric_set(m_complexity, c);
+	metric_add(m_complexity_changes, 1);
+	rtlog(stderr, "Encoder complexity %ld (encode took %ld of %ld ns)\n",
+		(long)c, (long)encode, (long)governor.deadline);
+}
+
+#ifdef USE_NATIVE_RTP
+
+static int create_rtp_send(struct rtp_sender *session,
+		const char *addr_desc, const int port, const int payload)
+{
+	if (rtp_sender_init(session, addr_desc, port, payload,
+			sockopts.ttl, sockopts.dscp, 1) == -1)
+	{
+		return -1;
+	}
+
+	if (sockopt_apply(&sockopts, session->fd, verbose) == -1) {
+		rtp_sender_clear(session);
+		return -1;
+	}
+
+	return 0;
+}
+
+#else
+
+static RtpSession* create_rtp_send(const char *addr_desc, const int port,
+		const int payload)
 {
 	RtpSession *session;
 
@@ -51,16 +246,64 @@ static RtpSession* create_rtp_send(const char *addr_desc, const int port)
 	rtp_session_set_connected_mode(session, FALSE);
 	if (rtp_session_set_remote_addr(session, addr_desc, port) != 0)
 		abort();
-	if (rtp_session_set_payload_type(session, 0) != 0)
+	if (rtp_session_set_payload_type(session, payload) != 0)
 		abort();
-	if (rtp_session_set_multicast_ttl(session, 16) != 0)
+	if (rtp_session_set_multicast_ttl(session, sockopts.ttl) != 0)
 		abort();
-	if (rtp_session_set_dscp(session, 40) != 0)
+	if (rtp_session_set_dscp(session, sockopts.dscp) != 0)
 		abort();
 
+	if (sockopt_apply(&sockopts, rtp_session_get_rtp_socket(session),
+			verbose) == -1)
+	{
+		rtp_session_destroy(session);
+		return NULL;
+	}
+
 	return session;
 }
 
+#endif
+
+/*
+ * Read from the file at the pace a device would deliver it, so that
+ * everything downstream runs in real time. Return 1 at the end
+ */
+
+static int read_file(void *pcm, unsigned long samples, uint64_t *capture)
+{
+	static uint64_t start;
+	static unsigned long position;
+	struct timespec t;
+	uint64_t due, now;
+	long n;
+
+	if (start == 0) {
+		start = monotonic_ns();
+		file_start = wallclock_ns();
+	}
+
+	/* A frame is complete once its last sample is captured */
+	due = start + (uint64_t)(position + samples) * 1000000000 / file.rate;
+	now = monotonic_ns();
+	if (due > now) {
+		t.tv_sec = (due - now) / 1000000000;
+		t.tv_nsec = (due - now) % 1000000000;
+		nanosleep(&t, NULL);
+	}
+
+	n = wav_read(&file, pcm, samples);
+	if (n == -1)
+		return -1;
+	if (n < samples)
+		return 1;
+
+	if (send_capture_time)
+		*capture = file_start + (uint64_t)position * 1000000000 / file.rate;
+	position += samples;
+
+	return 0;
+}
 
 static int send_one_frame(
 #ifdef USE_ALSA
@@ -76,69 +319,190 @@ static int send_one_frame(
 #ifdef USE_PORTAUDIO
 		const long samples,
 #endif
-		OpusEncoder *encoder,
+		OpusMSEncoder *encoder,
+		const struct layout *layout,
 		const size_t bytes_per_frame,
 		const unsigned int ts_per_frame,
+#ifdef USE_NATIVE_RTP
+		struct rtp_sender *session)
+#else
 		RtpSession *session)
+#endif
 {
-	int16_t *pcm;
-	void *packet;
+	void *pcm, *in, *packet;
+	unsigned int n;
 	ssize_t z;
+	uint64_t start, duration, capture = 0;
+#ifndef USE_NATIVE_RTP
+	mblk_t *mp;
+#endif
 #ifdef USE_ALSA
 	snd_pcm_sframes_t f;
 #endif
 #ifdef USE_PORTAUDIO
 	PaError err;;
 #endif
-	static unsigned int ts = 0;
+	static unsigned int ts = 0, quiet = 0;
+	static int talkspurt = 1;
+	int r;
 
-	pcm = alloca(sizeof(*pcm) * samples * channels);
+	pcm = alloca(encoding_sample_size(encoding) * samples * channels);
 	packet = alloca(bytes_per_frame);
 
-#ifdef USE_ALSA
-	f = snd_pcm_readi(snd, pcm, samples);
-	if (f < 0) {
-		if (f == -ESTRPIPE)
-			ts = 0;
+	/* Read only what the resampler needs for this frame, so it adds
+	 * no buffering */
 
-		f = snd_pcm_recover(snd, f, 0);
+	if (resampling) {
+		n = resample_input(&resampler, samples);
+		in = alloca(encoding_sample_size(encoding) * n * channels);
+	} else {
+		n = samples;
+		in = pcm;
+	}
+
+	if (file.f != NULL) {
+		r = read_file(in, n, &capture);
+		if (r != 0)
+			return r;
+	} else {
+#ifdef USE_ALSA
+		f = snd_pcm_readi(snd, in, n);
 		if (f < 0) {
-			aerror("snd_pcm_readi", f);
-			return -1;
+			if (f == -ESTRPIPE)
+				ts = 0;
+			if (f == -EPIPE)
+				metric_add(m_overruns, 1);
+
+			f = snd_pcm_recover(snd, f, 0);
+			if (f < 0) {
+				aerror("snd_pcm_readi", f);
+				return -1;
+			}
+			return 0;
 		}
-		return 0;
-	}
 #endif
 #ifdef USE_PORTAUDIO
-	err = Pa_ReadStream(stream, pcm, samples);
+		err = Pa_ReadStream(stream, in, n);
+		if (send_capture_time)
+			capture = pa_capture_time(stream, n);
 #endif
+	}
+	TRACE(TRACE_CAPTURE, ts);
 
-	/* Opus encoder requires a complete frame, so if we xrun
-	 * mid-frame then we discard the incomplete audio. The next
-	 * read will catch the error condition and recover */
+	if (file.f == NULL) {
+		/* Opus encoder requires a complete frame, so if we xrun
+		 * mid-frame then we discard the incomplete audio. The next
+		 * read will catch the error condition and recover */
 #ifdef USE_ALSA
-	if (f < samples) {
-		fprintf(stderr, "Short read, %ld\n", f);
-		return 0;
-	}
+		if (f < n) {
+			rtlog(stderr, "Short read, %ld\n", (long)f);
+			return 0;
+		}
 #endif
 #ifdef USE_PORTAUDIO
-	if (err != paNoError)
-	{
-		fprintf(stderr,"PortAudio error: %s \n", Pa_GetErrorText(err));
+		if (err != paNoError)
+		{
+			if (err == paInputOverflowed)
+				metric_add(m_overruns, 1);
+			rtlog_text(stderr, "PortAudio error: %s \n", Pa_GetErrorText(err));
+			return 0;
+		}
+#endif
+	}
+
+	if (resampling) {
+		resample_process(&resampler, in, n, pcm, samples);
+		if (capture)
+			capture -= resampler.delay * 1e9;
+	}
+
+	/* Once the audio has been below the gate for long enough, stop
+	 * sending; the timestamps carry on, so the receiver sees a gap */
+
+	silence.frames++;
+	if (gate) {
+		if (below_gate(pcm, samples * channels))
+			quiet++;
+		else
+			quiet = 0;
+
+		if (quiet > hangover) {
+			suppressed(0);
+			talkspurt = 1;
+			ts += ts_per_frame;
+			return 0;
+		}
+	}
+
+	/* All channels go in a single packet, so they stay aligned */
+
+	start = monotonic_ns();
+	if (encoding == ENCODING_OPUS) {
+		layout_to_opus(layout, pcm, samples);
+		z = opus_multistream_encode(encoder, pcm, samples, packet,
+				bytes_per_frame);
+		if (z < 0) {
+			fprintf(stderr, "opus_multistream_encode: %s\n",
+				opus_strerror(z));
+			return -1;
+		}
+	} else {
+		z = pcm_pack(encoding, pcm, samples * channels, packet);
+	}
+	duration = monotonic_ns() - start;
+	metric_observe(m_encode, duration);
+	if (auto_complexity)
+		govern(duration);
+	TRACE(TRACE_ENCODE, ts);
+
+	silence.encodes++;
+	silence.encode_ns += duration;
+
+	/* In DTX the encoder gives only the TOC byte (or two) for a
+	 * frame which need not be sent at all; in a multistream packet,
+	 * that for each stream, with its length ahead of all but the
+	 * last. Only when every stream is silent can the packet go */
+
+	if (dtx && z <= 2 * layout->streams) {
+		suppressed(1);
+		talkspurt = 1;
+		ts += ts_per_frame;
 		return 0;
 	}
-#endif
 
-	z = opus_encode(encoder, pcm, samples, packet, bytes_per_frame);
-	if (z < 0) {
-		fprintf(stderr, "opus_encode_float: %s\n", opus_strerror(z));
-		return -1;
+	/* The marker bit is the start of a talkspurt, RFC 3551 */
+
+#ifdef USE_NATIVE_RTP
+	if (rtp_send(session, ts, talkspurt, capture, packet, z) == -1)
+		rtlog(stderr, "Send failed, error %ld\n", (long)errno);
+	talkspurt = 0;
+#else
+	mp = rtp_session_create_packet(session, RTP_FIXED_HEADER_SIZE,
+			packet, z);
+
+	if (talkspurt) {
+		rtp_set_markbit(mp, 1);
+		talkspurt = 0;
 	}
 
-	rtp_session_send_with_ts(session, packet, z, ts);
+	if (capture) {
+		uint8_t ntp[CAPTURE_TIME_SIZE];
+
+		ntp_from_ns(capture, ntp);
+		rtp_add_extension_header(mp, CAPTURE_TIME_EXTENSION,
+				sizeof ntp, ntp);
+	}
+
+	rtp_session_sendm_with_ts(session, mp, ts);
+#endif
+	TRACE(TRACE_SEND, ts);
 	ts += ts_per_frame;
 
+	metric_add(m_packets, 1);
+	metric_add(m_bytes, z);
+	silence.sent++;
+	silence.bytes += z;
+
 	return 0;
 }
 
@@ -156,34 +520,39 @@ static int run_tx(
 #ifdef USE_PORTAUDIO
 		long frame,
 #endif
-		OpusEncoder *encoder,
+		OpusMSEncoder *encoder,
+		const struct layout *layout,
 		const size_t bytes_per_frame,
 		const unsigned int ts_per_frame,
+#ifdef USE_NATIVE_RTP
+		struct rtp_sender *session)
+#else
 		RtpSession *session)
+#endif
 {
-	uint64_t tc_start, tc_now;
-	tc_start = ortp_get_cur_time_ms();
+	uint64_t last, now;
+
+	last = monotonic_ns();
 
 	for (;;) {
 		int r;
 
 		r = send_one_frame(snd, channels, frame,
-				encoder, bytes_per_frame, ts_per_frame,
+				encoder, layout, bytes_per_frame, ts_per_frame,
 				session);
 		if (r == -1)
 			return -1;
+		if (r == 1)
+			return 0; /* end of file */
 
 		if (verbose > 1)
-			fputc('>', stderr);
+			rtlog_char(stderr, '>');
 
-		// log globals stats on regular basis
-		tc_now = ortp_get_cur_time_ms();
-		if (tc_now - tc_start > STATS_INTERVAL_MS)
-		{
-			printf("\n\n");
-			ortp_global_stats_display();
-			printf("\n\n");
-			tc_start = tc_now;
+		now = monotonic_ns();
+		if (now - last > (uint64_t)STATS_INTERVAL_MS * 1000000) {
+			if ((dtx || gate) && verbose > 0)
+				report_silence(now - last);
+			last = now;
 		}
 	}
 }
@@ -210,47 +579,78 @@ static void usage(FILE *fd)
 #endif
 	fprintf(fd, "  -m <ms>     Buffer time (default %d milliseconds)\n",
 		DEFAULT_BUFFER);
+	fprintf(fd, "  -R <rate>   Device sample rate, converted to the encoding rate,\n"
+		"              or 'native' (default the encoding rate)\n");
+	fprintf(fd, "  -W <file>   Read a WAV file in real time, in place of the device\n");
 
 	fprintf(fd, "\nNetwork parameters:\n");
 	fprintf(fd, "  -h <addr>   IP address to send to (default %s)\n",
 		DEFAULT_ADDR);
 	fprintf(fd, "  -p <port>   UDP port number (default %d)\n",
 		DEFAULT_PORT);
+	fprintf(fd, "  -O <list>   Socket options, eg. sndbuf=256k,priority=6,dscp=46,\n"
+		"              ttl=16,pmtu=do (default dscp=40,ttl=16)\n");
+	fprintf(fd, "  -E          Send capture time in an RTP header extension\n");
+	fprintf(fd, "  -K <file>   Encrypt by SRTP, with the key in the given file\n");
 
 	fprintf(fd, "\nEncoding parameters:\n");
+	fprintf(fd, "  -e <enc>    Encoding: opus, L16 or L24 (default opus)\n");
 	fprintf(fd, "  -r <rate>   Sample rate (default %dHz)\n",
 		DEFAULT_RATE);
 	fprintf(fd, "  -c <n>      Number of channels (default %d)\n",
 		DEFAULT_INPUTCHANNELS);
+	fprintf(fd, "  -F <n>      Channel mapping family: 0, 1 (surround) or 255\n"
+		"              (default 0 for up to 2 channels, 1 up to 8, otherwise 255)\n");
+	fprintf(fd, "  -L <list>   Device channel of each Opus channel, eg. 0,2,1,4,5,3\n");
 	fprintf(fd, "  -f <n>      Frame size (default %d samples, see below)\n",
 		DEFAULT_FRAME);
-	fprintf(fd, "  -b <kbps>   Bitrate (approx., default %d)\n",
+	fprintf(fd, "  -b <kbps>   Bitrate (default %d)\n",
 		DEFAULT_BITRATE);
+	fprintf(fd, "  -P <spec>   Encoder profile: audio, voice or lowdelay, with any\n"
+		"              of vbr=on|off|constrained, complexity=<0-10> and\n"
+		"              signal=auto|voice|music (default audio)\n");
+	fprintf(fd, "  -Z          Enable DTX, sending nothing in silence\n");
+	fprintf(fd, "  -S <dBFS>   Stop sending when the peak level is below the\n"
+		"              given level, eg. -60 (default off)\n");
+	fprintf(fd, "  -A          Lower the complexity automatically if encoding\n"
+		"              risks missing the frame deadline\n");
 
 	fprintf(fd, "\nProgram parameters:\n");
 	fprintf(fd, "  -v <n>      Verbosity level (default %d)\n",
 		DEFAULT_VERBOSE);
+	fprintf(fd, "  -M <spec>   Export metrics to tcp:<port>, unix:<path> or a file\n");
+	fprintf(fd, "  -T <file>   Write a per-frame trace (Chrome trace format)\n");
 #ifdef LINUX
+	fprintf(fd, "  -C <spec>   Real-time CPU and priority, eg. audio=2:80,codec=3\n");
 	fprintf(fd, "  -D <file>   Run as a daemon, writing process ID to the given file\n");
 #endif
-	fprintf(fd, "\nAllowed frame sizes (-f) are defined by the Opus codec. For example,\n"
-		"at 48000Hz the permitted values are 120, 240, 480 or 960.\n");
+	fprintf(fd, "\nAllowed frame sizes (-f) are 2.5, 5, 10 or 20ms, and also 40 or 60ms\n"
+		"other than in the lowdelay profile. For example, at 48000Hz the\n"
+		"permitted values are 120, 240, 480 or 960.\n");
+	fprintf(fd, "\nWith L16 or L24 the rate must be 48000Hz and any frame size which\n"
+		"fits in a packet may be used, eg. 6 (125us) to 48 (1ms).\n");
 }
 
 int main(int argc, char *argv[])
 {
-	int r, error;
+	int r, payload, family = -1, device_rate = -1;
 	size_t bytes_per_frame;
 	unsigned int ts_per_frame;
 #ifdef USE_ALSA
-	snd_pcm_t *snd;
+	snd_pcm_t *snd = NULL;
 #endif
 #ifdef USE_PORTAUDIO
-	PaStream *stream;
+	PaStream *stream = NULL;
 	PaError err;
 #endif
-	OpusEncoder *encoder;
+	OpusMSEncoder *encoder;
+	struct layout layout;
+	struct profile profile;
+#ifdef USE_NATIVE_RTP
+	struct rtp_sender sender, *session = &sender;
+#else
 	RtpSession *session;
+#endif
 
 #ifdef USE_PORTAUDIO
 	err = Pa_Initialize();
@@ -270,6 +670,12 @@ int main(int argc, char *argv[])
 #ifdef USE_ALSA
 		*device = DEFAULT_DEVICE,
 #endif
+		*metrics = NULL,
+		*trace = NULL,
+		*wav = NULL,
+		*key = NULL,
+		*order = NULL,
+		*profile_spec = "audio",
 		*addr = DEFAULT_ADDR;
 	unsigned int buffer = DEFAULT_BUFFER,
 		rate = DEFAULT_RATE,
@@ -282,14 +688,15 @@ int main(int argc, char *argv[])
 		port = DEFAULT_PORT;
 
 	fputs(COPYRIGHT "\n", stderr);
+	sockopt_init(&sockopts);
 
 	for (;;) {
 		int c;
 
 #ifdef LINUX
-		c = getopt(argc, argv, "b:c:d:f:h:m:p:r:v:D:");
+		c = getopt(argc, argv, "b:c:d:e:f:h:m:p:r:v:AC:D:EF:K:L:M:O:P:R:S:T:W:Z");
 #else
-		c = getopt(argc, argv, "b:c:d:f:h:m:p:r:v:");
+		c = getopt(argc, argv, "b:c:d:e:f:h:m:p:r:v:AEF:K:L:M:O:P:R:S:T:W:Z");
 #endif
 		if (c == -1)
 			break;
@@ -304,6 +711,12 @@ int main(int argc, char *argv[])
 		case 'd':
 			device = atoi(optarg);
 			break;
+		case 'e':
+			r = encoding_parse(optarg);
+			if (r == -1)
+				return -1;
+			encoding = r;
+			break;
 		case 'f':
 			frame = atol(optarg);
 			break;
@@ -322,7 +735,56 @@ int main(int argc, char *argv[])
 		case 'v':
 			verbose = atoi(optarg);
 			break;
+		case 'A':
+			auto_complexity = 1;
+			break;
+		case 'E':
+			send_capture_time = 1;
+			break;
+		case 'F':
+			family = atoi(optarg);
+			break;
+		case 'K':
+			key = optarg;
+			break;
+		case 'L':
+			order = optarg;
+			break;
+		case 'M':
+			metrics = optarg;
+			break;
+		case 'O':
+			if (sockopt_parse(&sockopts, optarg) == -1)
+				return -1;
+			break;
+		case 'P':
+			profile_spec = optarg;
+			break;
+		case 'R':
+			if (strcmp(optarg, "native") == 0)
+				device_rate = 0;
+			else
+				device_rate = atoi(optarg);
+			break;
+		case 'S':
+			gate = 32768 * pow(10, atof(optarg) / 20);
+			if (gate < 1)
+				gate = 1;
+			break;
+		case 'T':
+			trace = optarg;
+			break;
+		case 'W':
+			wav = optarg;
+			break;
+		case 'Z':
+			dtx = 1;
+			break;
 #ifdef LINUX
+		case 'C':
+			if (rt_configure(optarg) == -1)
+				return -1;
+			break;
 		case 'D':
 			pid = optarg;
 			break;
@@ -333,110 +795,315 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	encoder = opus_encoder_create(rate, channels, OPUS_APPLICATION_AUDIO,
-				&error);
-	if (encoder == NULL) {
-		fprintf(stderr, "opus_encoder_create: %s\n",
-			opus_strerror(error));
+#ifndef USE_SRTP
+	if (key) {
+		fprintf(stderr, "SRTP is not built in (make SRTP=yes)\n");
 		return -1;
 	}
+#endif
 
-	bytes_per_frame = kbps * 1024 * frame / rate / 8;
+	if (wav) {
+		if (wav_open_read(&file, wav) == -1)
+			return -1;
+		if (device_rate == 0)
+			device_rate = file.rate;
+	}
+#ifdef USE_PORTAUDIO
+	if (device_rate == 0)
+		device_rate = Pa_GetDeviceInfo(device)->defaultSampleRate;
+#endif
+	if (device_rate == -1)
+		device_rate = rate;
+	if (device_rate <= 0) {
+		fprintf(stderr, "Invalid device rate\n");
+		return -1;
+	}
 
-	/* Follow the RFC, payload 0 has 8kHz reference rate */
+	if (wav) {
+		if (file.rate != device_rate || file.channels != channels
+			|| file.bytes != encoding_sample_size(encoding))
+		{
+			fprintf(stderr, "%s: must be %uHz, %u channels of "
+				"%u-bit audio\n", wav, device_rate, channels,
+				(unsigned int)encoding_sample_size(encoding) * 8);
+			return -1;
+		}
+	}
 
-	ts_per_frame = frame * 8000 / rate;
+	if (device_rate != rate) {
+		if (encoding == ENCODING_L24) {
+			fprintf(stderr, "L24 cannot be resampled\n");
+			return -1;
+		}
+		if (resample_init(&resampler, device_rate, rate, channels) == -1)
+			return -1;
+		resampling = 1;
+
+		if (verbose > 0) {
+			fprintf(stderr, "Converting %dHz to %uHz, delay %.2fms\n",
+				device_rate, rate, resampler.delay * 1000);
+		}
+	}
+
+	hangover = GATE_HANGOVER_MS * rate / 1000 / frame;
+
+	/* The bitrate is set on the encoder; this only bounds a packet */
+
+	bytes_per_frame = MAX_PACKET;
+#ifdef USE_SRTP
+	if (key)
+		bytes_per_frame -= SRTP_MAX_TAG;
+#endif
 
+	if (encoding == ENCODING_OPUS) {
+		if (family == -1)
+			family = channels <= 2 ? 0 : channels <= 8 ? 1 : 255;
+		if (layout_init(&layout, channels, family, order) == -1)
+			return -1;
+
+		if (profile_init(&profile, profile_spec) == -1)
+			return -1;
+		if (profile_check_frame(&profile, rate, frame) == -1)
+			return -1;
+
+		encoder = layout_encoder_create(&layout, rate,
+				profile.application);
+		if (encoder == NULL)
+			return -1;
+		if (profile_apply(&profile, encoder, kbps) == -1)
+			return -1;
+
+		if (dtx) {
+			r = opus_multistream_encoder_ctl(encoder,
+					OPUS_SET_DTX(1));
+			if (r != OPUS_OK) {
+				fprintf(stderr, "OPUS_SET_DTX: %s\n",
+					opus_strerror(r));
+				return -1;
+			}
+		}
+
+		if (verbose > 0) {
+			fprintf(stderr, "%u channels in %d streams (%d coupled)\n",
+				channels, layout.streams, layout.coupled);
+			if (profile_report(&profile, &layout, rate, frame,
+					kbps) == -1)
+			{
+				return -1;
+			}
+		}
+
+#ifdef USE_NATIVE_RTP
+		/* RFC 7587: Opus is clocked at 48000Hz whatever the rate,
+		 * and this is what rx counts in */
+
+		payload = PAYLOAD_TYPE_OPUS;
+		ts_per_frame = frame * RTP_CLOCK / rate;
+#else
+		/* Follow the RFC, payload 0 has 8kHz reference rate */
+
+		payload = 0;
+		ts_per_frame = frame * 8000 / rate;
+#endif
+
+	} else {
+		if (rate != 48000) {
+			fprintf(stderr, "L16 and L24 are sent at 48000Hz only\n");
+			return -1;
+		}
+		if (frame * channels * encoding_wire_size(encoding)
+				> bytes_per_frame)
+		{
+			fprintf(stderr, "Frame of %u samples does not fit in "
+				"a packet\n", frame);
+			return -1;
+		}
+		if (auto_complexity || dtx) {
+			fprintf(stderr, "-A and -Z apply only to Opus\n");
+			return -1;
+		}
+#ifdef USE_ALSA
+		if (encoding == ENCODING_L24) {
+			fprintf(stderr, "L24 is not available with ALSA\n");
+			return -1;
+		}
+#endif
+
+		encoder = NULL;
+		payload = encoding == ENCODING_L16 ? PAYLOAD_TYPE_L16
+			: PAYLOAD_TYPE_L24;
+		ts_per_frame = frame;
+	}
+
+#ifndef USE_NATIVE_RTP
 	ortp_init();
 	ortp_scheduler_init();
 	
 	// enable showing of the global stats
 	ortp_set_log_level_mask(NULL, ORTP_MESSAGE|ORTP_WARNING|ORTP_ERROR);
-	ortp_set_log_file(stdout);
-
-	session = create_rtp_send(addr, port);
-#ifdef LINUX
-	assert(session != NULL);
+	ortp_set_log_handler(rtlog_ortp);
 #endif
 
-#ifdef USE_ALSA
-	r = snd_pcm_open(&snd, device, SND_PCM_STREAM_CAPTURE, 0);
-	if (r < 0) {
-		aerror("snd_pcm_open", r);
-		return -1;
+	init_metrics();
+	if (auto_complexity) {
+		if (governor_init(&governor, encoder, rate, frame) == -1)
+			return -1;
+		metric_set(m_complexity, governor.complexity);
 	}
-	if (set_alsa_hw(snd, rate, channels, buffer * 1000) == -1)
+
+#ifdef USE_NATIVE_RTP
+	if (create_rtp_send(session, addr, port, payload) == -1)
 		return -1;
-	if (set_alsa_sw(snd) == -1)
+#ifdef USE_SRTP
+	if (key) {
+		if (srtp_open(&srtp, key) == -1)
+			return -1;
+		session->srtp = &srtp;
+	}
+#endif
+#else
+	rtp_profile_set_payload(&av_profile, PAYLOAD_TYPE_L16,
+		&payload_type_l16_48000);
+	rtp_profile_set_payload(&av_profile, PAYLOAD_TYPE_L24,
+		&payload_type_l24_48000);
+
+	session = create_rtp_send(addr, port, payload);
+	if (session == NULL)
 		return -1;
 #endif
 
+	if (wav == NULL) {
+#ifdef USE_ALSA
+		r = snd_pcm_open(&snd, device, SND_PCM_STREAM_CAPTURE, 0);
+		if (r < 0) {
+			aerror("snd_pcm_open", r);
+			return -1;
+		}
+		if (set_alsa_hw(snd, device_rate, channels, buffer * 1000) == -1)
+			return -1;
+		if (set_alsa_sw(snd) == -1)
+			return -1;
+#endif
+
 #ifdef USE_PORTAUDIO
-	err = Pa_Initialize();
-	if (err != paNoError)
-	{
-		printf("PortAudio error: %s \n", Pa_GetErrorText(err));
-		return -1;
+		err = Pa_Initialize();
+		if (err != paNoError)
+		{
+			printf("PortAudio error: %s \n", Pa_GetErrorText(err));
+			return -1;
+		}
+
+		// TODO buffer size?
+		err = open_pa_readstream(&stream, device_rate, channels, device,
+			encoding == ENCODING_L24 ? paInt32 : paInt16);
+		if (err != paNoError)
+		{
+			aerror("open_pa_stream", err);
+			return -1;
+		}
+
+		err = Pa_StartStream(stream);
+		if (err != paNoError)
+		{
+			aerror("open_pa_stream", err);
+			return -1;
+		}
+#endif
 	}
 
-	// TODO buffer size?
-	err = open_pa_readstream(&stream, rate, channels, device);
-	if (err != paNoError)
-	{
-		aerror("open_pa_stream", err);
-		return -1;
+#ifdef LINUX
+	if (pid) {
+		/* daemon() changes to the root directory */
+
+		if (metrics) {
+			metrics = metrics_absolute(metrics);
+			if (metrics == NULL)
+				return -1;
+		}
+		if (trace) {
+			trace = absolute_path(trace);
+			if (trace == NULL)
+				return -1;
+		}
+		go_daemon(pid);
 	}
+#endif
 
-	err = Pa_StartStream(stream);
-	if (err != paNoError)
-	{
-		aerror("open_pa_stream", err);
+	/* Only the calling thread survives daemon() */
+
+	if (rtlog_start() == -1)
+		return -1;
+	if (metrics && metrics_export(metrics) == -1)
 		return -1;
+	if (trace) {
+		if (trace_start(trace) == -1)
+			return -1;
+		trace_thread("tx");
 	}
-#endif
 
 #ifdef LINUX
-	if (pid)
-		go_daemon(pid);
-
 	go_realtime();
 #endif
 #ifdef USE_ALSA
-	r = run_tx(snd, channels, frame, encoder, bytes_per_frame,
+	r = run_tx(snd, channels, frame, encoder, &layout, bytes_per_frame,
 		ts_per_frame, session);
 
-	if (snd_pcm_close(snd) < 0)
+	if (wav == NULL && snd_pcm_close(snd) < 0)
 		abort();
 #endif
 
 #ifdef USE_PORTAUDIO
-	r = run_tx(stream, channels, frame, encoder, bytes_per_frame,
+	r = run_tx(stream, channels, frame, encoder, &layout, bytes_per_frame,
 		ts_per_frame, session);
 #endif
 
 #ifdef USE_PORTAUDIO
-	err = Pa_StopStream(stream);
-	if (err != paNoError)
-	{
-		aerror("open_pa_stream", err);
-		return -1;
-	}
+	if (wav == NULL) {
+		err = Pa_StopStream(stream);
+		if (err != paNoError)
+		{
+			aerror("open_pa_stream", err);
+			return -1;
+		}
 	
-	err = Pa_CloseStream(stream);
-	if (err != paNoError)
-	{
-		aerror("open_pa_stream", err);
-		return -1;
+		err = Pa_CloseStream(stream);
+		if (err != paNoError)
+		{
+			aerror("open_pa_stream", err);
+			return -1;
+		}
 	}
 
 	Pa_Terminate();
 #endif
 
+	trace_stop();
+
+#ifdef USE_NATIVE_RTP
+	rtp_sender_clear(session);
+#ifdef USE_SRTP
+	if (key)
+		srtp_clear(&srtp);
+#endif
+#else
 	rtp_session_destroy(session);
 	ortp_exit();
 	ortp_global_stats_display();
+#endif
+	rtlog_stop();
+
+	/* A summary for scripts, eg. loopbench */
+	if (wav) {
+		fprintf(stderr, "tx: start=%llu cpu=%.2f%%\n",
+			(unsigned long long)file_start,
+			100.0 * process_cpu_ns() / (wallclock_ns() - file_start));
+		wav_close(&file);
+	}
 
-	opus_encoder_destroy(encoder);
+	if (encoder)
+		opus_multistream_encoder_destroy(encoder);
+	if (resampling)
+		resample_clear(&resampler);
 
 	return r;
 }
@@ -0,0 +1,418 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#define BUFFER_GROUP 0
+
+static int sys_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned int submit, unsigned int wait,
+		unsigned int flags, void *arg, size_t size)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, size);
+}
+
+static int sys_register(int fd, unsigned int op, void *arg, unsigned int n)
+{
+	return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+/*
+ * Give a buffer (back) to the kernel
+ */
+
+static void give(struct uring *u, int buffer)
+{
+	struct io_uring_buf *b;
+
+	b = &u->br->bufs[u->br_tail & u->mask];
+	b->addr = (uintptr_t)(u->buf + (size_t)buffer * u->size);
+	b->len = u->size;
+	b->bid = buffer;
+	u->br_tail++;
+}
+
+static int provide(struct uring *u, unsigned int buffers, size_t size)
+{
+	struct io_uring_buf_reg reg;
+	unsigned int n;
+
+	if (buffers & (buffers - 1)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	u->buffers = buffers;
+	u->mask = buffers - 1;
+	u->size = size;
+
+	/* The ring must be page aligned */
+	u->br_size = sizeof(struct io_uring_buf) * buffers;
+	u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->br == MAP_FAILED) {
+		u->br = NULL;
+		return -1;
+	}
+
+	u->buf = mmap(NULL, size * buffers, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->buf == MAP_FAILED) {
+		u->buf = NULL;
+		return -1;
+	}
+
+	memset(&reg, 0, sizeof reg);
+	reg.ring_addr = (uintptr_t)u->br;
+	reg.ring_entries = buffers;
+	reg.bgid = BUFFER_GROUP;
+	if (sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		return -1;
+
+	u->br_tail = 0;
+	for (n = 0; n < buffers; n++)
+		give(u, n);
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*
+ * Set up a ring with room for the given number of operations in
+ * flight, and if buffers is not zero (a power of two) that many
+ * buffers of the given size to receive into. On failure return -1
+ * with errno set, and print nothing; it is for the caller to decide
+ * whether this matters
+ */
+
+int uring_init(struct uring *u, unsigned int entries,
+		unsigned int buffers, size_t size)
+{
+	struct io_uring_params p;
+	unsigned char *ring;
+	size_t sq, cq;
+	int e;
+
+	memset(u, 0, sizeof *u);
+
+	/* Completions run when we next enter the kernel, rather than
+	 * interrupting us, and a multishot receive has room for a
+	 * completion per buffer */
+
+	memset(&p, 0, sizeof p);
+	p.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG
+		| IORING_SETUP_CQSIZE;
+	p.cq_entries = 2 * (buffers > entries ? buffers : entries);
+
+	u->fd = sys_setup(entries, &p);
+	if (u->fd == -1)
+		return -1;
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)
+		|| !(p.features & IORING_FEAT_EXT_ARG))
+	{
+		errno = ENOSYS;
+		goto fail;
+	}
+
+	sq = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->ring_size = sq > cq ? sq : cq;
+	u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->ring == MAP_FAILED) {
+		u->ring = NULL;
+		goto fail;
+	}
+
+	u->sqe_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqe_mem = mmap(NULL, u->sqe_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqe_mem == MAP_FAILED) {
+		u->sqe_mem = NULL;
+		goto fail;
+	}
+
+	ring = u->ring;
+	u->sq_head = (unsigned int*)(ring + p.sq_off.head);
+	u->sq_tail = (unsigned int*)(ring + p.sq_off.tail);
+	u->sq_mask = (unsigned int*)(ring + p.sq_off.ring_mask);
+	u->sq_flags = (unsigned int*)(ring + p.sq_off.flags);
+	u->sq_array = (unsigned int*)(ring + p.sq_off.array);
+	u->cq_head = (unsigned int*)(ring + p.cq_off.head);
+	u->cq_tail = (unsigned int*)(ring + p.cq_off.tail);
+	u->cq_mask = (unsigned int*)(ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*)(ring + p.cq_off.cqes);
+	u->sqes = u->sqe_mem;
+
+	if (buffers > 0 && provide(u, buffers, size) == -1)
+		goto fail;
+
+	return 0;
+
+fail:
+	e = errno;
+	uring_clear(u);
+	errno = e;
+	return -1;
+}
+
+void uring_clear(struct uring *u)
+{
+	if (u->buf != NULL)
+		munmap(u->buf, u->size * u->buffers);
+	if (u->br != NULL)
+		munmap(u->br, u->br_size);
+	if (u->sqe_mem != NULL)
+		munmap(u->sqe_mem, u->sqe_size);
+	if (u->ring != NULL)
+		munmap(u->ring, u->ring_size);
+	close(u->fd);
+}
+
+/*
+ * The next free submission, cleared, or NULL if the queue is full
+ */
+
+static struct io_uring_sqe* next_sqe(struct uring *u)
+{
+	unsigned int head, tail;
+	struct io_uring_sqe *s;
+
+	head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	tail = *u->sq_tail;
+	if (tail - head > *u->sq_mask) {
+		errno = EBUSY;
+		return NULL;
+	}
+
+	s = &u->sqes[tail & *u->sq_mask];
+	memset(s, 0, sizeof *s);
+	return s;
+}
+
+static void queue(struct uring *u)
+{
+	unsigned int tail = *u->sq_tail;
+
+	u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->queued++;
+}
+
+/*
+ * Queue a multishot receive into the provided buffers. The message
+ * gives only the room for the address and control data in each, and
+ * must stay in place while the receive is armed
+ */
+
+int uring_recvmsg(struct uring *u, int fd, struct msghdr *msg,
+		uint64_t data)
+{
+	struct io_uring_sqe *s;
+
+	s = next_sqe(u);
+	if (s == NULL)
+		return -1;
+
+	s->opcode = IORING_OP_RECVMSG;
+	s->fd = fd;
+	s->addr = (uintptr_t)msg;
+	s->len = 1;
+	s->ioprio = IORING_RECV_MULTISHOT;
+	s->flags = IOSQE_BUFFER_SELECT;
+	s->buf_group = BUFFER_GROUP;
+	s->user_data = data;
+
+	queue(u);
+	return 0;
+}
+
+/*
+ * Queue a send; the message and what it points to must stay in place
+ * until its completion
+ */
+
+int uring_sendmsg(struct uring *u, int fd, const struct msghdr *msg,
+		uint64_t data)
+{
+	struct io_uring_sqe *s;
+
+	s = next_sqe(u);
+	if (s == NULL)
+		return -1;
+
+	s->opcode = IORING_OP_SENDMSG;
+	s->fd = fd;
+	s->addr = (uintptr_t)msg;
+	s->len = 1;
+	s->user_data = data;
+
+	queue(u);
+	return 0;
+}
+
+/*
+ * Hand everything queued to the kernel, in one system call. If the
+ * kernel takes none (eg. its completion queue is full) give EAGAIN;
+ * what is queued stays queued, for the next call
+ */
+
+int uring_submit(struct uring *u)
+{
+	int r;
+
+	while (u->queued > 0) {
+		r = sys_enter(u->fd, u->queued, 0, 0, NULL, 0);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (r == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+		u->queued -= r;
+	}
+
+	return 0;
+}
+
+/*
+ * Block until there is a completion, or the timeout (ns) passes
+ */
+
+int uring_wait(struct uring *u, uint64_t timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec t;
+
+	if (uring_submit(u) == -1)
+		return -1;
+
+	t.tv_sec = timeout / 1000000000;
+	t.tv_nsec = timeout % 1000000000;
+
+	memset(&arg, 0, sizeof arg);
+	arg.ts = (uintptr_t)&t;
+
+	if (sys_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS
+			| IORING_ENTER_EXT_ARG, &arg, sizeof arg) == -1
+		&& errno != ETIME && errno != EINTR)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Take the next completion, if there is one; return 1 if so. This is
+ * a read of shared memory, unless the kernel has work to finish
+ */
+
+int uring_next(struct uring *u, struct uring_event *e)
+{
+	const struct io_uring_cqe *c;
+	unsigned int head, tail;
+
+	head = *u->cq_head;
+	tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+	if (head == tail) {
+		if (!(__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED)
+				& IORING_SQ_TASKRUN))
+			return 0;
+
+		sys_enter(u->fd, 0, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			return 0;
+	}
+
+	c = &u->cqes[head & *u->cq_mask];
+	e->data = c->user_data;
+	e->res = c->res;
+	e->more = (c->flags & IORING_CQE_F_MORE) != 0;
+	if (c->flags & IORING_CQE_F_BUFFER)
+		e->buffer = c->flags >> IORING_CQE_BUFFER_SHIFT;
+	else
+		e->buffer = -1;
+
+	__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Find the control data and payload of a packet from a multishot
+ * receive, laid out in its buffer according to the message it was
+ * armed with. Return -1 if there is no whole packet
+ */
+
+int uring_packet(struct uring *u, const struct uring_event *e,
+		const struct msghdr *msg, struct msghdr *h,
+		unsigned char **payload, size_t *len)
+{
+	const struct io_uring_recvmsg_out *o;
+	unsigned char *b;
+
+	if (e->buffer < 0 || e->res < (int)sizeof *o)
+		return -1;
+
+	b = u->buf + (size_t)e->buffer * u->size;
+	o = (const void*)b;
+	if (o->flags & MSG_TRUNC)
+		return -1;
+
+	memset(h, 0, sizeof *h);
+	h->msg_control = b + sizeof *o + msg->msg_namelen;
+	h->msg_controllen = o->controllen;
+
+	*payload = b + sizeof *o + msg->msg_namelen + msg->msg_controllen;
+	*len = o->payloadlen;
+	return 0;
+}
+
+void uring_recycle(struct uring *u, int buffer)
+{
+	give(u, buffer);
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * The size of buffer to receive a payload with the given message
+ */
+
+size_t uring_buffer_size(const struct msghdr *msg, size_t payload)
+{
+	return sizeof(struct io_uring_recvmsg_out) + msg->msg_namelen
+		+ msg->msg_controllen + payload;
+}
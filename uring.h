@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * Just enough of io_uring (Linux 6.0 or later) for UDP, by the system
+ * calls themselves so there is no library to depend on.
+ *
+ * Receiving is by one multishot recvmsg, which stays armed, into a
+ * ring of buffers given to the kernel up front; each packet is then a
+ * completion to be read from memory shared with the kernel, without a
+ * system call. Sends are queued and go to the kernel together.
+ *
+ * Where io_uring is missing or refused, uring_init() fails and the
+ * caller goes on with plain system calls.
+ */
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+struct uring {
+	int fd;
+
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned int queued; /* not yet submitted */
+
+	void *ring, *sqe_mem;
+	size_t ring_size, sqe_size;
+
+	struct io_uring_buf_ring *br; /* provided buffers, if any */
+	unsigned char *buf;
+	unsigned int buffers, mask;
+	size_t size, br_size;
+	uint16_t br_tail;
+};
+
+/*
+ * A completion: the result of an operation, and for a packet the
+ * buffer which holds it
+ */
+
+struct uring_event {
+	uint64_t data;
+	int res;
+	int more; /* a multishot operation remains armed */
+	int buffer; /* or -1 */
+};
+
+int uring_init(struct uring *u, unsigned int entries,
+		unsigned int buffers, size_t size);
+void uring_clear(struct uring *u);
+
+int uring_recvmsg(struct uring *u, int fd, struct msghdr *msg,
+		uint64_t data);
+int uring_sendmsg(struct uring *u, int fd, const struct msghdr *msg,
+		uint64_t data);
+int uring_submit(struct uring *u);
+int uring_wait(struct uring *u, uint64_t timeout);
+
+int uring_next(struct uring *u, struct uring_event *e);
+int uring_packet(struct uring *u, const struct uring_event *e,
+		const struct msghdr *msg, struct msghdr *h,
+		unsigned char **payload, size_t *len);
+void uring_recycle(struct uring *u, int buffer);
+
+size_t uring_buffer_size(const struct msghdr *msg, size_t payload);
+
+#endif
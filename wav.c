@@ -0,0 +1,282 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <string.h>
+
+#include "wav.h"
+
+#define HEADER_SIZE 44
+
+static unsigned int le16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_le16(unsigned char *p, unsigned int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/*
+ * Convert samples between little-endian and the host, in place
+ */
+
+static void swap_samples(void *pcm, size_t n, unsigned int bytes)
+{
+	unsigned char *p = pcm;
+	size_t i;
+
+	if (bytes == 2) {
+		for (i = 0; i < n; i++, p += 2) {
+			int16_t s = le16(p);
+			memcpy(p, &s, 2);
+		}
+	} else {
+		for (i = 0; i < n; i++, p += 4) {
+			int32_t s = le32(p);
+			memcpy(p, &s, 4);
+		}
+	}
+}
+
+static void unswap_samples(const void *pcm, unsigned char *out, size_t n,
+		unsigned int bytes)
+{
+	const unsigned char *p = pcm;
+	size_t i;
+
+	if (bytes == 2) {
+		for (i = 0; i < n; i++, p += 2, out += 2) {
+			int16_t s;
+
+			memcpy(&s, p, 2);
+			put_le16(out, (uint16_t)s);
+		}
+	} else {
+		for (i = 0; i < n; i++, p += 4, out += 4) {
+			int32_t s;
+
+			memcpy(&s, p, 4);
+			put_le32(out, (uint32_t)s);
+		}
+	}
+}
+
+/*
+ * Open a file and position it at the start of the audio
+ */
+
+int wav_open_read(struct wav *w, const char *path)
+{
+	unsigned char header[12], chunk[8], fmt[16];
+	unsigned int bits;
+	uint32_t size;
+
+	w->f = fopen(path, "rb");
+	if (w->f == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	if (fread(header, sizeof header, 1, w->f) != 1
+			|| memcmp(header, "RIFF", 4) != 0
+			|| memcmp(header + 8, "WAVE", 4) != 0)
+	{
+		goto invalid;
+	}
+
+	w->channels = 0;
+	w->writing = 0;
+
+	while (fread(chunk, sizeof chunk, 1, w->f) == 1) {
+		size = le32(chunk + 4);
+
+		if (memcmp(chunk, "fmt ", 4) == 0) {
+			if (size < sizeof fmt
+					|| fread(fmt, sizeof fmt, 1, w->f) != 1)
+				goto invalid;
+
+			bits = le16(fmt + 14);
+			if (le16(fmt) != 1 || (bits != 16 && bits != 32)) {
+				fprintf(stderr, "%s: only 16 or 32-bit PCM is "
+					"supported\n", path);
+				goto fail;
+			}
+			w->channels = le16(fmt + 2);
+			w->rate = le32(fmt + 4);
+			w->bytes = bits / 8;
+			size -= sizeof fmt;
+
+		} else if (memcmp(chunk, "data", 4) == 0) {
+			if (w->channels == 0)
+				goto invalid;
+
+			w->samples = size / w->bytes / w->channels;
+			return 0;
+		}
+
+		if (fseek(w->f, size + (size & 1), SEEK_CUR) == -1)
+			goto invalid;
+	}
+
+invalid:
+	fprintf(stderr, "%s: not a valid WAV file\n", path);
+fail:
+	fclose(w->f);
+	w->f = NULL;
+	return -1;
+}
+
+/*
+ * Create a file, whose header is completed on closing
+ */
+
+int wav_open_write(struct wav *w, const char *path, unsigned int rate,
+		unsigned int channels, unsigned int bytes)
+{
+	unsigned char header[HEADER_SIZE];
+
+	w->f = fopen(path, "wb");
+	if (w->f == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	w->rate = rate;
+	w->channels = channels;
+	w->bytes = bytes;
+	w->samples = 0;
+	w->writing = 1;
+
+	memcpy(header, "RIFF", 4);
+	put_le32(header + 4, 0);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	put_le32(header + 16, 16);
+	put_le16(header + 20, 1); /* PCM */
+	put_le16(header + 22, channels);
+	put_le32(header + 24, rate);
+	put_le32(header + 28, rate * channels * bytes);
+	put_le16(header + 32, channels * bytes);
+	put_le16(header + 34, bytes * 8);
+	memcpy(header + 36, "data", 4);
+	put_le32(header + 40, 0);
+
+	if (fwrite(header, sizeof header, 1, w->f) != 1) {
+		perror("fwrite");
+		fclose(w->f);
+		w->f = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Return the number of samples (per channel) read, which is fewer
+ * than asked for only at the end of the file
+ */
+
+long wav_read(struct wav *w, void *pcm, unsigned long samples)
+{
+	size_t n;
+
+	n = fread(pcm, w->bytes * w->channels, samples, w->f);
+	if (n < samples && ferror(w->f)) {
+		perror("fread");
+		return -1;
+	}
+
+	swap_samples(pcm, n * w->channels, w->bytes);
+	return n;
+}
+
+int wav_write(struct wav *w, const void *pcm, unsigned long samples)
+{
+	unsigned char buf[4096];
+	size_t n, chunk, frame;
+
+	frame = w->bytes * w->channels;
+	chunk = sizeof buf / frame;
+
+	while (samples > 0) {
+		n = samples < chunk ? samples : chunk;
+		unswap_samples(pcm, buf, n * w->channels, w->bytes);
+
+		if (fwrite(buf, frame, n, w->f) != n) {
+			perror("fwrite");
+			return -1;
+		}
+
+		pcm = (const unsigned char*)pcm + n * frame;
+		samples -= n;
+		w->samples += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Close the file, filling in the sizes if it was written. A file
+ * which cannot seek (eg. /dev/null) is left as it is
+ */
+
+int wav_close(struct wav *w)
+{
+	unsigned char size[4];
+	uint32_t data;
+	int r = 0;
+
+	if (w->f == NULL)
+		return 0;
+
+	data = w->samples * w->channels * w->bytes;
+
+	if (w->writing && fseek(w->f, 4, SEEK_SET) == 0) {
+		put_le32(size, data + HEADER_SIZE - 8);
+		if (fwrite(size, sizeof size, 1, w->f) != 1)
+			r = -1;
+		if (fseek(w->f, 40, SEEK_SET) == 0) {
+			put_le32(size, data);
+			if (fwrite(size, sizeof size, 1, w->f) != 1)
+				r = -1;
+		}
+	}
+
+	if (fclose(w->f) != 0)
+		r = -1;
+	if (r == -1)
+		perror("wav_close");
+
+	w->f = NULL;
+	return r;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef WAV_H
+#define WAV_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * WAV files of 16 or 32-bit PCM, read and written a frame at a time
+ * in place of an audio device. Samples in memory are int16_t or
+ * int32_t to match, interleaved
+ */
+
+struct wav {
+	FILE *f;
+	unsigned int rate, channels, bytes; /* bytes per sample */
+	unsigned long samples; /* per channel, in the file */
+	int writing;
+};
+
+int wav_open_read(struct wav *w, const char *path);
+int wav_open_write(struct wav *w, const char *path, unsigned int rate,
+		unsigned int channels, unsigned int bytes);
+
+long wav_read(struct wav *w, void *pcm, unsigned long samples);
+int wav_write(struct wav *w, const void *pcm, unsigned long samples);
+
+int wav_close(struct wav *w);
+
+#endif
@@ -0,0 +1,394 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Compare the audio out of rx with the audio into tx: find the delay
+ * between them by cross-correlation, and the signal to noise ratio
+ * once aligned. Also generates a test signal suited to this
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defaults.h"
+#include "notice.h"
+#include "wav.h"
+
+#define DECIMATE 8
+#define REFINE (DECIMATE * 2) /* samples either side */
+
+#define DEFAULT_MAX_MS 1000
+#define SKIP_MS 500 /* while the codec settles */
+#define WINDOW_MS 2000
+
+struct audio {
+	float *mono;
+	unsigned long samples;
+	unsigned int rate;
+};
+
+/*
+ * Load a file as mono, full scale at 1.0
+ */
+
+static int load(const char *path, struct audio *a)
+{
+	struct wav w;
+	unsigned char *buf;
+	unsigned long s;
+	unsigned int c;
+	long n;
+
+	if (wav_open_read(&w, path) == -1)
+		return -1;
+
+	buf = malloc((size_t)w.samples * w.channels * w.bytes);
+	a->mono = malloc(sizeof(*a->mono) * w.samples);
+	if (buf == NULL || a->mono == NULL) {
+		perror("malloc");
+		goto fail;
+	}
+
+	n = wav_read(&w, buf, w.samples);
+	if (n == -1)
+		goto fail;
+
+	for (s = 0; s < n; s++) {
+		double sum = 0;
+
+		for (c = 0; c < w.channels; c++) {
+			if (w.bytes == 2)
+				sum += ((int16_t*)buf)[s * w.channels + c] / 32768.0;
+			else
+				sum += ((int32_t*)buf)[s * w.channels + c] / 2147483648.0;
+		}
+		a->mono[s] = sum / w.channels;
+	}
+
+	a->samples = n;
+	a->rate = w.rate;
+
+	free(buf);
+	wav_close(&w);
+	return 0;
+
+fail:
+	free(buf);
+	free(a->mono);
+	wav_close(&w);
+	return -1;
+}
+
+static void decimate(const float *in, unsigned long n, float *out)
+{
+	unsigned long s;
+	unsigned int k;
+
+	for (s = 0; s < n / DECIMATE; s++) {
+		float sum = 0;
+
+		for (k = 0; k < DECIMATE; k++)
+			sum += in[s * DECIMATE + k];
+		out[s] = sum;
+	}
+}
+
+/*
+ * Normalised correlation of x with y offset by lag, over n samples
+ */
+
+static double correlate(const float *x, const float *y, unsigned long n)
+{
+	double xy = 0, xx = 0, yy = 0;
+	unsigned long s;
+
+	for (s = 0; s < n; s++) {
+		xy += x[s] * y[s];
+		xx += x[s] * x[s];
+		yy += y[s] * y[s];
+	}
+
+	if (xx == 0 || yy == 0)
+		return 0;
+
+	return xy / sqrt(xx * yy);
+}
+
+/*
+ * Find where a window of the input best matches the output, first
+ * coarsely on decimated audio and then at every sample
+ */
+
+static long find_lag(const struct audio *in, const struct audio *out,
+		long from, long to, unsigned long offset, unsigned long n,
+		double *peak)
+{
+	float *din, *dout;
+	long lag, best = -1;
+	double r;
+
+	din = malloc(sizeof(*din) * in->samples / DECIMATE);
+	dout = malloc(sizeof(*dout) * out->samples / DECIMATE);
+	if (din == NULL || dout == NULL) {
+		perror("malloc");
+		free(din);
+		return -1;
+	}
+
+	decimate(in->mono, in->samples, din);
+	decimate(out->mono, out->samples, dout);
+
+	*peak = -1;
+	for (lag = from / DECIMATE; lag <= to / DECIMATE; lag++) {
+		if ((offset + n) / DECIMATE + lag > out->samples / DECIMATE)
+			break;
+		r = correlate(din + offset / DECIMATE,
+			dout + offset / DECIMATE + lag, n / DECIMATE);
+		if (r > *peak) {
+			*peak = r;
+			best = lag * DECIMATE;
+		}
+	}
+
+	free(din);
+	free(dout);
+
+	if (best == -1)
+		return -1;
+
+	from = best - REFINE > from ? best - REFINE : from;
+	to = best + REFINE;
+
+	*peak = -1;
+	for (lag = from; lag <= to; lag++) {
+		if (offset + n + lag > out->samples)
+			break;
+		r = correlate(in->mono + offset, out->mono + offset + lag, n);
+		if (r > *peak) {
+			*peak = r;
+			best = lag;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Signal to noise ratio of the output against the input, allowing
+ * for any change of gain
+ */
+
+static double snr(const float *x, const float *y, unsigned long n)
+{
+	double xy = 0, yy = 0, xx = 0, e = 0, g;
+	unsigned long s;
+
+	for (s = 0; s < n; s++) {
+		xy += x[s] * y[s];
+		yy += y[s] * y[s];
+		xx += x[s] * x[s];
+	}
+	if (yy == 0)
+		return 0;
+
+	g = xy / yy;
+	for (s = 0; s < n; s++) {
+		double d = x[s] - g * y[s];
+		e += d * d;
+	}
+	if (e == 0)
+		return INFINITY;
+
+	return 10 * log10(xx / e);
+}
+
+/*
+ * Noise in bursts of random level and length: broadband, so the
+ * correlation has a sharp peak, and never periodic, so it has only
+ * one
+ */
+
+static int generate(const char *path, unsigned int seconds,
+		unsigned int rate, unsigned int channels)
+{
+	struct wav w;
+	int16_t *pcm;
+	unsigned long s, n, left = 0;
+	unsigned int c;
+	double level = 0;
+	int r = 0;
+
+	if (wav_open_write(&w, path, rate, channels, 2) == -1)
+		return -1;
+
+	pcm = malloc(sizeof(*pcm) * channels);
+	if (pcm == NULL) {
+		perror("malloc");
+		wav_close(&w);
+		return -1;
+	}
+
+	srand(1);
+	n = (unsigned long)seconds * rate;
+
+	for (s = 0; s < n; s++) {
+		if (left == 0) {
+			left = rate / 20 + rand() % (rate / 4);
+			level = rand() % 4 ? 0.05 + 0.25 * rand() / RAND_MAX : 0;
+		}
+		left--;
+
+		for (c = 0; c < channels; c++)
+			pcm[c] = level * (rand() % 65536 - 32768);
+
+		if (wav_write(&w, pcm, 1) == -1) {
+			r = -1;
+			break;
+		}
+	}
+
+	free(pcm);
+	if (wav_close(&w) == -1)
+		r = -1;
+	return r;
+}
+
+static void usage(FILE *fd)
+{
+	fprintf(fd, "Usage: wavcmp [<parameters>] <in.wav> <out.wav>\n"
+		"       wavcmp -G <secs> [<parameters>] <out.wav>\n"
+		"Compare the audio into tx with the audio out of rx\n");
+
+	fprintf(fd, "\nComparing:\n");
+	fprintf(fd, "  -d <ms>     Time from the start of the output to the start\n"
+		"              of the input; latency is measured from the input\n");
+	fprintf(fd, "  -m <ms>     Most latency to search for (default %d)\n",
+		DEFAULT_MAX_MS);
+
+	fprintf(fd, "\nGenerating a test signal:\n");
+	fprintf(fd, "  -G <secs>   Length\n");
+	fprintf(fd, "  -r <rate>   Sample rate (default %dHz)\n",
+		DEFAULT_RATE);
+	fprintf(fd, "  -c <n>      Number of channels (default %d)\n",
+		DEFAULT_OUTPUTCHANNELS);
+
+	fprintf(fd, "\nResults are printed as name=value pairs.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int seconds = 0, rate = DEFAULT_RATE,
+		channels = DEFAULT_OUTPUTCHANNELS;
+	double delta = 0, max = DEFAULT_MAX_MS, peak;
+	struct audio in, out;
+	unsigned long offset, n;
+	long from, to, lag;
+
+	fputs(COPYRIGHT "\n", stderr);
+
+	for (;;) {
+		int c;
+
+		c = getopt(argc, argv, "c:d:m:r:G:");
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'c':
+			channels = atoi(optarg);
+			break;
+		case 'd':
+			delta = atof(optarg);
+			break;
+		case 'm':
+			max = atof(optarg);
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 'G':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage(stderr);
+			return -1;
+		}
+	}
+
+	if (seconds) {
+		if (argc - optind != 1) {
+			usage(stderr);
+			return -1;
+		}
+		return generate(argv[optind], seconds, rate, channels);
+	}
+
+	if (argc - optind != 2) {
+		usage(stderr);
+		return -1;
+	}
+
+	if (load(argv[optind], &in) == -1)
+		return -1;
+	if (load(argv[optind + 1], &out) == -1)
+		return -1;
+
+	if (in.rate != out.rate) {
+		fprintf(stderr, "Sample rates differ\n");
+		return -1;
+	}
+
+	/* A window of the input, after the start */
+
+	offset = (unsigned long)SKIP_MS * in.rate / 1000;
+	n = (unsigned long)WINDOW_MS * in.rate / 1000;
+	if (offset + n > in.samples) {
+		fprintf(stderr, "Input is too short\n");
+		return -1;
+	}
+
+	/* Input sample i is output sample i + lag */
+
+	from = delta * in.rate / 1000;
+	to = (delta + max) * in.rate / 1000;
+	if (from < 0)
+		from = 0;
+
+	lag = find_lag(&in, &out, from, to, offset, n, &peak);
+	if (lag == -1) {
+		fprintf(stderr, "Output is too short\n");
+		return -1;
+	}
+
+	/* Compare all the audio in common */
+
+	n = in.samples;
+	if (n + lag > out.samples)
+		n = out.samples - lag;
+
+	printf("latency_ms=%.2f snr_db=%.2f correlation=%.3f\n",
+		((double)lag * 1000 / in.rate) - delta,
+		snr(in.mono + offset, out.mono + offset + lag, n - offset),
+		peak);
+
+	return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "wheel.h"
+
+void wheel_init(struct wheel *w, uint64_t now)
+{
+	memset(w->slot, 0, sizeof w->slot);
+	w->tick = now >> WHEEL_SHIFT;
+	w->count = 0;
+}
+
+void timer_init(struct timer *t, void (*fire)(struct timer*, uint64_t),
+		void *data)
+{
+	t->next = NULL;
+	t->pprev = NULL;
+	t->when = 0;
+	t->fire = fire;
+	t->data = data;
+}
+
+static void attach(struct wheel *w, struct timer *t)
+{
+	uint64_t tick;
+	struct timer **s;
+
+	/* One already due goes on the next tick to be run */
+
+	tick = t->when >> WHEEL_SHIFT;
+	if (tick < w->tick)
+		tick = w->tick;
+
+	s = &w->slot[tick & (WHEEL_SLOTS - 1)];
+	t->next = *s;
+	if (t->next)
+		t->next->pprev = &t->next;
+	t->pprev = s;
+	*s = t;
+}
+
+static void detach(struct timer *t)
+{
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/*
+ * Set the timer to fire at the given time, whether or not it is
+ * pending already
+ */
+
+void timer_add(struct wheel *w, struct timer *t, uint64_t when)
+{
+	if (timer_pending(t))
+		detach(t);
+	else
+		w->count++;
+
+	t->when = when;
+	attach(w, t);
+}
+
+void timer_del(struct wheel *w, struct timer *t)
+{
+	if (!timer_pending(t))
+		return;
+
+	detach(t);
+	w->count--;
+}
+
+/*
+ * The time at which the wheel next needs to be run, or UINT64_MAX if
+ * there are no timers. This is found from the first slot in use, so
+ * may be early where that slot holds only timers of a later rotation;
+ * running the wheel then does nothing
+ */
+
+uint64_t wheel_next(const struct wheel *w)
+{
+	unsigned int n;
+
+	if (w->count == 0)
+		return UINT64_MAX;
+
+	for (n = 0; n < WHEEL_SLOTS; n++) {
+		if (w->slot[(w->tick + n) & (WHEEL_SLOTS - 1)] != NULL)
+			return (w->tick + n + 1) << WHEEL_SHIFT;
+	}
+
+	return UINT64_MAX; /* not reached */
+}
+
+/*
+ * Fire the timers of every tick which has passed. A timer may add
+ * itself again, or add or remove others, as it fires
+ */
+
+void wheel_run(struct wheel *w, uint64_t now)
+{
+	uint64_t target;
+
+	/* After a long time, every slot has passed once */
+
+	target = now >> WHEEL_SHIFT;
+	if (target > w->tick + WHEEL_SLOTS)
+		w->tick = target - WHEEL_SLOTS;
+
+	while (w->tick < target) {
+		struct timer **s, *list, *t;
+
+		/* Take the slot's list aside, so a timer which adds
+		 * itself again is not seen again here */
+
+		s = &w->slot[w->tick & (WHEEL_SLOTS - 1)];
+		list = *s;
+		*s = NULL;
+		if (list)
+			list->pprev = &list;
+		w->tick++;
+
+		while (list) {
+			t = list;
+			detach(t);
+
+			if (t->when >> WHEEL_SHIFT >= target) {
+				attach(w, t); /* a later rotation */
+				continue;
+			}
+
+			w->count--;
+			t->fire(t, now);
+		}
+	}
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdint.h>
+
+/*
+ * A timer wheel: a slot for each tick of a rotation, and in each slot
+ * a list of the timers which fall on that tick of any rotation.
+ * Adding and removing a timer is constant time, and running the wheel
+ * visits only the slots passed since it was last run, so the cost is
+ * in the timers which fire, not the number waiting.
+ *
+ * A timer fires within a tick after it is due; never before.
+ */
+
+#define WHEEL_SHIFT 24 /* tick of 2^24ns, about 17ms */
+#define WHEEL_SLOTS 256 /* a power of two; about 4s to a rotation */
+
+struct timer {
+	struct timer *next, **pprev; /* pprev is NULL if not pending */
+	uint64_t when; /* monotonic ns */
+	void (*fire)(struct timer *t, uint64_t now);
+	void *data;
+};
+
+struct wheel {
+	uint64_t tick; /* next to run */
+	unsigned int count;
+	struct timer *slot[WHEEL_SLOTS];
+};
+
+void wheel_init(struct wheel *w, uint64_t now);
+
+void timer_init(struct timer *t, void (*fire)(struct timer*, uint64_t),
+		void *data);
+void timer_add(struct wheel *w, struct timer *t, uint64_t when);
+void timer_del(struct wheel *w, struct timer *t);
+
+static inline int timer_pending(const struct timer *t)
+{
+	return t->pprev != NULL;
+}
+
+uint64_t wheel_next(const struct wheel *w);
+void wheel_run(struct wheel *w, uint64_t now);
+
+#endif